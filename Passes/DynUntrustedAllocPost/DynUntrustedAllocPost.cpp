@@ -19,6 +19,7 @@
 #include "llvm/ADT/PostOrderIterator.h"
 #include "llvm/ADT/SCCIterator.h"
 #include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringSwitch.h"
 #include "llvm/Analysis/CallGraph.h"
 #include "llvm/Analysis/LazyCallGraph.h"
 #include "llvm/IR/Attributes.h"
@@ -28,6 +29,7 @@
 #include "llvm/IR/DiagnosticInfo.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InlineAsm.h"
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/Instruction.h"
 #include "llvm/IR/Instructions.h"
@@ -46,7 +48,10 @@
 #include "llvm/Support/ToolOutputFile.h"
 #include "llvm/Support/WithColor.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 #include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 
 #include <fstream>
 #include <map>
@@ -54,7 +59,7 @@
 #include <utility>
 #include <vector>
 
-#define DEBUG_TYPE "dyn-untrusted"
+#define DEBUG_TYPE "provsan-post"
 
 using namespace llvm;
 
@@ -73,13 +78,21 @@ static cl::opt<bool> MPKVerbosePatching(
     "mpk-verbose-patching", cl::init(false), cl::Hidden,
     cl::desc("Print out patched instructions on instrumentation pass."));
 
-#ifdef MPK_STATS
 // Ensure we assign a local ID to the same number of hooks as we made in the
 // Pre pass.
-uint64_t total_hooks = 0;
-// Count the number of modified Alloc instructions
-uint64_t modified_inst_count = 0;
-#endif
+ALWAYS_ENABLED_STATISTIC(NumHooks, "Number of hooks given a LocalID");
+ALWAYS_ENABLED_STATISTIC(NumAllocHooks, "Number of allocHooks");
+ALWAYS_ENABLED_STATISTIC(NumBatchHooks, "Number of allocHookBatch calls");
+ALWAYS_ENABLED_STATISTIC(NumReallocHooks, "Number of reallocHooks");
+ALWAYS_ENABLED_STATISTIC(NumDeallocHooks, "Number of deallocHooks");
+ALWAYS_ENABLED_STATISTIC(NumProfileSites,
+                         "Number of faulting sites read from profiles");
+ALWAYS_ENABLED_STATISTIC(NumPatchedSites,
+                         "Number of alloc instructions modified to unsafe");
+ALWAYS_ENABLED_STATISTIC(NumSizeClassSites,
+                         "Number of those specialized to a size class");
+ALWAYS_ENABLED_STATISTIC(NumClonedWrappers,
+                         "Number of wrappers cloned for faulting callers");
 
 enum HookIndex {
   allocHookIndex = 2,
@@ -95,6 +108,7 @@ enum HookIndex {
 // TODO : Remove localID from deallocHook.
 const static std::map<std::string, HookIndex> patchArgIndexMap = {
     {"allocHook", allocHookIndex},
+    {"allocHookBatch", allocHookIndex},
     {"reallocHook", reallocHookIndex},
     {"deallocHook", deallocHookIndex}};
 
@@ -105,12 +119,18 @@ const static std::map<std::string, std::string> AllocReplacementMap = {
     {"__rust_alloc_zeroed", "__rust_untrusted_alloc_zeroed"},
 };
 
-/// Map for counting total number of hooks split between type.
-static std::map<std::string, int> hookCountMap = {
-    {"allocHook", 0}, {"reallocHook", 0}, {"deallocHook", 0}};
-
-std::vector<Instruction *> hookList;
-std::vector<CallBase *> patchList;
+/// Counts a hook, split between type.
+static void countHook(StringRef Name) {
+  ++NumHooks;
+  TrackingStatistic *Counter = StringSwitch<TrackingStatistic *>(Name)
+                                   .Case("allocHook", &NumAllocHooks)
+                                   .Case("allocHookBatch", &NumBatchHooks)
+                                   .Case("reallocHook", &NumReallocHooks)
+                                   .Case("deallocHook", &NumDeallocHooks)
+                                   .Default(nullptr);
+  if (Counter)
+    ++*Counter;
+}
 
 class IDGenerator {
   uint64_t id;
@@ -131,27 +151,63 @@ public:
 static IDGenerator IDG;
 
 PreservedAnalyses ProvsanPost::run(Module &M, ModuleAnalysisManager &MAM) {
+  // The optimizer-last extension point runs in both the compile and the link
+  // step of a ThinLTO build.
+  if (M.getModuleFlag(PROVSAN_POST_DONE_FLAG)) {
+    LLVM_DEBUG(errs() << "ProvsanPost already ran on this module.\n");
+    return PreservedAnalyses::all();
+  }
 
   llvm::errs() << "ProvsanPost Pass Running ...\n";
+  HookList.clear();
+  PatchList.clear();
+  AllocWrappers.clear();
+  ContextCalls.clear();
+  ContextPatches.clear();
+  CompactList.clear();
   // Additional flags for easier testing with opt.
   if (MPKProfilePath.empty() && !MPKTestProfilePath.empty())
     MPKProfilePath = MPKTestProfilePath;
   if (MPKTestRemoveHooks)
     RemoveHooks = MPKTestRemoveHooks;
 
+  ProvsanStats Stats("ProvsanPost",
+                     {&NumHooks, &NumAllocHooks, &NumBatchHooks,
+                      &NumReallocHooks, &NumDeallocHooks, &NumProfileSites,
+                      &NumPatchedSites, &NumSizeClassSites,
+                      &NumClonedWrappers});
+
+  // Hooks marked by the Pre pass are only inserted now, so that the optimizer
+  // ran on code without hook calls.
+  {
+    ProvsanStats::Phase Phase(Stats, "materialize-hooks",
+                              "Materialize hook markers");
+    materializeHookMarkers(M);
+    if (ContextCloning)
+      instrumentAllocContexts(M);
+  }
+
   // Post inliner pass, iterate over all functions and find hook CallSites.
   // Assign a unique local ID in a deterministic pattern to ensure localID is
   // consistent between runs.
-  assignLocalIDs(M);
+  assignLocalIDs(M, Stats);
 
   if (!MPKProfilePath.empty()) {
-    for (auto *allocSite : patchList) {
+    ProvsanStats::Phase Phase(Stats, "patch-sites", "Patch faulting sites");
+    for (auto *allocSite : PatchList) {
       patchInstruction(M, allocSite);
     }
+    cloneWrappersForContexts(M);
   }
 
-  if (RemoveHooks)
+  if (RemoveHooks) {
+    ProvsanStats::Phase Phase(Stats, "remove-hooks", "Remove hooks");
     removeHooks(M);
+  } else if (CompactHooks) {
+    ProvsanStats::Phase Phase(Stats, "compact-hooks", "Emit compact hooks");
+    emitCompactHooks(M);
+  }
+  Stats.writeJSON(M);
 
 #ifdef MPK_STATS
   printStats(M);
@@ -162,6 +218,7 @@ PreservedAnalyses ProvsanPost::run(Module &M, ModuleAnalysisManager &MAM) {
       "AllocSiteTotal", IntegerType::getInt64Ty(M.getContext())));
   AllocSiteTotal->setInitializer(IDG.getConstIntCount(M));
 #endif
+  M.addModuleFlag(Module::Max, PROVSAN_POST_DONE_FLAG, 1);
   LLVM_DEBUG(errs() << "DynUntrustedPost finish.\n");
   return PreservedAnalyses::none();
 }
@@ -203,6 +260,45 @@ bool fromJSON(const llvm::json::Value &Alloc, FaultingSite &F) {
   F.bbName = temp_bbName;
   F.funcName = temp_funcName;
 
+  // Access offsets are optional, and only written by runtimes that record
+  // them.
+  if (const json::Object *Obj = Alloc.getAsObject())
+    if (const json::Object *Accesses = Obj->getObject("accesses"))
+      if (const json::Array *Offsets = Accesses->getArray("offsets"))
+        for (const json::Value &Offset : *Offsets) {
+          const json::Object *Range = Offset.getAsObject();
+          if (!Range)
+            continue;
+          AccessRange R;
+          R.start = Range->getInteger("start").getValueOr(0);
+          // The last bucket has no end.
+          R.end = Range->getInteger("end").getValueOr(UINT64_MAX);
+          R.reads = Range->getInteger("reads").getValueOr(0);
+          R.writes = Range->getInteger("writes").getValueOr(0);
+          F.accesses.emplace(R.start, R);
+        }
+
+  if (const json::Object *Obj = Alloc.getAsObject())
+    if (auto File = Obj->getString("file")) {
+      F.file = File->str();
+      F.line = Obj->getInteger("line").getValueOr(0);
+      F.column = Obj->getInteger("column").getValueOr(0);
+    }
+
+  // Only allocations made through a wrapper call carry a context. Older
+  // runtimes wrote one entry per context, with a single "context".
+  const json::Object *Obj = Alloc.getAsObject();
+  if (const json::Array *Contexts = Obj ? Obj->getArray("contexts") : nullptr) {
+    for (const json::Value &Context : *Contexts)
+      if (auto ID = Context.getAsInteger())
+        F.contexts.insert(*ID);
+    F.contextFree = Obj->getBoolean("contextFree").getValueOr(false);
+  } else if (auto Context = Obj ? Obj->getInteger("context") : None) {
+    F.contexts.insert(*Context);
+  } else {
+    F.contextFree = true;
+  }
+
   return O && temp_id_result && temp_pkey_result && temp_bbName_result &&
          temp_funcName_result;
 }
@@ -251,8 +347,16 @@ ProvsanPost::parseJSONArrayFile(llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer
   return *ParseResult->getAsArray();
 }
 
+// Key of a source location, as written by provsan-symbolize.
+static std::string locationKey(StringRef file, uint64_t line, uint64_t column) {
+  return (file + ":" + Twine(line) + ":" + Twine(column)).str();
+}
+
+// Faulting sites with a source location (from interposition profiles) are
+// also returned in located, keyed by locationKey.
 std::map<std::string, std::map<uint64_t, FaultingSite>>
-ProvsanPost::getFaultingAllocMap() {
+ProvsanPost::getFaultingAllocMap(
+    std::map<std::string, FaultingSite> &located) {
   std::map<std::string, std::map<uint64_t, FaultingSite>> fault_map;
   // If no path provided, return empty map.
   if (MPKProfilePath.empty())
@@ -265,30 +369,361 @@ ProvsanPost::getFaultingAllocMap() {
       continue;
     }
 
+    // Older runtimes wrote a site once per stack and context, each entry with
+    // the accesses of the whole site. Those are only counted once per file.
+    std::set<std::pair<std::string, uint64_t>> sites_in_file;
     for (const auto &Alloc : ParseResult.getValue()) {
       FaultingSite FS;
       if (fromJSON(Alloc, FS)) {
+        if (!FS.file.empty() && FS.line != 0)
+          located.emplace(locationKey(FS.file, FS.line, FS.column), FS);
         auto iter = fault_map.find(FS.funcName);
         if (iter == fault_map.end()) {
           fault_map.emplace(FS.funcName, std::map<uint64_t, FaultingSite>());
           iter = fault_map.find(FS.funcName);
         }
-        iter->second.emplace(FS.localID, FS);
+        bool repeated =
+            !sites_in_file.emplace(FS.funcName, FS.localID).second;
+        auto inserted = iter->second.emplace(FS.localID, FS);
+        if (!inserted.second) {
+          // Entries of a site reached through several contexts are merged.
+          auto &site = inserted.first->second;
+          site.contexts.insert(FS.contexts.begin(), FS.contexts.end());
+          site.contextFree |= FS.contextFree;
+          if (repeated)
+            continue;
+          // The same site faulted in several runs, sum up its accesses.
+          auto &accesses = inserted.first->second.accesses;
+          for (auto &range : FS.accesses) {
+            auto merged = accesses.emplace(range.first, range.second);
+            if (!merged.second) {
+              merged.first->second.reads += range.second.reads;
+              merged.first->second.writes += range.second.writes;
+            }
+          }
+        }
       } else {
         errs() << "Error getting Allocation Site: " << Alloc << "\n";
       }
     }
   }
 
+  for (auto &func : fault_map)
+    NumProfileSites += func.second.size();
+
   LLVM_DEBUG(errs() << "Returning successful fault_map.\n");
   return fault_map;
 }
 
+/// The site of the allocHookBatch calls that flush one buffer, see
+/// DynUntrustedAllocPre::emitBatchedHook.
+struct BatchSite {
+  ConstantInt *id;
+  Value *bbNameStr;
+  Value *funcNameStr;
+};
+
+// Finds the allocation calls whose results are stored into a batch buffer.
+static void findBatchedAllocs(Value *Buffer,
+                              SmallVectorImpl<CallBase *> &Allocs) {
+  SmallVector<Value *, 8> WorkList = {Buffer};
+  SmallPtrSet<Value *, 8> Visited;
+  while (!WorkList.empty()) {
+    Value *V = WorkList.pop_back_val();
+    if (!Visited.insert(V).second)
+      continue;
+    for (User *U : V->users()) {
+      if (isa<GetElementPtrInst>(U) || isa<BitCastInst>(U)) {
+        WorkList.push_back(U);
+      } else if (auto *Store = dyn_cast<StoreInst>(U)) {
+        auto *Alloc =
+            dyn_cast<CallBase>(Store->getValueOperand()->stripPointerCasts());
+        if (Store->getPointerOperand() == V && Alloc &&
+            Alloc->getCalledFunction() &&
+            AllocReplacementMap.count(Alloc->getCalledFunction()->getName().str()))
+          Allocs.push_back(Alloc);
+      }
+    }
+  }
+}
+
+// Removes the module flag named Key, if present.
+static void eraseModuleFlag(Module &M, StringRef Key) {
+  NamedMDNode *Flags = M.getModuleFlagsMetadata();
+  if (!Flags)
+    return;
+  SmallVector<MDNode *, 8> Kept;
+  for (MDNode *Flag : Flags->operands())
+    if (cast<MDString>(Flag->getOperand(1))->getString() != Key)
+      Kept.push_back(Flag);
+  Flags->clearOperands();
+  for (MDNode *Flag : Kept)
+    Flags->addOperand(Flag);
+}
+
+// Inserts the hook call described by each provsan.hook marker, with the same
+// arguments and placement as ProvsanPre gives real hooks: after the call, or
+// at the start of the normal destination of an invoke.
+//
+// Optimizations that merge calls (e.g. hoisting or sinking identical calls
+// out of two branches) drop metadata they do not know, markers included. In
+// modules where ProvsanPre left markers, every call to one of the allocation
+// functions (PROVSAN_ALLOC, PROVSAN_REALLOC, PROVSAN_FREE, as in ProvsanPre)
+// is therefore visited, and one that lost its marker is hooked by the kind of
+// its callee. In the functions ProvsanPre left out of its scope, which carry
+// PROVSAN_UNSCOPED_ATTR, such a call is hooked as Pre marks them there: a
+// realloc or free releases its old pointer, an allocation is not hooked. The
+// flag and the attribute are removed, so a later run does not hook the calls
+// again.
+void ProvsanPost::materializeHookMarkers(Module &M) {
+  if (!M.getModuleFlag(PROVSAN_HOOK_MARKERS_FLAG))
+    return;
+  eraseModuleFlag(M, PROVSAN_HOOK_MARKERS_FLAG);
+
+  StringMap<StringRef> CalleeKinds;
+  for (auto &name : allocFunctionNames("PROVSAN_ALLOC", "trusted_malloc"))
+    CalleeKinds[name] = "alloc";
+  for (auto &name : allocFunctionNames("PROVSAN_REALLOC", "trusted_realloc"))
+    CalleeKinds[name] = "realloc";
+  for (auto &name : allocFunctionNames("PROVSAN_FREE", "trusted_free"))
+    CalleeKinds[name] = "dealloc";
+
+  SmallVector<std::pair<CallBase *, StringRef>, 32> Marked;
+  unsigned Recovered = 0;
+  for (Function &F : M) {
+    bool Scoped = !F.hasFnAttribute(PROVSAN_UNSCOPED_ATTR);
+    F.removeFnAttr(PROVSAN_UNSCOPED_ATTR);
+    for (Instruction &I : instructions(F)) {
+      auto *CS = dyn_cast<CallBase>(&I);
+      if (!CS)
+        continue;
+      if (MDNode *Marker = CS->getMetadata(PROVSAN_HOOK_MD)) {
+        CS->setMetadata(PROVSAN_HOOK_MD, nullptr);
+        StringRef Kind = cast<MDString>(Marker->getOperand(0))->getString();
+        if (Kind != "none")
+          Marked.push_back({CS, Kind});
+        continue;
+      }
+      Function *Callee = CS->getCalledFunction();
+      auto Kind =
+          Callee ? CalleeKinds.find(Callee->getName()) : CalleeKinds.end();
+      if (Kind == CalleeKinds.end())
+        continue;
+      ++Recovered;
+      if (Scoped)
+        Marked.push_back({CS, Kind->second});
+      else if (Kind->second != "alloc")
+        Marked.push_back({CS, "dealloc"});
+    }
+  }
+  if (Recovered)
+    errs() << "WARNING: " << Recovered << " allocation call"
+           << (Recovered == 1 ? "" : "s")
+           << " lost their provsan.hook marker, hooked by callee.\n";
+  if (Marked.empty())
+    return;
+
+  LLVMContext &C = M.getContext();
+  Type *VoidTy = Type::getVoidTy(C);
+  Type *Int8PtrTy = Type::getInt8PtrTy(C);
+  Type *Int64Ty = Type::getInt64Ty(C);
+  AttributeList fnAttrs =
+      AttributeList::get(C, AttributeList::FunctionIndex,
+                         {Attribute::NoUnwind, Attribute::ArgMemOnly});
+  FunctionCallee allocHook =
+      M.getOrInsertFunction("allocHook", fnAttrs, VoidTy, Int8PtrTy, Int64Ty,
+                            Int64Ty, Int8PtrTy, Int8PtrTy);
+  FunctionCallee reallocHook = M.getOrInsertFunction(
+      "reallocHook", fnAttrs, VoidTy, Int8PtrTy, Int64Ty, Int8PtrTy, Int64Ty,
+      Int64Ty, Int8PtrTy, Int8PtrTy);
+  FunctionCallee deallocHook = M.getOrInsertFunction(
+      "deallocHook", fnAttrs, VoidTy, Int8PtrTy, Int64Ty, Int64Ty);
+  Value *DummyID = ConstantInt::get(Int64Ty, -1);
+  Value *NullStr = ConstantPointerNull::get(cast<PointerType>(Int8PtrTy));
+
+  for (auto &Entry : Marked) {
+    CallBase *CS = Entry.first;
+    StringRef Kind = Entry.second;
+    Instruction *InsertPt;
+    if (auto *Invoke = dyn_cast<InvokeInst>(CS)) {
+      BasicBlock *NormalDest = Invoke->getNormalDest();
+      if (!NormalDest->getSinglePredecessor())
+        NormalDest = SplitEdge(Invoke->getParent(), NormalDest);
+      InsertPt = &*NormalDest->getFirstInsertionPt();
+    } else {
+      InsertPt = CS->getNextNode();
+    }
+
+    IRBuilder<> IRB(InsertPt);
+    if (Kind == "alloc")
+      IRB.CreateCall(allocHook, {CS, CS->getArgOperand(0), DummyID, NullStr,
+                                 NullStr});
+    else if (Kind == "realloc")
+      IRB.CreateCall(reallocHook,
+                     {CS, CS->getArgOperand(3), CS->getArgOperand(0),
+                      CS->getArgOperand(1), DummyID, NullStr, NullStr});
+    else if (Kind == "dealloc")
+      IRB.CreateCall(deallocHook,
+                     {CS->getArgOperand(0), CS->getArgOperand(1), DummyID});
+  }
+}
+
+// Returns "@callee:line<caller:line..." for a location inlined into its
+// function, innermost frame first, and "" otherwise. It is appended to the
+// block name of a site, so that each inlined copy of an allocation carries
+// the calls it was inlined through into the profile.
+static std::string inlinedAtChain(const DebugLoc &Loc) {
+  if (!Loc || !Loc.getInlinedAt())
+    return "";
+  std::string Chain = "@";
+  for (DILocation *L = Loc.get(); L; L = L->getInlinedAt()) {
+    if (L != Loc.get())
+      Chain += "<";
+    Chain += L->getScope()->getSubprogram()->getName().str() + ":" +
+             std::to_string(L->getLine());
+  }
+  return Chain;
+}
+
+static bool funcSort(Function *F1, Function *F2);
+
+// Id of the ordinal-th call to an allocation wrapper in Caller. Ids have to
+// be the same in the profiling and the patching build, and fit a JSON
+// integer.
+static uint64_t contextID(StringRef Caller, uint64_t Ordinal) {
+  uint64_t Hash = 0xcbf29ce484222325ULL;
+  std::string Key = (Caller + "#" + Twine(Ordinal)).str();
+  for (unsigned char c : Key)
+    Hash = (Hash ^ c) * 0x100000001b3ULL;
+  return (Hash & INT64_MAX) | 1;
+}
+
+// Finds the allocation wrappers, functions that return the result of a hooked
+// allocation, and numbers the direct calls to them. Unless the hooks are
+// removed, each call stores its id to the runtime's __provsan_alloc_context,
+// which the hooks record with every allocation, and restores the previous
+// context afterwards, so a wrapper calling another wrapper keeps its own.
+void ProvsanPost::instrumentAllocContexts(Module &M) {
+  SmallPtrSet<Value *, 32> hookedAllocs;
+  for (StringRef name : {"allocHook", "reallocHook"})
+    if (Function *hook = M.getFunction(name))
+      for (User *U : hook->users())
+        if (auto *CS = dyn_cast<CallBase>(U))
+          hookedAllocs.insert(CS->getArgOperand(0));
+
+  for (Function &F : M)
+    for (Instruction &I : instructions(F))
+      if (auto *Ret = dyn_cast<ReturnInst>(&I))
+        if (Value *V = Ret->getReturnValue())
+          if (hookedAllocs.count(V->stripPointerCasts()))
+            AllocWrappers.insert(&F);
+  if (AllocWrappers.empty())
+    return;
+
+  LLVMContext &C = M.getContext();
+  Type *Int64Ty = Type::getInt64Ty(C);
+  auto *Context =
+      cast<GlobalVariable>(M.getOrInsertGlobal("__provsan_alloc_context",
+                                               Int64Ty));
+  Context->setThreadLocalMode(GlobalValue::InitialExecTLSModel);
+
+  std::vector<Function *> WorkList;
+  for (Function &F : M)
+    if (!F.isDeclaration())
+      WorkList.push_back(&F);
+  std::sort(WorkList.begin(), WorkList.end(), funcSort);
+
+  for (Function *F : WorkList) {
+    uint64_t Ordinal = 0;
+    // Holds the previous context across invokes, whose successors may be
+    // shared with other paths. It starts out with the context at entry, which
+    // is the context on every path not through an invoke.
+    AllocaInst *Saved = nullptr;
+    std::vector<CallBase *> Calls;
+    ReversePostOrderTraversal<Function *> RPOT(F);
+    for (BasicBlock *BB : RPOT)
+      for (Instruction &I : *BB)
+        if (auto *CS = dyn_cast<CallBase>(&I))
+          if (AllocWrappers.count(CS->getCalledFunction()))
+            Calls.push_back(CS);
+
+    for (CallBase *CS : Calls) {
+      uint64_t ID = contextID(F->getName(), Ordinal++);
+      ContextCalls[CS] = ID;
+      if (RemoveHooks)
+        continue;
+
+      Value *Previous = new LoadInst(Int64Ty, Context, "provsan.context", CS);
+      new StoreInst(ConstantInt::get(Int64Ty, ID), Context, CS);
+      // The previous context is restored wherever the call returns or unwinds
+      // to.
+      if (auto *Invoke = dyn_cast<InvokeInst>(CS)) {
+        if (!Saved) {
+          Instruction *Entry = &*F->getEntryBlock().getFirstInsertionPt();
+          Saved = new AllocaInst(Int64Ty, M.getDataLayout().getAllocaAddrSpace(),
+                                 "provsan.context.slot", Entry);
+          new StoreInst(new LoadInst(Int64Ty, Context, "provsan.context", Entry),
+                        Saved, Entry);
+        }
+        new StoreInst(Previous, Saved, Invoke);
+        for (BasicBlock *Dest :
+             {Invoke->getNormalDest(), Invoke->getUnwindDest()}) {
+          Instruction *InsertPt = &*Dest->getFirstInsertionPt();
+          new StoreInst(new LoadInst(Int64Ty, Saved, "provsan.context",
+                                     InsertPt),
+                        Context, InsertPt);
+        }
+      } else {
+        new StoreInst(Previous, Context, CS->getNextNode());
+      }
+    }
+  }
+}
+
+// Patches the allocations collected in ContextPatches in a clone of their
+// wrapper, and points the calls whose context faulted at the clone. All other
+// callers keep allocating trusted memory.
+void ProvsanPost::cloneWrappersForContexts(Module &M) {
+  for (auto &entry : ContextPatches) {
+    Function *Wrapper = entry.first;
+    ContextPatch &Patch = entry.second;
+
+    ValueToValueMapTy VMap;
+    Function *Clone = CloneFunction(Wrapper, VMap);
+    Clone->setName(Wrapper->getName() + ".provsan.untrusted");
+    Clone->setLinkage(GlobalValue::InternalLinkage);
+    for (CallBase *Alloc : Patch.allocs)
+      patchInstruction(M, cast<CallBase>(VMap[Alloc]));
+    // The hooks of the clone describe the same sites as those of the wrapper.
+    for (size_t i = 0, e = CompactList.size(); i != e; ++i) {
+      if (CompactList[i].hook->getFunction() != Wrapper)
+        continue;
+      CompactSite Site = CompactList[i];
+      Site.hook = cast<CallBase>(VMap[Site.hook]);
+      CompactList.push_back(Site);
+    }
+
+    unsigned Redirected = 0, Total = 0;
+    for (auto &call : ContextCalls) {
+      if (call.first->getCalledFunction() != Wrapper)
+        continue;
+      ++Total;
+      if (Patch.contexts.count(call.second)) {
+        call.first->setCalledFunction(Clone);
+        ++Redirected;
+      }
+    }
+    errs() << "Cloned " << Wrapper->getName() << " for " << Redirected
+           << " of its " << Total << " calls\n";
+    ++NumClonedWrappers;
+  }
+}
+
 static bool funcSort(Function *F1, Function *F2) {
   return F1->getName().str() > F2->getName().str();
 }
 
-void ProvsanPost::assignLocalIDs(Module &M) {
+void ProvsanPost::assignLocalIDs(Module &M, ProvsanStats &Stats) {
   std::vector<Function *> WorkList;
   for (Function &F : M) {
     if (!F.isDeclaration())
@@ -299,7 +734,13 @@ void ProvsanPost::assignLocalIDs(Module &M) {
 
   LLVM_DEBUG(errs() << "Search for modified functions!\n");
 
-  auto fault_map = getFaultingAllocMap();
+  std::map<std::string, FaultingSite> located;
+  std::map<std::string, std::map<uint64_t, FaultingSite>> fault_map;
+  {
+    ProvsanStats::Phase Phase(Stats, "load-profiles", "Load fault profiles");
+    fault_map = getFaultingAllocMap(located);
+  }
+  ProvsanStats::Phase Phase(Stats, "assign-ids", "Assign local IDs");
 
   // Note on ModuleSlotTracker:
   // The MST is used for "naming" BasicBlocks that do not already
@@ -314,7 +755,13 @@ void ProvsanPost::assignLocalIDs(Module &M) {
   // - void MIRPrinter::print(const MachineBasicBlock &MBB)
   ModuleSlotTracker MST(&M, /*shouldInitializeAllMetaData*/ false);
 
+  std::map<Value *, BatchSite> batchSites;
   for (Function *F : WorkList) {
+    uint64_t FunctionHooks = 0;
+    TimeRecord Begin;
+    if (Stats.tracksFunctions())
+      Begin = TimeRecord::getCurrentTime(/*Start=*/true);
+
     MST.incorporateFunction(*F);
     ReversePostOrderTraversal<Function *> RPOT(F);
     IDGenerator LocalIDG;
@@ -336,21 +783,14 @@ void ProvsanPost::assignLocalIDs(Module &M) {
         auto index_iter = patchArgIndexMap.find(hook->getName().str());
         if (index_iter == patchArgIndexMap.end())
           continue;
-#ifdef MPK_STATS
-        auto hookCounter = hookCountMap.find(hook->getName().str());
-        if (hookCounter != hookCountMap.end())
-          hookCounter->second++;
-#endif
+        countHook(hook->getName());
+        ++FunctionHooks;
 
         auto index = index_iter->second;
         Instruction *callInst = cast<Instruction>(CS);
 
-#ifdef MPK_STATS
-        ++total_hooks;
-#endif
-
         if (RemoveHooks)
-          hookList.push_back(callInst);
+          HookList.push_back(callInst);
 
         // If index == deallocHookIndex, then this is a deallocHook. We can
         // skip the rest of the code since we know we dont need to patch this
@@ -358,6 +798,22 @@ void ProvsanPost::assignLocalIDs(Module &M) {
         if (index == deallocHookIndex)
           continue;
 
+        // All allocHookBatch calls flushing one buffer describe the same
+        // site, which is numbered at the first of them.
+        Value *batchBuffer = nullptr;
+        if (hook->getName() == "allocHookBatch") {
+          batchBuffer = CS->getArgOperand(0)->stripPointerCasts();
+          auto batch = batchSites.find(batchBuffer);
+          if (batch != batchSites.end()) {
+            CS->setArgOperand(index, batch->second.id);
+            if (!RemoveHooks) {
+              CS->setArgOperand(index + 1, batch->second.bbNameStr);
+              CS->setArgOperand(index + 2, batch->second.funcNameStr);
+            }
+            continue;
+          }
+        }
+
         // Get (or make) BasicBlock name
         std::string bbName;
         if (BB->getName().str().empty()) {
@@ -365,11 +821,31 @@ void ProvsanPost::assignLocalIDs(Module &M) {
         } else {
           bbName = BB->getName().str();
         }
+        auto *allocCall = dyn_cast<CallBase>(CS->getArgOperand(0));
+        bbName += inlinedAtChain(allocCall ? allocCall->getDebugLoc()
+                                           : CS->getDebugLoc());
 
         // Set LocalID for hook function
         auto id = LocalIDG.getConstID(M);
         CS->setArgOperand(index, id);
-        if (!RemoveHooks) {
+        if (batchBuffer) {
+          // Batches are flushed rarely, so they keep their string arguments
+          // even with compact hooks.
+          BatchSite &batch = batchSites[batchBuffer];
+          batch = {id, nullptr, nullptr};
+          if (!RemoveHooks) {
+            IRBuilder<> IRB(&*callInst);
+            batch.bbNameStr = IRB.CreateGlobalStringPtr(bbName);
+            batch.funcNameStr = IRB.CreateGlobalStringPtr(funcName);
+            CS->setArgOperand(index + 1, batch.bbNameStr);
+            CS->setArgOperand(index + 2, batch.funcNameStr);
+          }
+        } else if (!RemoveHooks && CompactHooks) {
+          // The site is described once, in the table emitted by
+          // emitCompactHooks.
+          CompactList.push_back({CS, id->getZExtValue(), bbName, funcName,
+                                 index == reallocHookIndex});
+        } else if (!RemoveHooks) {
           // We only want to create these global strings if they are going to
           // be used in final program execution. When removing the hooks, skip
           // creating (and assigning) the Global String identifiers.
@@ -383,34 +859,64 @@ void ProvsanPost::assignLocalIDs(Module &M) {
         // If provided a valid path, modify given instruction
         if (!MPKProfilePath.empty()) {
           // Check to see if this function contains any faults
-          if (func_fault_iter == fault_map.end()) {
+          if (func_fault_iter == fault_map.end() && located.empty()) {
             continue;
           }
 
-          // Get Call Instr this hook references
+          // Get Call Instr this hook references. A batch references the
+          // allocations stored into its buffer.
           auto allocFunc = CS->getArgOperand(0);
-          if (auto *allocInst = dyn_cast<CallBase>(allocFunc)) {
+          SmallVector<CallBase *, 2> allocInsts;
+          if (batchBuffer)
+            findBatchedAllocs(batchBuffer, allocInsts);
+          else if (auto *allocInst = dyn_cast<CallBase>(allocFunc))
+            allocInsts.push_back(allocInst);
+          if (!allocInsts.empty()) {
 
             // Check to see if ID is in fault map for patching
-            auto &func_fault_map = func_fault_iter->second;
-            auto map_iter = func_fault_map.find(id->getZExtValue());
-            if (map_iter == func_fault_map.end()) {
-              continue;
+            const FaultingSite *site = nullptr;
+            if (func_fault_iter != fault_map.end()) {
+              auto &func_fault_map = func_fault_iter->second;
+              auto map_iter = func_fault_map.find(id->getZExtValue());
+              if (map_iter != func_fault_map.end())
+                site = &map_iter->second;
             }
 
-            if (bbName.compare(map_iter->second.bbName) != 0) {
+            if (site && bbName.compare(site->bbName) != 0) {
               errs() << "ERROR : Faulting allocation site found in "
                         "non-matching BasicBlock:\n"
-                     << "AllocSite(" << map_iter->second.localID << ", "
-                     << map_iter->second.funcName << ")\n"
-                     << "TraceBlock(" << map_iter->second.bbName << ") -> "
+                     << "AllocSite(" << site->localID << ", "
+                     << site->funcName << ")\n"
+                     << "TraceBlock(" << site->bbName << ") -> "
                      << "InstrBlock(" << bbName << ")\n";
             }
-            LLVM_DEBUG(errs() << "modified callsite:\n");
-            LLVM_DEBUG(errs() << *CS << "\n");
 
-            patchList.push_back(allocInst);
-            PrintFaultingLocation(M, allocInst);
+            for (CallBase *allocInst : allocInsts) {
+              // Sites profiled through interposition are only known by the
+              // source location of the allocation call.
+              const FaultingSite *allocSite =
+                  site ? site : findLocatedSite(located, allocInst);
+              if (!allocSite)
+                continue;
+              LLVM_DEBUG(errs() << "modified callsite:\n");
+              LLVM_DEBUG(errs() << *CS << "\n");
+
+              // Allocations in a wrapper that only faulted through some of
+              // its calls are patched in a clone used by those calls.
+              Function *wrapper = allocInst->getFunction();
+              if (ContextCloning && AllocWrappers.count(wrapper) &&
+                  !allocSite->contextFree) {
+                auto &patch = ContextPatches[wrapper];
+                patch.allocs.push_back(allocInst);
+                patch.contexts.insert(allocSite->contexts.begin(),
+                                      allocSite->contexts.end());
+                PrintFaultingLocation(M, allocInst, *allocSite);
+                continue;
+              }
+
+              PatchList.push_back(allocInst);
+              PrintFaultingLocation(M, allocInst, *allocSite);
+            }
           } else {
             LLVM_DEBUG(errs()
                        << "Alloc Func expected, found: " << *allocFunc << "\n");
@@ -420,9 +926,85 @@ void ProvsanPost::assignLocalIDs(Module &M) {
         }
       }
     }
+
+    if (Stats.tracksFunctions())
+      Stats.recordFunction(*F, FunctionHooks, secondsSince(Begin));
   }
 }
 
+const FaultingSite *ProvsanPost::findLocatedSite(
+    const std::map<std::string, FaultingSite> &located, CallBase *inst) const {
+  if (located.empty())
+    return nullptr;
+  const DebugLoc &Loc = inst->getDebugLoc();
+  if (!Loc)
+    return nullptr;
+
+  // The symbolizer reports the innermost (inlined) frame, with the file name
+  // joined to its compilation directory.
+  auto *Scope = cast<DIScope>(Loc.getScope());
+  SmallString<256> Path(Scope->getFilename());
+  if (!sys::path::is_absolute(Path)) {
+    Path = Scope->getDirectory();
+    sys::path::append(Path, Scope->getFilename());
+  }
+  auto found = located.find(locationKey(Path, Loc.getLine(), Loc.getCol()));
+  return found == located.end() ? nullptr : &found->second;
+}
+
+// Returns the size class the runtime's allocator serves an allocation of the
+// given size and alignment from, or None if it is mapped individually. Has to
+// match initSizeClasses and compartmentAlloc in Runtime/provsan_alloc.cpp.
+static Optional<unsigned> getSizeClass(uint64_t Size, uint64_t Align) {
+  const uint64_t MinAlign = 16, MaxSmall = 32768, PageSize = 4096;
+  if (Size == 0)
+    Size = 1;
+  if (Align > MinAlign) {
+    // Power of two classes hold objects aligned to their size.
+    uint64_t Rounded = PowerOf2Ceil(std::max(Size, Align));
+    if (Align > PageSize || Rounded > MaxSmall)
+      return None;
+    Size = Rounded;
+  }
+  if (Size > MaxSmall)
+    return None;
+
+  // 16 byte steps up to 128 bytes, then four classes per power of two.
+  Size = alignTo(Size, MinAlign);
+  if (Size <= 128)
+    return Size / MinAlign - 1;
+  unsigned Class = 128 / MinAlign;
+  for (uint64_t Base = 128; Base < MaxSmall; Base *= 2)
+    for (uint64_t Step = 1; Step <= 4; ++Step, ++Class)
+      if (Size <= Base + Step * (Base / 4))
+        return Class;
+  return None;
+}
+
+// Returns the untrusted_malloc_c<N> entry point serving a patched call of
+// constant size and alignment, or nullptr.
+static Function *getSizeClassAlloc(Module &M, CallBase *inst,
+                                   Function *repl_func) {
+  // Zeroed allocations keep the generic entry point.
+  if (repl_func->getName() != "untrusted_malloc" &&
+      repl_func->getName() != "__rust_untrusted_alloc")
+    return nullptr;
+  if (inst->arg_size() != 2)
+    return nullptr;
+  auto *Size = dyn_cast<ConstantInt>(inst->getArgOperand(0));
+  auto *Align = dyn_cast<ConstantInt>(inst->getArgOperand(1));
+  if (!Size || !Align)
+    return nullptr;
+  auto Class = getSizeClass(Size->getZExtValue(), Align->getZExtValue());
+  if (!Class)
+    return nullptr;
+  // The entry points take the same arguments, and ignore them.
+  FunctionCallee Callee = M.getOrInsertFunction(
+      ("untrusted_malloc_c" + Twine(*Class)).str(),
+      repl_func->getFunctionType(), repl_func->getAttributes());
+  return dyn_cast<Function>(Callee.getCallee());
+}
+
 void ProvsanPost::patchInstruction(Module &M, CallBase *inst) {
   auto calledFuncName = inst->getCalledFunction()->getName().str();
   auto repl_iter = AllocReplacementMap.find(calledFuncName);
@@ -442,11 +1024,15 @@ void ProvsanPost::patchInstruction(Module &M, CallBase *inst) {
     return;
   }
 
+  if (SizeClasses)
+    if (Function *class_func = getSizeClassAlloc(M, inst, repl_func)) {
+      repl_func = class_func;
+      ++NumSizeClassSites;
+    }
+
   inst->setCalledFunction(repl_func);
   LLVM_DEBUG(errs() << "Modified CallInstruction: " << *inst << "\n");
-#ifdef MPK_STATS
-  ++modified_inst_count;
-#endif
+  ++NumPatchedSites;
 }
 
 // Working under the assumption that all missed cases of Hook calls is
@@ -457,12 +1043,7 @@ void removeFunctionUsers(Function *F) {
     if (auto *inst = dyn_cast<Instruction>(user)) {
       salvageDebugInfo(*inst);
       inst->eraseFromParent();
-#ifdef MPK_STATS
-      total_hooks++;
-      auto trackedHook = hookCountMap.find(F->getName().str());
-      if (trackedHook != hookCountMap.end())
-        trackedHook->second++;
-#endif
+      countHook(F->getName());
     } else {
       errs() << "User not an instruction: " << *user << "\n";
       assert(false && "Function user not an instruction!");
@@ -500,20 +1081,36 @@ void ProvsanPost::getDiagMessage(raw_ostream &OS, const DebugLoc &Loc,
   }
 }
 
-void ProvsanPost::PrintFaultingLocation(Module &M, CallBase *inst) {
+void ProvsanPost::PrintFaultingLocation(Module &M, CallBase *inst,
+                                        const FaultingSite &site) {
   auto &DI = inst->getDebugLoc();
 
   WithColor(errs(), HighlightColor::Error) << "Error";
   errs().changeColor(raw_ostream::Colors::WHITE, true)
       << ": Compartment Violation from memory originally allocated at ";
   errs().changeColor(raw_ostream::Colors::WHITE, false);
-  getDiagMessage(errs(), DI, true);
+  if (DI)
+    getDiagMessage(errs(), DI, true);
+  else
+    errs() << inst->getFunction()->getName();
   errs() << "\n";
+
+  // Show which byte ranges of the allocation were accessed, so that shared
+  // fields can be split off instead of moving the whole object.
+  for (auto &range : site.accesses) {
+    const AccessRange &R = range.second;
+    errs() << "\tAccessed bytes [" << R.start << ", ";
+    if (R.end == UINT64_MAX)
+      errs() << "...";
+    else
+      errs() << R.end;
+    errs() << "): " << R.reads << " reads, " << R.writes << " writes\n";
+  }
 }
 
 void ProvsanPost::removeHooks(Module &M) {
   llvm::errs() << "RemoveHooks called. RemoveHooks = " << RemoveHooks << "\n";
-  for (auto inst : hookList) {
+  for (auto inst : HookList) {
     salvageDebugInfo(*inst);
     inst->eraseFromParent();
   }
@@ -529,6 +1126,120 @@ void ProvsanPost::removeHooks(Module &M) {
   auto deallocHook = M.getFunction("deallocHook");
   if (deallocHook)
     removeFunctionUsers(deallocHook);
+
+  auto allocHookBatch = M.getFunction("allocHookBatch");
+  if (allocHookBatch)
+    removeFunctionUsers(allocHookBatch);
+}
+
+// Replaces every hook with a compact hook, that only takes the allocation
+// (and for reallocHookPC the old allocation). Each site is described by an
+// internal SiteDescriptor global ({localID, bbName, funcName, isRealloc}, see
+// Runtime/provsan_site_pcs.h), and an entry {return address, descriptor},
+// both as offsets from the entry, is added to the read-only provsan_site_pcs
+// section. The compact hook is called from an inline asm statement, so the
+// label following the call is its return address. A constructor registers
+// the section with the runtime, which resolves the return address of each
+// compact hook call with a binary search.
+void ProvsanPost::emitCompactHooks(Module &M) {
+  if (CompactList.empty())
+    return;
+
+  LLVMContext &C = M.getContext();
+  Type *Int64Ty = Type::getInt64Ty(C);
+  Type *Int8PtrTy = Type::getInt8PtrTy(C);
+  StructType *DescTy = StructType::get(C, {Int64Ty, Int8PtrTy, Int8PtrTy, Int64Ty});
+  FunctionType *CtorTy = FunctionType::get(Type::getVoidTy(C), false);
+  SmallVector<GlobalValue *, 16> Descriptors;
+
+  for (auto &site : CompactList) {
+    CallBase *hook = site.hook;
+    IRBuilder<> IRB(hook);
+    auto *Desc = new GlobalVariable(
+        M, DescTy, /*isConstant*/ true, GlobalValue::InternalLinkage,
+        ConstantStruct::get(
+            DescTy, {ConstantInt::get(Int64Ty, site.localID),
+                     IRB.CreateGlobalStringPtr(site.bbName),
+                     IRB.CreateGlobalStringPtr(site.funcName),
+                     ConstantInt::get(Int64Ty, site.isRealloc)}),
+        "__provsan_site");
+    Descriptors.push_back(Desc);
+
+    // allocHook(ptr, size, ...) and reallocHook(newPtr, newSize, oldPtr,
+    // oldSize, ...) keep their leading arguments, passed in the registers of
+    // the C calling convention. The statement clobbers the registers the
+    // callee may clobber, the ones holding arguments through tied outputs.
+    static const char *const ArgRegs[] = {"rdi", "rsi", "rdx", "rcx"};
+    unsigned NumArgs = site.isRealloc ? 4 : 2;
+    SmallVector<Type *, 4> OutTys(NumArgs, Int64Ty);
+    SmallVector<Type *, 5> ParamTys;
+    SmallVector<Value *, 5> Args;
+    std::string Outputs, Inputs, Clobbers;
+    for (unsigned i = NumArgs; i < 4; ++i)
+      Clobbers += "~{" + std::string(ArgRegs[i]) + "},";
+    for (unsigned i = 0; i < NumArgs; ++i) {
+      Value *Arg = hook->getArgOperand(i);
+      Args.push_back(Arg->getType()->isPointerTy()
+                         ? IRB.CreatePtrToInt(Arg, Int64Ty)
+                         : IRB.CreateZExtOrTrunc(Arg, Int64Ty));
+      ParamTys.push_back(Int64Ty);
+      Outputs += "={" + std::string(ArgRegs[i]) + "},";
+      Inputs += std::to_string(i) + ",";
+    }
+    Args.push_back(Desc);
+    ParamTys.push_back(Desc->getType());
+    std::string Constraints =
+        Outputs + Inputs + "i," + Clobbers +
+        "~{rax},~{r8},~{r9},~{r10},~{r11},~{xmm0},~{xmm1},~{xmm2},~{xmm3},"
+        "~{xmm4},~{xmm5},~{xmm6},~{xmm7},~{xmm8},~{xmm9},~{xmm10},~{xmm11},"
+        "~{xmm12},~{xmm13},~{xmm14},~{xmm15},~{memory},~{dirflag},~{fpsr},"
+        "~{flags}";
+    // Numeric labels may be defined several times, so the statement can be
+    // duplicated by later passes.
+    std::string Asm = std::string("call ") +
+                      (site.isRealloc ? "reallocHookPC" : "allocHookPC") +
+                      "@PLT\n"
+                      "1:\n"
+                      ".pushsection provsan_site_pcs,\"a\",@progbits\n"
+                      ".p2align 2\n"
+                      ".long 1b - .\n"
+                      ".long ${" +
+                      std::to_string(2 * NumArgs) +
+                      ":c} - .\n"
+                      ".popsection";
+    // alignstack, as the statement makes a call.
+    CallInst *Call = IRB.CreateCall(
+        InlineAsm::get(FunctionType::get(StructType::get(C, OutTys), ParamTys,
+                                         false),
+                       Asm, Constraints, /*hasSideEffects*/ true,
+                       /*isAlignStack*/ true),
+        Args);
+    Call->setDebugLoc(hook->getDebugLoc());
+    hook->eraseFromParent();
+  }
+  appendToCompilerUsed(M, Descriptors);
+
+  // The linker defines __start_ and __stop_ symbols for sections named like C
+  // identifiers.
+  auto *Start = cast<GlobalVariable>(
+      M.getOrInsertGlobal("__start_provsan_site_pcs", Type::getInt8Ty(C)));
+  auto *Stop = cast<GlobalVariable>(
+      M.getOrInsertGlobal("__stop_provsan_site_pcs", Type::getInt8Ty(C)));
+  Start->setVisibility(GlobalValue::HiddenVisibility);
+  Stop->setVisibility(GlobalValue::HiddenVisibility);
+
+  Function *Ctor = Function::Create(CtorTy, GlobalValue::InternalLinkage,
+                                    "provsan.register_site_pcs", M);
+  IRBuilder<> IRB(BasicBlock::Create(C, "", Ctor));
+  FunctionCallee Register = M.getOrInsertFunction(
+      "provsan_register_site_pcs", Type::getVoidTy(C), Int8PtrTy, Int8PtrTy);
+  IRB.CreateCall(Register, {Start, Stop});
+  IRB.CreateRetVoid();
+  appendToGlobalCtors(M, Ctor, 0);
+
+  LLVM_DEBUG(errs() << "Emitted " << CompactList.size()
+                    << " compact hooks.\n");
+  CompactList.clear();
 }
 
 #ifdef MPK_STATS
@@ -547,14 +1258,14 @@ void ProvsanPost::printStats(Module &M) {
   }
 
   llvm::raw_fd_ostream OS(PreStats->FD, /* shouldClose */ false);
-  OS << "Number of alloc instructions modified to unsafe: "
-     << modified_inst_count << "\n"
-     << "Total number hooks given a LocalID: " << total_hooks << "\n"
-     << "Total allocHooks: " << hookCountMap.find("allocHook")->second << "\n"
-     << "Total reallocHooks: " << hookCountMap.find("reallocHook")->second
+  OS << "Number of alloc instructions modified to unsafe: " << NumPatchedSites
+     << "\n"
+     << "Number of those specialized to a size class: " << NumSizeClassSites
      << "\n"
-     << "Total deallocHooks: " << hookCountMap.find("deallocHook")->second
-     << "\n";
+     << "Total number hooks given a LocalID: " << NumHooks << "\n"
+     << "Total allocHooks: " << NumAllocHooks << "\n"
+     << "Total reallocHooks: " << NumReallocHooks << "\n"
+     << "Total deallocHooks: " << NumDeallocHooks << "\n";
   OS.flush();
 
   if (auto E = PreStats->keep()) {
@@ -582,21 +1293,41 @@ llvmGetPassPluginInfo() {
   return {LLVM_PLUGIN_API_VERSION, "ProvsanPost", LLVM_VERSION_STRING,
           [](llvm::PassBuilder &PB) {
             using namespace llvm;
+#if LLVM_VERSION_MAJOR >= 14
+            using OptimizationLevel = llvm::OptimizationLevel;
+#else
             using OptimizationLevel = typename PassBuilder::OptimizationLevel;
-            // PB.registerPipelineParsingCallback(
-            //[&](StringRef Name, ModulePassManager &MPM,
-            // ArrayRef<PassBuilder::PipelineElement>) {
-            // if (Name == "provsan-pre") {
-            // MPM.addPass(llvm::DynUntrustedAllocPre());
-            // return true;
-            //}
-            // return false;
-            //});
-
-            PB.registerPipelineStartEPCallback(
-                [](ModulePassManager &MPM, OptimizationLevel OL) {
-                  llvm::errs() << "ProvsanPost\n";
+#endif
+            // -passes=provsan-post runs the pass alone, e.g. in the lit tests.
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, ModulePassManager &MPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  if (Name != "provsan-post")
+                    return false;
                   MPM.addPass(llvm::ProvsanPost());
+                  return true;
                 });
+
+            // ProvsanPost is meant to run after the inliner, so that every
+            // inlined copy of a hook is numbered as a site of its own.
+            // PROVSAN_POST_EP selects the extension point it is added at.
+            auto addPost = [](ModulePassManager &MPM, OptimizationLevel OL) {
+              llvm::errs() << "ProvsanPost\n";
+              MPM.addPass(llvm::ProvsanPost());
+            };
+            std::string EP = "optimizer-last";
+            const char *var = getenv("PROVSAN_POST_EP");
+            if (var && *var)
+              EP = var;
+            if (EP == "pipeline-start") {
+              PB.registerPipelineStartEPCallback(addPost);
+            } else if (EP == "early-simplification") {
+              PB.registerPipelineEarlySimplificationEPCallback(addPost);
+            } else {
+              if (EP != "optimizer-last")
+                errs() << "ProvsanPost: unknown PROVSAN_POST_EP " << EP
+                       << ", using optimizer-last\n";
+              PB.registerOptimizerLastEPCallback(addPost);
+            }
           }};
 }
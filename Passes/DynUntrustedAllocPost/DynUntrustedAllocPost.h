@@ -23,7 +23,14 @@
 #include "llvm/Pass.h"
 #include "llvm/Support/JSON.h"
 
+#include "ProvsanHooks.h"
+#include "ProvsanStats.h"
+
 #include <cstdlib>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
 
 // Used for printing compile time statistics for DynUntrustedAllocPost pass.
 #define MPK_STATS
@@ -31,11 +38,46 @@
 namespace llvm {
 class ModulePass;
 
+/// Faulting accesses to a byte range of allocations made at a site.
+struct AccessRange {
+  uint64_t start;
+  uint64_t end;
+  uint64_t reads;
+  uint64_t writes;
+};
+
 struct FaultingSite {
   uint64_t localID;
   uint32_t pkey;
   std::string bbName;
   std::string funcName;
+  // Optional access offset histogram, merged over all profiles.
+  std::map<uint64_t, AccessRange> accesses;
+  // Optional source location of the allocation call, added by
+  // provsan-symbolize to profiles collected through interposition.
+  std::string file;
+  uint64_t line = 0;
+  uint64_t column = 0;
+  // Ids of the wrapper calls the faulting allocations were made through, and
+  // whether any of them was made outside of a wrapper call.
+  std::set<uint64_t> contexts;
+  bool contextFree = false;
+};
+
+/// Allocations in a wrapper that only faulted when reached through some of
+/// its calls, to be patched in a clone of the wrapper.
+struct ContextPatch {
+  std::vector<CallBase *> allocs;
+  std::set<uint64_t> contexts;
+};
+
+/// A hook call to be replaced by a compact hook.
+struct CompactSite {
+  CallBase *hook;
+  uint64_t localID;
+  std::string bbName;
+  std::string funcName;
+  bool isRealloc;
 };
 
 /// Pass to patch all hook instructions after the inliner has run with
@@ -47,6 +89,21 @@ public:
   ProvsanPost(std::string mpk_profile_path = "", bool remove_hooks = false)
       : MPKProfilePath(mpk_profile_path), RemoveHooks(remove_hooks) {
 
+    // Replace the hooks with compact hooks, whose site is looked up by return
+    // address in a table emitted by this pass.
+    if (const char *compact = getenv("PROVSAN_COMPACT_HOOKS"))
+      CompactHooks = (bool)std::stoi(compact);
+
+    // Record which call to an allocation wrapper each allocation was made
+    // through, and patch wrappers only for the calls that faulted.
+    if (const char *cloning = getenv("PROVSAN_CONTEXT_CLONING"))
+      ContextCloning = (bool)std::stoi(cloning);
+
+    // Redirect patched sites of constant size and alignment to the untrusted
+    // allocator's entry point for their size class.
+    if (const char *classes = getenv("PROVSAN_SIZE_CLASSES"))
+      SizeClasses = (bool)std::stoi(classes);
+
     // errs() <<"Attempt to read PROVSAN_PATH from environment variable\n";
     if (MPKProfilePath.empty()) {
       const char *var = getenv("PROVSAN_PATH");
@@ -70,20 +127,42 @@ private:
   Optional<json::Array>
   parseJSONArrayFile(llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> File);
 
-  void assignLocalIDs(Module &M);
+  void materializeHookMarkers(Module &M);
+  void instrumentAllocContexts(Module &M);
+  void cloneWrappersForContexts(Module &M);
+  void assignLocalIDs(Module &M, ProvsanStats &Stats);
   void patchInstruction(Module &M, CallBase *inst);
   void removeHooks(Module &M);
-  void PrintFaultingLocation(Module &M, CallBase *inst);
+  void emitCompactHooks(Module &M);
+  void PrintFaultingLocation(Module &M, CallBase *inst,
+                             const FaultingSite &site);
   void getDiagMessage(raw_ostream &OS, const DebugLoc &Loc, bool first) const;
 
 #ifdef MPK_STATS
   void printStats(Module &M);
 #endif
 
-  std::map<std::string, std::map<uint64_t, FaultingSite>> getFaultingAllocMap();
+  std::map<std::string, std::map<uint64_t, FaultingSite>>
+  getFaultingAllocMap(std::map<std::string, FaultingSite> &located);
+  const FaultingSite *
+  findLocatedSite(const std::map<std::string, FaultingSite> &located,
+                  CallBase *inst) const;
 
   std::string MPKProfilePath;
   bool RemoveHooks;
+  bool CompactHooks = false;
+  bool ContextCloning = false;
+  bool SizeClasses = false;
+
+  // State of one run, cleared when it starts.
+  std::vector<Instruction *> HookList;
+  std::vector<CallBase *> PatchList;
+  // Functions returning a hooked allocation, and the id of every direct call
+  // to them (see instrumentAllocContexts).
+  std::set<Function *> AllocWrappers;
+  std::map<CallBase *, uint64_t> ContextCalls;
+  std::map<Function *, ContextPatch> ContextPatches;
+  std::vector<CompactSite> CompactList;
 };
 
 // ModulePass *createDynUntrustedAllocPostPass(std::string mpk_profile_path,
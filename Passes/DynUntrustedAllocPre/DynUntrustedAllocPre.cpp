@@ -30,13 +30,16 @@
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/Instruction.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/IR/Type.h"
 #include "llvm/InitializePasses.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
+#include "llvm/Demangle/Demangle.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
@@ -45,7 +48,7 @@
 #include <set>
 #include <string>
 
-#define DEBUG_TYPE "dyn-untrusted"
+#define DEBUG_TYPE "provsan-pre"
 // Used for printing compile time statistics for DynUntrustedAllocPre pass.
 
 namespace {
@@ -82,32 +85,91 @@ static cl::list<std::string>
                 cl::desc("Specify the symbol used to free trusted memory."),
                 cl::ZeroOrMore);
 
-#ifdef MPK_STATS
-// Tracker to count number of hook calls we create.
-uint64_t hook_count = 0;
-
-// Counters for tracking each type of hook separately
-uint64_t alloc_hook_counter = 0;
-uint64_t realloc_hook_counter = 0;
-uint64_t dealloc_hook_counter = 0;
-#endif
+// Hook calls (or markers) we create, in total and by type.
+ALWAYS_ENABLED_STATISTIC(NumHooks, "Number of hook instructions");
+ALWAYS_ENABLED_STATISTIC(NumAllocHooks, "Number of alloc hook instructions");
+ALWAYS_ENABLED_STATISTIC(NumReallocHooks,
+                         "Number of realloc hook instructions");
+ALWAYS_ENABLED_STATISTIC(NumDeallocHooks,
+                         "Number of dealloc hook instructions");
+ALWAYS_ENABLED_STATISTIC(NumBatchedAllocs,
+                         "Number of loop allocations with batched hooks");
+ALWAYS_ENABLED_STATISTIC(NumInstrumentedFunctions,
+                         "Number of functions in the instrumentation scope");
+ALWAYS_ENABLED_STATISTIC(NumSkippedFunctions,
+                         "Number of functions outside of the scope");
 
 void populateFromEnv(cl::list<std::string> &ins, const char *env_var,
                      const char *fallback) {
+  for (auto &name : allocFunctionNames(env_var, fallback))
+    ins.push_back(name);
+}
 
+// Reads a comma separated list of fun:, src: and mod: glob patterns from
+// env_var. Patterns without a prefix match function names.
+void parseScope(const char *env_var, InstrumentationScope &Scope) {
+  Scope = InstrumentationScope();
   const char *var = getenv(env_var);
   if (!var)
-    var = "";
-  std::string a(var);
-  if (a.empty()) {
-    // errs() << "ProvSanAlloc = trusted_malloc\n";
-    ins.push_back(fallback);
-  } else {
-    auto v = str_to_vec(a, ',');
-    for (auto &s : v) {
-      ins.push_back(s);
+    return;
+  for (auto &entry : str_to_vec(var, ',')) {
+    // Literal patterns refer to their string, which the scope has to keep.
+    Scope.Patterns.push_back(entry);
+    StringRef Pattern(Scope.Patterns.back());
+    std::vector<GlobPattern> *List = &Scope.Functions;
+    if (Pattern.consume_front("src:"))
+      List = &Scope.Files;
+    else if (Pattern.consume_front("mod:"))
+      List = &Scope.Modules;
+    else
+      Pattern.consume_front("fun:");
+
+    auto Glob = GlobPattern::create(Pattern);
+    if (!Glob) {
+      errs() << "WARNING: ignoring " << env_var << " pattern '" << entry
+             << "': " << toString(Glob.takeError()) << "\n";
+      continue;
+    }
+    List->push_back(std::move(*Glob));
+  }
+}
+
+static bool matchesAny(const std::vector<GlobPattern> &List, StringRef Name) {
+  return llvm::any_of(List,
+                      [&](const GlobPattern &Glob) { return Glob.match(Name); });
+}
+
+bool InstrumentationScope::matches(const Function &F) const {
+  const Module &M = *F.getParent();
+  if (matchesAny(Modules, M.getModuleIdentifier()) ||
+      matchesAny(Modules, M.getSourceFileName()))
+    return true;
+
+  // Functions inlined from headers are attributed to the header.
+  std::string File = M.getSourceFileName();
+  if (const DISubprogram *SP = F.getSubprogram()) {
+    SmallString<256> Path(SP->getFilename());
+    if (!sys::path::is_absolute(Path)) {
+      Path = SP->getDirectory();
+      sys::path::append(Path, SP->getFilename());
     }
+    File = Path.str().str();
   }
+  if (matchesAny(Files, File))
+    return true;
+
+  if (Functions.empty())
+    return false;
+  return matchesAny(Functions, F.getName()) ||
+         matchesAny(Functions, demangle(F.getName().str()));
+}
+
+// A function is instrumented if it matches PROVSAN_INCLUDE (when set) and does
+// not match PROVSAN_EXCLUDE.
+bool DynUntrustedAllocPre::isInstrumented(const Function &F) const {
+  if (!Include.empty() && !Include.matches(F))
+    return false;
+  return Exclude.empty() || !Exclude.matches(F);
 }
 
 ConstantInt *getDummyID(Module &M) {
@@ -127,6 +189,20 @@ PreservedAnalyses DynUntrustedAllocPre::run(Module &M,
   ReallocFunctions = GetTargetFunctionSet(M, ProvSanRealloc);
   DeallocFunctions = GetTargetFunctionSet(M, ProvSanFree);
 
+  parseScope("PROVSAN_INCLUDE", Include);
+  parseScope("PROVSAN_EXCLUDE", Exclude);
+
+  // A marker lives on the call, so inlining an allocation function defined in
+  // this module would take the call and its marker away.
+  if (HookMarkers)
+    for (auto *Targets :
+         {&AllocFunctions, &ReallocFunctions, &DeallocFunctions})
+      for (Function *F : *Targets)
+        if (F && !F->isDeclaration()) {
+          F->removeFnAttr(Attribute::AlwaysInline);
+          F->addFnAttr(Attribute::NoInline);
+        }
+
   llvm::errs() << "ProvsanPre Pass Running ...\n";
 
   // Pre-inline pass:
@@ -136,7 +212,11 @@ PreservedAnalyses DynUntrustedAllocPre::run(Module &M,
   GlobalNullStr =
       llvm::ConstantPointerNull::get(Type::getInt8PtrTy(M.getContext()));
 
+#if LLVM_VERSION_MAJOR >= 14
+  AttrBuilder attrBldr(M.getContext());
+#else
   AttrBuilder attrBldr;
+#endif
   attrBldr.addAttribute(Attribute::NoUnwind);
   attrBldr.addAttribute(Attribute::ArgMemOnly);
 
@@ -178,7 +258,31 @@ PreservedAnalyses DynUntrustedAllocPre::run(Module &M,
   deallocHook = cast<Function>(deallocHookFunc.getCallee());
   deallocHook->setLinkage(GlobalValue::LinkageTypes::ExternalLinkage);
 
-  hookFunctions(M, MAM);
+  if (BatchHooks) {
+    FunctionCallee allocHookBatchFunc = M.getOrInsertFunction(
+        "allocHookBatch", fnAttrs,
+        Type::getVoidTy(M.getContext()),         // void allocHookBatch(
+        Type::getInt8PtrTy(M.getContext()),      // HookBatchEntry *entries,
+        IntegerType::get(M.getContext(), 64),    // int64_t count,
+        IntegerType::getInt64Ty(M.getContext()), // int64_t localID,
+        Type::getInt8PtrTy(M.getContext()),      // const char *bbName,
+        Type::getInt8PtrTy(M.getContext()));     // const char *funcName)
+    allocHookBatch = cast<Function>(allocHookBatchFunc.getCallee());
+    allocHookBatch->setLinkage(GlobalValue::LinkageTypes::ExternalLinkage);
+  }
+
+  ProvsanStats Stats(
+      "ProvsanPre",
+      {&NumHooks, &NumAllocHooks, &NumReallocHooks, &NumDeallocHooks,
+       &NumBatchedAllocs, &NumInstrumentedFunctions, &NumSkippedFunctions});
+  {
+    ProvsanStats::Phase Phase(Stats, "hook-functions", "Insert hooks");
+    hookFunctions(M, MAM, Stats);
+  }
+  // Lets ProvsanPost find the calls whose markers the optimizer dropped.
+  if (HookMarkers && !M.getModuleFlag(PROVSAN_HOOK_MARKERS_FLAG))
+    M.addModuleFlag(Module::Max, PROVSAN_HOOK_MARKERS_FLAG, 1);
+  Stats.writeJSON(M);
 
 #ifdef MPK_STATS
   printStats(M);
@@ -199,30 +303,37 @@ llvm::SmallPtrSet<Function *, 4> DynUntrustedAllocPre::GetTargetFunctionSet(
   return ret;
 }
 
-Instruction *DynUntrustedAllocPre::getHookInst(Module &M, CallBase *CS) {
+// Functions outside of the instrumentation scope only hook the release of
+// memory, so that the runtime does not attribute faults on reused memory to
+// stale allocations.
+Instruction *DynUntrustedAllocPre::getHookInst(Module &M, CallBase *CS,
+                                               bool Scoped) {
   Function *F = CS->getCalledFunction();
   if (!F)
     return nullptr;
 
+  if (!Scoped) {
+    if (!ReallocFunctions.contains(F) && !DeallocFunctions.contains(F))
+      return nullptr;
+    ++NumDeallocHooks;
+    return CallInst::Create(
+        (Function *)deallocHook,
+        {CS->getArgOperand(0), CS->getArgOperand(1), getDummyID(M)});
+  }
+
   if (AllocFunctions.contains(F)) {
-#ifdef MPK_STATS
-    alloc_hook_counter++;
-#endif
+    ++NumAllocHooks;
     return CallInst::Create((Function *)allocHook,
                             {CS, CS->getArgOperand(0), getDummyID(M),
                              GlobalNullStr, GlobalNullStr});
   } else if (ReallocFunctions.contains(F)) {
-#ifdef MPK_STATS
-    realloc_hook_counter++;
-#endif
+    ++NumReallocHooks;
     return CallInst::Create((Function *)reallocHook,
                             {CS, CS->getArgOperand(3), CS->getArgOperand(0),
                              CS->getArgOperand(1), getDummyID(M), GlobalNullStr,
                              GlobalNullStr});
   } else if (DeallocFunctions.contains(F)) {
-#ifdef MPK_STATS
-    dealloc_hook_counter++;
-#endif
+    ++NumDeallocHooks;
     return CallInst::Create(
         (Function *)deallocHook,
         {CS->getArgOperand(0), CS->getArgOperand(1), getDummyID(M)});
@@ -231,8 +342,50 @@ Instruction *DynUntrustedAllocPre::getHookInst(Module &M, CallBase *CS) {
   }
 }
 
-void DynUntrustedAllocPre::hookFunctions(Module &M,
-                                         ModuleAnalysisManager &MAM) {
+// Marks CS with the kind of hook ProvsanPost has to insert after it. Unlike a
+// hook call, metadata does not keep the optimizer from treating the
+// allocation like any other call, so the profiled code is optimized like the
+// release build. Returns false if CS does not need a hook.
+bool DynUntrustedAllocPre::markHook(CallBase *CS, bool Scoped) {
+  Function *F = CS->getCalledFunction();
+  if (!F)
+    return false;
+
+  StringRef Kind;
+  LLVMContext &C = CS->getContext();
+  if (!Scoped) {
+    // As in getHookInst, only the old pointer of a realloc is released.
+    if (!ReallocFunctions.contains(F) && !DeallocFunctions.contains(F)) {
+      // Tells ProvsanPost that the call is deliberately not hooked, see
+      // materializeHookMarkers.
+      if (AllocFunctions.contains(F))
+        CS->setMetadata(PROVSAN_HOOK_MD,
+                        MDNode::get(C, MDString::get(C, "none")));
+      return false;
+    }
+    ++NumDeallocHooks;
+    Kind = "dealloc";
+  } else if (AllocFunctions.contains(F)) {
+    ++NumAllocHooks;
+    Kind = "alloc";
+  } else if (ReallocFunctions.contains(F)) {
+    ++NumReallocHooks;
+    Kind = "realloc";
+  } else if (DeallocFunctions.contains(F)) {
+    ++NumDeallocHooks;
+    Kind = "dealloc";
+  } else {
+    return false;
+  }
+
+  CS->setMetadata(PROVSAN_HOOK_MD, MDNode::get(C, MDString::get(C, Kind)));
+  return true;
+}
+
+void DynUntrustedAllocPre::hookFunctions(Module &M, ModuleAnalysisManager &MAM,
+                                         ProvsanStats &Stats) {
+  unsigned Instrumented = 0, Skipped = 0;
+  uint64_t ModuleHooks = 0;
   for (Function &F : M) {
     if (F.isDeclaration())
       continue;
@@ -240,15 +393,42 @@ void DynUntrustedAllocPre::hookFunctions(Module &M,
     auto &FAM =
         MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
 
+    bool Scoped = isInstrumented(F);
+    if (HookMarkers && !Scoped)
+      F.addFnAttr(PROVSAN_UNSCOPED_ATTR);
+    ++(Scoped ? Instrumented : Skipped);
+    ++(Scoped ? NumInstrumentedFunctions : NumSkippedFunctions);
+    uint64_t FunctionHooks = 0;
+    TimeRecord Begin;
+    if (Stats.tracksFunctions())
+      Begin = TimeRecord::getCurrentTime(/*Start=*/true);
+
+    // Loops are analyzed before any block is split by the hooks below.
+    SmallVector<BatchedAlloc, 8> Batched;
+    SmallPtrSet<CallBase *, 8> BatchedCalls;
+    if (BatchHooks && !HookMarkers && Scoped) {
+      collectBatchedAllocs(FAM.getResult<LoopAnalysis>(F), Batched);
+      for (auto &entry : Batched)
+        BatchedCalls.insert(entry.Alloc);
+    }
+
     ReversePostOrderTraversal<Function *> RPOT(&F);
 
     for (BasicBlock *BB : RPOT) {
       for (Instruction &I : *BB) {
         CallBase *CS = dyn_cast<CallBase>(&I);
-        if (!CS)
+        if (!CS || BatchedCalls.contains(CS))
           continue;
 
-        Instruction *newHook = getHookInst(M, CS);
+        if (HookMarkers) {
+          if (markHook(CS, Scoped)) {
+            ++NumHooks;
+            ++FunctionHooks;
+          }
+          continue;
+        }
+
+        Instruction *newHook = getHookInst(M, CS, Scoped);
         if (!newHook)
           continue;
 
@@ -282,12 +462,135 @@ void DynUntrustedAllocPre::hookFunctions(Module &M,
         errs() << "Inserting Hook\n";
         IRBuilder<> IRB(&*NextInst);
         IRB.Insert(newHook);
-#ifdef MPK_STATS
-        ++hook_count;
-#endif
+        ++NumHooks;
+        ++FunctionHooks;
       }
     }
+
+    for (auto &entry : Batched)
+      FunctionHooks += emitBatchedHook(M, F, entry);
+    NumBatchedAllocs += Batched.size();
+
+    ModuleHooks += FunctionHooks;
+    if (Stats.tracksFunctions())
+      Stats.recordFunction(F, FunctionHooks, secondsSince(Begin));
   }
+
+  if (!Include.empty() || !Exclude.empty())
+    errs() << "ProvsanPre: " << M.getModuleIdentifier() << ": instrumented "
+           << Instrumented << " functions, skipped " << Skipped << " ("
+           << ModuleHooks << " hooks)\n";
+}
+
+// A loop can buffer its allocations if nothing in it can run code that
+// accesses them from the other compartment, or free or reallocate them, before
+// they are registered at the loop exit. This holds if the only calls it makes
+// are to the allocation functions and to intrinsics. Exits have to be
+// dedicated and must not be EH pads, so that the flush can be placed at the
+// start of each exit block.
+bool DynUntrustedAllocPre::isBatchableLoop(const Loop *L) const {
+  if (!L->hasDedicatedExits())
+    return false;
+  SmallVector<BasicBlock *, 4> Exits;
+  L->getUniqueExitBlocks(Exits);
+  if (Exits.empty())
+    return false;
+  for (BasicBlock *Exit : Exits)
+    if (Exit->isEHPad())
+      return false;
+
+  for (BasicBlock *BB : L->blocks()) {
+    for (Instruction &I : *BB) {
+      auto *CS = dyn_cast<CallBase>(&I);
+      if (!CS || isa<IntrinsicInst>(CS))
+        continue;
+      if (!isa<CallInst>(CS) ||
+          !AllocFunctions.contains(CS->getCalledFunction()))
+        return false;
+    }
+  }
+  return true;
+}
+
+// Collects the allocation calls to batch, with the exits of the innermost loop
+// they are in.
+void DynUntrustedAllocPre::collectBatchedAllocs(
+    LoopInfo &LI, SmallVectorImpl<BatchedAlloc> &Batched) {
+  for (Loop *L : LI.getLoopsInPreorder()) {
+    if (!isBatchableLoop(L))
+      continue;
+    SmallVector<BasicBlock *, 4> Exits;
+    L->getUniqueExitBlocks(Exits);
+    for (BasicBlock *BB : L->blocks()) {
+      if (LI.getLoopFor(BB) != L)
+        continue;
+      for (Instruction &I : *BB) {
+        auto *CS = dyn_cast<CallInst>(&I);
+        if (CS && AllocFunctions.contains(CS->getCalledFunction()))
+          Batched.push_back({CS, Exits});
+      }
+    }
+  }
+}
+
+// Replaces the allocHook of CS by a store into a stack buffer of
+// {ptr, size} pairs. The buffer is passed to allocHookBatch when it is full,
+// and at every exit of the loop if it is not empty. All calls to
+// allocHookBatch for a buffer describe the same site, ProvsanPost numbers them
+// once and finds the allocation through the stores into the buffer.
+unsigned DynUntrustedAllocPre::emitBatchedHook(Module &M, Function &F,
+                                               const BatchedAlloc &Batched) {
+  CallBase *CS = Batched.Alloc;
+  LLVMContext &C = M.getContext();
+  Type *Int64Ty = Type::getInt64Ty(C);
+  Type *Int8PtrTy = Type::getInt8PtrTy(C);
+  StructType *EntryTy = StructType::get(C, {Int8PtrTy, Int64Ty});
+  ArrayType *BufferTy = ArrayType::get(EntryTy, BatchSize);
+
+  IRBuilder<> EntryIRB(&*F.getEntryBlock().getFirstInsertionPt());
+  AllocaInst *Buffer = EntryIRB.CreateAlloca(BufferTy, nullptr, "provsan.batch");
+  AllocaInst *Count =
+      EntryIRB.CreateAlloca(Int64Ty, nullptr, "provsan.batch.count");
+  EntryIRB.CreateStore(ConstantInt::get(Int64Ty, 0), Count);
+
+  unsigned Hooks = 0;
+  auto flush = [&](Instruction *Before, Value *N) {
+    IRBuilder<> IRB(Before);
+    IRB.CreateCall(allocHookBatch,
+                   {IRB.CreatePointerCast(Buffer, Int8PtrTy), N,
+                    getDummyID(M), GlobalNullStr, GlobalNullStr});
+    IRB.CreateStore(ConstantInt::get(Int64Ty, 0), Count);
+    ++NumAllocHooks;
+    ++NumHooks;
+    ++Hooks;
+  };
+
+  Instruction *Next = CS->getNextNode();
+  IRBuilder<> IRB(Next);
+  Value *N = IRB.CreateLoad(Int64Ty, Count);
+  Value *Slot = IRB.CreateInBoundsGEP(
+      BufferTy, Buffer, {ConstantInt::get(Int64Ty, 0), N});
+  IRB.CreateStore(IRB.CreatePointerCast(CS, Int8PtrTy),
+                  IRB.CreateStructGEP(EntryTy, Slot, 0));
+  IRB.CreateStore(IRB.CreateZExtOrTrunc(CS->getArgOperand(0), Int64Ty),
+                  IRB.CreateStructGEP(EntryTy, Slot, 1));
+  Value *Filled = IRB.CreateAdd(N, ConstantInt::get(Int64Ty, 1));
+  IRB.CreateStore(Filled, Count);
+  flush(SplitBlockAndInsertIfThen(
+            IRB.CreateICmpEQ(Filled, ConstantInt::get(Int64Ty, BatchSize)),
+            Next, false),
+        Filled);
+
+  for (BasicBlock *Exit : Batched.Exits) {
+    IRBuilder<> ExitIRB(&*Exit->getFirstInsertionPt());
+    Value *Pending = ExitIRB.CreateLoad(Int64Ty, Count);
+    flush(SplitBlockAndInsertIfThen(
+              ExitIRB.CreateICmpNE(Pending, ConstantInt::get(Int64Ty, 0)),
+              &*ExitIRB.GetInsertPoint(), false),
+          Pending);
+  }
+  LLVM_DEBUG(errs() << "Batching Hook\n");
+  return Hooks;
 }
 
 #ifdef MPK_STATS
@@ -306,10 +609,10 @@ void DynUntrustedAllocPre::printStats(Module &M) {
   }
 
   llvm::raw_fd_ostream OS(PreStats->FD, /* shouldClose */ false);
-  OS << "Total number of hook instructions: " << hook_count << "\n"
-     << "Number of alloc hook instructions: " << alloc_hook_counter << "\n"
-     << "Number of realloc hook instructions: " << realloc_hook_counter << "\n"
-     << "Number of dealloc hook instructions: " << dealloc_hook_counter << "\n";
+  OS << "Total number of hook instructions: " << NumHooks << "\n"
+     << "Number of alloc hook instructions: " << NumAllocHooks << "\n"
+     << "Number of realloc hook instructions: " << NumReallocHooks << "\n"
+     << "Number of dealloc hook instructions: " << NumDeallocHooks << "\n";
   OS.flush();
 
   if (auto E = PreStats->keep()) {
@@ -327,16 +630,20 @@ llvmGetPassPluginInfo() {
   return {LLVM_PLUGIN_API_VERSION, "DynUntrustedAllocPre", LLVM_VERSION_STRING,
           [](llvm::PassBuilder &PB) {
             using namespace llvm;
+#if LLVM_VERSION_MAJOR >= 14
+            using OptimizationLevel = llvm::OptimizationLevel;
+#else
             using OptimizationLevel = typename PassBuilder::OptimizationLevel;
-            // PB.registerPipelineParsingCallback(
-            //[&](StringRef Name, ModulePassManager &MPM,
-            // ArrayRef<PassBuilder::PipelineElement>) {
-            // if (Name == "provsan-pre") {
-            // MPM.addPass(llvm::DynUntrustedAllocPre());
-            // return true;
-            //}
-            // return false;
-            //});
+#endif
+            // -passes=provsan-pre runs the pass alone, e.g. in the lit tests.
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, ModulePassManager &MPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  if (Name != "provsan-pre")
+                    return false;
+                  MPM.addPass(llvm::DynUntrustedAllocPre());
+                  return true;
+                });
 
             PB.registerPipelineStartEPCallback(
                 [](ModulePassManager &MPM, OptimizationLevel OL) {
@@ -16,27 +16,78 @@
 #define LLVM_TRANSFORMS_DYNAMIC_MPK_UNTRUSTED_PRE_H
 
 #include "llvm/ADT/StringRef.h"
+#include "llvm/Analysis/LoopInfo.h"
 #include "llvm/IR/InstrTypes.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/Pass.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/GlobPattern.h"
+
+#include "ProvsanHooks.h"
+#include "ProvsanStats.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <deque>
+#include <string>
+#include <vector>
 
 #define MPK_STATS
 
 namespace llvm {
 
+/// An allocation call in a loop whose hooks are batched, with the exit blocks
+/// of the loop, taken before any block is split.
+struct BatchedAlloc {
+  CallBase *Alloc;
+  SmallVector<BasicBlock *, 4> Exits;
+};
+
+/// Functions selected by PROVSAN_INCLUDE or PROVSAN_EXCLUDE, by name (fun:),
+/// source file (src:) or module (mod:) glob patterns.
+struct InstrumentationScope {
+  std::deque<std::string> Patterns;
+  std::vector<GlobPattern> Functions;
+  std::vector<GlobPattern> Files;
+  std::vector<GlobPattern> Modules;
+
+  bool empty() const {
+    return Functions.empty() && Files.empty() && Modules.empty();
+  }
+  bool matches(const Function &F) const;
+};
+
 /// Pass to identify and add runtime hooks to all Rust alloc, realloc, and
 /// dealloc calls. Additionally removes the NoInline attribute from functions
 /// with the RustAllocator attribute.
 class DynUntrustedAllocPre : public PassInfoMixin<DynUntrustedAllocPre> {
 public:
-  DynUntrustedAllocPre() {}
+  DynUntrustedAllocPre() {
+    // Buffer the allocations of loops that stay in the compartment, and
+    // register them with one allocHookBatch call per batch.
+    if (const char *batch = getenv("PROVSAN_BATCH_HOOKS"))
+      BatchHooks = (bool)std::stoi(batch);
+    if (const char *size = getenv("PROVSAN_BATCH_SIZE"))
+      BatchSize = std::max(1, std::stoi(size));
+    // Only mark the allocation calls, and let ProvsanPost insert the hooks.
+    if (const char *markers = getenv("PROVSAN_HOOK_MARKERS"))
+      HookMarkers = (bool)std::stoi(markers);
+  }
   PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM);
 
 private:
-  void hookFunctions(Module &M, ModuleAnalysisManager &MAM);
-  Instruction *getHookInst(Module &M, CallBase *CS);
+  void hookFunctions(Module &M, ModuleAnalysisManager &MAM,
+                     ProvsanStats &Stats);
+  Instruction *getHookInst(Module &M, CallBase *CS, bool Scoped);
+  bool markHook(CallBase *CS, bool Scoped);
+  bool isInstrumented(const Function &F) const;
+  bool isBatchableLoop(const Loop *L) const;
+  void collectBatchedAllocs(LoopInfo &LI,
+                            SmallVectorImpl<BatchedAlloc> &Batched);
+  /// Returns the number of allocHookBatch calls emitted.
+  unsigned emitBatchedHook(Module &M, Function &F,
+                           const BatchedAlloc &Batched);
   llvm::SmallPtrSet<Function *, 4>
   GetTargetFunctionSet(llvm::Module &M,
                        const llvm::cl::list<std::string> &targets);
@@ -47,6 +98,13 @@ private:
   Function *allocHook;
   Function *reallocHook;
   Function *deallocHook;
+  Function *allocHookBatch;
+
+  bool BatchHooks = false;
+  int BatchSize = 16;
+  bool HookMarkers = false;
+  InstrumentationScope Include;
+  InstrumentationScope Exclude;
 
   llvm::SmallPtrSet<Function *, 4> AllocFunctions;
   llvm::SmallPtrSet<Function *, 4> ReallocFunctions;
@@ -0,0 +1,393 @@
+//===- provsan_pass_bench.cpp - Compile-time benchmark of the passes ------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// provsan-pass-bench measures how the compile time and peak memory of the
+// Provsan passes scale with the size of a module.
+//
+// It generates synthetic modules for every combination of the swept
+// parameters (function count, allocation calls per function, fraction of
+// them made through invoke, fraction of sites in the fault profile), and runs
+// opt over each of them
+//   - without the plugins (baseline),
+//   - with both plugins, as a profiling build,
+//   - with both plugins, a generated fault profile and PROVSAN_HOOK=1, as a
+//     patching build.
+// For each it reports the wall time and peak memory of opt (the fastest of
+// --repeat runs), and the time spent in ProvsanPre and ProvsanPost as recorded
+// through PROVSAN_STATS_JSON. Other PROVSAN_* variables are passed through,
+// e.g. to measure PROVSAN_COMPACT_HOOKS or PROVSAN_HOOK_MARKERS builds.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+extern char **environ;
+
+using namespace llvm;
+
+static cl::opt<std::string> OptPath("opt", cl::desc("Path to opt"),
+                                    cl::init("opt"));
+static cl::opt<std::string> PrePlugin("pre", cl::Required,
+                                      cl::desc("Path to the ProvsanPre plugin"));
+static cl::opt<std::string>
+    PostPlugin("post", cl::Required,
+               cl::desc("Path to the ProvsanPost plugin"));
+static cl::opt<std::string>
+    Pipeline("pipeline", cl::init("default<O0>"),
+             cl::desc("Pipeline the plugins are run in (default: "
+                      "default<O0>)"));
+
+static cl::list<unsigned>
+    FunctionCounts("functions", cl::CommaSeparated,
+                   cl::desc("Function counts to sweep (default: "
+                            "100,1000,10000)"));
+static cl::list<unsigned>
+    AllocCounts("allocs", cl::CommaSeparated,
+                cl::desc("Allocation calls per function (default: 8)"));
+static cl::list<double>
+    InvokeRatios("invokes", cl::CommaSeparated,
+                 cl::desc("Fraction of allocation calls made through invoke "
+                          "(default: 0.25)"));
+static cl::list<double>
+    ProfileRatios("profile", cl::CommaSeparated,
+                  cl::desc("Fraction of allocation sites in the fault "
+                           "profile (default: 0.1)"));
+
+static cl::opt<unsigned>
+    Repeat("repeat", cl::init(3),
+           cl::desc("Runs per measurement, the fastest is reported"));
+static cl::opt<std::string>
+    WorkDir("work-dir",
+            cl::desc("Directory to keep the generated modules in (default: a "
+                     "temporary directory)"));
+
+namespace {
+
+struct Config {
+  unsigned Functions;
+  unsigned Allocs;
+  double Invokes;
+  double Profile;
+};
+
+enum Mode { BASELINE, PROFILING, PATCHING };
+
+struct Measurement {
+  bool Failed = false;
+  double Wall = 0;
+  uint64_t PeakKiB = 0;
+  double PreSeconds = 0;
+  double PostSeconds = 0;
+};
+
+// Spreads a fraction of the items of a sequence evenly, so that the modules
+// are the same for every run.
+bool selected(uint64_t Index, double Ratio) {
+  return uint64_t((Index + 1) * Ratio) != uint64_t(Index * Ratio);
+}
+
+// Writes the module, with debug info as in the -g builds the passes are used
+// in, and the profile of the selected sites. Returns the number of sites in
+// the profile.
+uint64_t generate(const Config &C, raw_ostream &IR, raw_ostream &Profile) {
+  IR << "; Generated by provsan-pass-bench\n"
+     << "declare i8* @trusted_malloc(i64, i64)\n"
+     << "declare i8* @untrusted_malloc(i64, i64)\n"
+     << "declare void @trusted_free(i8*, i64, i64)\n"
+     << "declare void @sink(i8*)\n"
+     << "declare i32 @__gxx_personality_v0(...)\n\n";
+
+  // !0 to !4 describe the compile unit, further nodes are numbered from 5.
+  std::vector<std::string> Metadata;
+  unsigned NextMD = 5;
+  uint64_t Site = 0, ProfileSites = 0;
+  Profile << "[\n";
+
+  for (unsigned F = 0; F < C.Functions; ++F) {
+    unsigned Line = F * (C.Allocs + 2) + 1;
+    unsigned SP = NextMD++;
+    Metadata.push_back(
+        (Twine("!") + Twine(SP) + " = distinct !DISubprogram(name: \"f" +
+         Twine(F) + "\", scope: !1, file: !1, line: " + Twine(Line) +
+         ", type: !3, scopeLine: " + Twine(Line) +
+         ", spFlags: DISPFlagDefinition, unit: !0)")
+            .str());
+
+    IR << "define void @f" << F << "(i64 %n) personality i32 (...)* "
+       << "@__gxx_personality_v0 !dbg !" << SP << " {\n"
+       << "entry:\n  br label %a0\n";
+    bool HasInvoke = false;
+    for (unsigned A = 0; A < C.Allocs; ++A, ++Site) {
+      unsigned Loc = NextMD++;
+      Metadata.push_back((Twine("!") + Twine(Loc) + " = !DILocation(line: " +
+                          Twine(Line + A + 1) + ", column: 3, scope: !" +
+                          Twine(SP) + ")")
+                             .str());
+      bool Invoke = selected(Site, C.Invokes);
+      HasInvoke |= Invoke;
+      IR << "a" << A << ":\n  %p" << A << " = ";
+      if (Invoke)
+        IR << "invoke i8* @trusted_malloc(i64 %n, i64 8) to label %a" << A
+           << ".ok unwind label %lpad, !dbg !" << Loc << "\n";
+      else
+        IR << "call i8* @trusted_malloc(i64 %n, i64 8), !dbg !" << Loc
+           << "\n  br label %a" << A << ".ok\n";
+      IR << "a" << A << ".ok:\n  call void @sink(i8* %p" << A << "), !dbg !"
+         << Loc << "\n";
+      if (A % 2)
+        IR << "  call void @trusted_free(i8* %p" << A
+           << ", i64 %n, i64 8), !dbg !" << Loc << "\n";
+      IR << "  br label %" << (A + 1 == C.Allocs ? Twine("exit")
+                                                  : Twine("a") + Twine(A + 1))
+         << "\n";
+
+      // Post numbers the hooks of a function in order, and names a site by
+      // the block of its hook, which follows the invoke into its normal
+      // destination.
+      if (selected(Site, C.Profile)) {
+        Profile << (ProfileSites++ ? ",\n" : "") << "{ \"id\": " << A
+                << ", \"pkey\": 1, \"bbName\": \"a" << A
+                << (Invoke ? ".ok" : "") << "\", \"funcName\": \"f" << F
+                << "\" }";
+      }
+    }
+    if (!C.Allocs)
+      IR << "a0:\n  br label %exit\n";
+    IR << "exit:\n  ret void\n";
+    if (HasInvoke)
+      IR << "lpad:\n  %lp = landingpad { i8*, i32 } cleanup\n"
+         << "  resume { i8*, i32 } %lp\n";
+    IR << "}\n\n";
+  }
+  Profile << "\n]\n";
+
+  IR << "!llvm.dbg.cu = !{!0}\n"
+     << "!llvm.module.flags = !{!4}\n"
+     << "!0 = distinct !DICompileUnit(language: DW_LANG_C99, file: !1, "
+     << "producer: \"provsan-pass-bench\", isOptimized: false, "
+     << "runtimeVersion: 0, emissionKind: FullDebug)\n"
+     << "!1 = !DIFile(filename: \"bench.c\", directory: \"/bench\")\n"
+     << "!2 = !{}\n"
+     << "!3 = !DISubroutineType(types: !2)\n"
+     << "!4 = !{i32 2, !\"Debug Info Version\", i32 3}\n";
+  for (auto &Node : Metadata)
+    IR << Node << "\n";
+  return ProfileSites;
+}
+
+// Sums the phase times each pass recorded in StatsDir.
+void readPassTimes(StringRef StatsDir, Measurement &M) {
+  std::error_code EC;
+  for (sys::fs::directory_iterator File(StatsDir, EC), End;
+       File != End && !EC; File.increment(EC)) {
+    auto Buffer = MemoryBuffer::getFile(File->path());
+    if (!Buffer)
+      continue;
+    Expected<json::Value> Report = json::parse((*Buffer)->getBuffer());
+    if (!Report) {
+      consumeError(Report.takeError());
+      continue;
+    }
+    const json::Object *Object = Report->getAsObject();
+    const json::Object *Phases = Object ? Object->getObject("phases") : nullptr;
+    if (!Phases)
+      continue;
+    double Seconds = 0;
+    for (auto &Phase : *Phases)
+      Seconds += Phase.second.getAsNumber().getValueOr(0);
+    Optional<StringRef> Pass = Object->getString("pass");
+    if (Pass && *Pass == "ProvsanPre")
+      M.PreSeconds += Seconds;
+    else if (Pass && *Pass == "ProvsanPost")
+      M.PostSeconds += Seconds;
+  }
+}
+
+Measurement measure(Mode RunMode, StringRef Module, StringRef ProfilePath,
+                    StringRef StatsDir) {
+  std::vector<std::string> Args = {OptPath};
+  if (RunMode != BASELINE) {
+    Args.push_back("-load-pass-plugin=" + PrePlugin);
+    Args.push_back("-load-pass-plugin=" + PostPlugin);
+  }
+  Args.push_back("-passes=" + Pipeline);
+  Args.push_back("-disable-output");
+  Args.push_back(Module.str());
+
+  // The environment of the benchmark is passed through, except for the
+  // variables it controls.
+  std::vector<std::string> Env;
+  for (char **Var = environ; *Var; ++Var) {
+    StringRef Entry(*Var);
+    if (!Entry.startswith("PROVSAN_PATH=") &&
+        !Entry.startswith("PROVSAN_HOOK=") &&
+        !Entry.startswith("PROVSAN_STATS_JSON="))
+      Env.push_back(Entry.str());
+  }
+  Env.push_back(("PROVSAN_STATS_JSON=" + StatsDir).str());
+  if (RunMode == PATCHING) {
+    Env.push_back(("PROVSAN_PATH=" + ProfilePath).str());
+    Env.push_back("PROVSAN_HOOK=1");
+  }
+
+  std::vector<StringRef> ArgRefs(Args.begin(), Args.end());
+  std::vector<StringRef> EnvRefs(Env.begin(), Env.end());
+  Optional<ArrayRef<StringRef>> Environment(EnvRefs);
+  // The passes report every site they patch.
+  Optional<StringRef> Redirects[] = {None, StringRef(""), StringRef("")};
+
+  Measurement Best;
+  for (unsigned Run = 0; Run < std::max(1u, unsigned(Repeat)); ++Run) {
+    sys::fs::remove_directories(StatsDir);
+    sys::fs::create_directories(StatsDir);
+
+    Measurement M;
+    Optional<sys::ProcessStatistics> Stats;
+    std::string Error;
+    auto Begin = std::chrono::steady_clock::now();
+    int Result = sys::ExecuteAndWait(OptPath, ArgRefs, Environment, Redirects,
+                                     /*SecondsToWait=*/0, /*MemoryLimit=*/0,
+                                     &Error, nullptr, &Stats);
+    M.Wall = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                           Begin)
+                 .count();
+    if (Result != 0) {
+      errs() << "provsan-pass-bench: opt failed on " << Module << " ("
+             << (Error.empty() ? "exit code " + std::to_string(Result) : Error)
+             << ")\n";
+      M.Failed = true;
+      return M;
+    }
+    M.PeakKiB = Stats ? Stats->PeakMemory : 0;
+    readPassTimes(StatsDir, M);
+
+    if (Run == 0) {
+      Best = M;
+      continue;
+    }
+    Best.Wall = std::min(Best.Wall, M.Wall);
+    Best.PeakKiB = std::min(Best.PeakKiB, M.PeakKiB);
+    Best.PreSeconds = std::min(Best.PreSeconds, M.PreSeconds);
+    Best.PostSeconds = std::min(Best.PostSeconds, M.PostSeconds);
+  }
+  return Best;
+}
+
+void printMeasurement(const Measurement &M, bool PassTimes) {
+  if (M.Failed) {
+    outs() << " " << right_justify("failed", PassTimes ? 30 : 16);
+    return;
+  }
+  outs() << format(" %8.3f %7.1f", M.Wall, M.PeakKiB / 1024.0);
+  if (PassTimes)
+    outs() << format(" %6.3f %6.3f", M.PreSeconds, M.PostSeconds);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(
+      argc, argv,
+      "Compile-time benchmark of the ProvsanPre and ProvsanPost passes\n");
+  if (FunctionCounts.empty())
+    for (unsigned Count : {100, 1000, 10000})
+      FunctionCounts.push_back(Count);
+  if (AllocCounts.empty())
+    AllocCounts.push_back(8);
+  if (InvokeRatios.empty())
+    InvokeRatios.push_back(0.25);
+  if (ProfileRatios.empty())
+    ProfileRatios.push_back(0.1);
+
+  SmallString<128> Dir(WorkDir);
+  bool Temporary = Dir.empty();
+  std::error_code EC = Temporary
+                           ? sys::fs::createUniqueDirectory("provsan-bench", Dir)
+                           : sys::fs::create_directories(Dir);
+  if (EC) {
+    errs() << "provsan-pass-bench: unable to create " << Dir << ": "
+           << EC.message() << "\n";
+    return 1;
+  }
+
+  outs() << "Pipeline " << Pipeline << ", fastest of " << Repeat
+         << " runs. Times in seconds, peak memory in MiB.\n\n"
+         << "functions allocs invokes profile profiled |         baseline "
+            "|                profiling build |                 patching "
+            "build\n"
+         << "                                           |     wall    peak "
+            "|     wall    peak    pre   post |     wall    peak    pre   "
+            "post\n";
+
+  bool Failed = false;
+  for (unsigned Functions : FunctionCounts)
+    for (unsigned Allocs : AllocCounts)
+      for (double Invokes : InvokeRatios)
+        for (double Profile : ProfileRatios) {
+          Config C = {Functions, Allocs, std::clamp(Invokes, 0.0, 1.0),
+                      std::clamp(Profile, 0.0, 1.0)};
+          std::string Name = "bench-" + std::to_string(Functions) + "-" +
+                             std::to_string(Allocs) + "-" +
+                             std::to_string(int(C.Invokes * 100)) + "-" +
+                             std::to_string(int(C.Profile * 100));
+          SmallString<128> Module(Dir), ProfilePath(Dir), StatsDir(Dir);
+          sys::path::append(Module, Name + ".ll");
+          sys::path::append(ProfilePath, Name + ".json");
+          sys::path::append(StatsDir, Name + ".stats");
+
+          uint64_t Sites;
+          {
+            raw_fd_ostream IR(Module, EC);
+            raw_fd_ostream Prof(ProfilePath, EC);
+            if (EC) {
+              errs() << "provsan-pass-bench: unable to write " << Name << ": "
+                     << EC.message() << "\n";
+              return 1;
+            }
+            Sites = generate(C, IR, Prof);
+          }
+
+          outs() << format("%9u %6u %7.2f %7.2f %8llu |", Functions, Allocs,
+                           C.Invokes, C.Profile, (unsigned long long)Sites);
+          outs().flush();
+          Measurement Runs[] = {
+              measure(BASELINE, Module, ProfilePath, StatsDir),
+              measure(PROFILING, Module, ProfilePath, StatsDir),
+              measure(PATCHING, Module, ProfilePath, StatsDir)};
+          for (unsigned I = 0; I < 3; ++I) {
+            if (I)
+              outs() << " |";
+            printMeasurement(Runs[I], I != BASELINE);
+            Failed |= Runs[I].Failed;
+          }
+          outs() << "\n";
+          outs().flush();
+          sys::fs::remove_directories(StatsDir);
+        }
+
+  if (Temporary)
+    sys::fs::remove_directories(Dir);
+  return Failed ? 1 : 0;
+}
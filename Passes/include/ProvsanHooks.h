@@ -0,0 +1,58 @@
+//===- ProvsanHooks.h - Hook conventions shared by the passes ---*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file defines how the Provsan Pre and Post passes agree on the
+// allocation functions and on the hook markers left by ProvsanPre.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TRANSFORMS_DYNAMIC_MPK_HOOKS_H
+#define LLVM_TRANSFORMS_DYNAMIC_MPK_HOOKS_H
+
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+// Metadata left on allocation calls by ProvsanPre with PROVSAN_HOOK_MARKERS=1,
+// naming the kind of hook ProvsanPost has to insert after the call ("alloc",
+// "realloc", "dealloc"), or "none" for calls that are not hooked.
+#define PROVSAN_HOOK_MD "provsan.hook"
+// Module flag set by ProvsanPre when it left hook markers.
+#define PROVSAN_HOOK_MARKERS_FLAG "provsan.hook-markers"
+// Function attribute set by ProvsanPre, in marker mode, on the functions
+// outside of PROVSAN_INCLUDE/PROVSAN_EXCLUDE. Unlike metadata, the optimizer
+// keeps it, so ProvsanPost hooks a call that lost its marker as Pre would
+// have.
+#define PROVSAN_UNSCOPED_ATTR "provsan-unscoped"
+// Module flag set by ProvsanPost once it numbered (and patched) the hooks of
+// a module. Later runs, e.g. in the link step of an LTO build, leave the
+// module alone, so site IDs are assigned exactly once.
+#define PROVSAN_POST_DONE_FLAG "provsan.post-done"
+
+namespace llvm {
+
+/// Returns the allocation functions named by env_var (PROVSAN_ALLOC,
+/// PROVSAN_REALLOC or PROVSAN_FREE), a comma separated list, or fallback if
+/// it is unset or empty.
+inline std::vector<std::string> allocFunctionNames(const char *env_var,
+                                                   const char *fallback) {
+  const char *var = getenv(env_var);
+  std::string list = var && *var ? var : fallback;
+  std::vector<std::string> names;
+  size_t start, end = 0;
+  while ((start = list.find_first_not_of(',', end)) != std::string::npos) {
+    end = list.find(',', start);
+    names.push_back(list.substr(start, end - start));
+  }
+  return names;
+}
+
+} // namespace llvm
+
+#endif // LLVM_TRANSFORMS_DYNAMIC_MPK_HOOKS_H
@@ -0,0 +1,156 @@
+//===- ProvsanStats.h - Compile-time statistics of the passes ---*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file defines the compile-time statistics shared by the Provsan Pre and
+// Post passes.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TRANSFORMS_DYNAMIC_MPK_STATS_H
+#define LLVM_TRANSFORMS_DYNAMIC_MPK_STATS_H
+
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassTimingInfo.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <initializer_list>
+#include <string>
+#include <vector>
+
+namespace llvm {
+
+/// Wall time since Begin, in seconds.
+inline double secondsSince(const TimeRecord &Begin) {
+  return TimeRecord::getCurrentTime(/*Start=*/false).getWallTime() -
+         Begin.getWallTime();
+}
+
+/// Compile-time costs of one run of a Provsan pass over a module.
+///
+/// Counters are ALWAYS_ENABLED_STATISTICs, reported by -stats and -stats-json.
+/// Phases are timed in the pass's timer group, reported by -time-passes. With
+/// PROVSAN_STATS_JSON set to a directory, every run also writes the module's
+/// counters, phase times and the cost of each function with hooks to
+/// <dir>/<pass>-*.json.
+class ProvsanStats {
+public:
+  ProvsanStats(StringRef PassName,
+               std::initializer_list<TrackingStatistic *> Counters)
+      : PassName(PassName.str()), Counters(Counters) {
+    // Statistics accumulate over every module of the process.
+    for (TrackingStatistic *Counter : Counters)
+      Start.push_back(Counter->getValue());
+    if (const char *dir = getenv("PROVSAN_STATS_JSON"))
+      JSONDir = dir;
+  }
+
+  /// Times a phase of the pass for the lifetime of the object.
+  class Phase {
+  public:
+    Phase(ProvsanStats &Stats, StringRef Name, StringRef Description)
+        : Stats(Stats), Name(Name),
+          Begin(TimeRecord::getCurrentTime(/*Start=*/true)) {
+      if (TimePassesIsEnabled)
+        Timer.emplace(Name, Description, Stats.PassName, Stats.PassName, true);
+    }
+    ~Phase() { Stats.Phases[Name] += secondsSince(Begin); }
+
+  private:
+    ProvsanStats &Stats;
+    StringRef Name;
+    TimeRecord Begin;
+    Optional<NamedRegionTimer> Timer;
+  };
+
+  /// Whether the cost of each function is recorded.
+  bool tracksFunctions() const { return !JSONDir.empty(); }
+
+  void recordFunction(const Function &F, uint64_t Hooks, double Seconds) {
+    if (Hooks)
+      Functions.push_back({F.getName().str(), Hooks, Seconds});
+  }
+
+  /// Writes the JSON report of the run, if requested.
+  void writeJSON(const Module &M) {
+    if (JSONDir.empty())
+      return;
+    if (!sys::fs::is_directory(JSONDir))
+      sys::fs::create_directories(JSONDir);
+    Expected<sys::fs::TempFile> File =
+        sys::fs::TempFile::create(JSONDir + "/" + PassName + "-%%%%%%%.json");
+    if (!File) {
+      errs() << "WARNING: unable to write " << PassName
+             << " statistics: " << toString(File.takeError()) << "\n";
+      return;
+    }
+
+    // The most expensive functions first.
+    std::stable_sort(Functions.begin(), Functions.end(),
+                     [](const FunctionCost &LHS, const FunctionCost &RHS) {
+                       return LHS.Seconds > RHS.Seconds;
+                     });
+
+    raw_fd_ostream OS(File->FD, /*shouldClose=*/false);
+    json::OStream J(OS, 2);
+    J.object([&] {
+      J.attribute("pass", PassName);
+      J.attribute("module", M.getModuleIdentifier());
+      J.attributeObject("counters", [&] {
+        for (size_t I = 0; I < Counters.size(); ++I)
+          J.attribute(Counters[I]->getName(),
+                      int64_t(Counters[I]->getValue() - Start[I]));
+      });
+      J.attributeObject("phases", [&] {
+        for (auto &Phase : Phases)
+          J.attribute(Phase.getKey(), Phase.getValue());
+      });
+      J.attributeArray("functions", [&] {
+        for (auto &Cost : Functions)
+          J.object([&] {
+            J.attribute("name", Cost.Name);
+            J.attribute("hooks", int64_t(Cost.Hooks));
+            J.attribute("seconds", Cost.Seconds);
+          });
+      });
+    });
+    OS << "\n";
+    OS.flush();
+
+    if (auto E = File->keep())
+      errs() << "WARNING: unable to keep " << PassName
+             << " statistics: " << toString(std::move(E)) << "\n";
+  }
+
+private:
+  struct FunctionCost {
+    std::string Name;
+    uint64_t Hooks;
+    double Seconds;
+  };
+
+  std::string PassName;
+  std::vector<TrackingStatistic *> Counters;
+  std::vector<uint64_t> Start;
+  std::string JSONDir;
+  StringMap<double> Phases;
+  std::vector<FunctionCost> Functions;
+};
+
+} // namespace llvm
+
+#endif // LLVM_TRANSFORMS_DYNAMIC_MPK_STATS_H
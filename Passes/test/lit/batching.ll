@@ -0,0 +1,67 @@
+; With PROVSAN_BATCH_HOOKS=1, the allocations of a loop without other calls
+; are buffered on the stack, and registered with one allocHookBatch call when
+; the buffer is full and at the loop exits. ProvsanPost numbers all flushes of
+; a buffer as one site.
+
+; RUN: env PROVSAN_BATCH_HOOKS=1 PROVSAN_BATCH_SIZE=8 %provsan_opt \
+; RUN:   -passes=provsan-pre -S %s 2>/dev/null | FileCheck %s
+; RUN: env PROVSAN_BATCH_HOOKS=1 %provsan_opt -passes=provsan-pre -S %s \
+; RUN:   2>/dev/null | %provsan_opt -passes=provsan-post -S 2>/dev/null \
+; RUN:   | FileCheck %s --check-prefix=POST
+
+declare i8* @trusted_malloc(i64, i64)
+declare void @use(i8*)
+
+define void @fill(i8** %array, i64 %n) {
+entry:
+  br label %loop
+loop:
+  %i = phi i64 [ 0, %entry ], [ %next, %loop ]
+  %p = call i8* @trusted_malloc(i64 16, i64 8)
+  %slot = getelementptr i8*, i8** %array, i64 %i
+  store i8* %p, i8** %slot
+  %next = add i64 %i, 1
+  %done = icmp eq i64 %next, %n
+  br i1 %done, label %exit, label %loop
+exit:
+  ret void
+}
+
+; Loops calling other functions keep a hook per allocation.
+define void @escape(i64 %n) {
+entry:
+  br label %loop
+loop:
+  %i = phi i64 [ 0, %entry ], [ %next, %loop ]
+  %p = call i8* @trusted_malloc(i64 16, i64 8)
+  call void @use(i8* %p)
+  %next = add i64 %i, 1
+  %done = icmp eq i64 %next, %n
+  br i1 %done, label %exit, label %loop
+exit:
+  ret void
+}
+
+; CHECK-LABEL: define void @fill(
+; CHECK: %provsan.batch = alloca [8 x { i8*, i64 }]
+; CHECK: %provsan.batch.count = alloca i64
+; CHECK: %p = call i8* @trusted_malloc(i64 16, i64 8)
+; CHECK-NOT: call void @allocHook
+; CHECK: %[[FILLED:.*]] = add i64 %{{.*}}, 1
+; CHECK: icmp eq i64 %[[FILLED]], 8
+; CHECK: call void @allocHookBatch(i8* %{{.*}}, i64 %[[FILLED]],
+; CHECK: exit:
+; CHECK: %[[PENDING:.*]] = load i64, i64* %provsan.batch.count
+; CHECK: icmp ne i64 %[[PENDING]], 0
+; CHECK: call void @allocHookBatch(i8* %{{.*}}, i64 %[[PENDING]],
+; CHECK-NOT: call void @allocHook
+
+; CHECK-LABEL: define void @escape(
+; CHECK: %p = call i8* @trusted_malloc(i64 16, i64 8)
+; CHECK-NEXT: call void @allocHook(i8* %p, i64 16,
+; CHECK-NOT: call void @allocHookBatch
+; CHECK: declare void @allocHookBatch(
+
+; POST-LABEL: define void @fill(
+; POST: call void @allocHookBatch(i8* %{{.*}}, i64 %{{.*}}, i64 [[ID:[0-9]+]], i8* getelementptr {{.*}} @[[BB:[0-9]+]], {{.*}} @[[FN:[0-9]+]],
+; POST: call void @allocHookBatch(i8* %{{.*}}, i64 %{{.*}}, i64 [[ID]], i8* getelementptr {{.*}} @[[BB]], {{.*}} @[[FN]],
@@ -0,0 +1,50 @@
+; With PROVSAN_COMPACT_HOOKS=1, the hooks only pass the allocation. Their site
+; is described by a descriptor, found through the provsan_site_pcs table entry
+; of the return address of the call, which a constructor registers.
+
+; RUN: env PROVSAN_COMPACT_HOOKS=1 %provsan_opt -passes=provsan-post -S %s \
+; RUN:   2>/dev/null | FileCheck %s
+; RUN: env PROVSAN_COMPACT_HOOKS=1 %provsan_opt -passes=provsan-post -S %s \
+; RUN:   2>/dev/null | llc -o - | FileCheck %s --check-prefix=ASM
+
+declare i8* @trusted_malloc(i64, i64)
+declare i8* @trusted_realloc(i8*, i64, i64, i64)
+declare void @allocHook(i8*, i64, i64, i8*, i8*)
+declare void @reallocHook(i8*, i64, i8*, i64, i64, i8*, i8*)
+
+define i8* @f(i64 %n) {
+entry:
+  %p = call i8* @trusted_malloc(i64 %n, i64 8)
+  call void @allocHook(i8* %p, i64 %n, i64 0, i8* null, i8* null)
+  %q = call i8* @trusted_realloc(i8* %p, i64 %n, i64 8, i64 64)
+  call void @reallocHook(i8* %q, i64 64, i8* %p, i64 %n, i64 0, i8* null, i8* null)
+  ret i8* %q
+}
+
+; CHECK: @[[ALLOC:__provsan_site[.0-9]*]] = internal constant { i64, i8*, i8*, i64 } { i64 0, {{.*}}, i64 0 }
+; CHECK: @[[REALLOC:__provsan_site[.0-9]*]] = internal constant { i64, i8*, i8*, i64 } { i64 1, {{.*}}, i64 1 }
+; CHECK: @__start_provsan_site_pcs = external hidden global i8
+; CHECK: @__stop_provsan_site_pcs = external hidden global i8
+; CHECK: @llvm.global_ctors = {{.*}} @provsan.register_site_pcs
+
+; CHECK-LABEL: define i8* @f(
+; CHECK-NOT: call void @allocHook
+; CHECK: call { i64, i64 } asm sideeffect alignstack "call allocHookPC@PLT\0A1:\0A.pushsection provsan_site_pcs,\22a\22,@progbits\0A.p2align 2\0A.long 1b - .\0A.long ${4:c} - .\0A.popsection", "={rdi},={rsi},0,1,i,~{rdx},~{rcx},{{.*}}"(i64 %{{[0-9]+}}, i64 %n, {{.*}} @[[ALLOC]])
+; CHECK-NOT: call void @reallocHook
+; CHECK: call { i64, i64, i64, i64 } asm sideeffect alignstack "call reallocHookPC@PLT{{.*}}${8:c} - .{{.*}}", "={rdi},={rsi},={rdx},={rcx},0,1,2,3,i,~{rax},{{.*}} @[[REALLOC]])
+
+; CHECK-LABEL: define internal void @provsan.register_site_pcs()
+; CHECK: call void @provsan_register_site_pcs(i8* @__start_provsan_site_pcs, i8* @__stop_provsan_site_pcs)
+
+; The table entries are offsets, so the section needs no relocations at load
+; time.
+; ASM: callq allocHookPC@PLT
+; ASM-NEXT: [[RET:.Ltmp[0-9]+]]:
+; ASM-NEXT: .section provsan_site_pcs,"a",@progbits
+; ASM-NEXT: .p2align 2
+; ASM-NEXT: [[PC:.Ltmp[0-9]+]]:
+; ASM-NEXT: .long [[RET]]-[[PC]]
+; ASM-NEXT: [[DESC:.Ltmp[0-9]+]]:
+; ASM-NEXT: .long __provsan_site-[[DESC]]
+; ASM: callq reallocHookPC@PLT
+; ASM: .long __provsan_site.1-
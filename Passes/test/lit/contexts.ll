@@ -0,0 +1,79 @@
+; With PROVSAN_CONTEXT_CLONING=1, calls to allocation wrappers set the
+; runtime's __provsan_alloc_context for their duration, and restore the
+; previous one afterwards. Wrapper allocations that only faulted through some
+; calls are patched in a clone of the wrapper, used by those calls.
+
+; RUN: env PROVSAN_CONTEXT_CLONING=1 %provsan_opt -passes=provsan-post -S %s \
+; RUN:   2>/dev/null | FileCheck %s
+; RUN: env PROVSAN_CONTEXT_CLONING=1 PROVSAN_COMPACT_HOOKS=1 \
+; RUN:   PROVSAN_PATH=%S/Inputs/contexts %provsan_opt -passes=provsan-post \
+; RUN:   -S %s 2>%t.err | FileCheck %s --check-prefix=CLONE
+; RUN: FileCheck %s --check-prefix=CLONE-ERR < %t.err
+
+declare i8* @trusted_malloc(i64, i64)
+declare i8* @untrusted_malloc(i64, i64)
+declare void @allocHook(i8*, i64, i64, i8*, i8*)
+declare void @use(i8*)
+declare i32 @__gxx_personality_v0(...)
+
+define i8* @xmalloc(i64 %n) {
+entry:
+  %p = call i8* @trusted_malloc(i64 %n, i64 8)
+  call void @allocHook(i8* %p, i64 %n, i64 0, i8* null, i8* null)
+  ret i8* %p
+}
+
+define void @caller() personality i32 (...)* @__gxx_personality_v0 {
+entry:
+  %a = call i8* @xmalloc(i64 16)
+  call void @use(i8* %a)
+  %b = invoke i8* @xmalloc(i64 32) to label %cont unwind label %lpad
+cont:
+  call void @use(i8* %b)
+  ret void
+lpad:
+  %lp = landingpad { i8*, i32 } cleanup
+  resume { i8*, i32 } %lp
+}
+
+; CHECK: @__provsan_alloc_context = external thread_local(initialexec) global i64
+
+; CHECK-LABEL: define void @caller()
+; CHECK: %[[SLOT:.*]] = alloca i64
+; CHECK-NEXT: %[[ENTRY:.*]] = load i64, i64* @__provsan_alloc_context
+; CHECK-NEXT: store i64 %[[ENTRY]], i64* %[[SLOT]]
+; CHECK-NEXT: %[[PREV_A:.*]] = load i64, i64* @__provsan_alloc_context
+; CHECK-NEXT: store i64 5348546507462822681, i64* @__provsan_alloc_context
+; CHECK-NEXT: %a = call i8* @xmalloc(i64 16)
+; CHECK-NEXT: store i64 %[[PREV_A]], i64* @__provsan_alloc_context
+; CHECK: %[[PREV_B:.*]] = load i64, i64* @__provsan_alloc_context
+; CHECK-NEXT: store i64 5348545407951194471, i64* @__provsan_alloc_context
+; CHECK-NEXT: store i64 %[[PREV_B]], i64* %[[SLOT]]
+; CHECK-NEXT: %b = invoke i8* @xmalloc(i64 32)
+; CHECK: cont:
+; CHECK-NEXT: %[[RESTORE:.*]] = load i64, i64* %[[SLOT]]
+; CHECK-NEXT: store i64 %[[RESTORE]], i64* @__provsan_alloc_context
+; CHECK: lpad:
+; CHECK-NEXT: landingpad
+; CHECK-NEXT: cleanup
+; CHECK-NEXT: %[[UNWIND:.*]] = load i64, i64* %[[SLOT]]
+; CHECK-NEXT: store i64 %[[UNWIND]], i64* @__provsan_alloc_context
+
+; The clone keeps the site of the wrapper's hook, with its own table entry.
+; CLONE: @[[SITE:__provsan_site]] = internal constant { i64, i8*, i8*, i64 } { i64 0,
+; CLONE: @[[CLONE_SITE:__provsan_site[.0-9]+]] = internal constant { i64, i8*, i8*, i64 } { i64 0,
+
+; CLONE-LABEL: define i8* @xmalloc(
+; CLONE: call i8* @trusted_malloc(
+; CLONE: asm sideeffect {{.*}} @[[SITE]])
+
+; CLONE-LABEL: define void @caller()
+; CLONE: %a = call i8* @xmalloc(i64 16)
+; CLONE: %b = invoke i8* @xmalloc.provsan.untrusted(i64 32)
+
+; CLONE-LABEL: define internal i8* @xmalloc.provsan.untrusted(
+; CLONE: call i8* @untrusted_malloc(
+; CLONE-NOT: call void @allocHook
+; CLONE: asm sideeffect {{.*}} @[[CLONE_SITE]])
+
+; CLONE-ERR: Cloned xmalloc for 1 of its 2 calls
@@ -0,0 +1,43 @@
+; The block name of an inlined site is followed by the calls it was inlined
+; through, innermost first. Sites profiled through interposition are patched
+; by the source location of their allocation call.
+
+; RUN: %provsan_opt -passes=provsan-post -S %s 2>/dev/null | FileCheck %s
+; RUN: env PROVSAN_PATH=%S/Inputs/debug-info %provsan_opt \
+; RUN:   -passes=provsan-post -S %s 2>/dev/null \
+; RUN:   | FileCheck %s --check-prefix=LOCATED
+
+declare i8* @trusted_malloc(i64, i64)
+declare i8* @untrusted_malloc(i64, i64)
+declare void @allocHook(i8*, i64, i64, i8*, i8*)
+
+define void @parse() !dbg !5 {
+entry:
+  %inlined = call i8* @trusted_malloc(i64 16, i64 8), !dbg !9
+  call void @allocHook(i8* %inlined, i64 16, i64 0, i8* null, i8* null), !dbg !9
+  %direct = call i8* @trusted_malloc(i64 32, i64 8), !dbg !11
+  call void @allocHook(i8* %direct, i64 32, i64 0, i8* null, i8* null), !dbg !11
+  ret void
+}
+
+!llvm.dbg.cu = !{!0}
+!llvm.module.flags = !{!3, !4}
+
+!0 = distinct !DICompileUnit(language: DW_LANG_C99, file: !1, emissionKind: FullDebug)
+!1 = !DIFile(filename: "alloc.c", directory: "/src")
+!2 = !DISubroutineType(types: !{})
+!3 = !{i32 2, !"Debug Info Version", i32 3}
+!4 = !{i32 7, !"Dwarf Version", i32 4}
+!5 = distinct !DISubprogram(name: "parse", scope: !1, file: !1, line: 8, type: !2, unit: !0, spFlags: DISPFlagDefinition)
+!6 = distinct !DISubprogram(name: "make", scope: !1, file: !1, line: 1, type: !2, unit: !0, spFlags: DISPFlagDefinition)
+!9 = !DILocation(line: 3, column: 5, scope: !6, inlinedAt: !10)
+!10 = distinct !DILocation(line: 10, column: 3, scope: !5)
+!11 = !DILocation(line: 12, column: 7, scope: !5)
+
+; CHECK-DAG: @[[INLINED:[0-9]+]] = private unnamed_addr constant [{{[0-9]+}} x i8] c"entry@make:3<parse:10\00"
+; CHECK-DAG: @[[DIRECT:[0-9]+]] = private unnamed_addr constant [6 x i8] c"entry\00"
+; CHECK: call void @allocHook(i8* %inlined, i64 16, i64 0, {{.*}} @[[INLINED]],
+; CHECK: call void @allocHook(i8* %direct, i64 32, i64 1, {{.*}} @[[DIRECT]],
+
+; LOCATED: %inlined = call i8* @trusted_malloc(i64 16, i64 8)
+; LOCATED: %direct = call i8* @untrusted_malloc(i64 32, i64 8)
@@ -0,0 +1,39 @@
+; ProvsanPost runs at the end of the optimization pipeline by default, so
+; every inlined copy of an allocation is a site of its own. PROVSAN_POST_EP
+; moves it before the inliner.
+
+; RUN: %provsan_opt -passes='default<O1>' -S %s 2>/dev/null | FileCheck %s
+; RUN: env PROVSAN_POST_EP=pipeline-start %provsan_opt -passes='default<O1>' \
+; RUN:   -S %s 2>/dev/null | FileCheck %s --check-prefix=START
+; RUN: env PROVSAN_POST_EP=nowhere %provsan_opt -passes='default<O1>' -S %s \
+; RUN:   2>&1 >/dev/null | FileCheck %s --check-prefix=UNKNOWN
+
+declare i8* @trusted_malloc(i64, i64)
+declare void @use(i8*)
+
+define internal i8* @make() {
+entry:
+  %p = call i8* @trusted_malloc(i64 16, i64 8)
+  ret i8* %p
+}
+
+define void @caller() {
+entry:
+  %a = call i8* @make()
+  call void @use(i8* %a)
+  %b = call i8* @make()
+  call void @use(i8* %b)
+  ret void
+}
+
+; CHECK: @[[CALLER:[0-9]+]] = private unnamed_addr constant [7 x i8] c"caller\00"
+; CHECK-LABEL: define void @caller()
+; CHECK: call void @allocHook(i8* %{{.*}}, i64 16, i64 0, {{.*}} @[[CALLER]],
+; CHECK: call void @allocHook(i8* %{{.*}}, i64 16, i64 1, {{.*}} @[[CALLER]],
+
+; START: @[[MAKE:[0-9]+]] = private unnamed_addr constant [5 x i8] c"make\00"
+; START-LABEL: define void @caller()
+; START: call void @allocHook(i8* %{{.*}}, i64 16, i64 0, {{.*}} @[[MAKE]],
+; START: call void @allocHook(i8* %{{.*}}, i64 16, i64 0, {{.*}} @[[MAKE]],
+
+; UNKNOWN: ProvsanPost: unknown PROVSAN_POST_EP nowhere, using optimizer-last
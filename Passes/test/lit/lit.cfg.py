@@ -0,0 +1,30 @@
+# Lit configuration of the pass tests. The paths of the plugins and of the
+# LLVM tools are passed by the provsan-lit test (see ../CMakeLists.txt).
+
+import os
+
+import lit.formats
+
+config.name = 'Provsan'
+config.test_format = lit.formats.ShTest(True)
+config.suffixes = ['.ll', '.test']
+config.excludes = ['Inputs']
+config.test_source_root = os.path.dirname(__file__)
+
+for param in ['build_dir', 'tools_dir', 'pre', 'post', 'bench']:
+    if param not in lit_config.params:
+        lit_config.fatal('missing --param %s=..., run the tests through ctest'
+                         % param)
+config.test_exec_root = lit_config.params['build_dir']
+
+config.environment['PATH'] = os.pathsep.join(
+    [lit_config.params['tools_dir'], config.environment['PATH']])
+
+config.substitutions.append(
+    ('%provsan_opt', 'opt -load-pass-plugin=%s -load-pass-plugin=%s'
+     % (lit_config.params['pre'], lit_config.params['post'])))
+config.substitutions.append(
+    ('%provsan_bench', '%s --opt=%s --pre=%s --post=%s'
+     % (lit_config.params['bench'],
+        os.path.join(lit_config.params['tools_dir'], 'opt'),
+        lit_config.params['pre'], lit_config.params['post'])))
@@ -0,0 +1,59 @@
+; Calls that lost their marker, e.g. when identical calls were merged, are
+; hooked by their callee. Calls marked "none" are left alone. In functions
+; outside of ProvsanPre's scope, such calls are hooked as Pre marks them there.
+
+; RUN: %provsan_opt -passes=provsan-post -S %s 2>%t.err | FileCheck %s
+; RUN: FileCheck %s --check-prefix=WARN < %t.err
+
+declare i8* @trusted_malloc(i64, i64)
+declare i8* @trusted_realloc(i8*, i64, i64, i64)
+
+define i8* @merged(i1 %c) {
+entry:
+  %p = call i8* @trusted_malloc(i64 16, i64 8)
+  ret i8* %p
+}
+
+define i8* @marked() {
+entry:
+  %p = call i8* @trusted_malloc(i64 32, i64 8), !provsan.hook !1
+  ret i8* %p
+}
+
+define i8* @excluded() {
+entry:
+  %p = call i8* @trusted_malloc(i64 64, i64 8), !provsan.hook !2
+  ret i8* %p
+}
+
+define i8* @unscoped() "provsan-unscoped" {
+entry:
+  %p = call i8* @trusted_malloc(i64 16, i64 8)
+  %q = call i8* @trusted_realloc(i8* %p, i64 16, i64 8, i64 32)
+  ret i8* %q
+}
+
+!llvm.module.flags = !{!0}
+
+!0 = !{i32 7, !"provsan.hook-markers", i32 1}
+!1 = !{!"alloc"}
+!2 = !{!"none"}
+
+; CHECK-LABEL: define i8* @merged(
+; CHECK: %p = call i8* @trusted_malloc(i64 16, i64 8)
+; CHECK-NEXT: call void @allocHook(i8* %p, i64 16,
+; CHECK-LABEL: define i8* @marked(
+; CHECK: %p = call i8* @trusted_malloc(i64 32, i64 8)
+; CHECK-NEXT: call void @allocHook(i8* %p, i64 32,
+; CHECK-LABEL: define i8* @excluded(
+; CHECK: %p = call i8* @trusted_malloc(i64 64, i64 8)
+; CHECK-NEXT: ret i8* %p
+; CHECK-LABEL: define i8* @unscoped()
+; CHECK-NEXT: entry:
+; CHECK-NEXT: %p = call i8* @trusted_malloc(i64 16, i64 8)
+; CHECK-NEXT: %q = call i8* @trusted_realloc(
+; CHECK-NEXT: call void @deallocHook(i8* %p, i64 16,
+; CHECK-NEXT: ret i8* %q
+; CHECK-NOT: provsan-unscoped
+
+; WARN: WARNING: 3 allocation calls lost their provsan.hook marker, hooked by callee.
@@ -0,0 +1,30 @@
+; An allocation function defined in the module is not inlined in marker mode,
+; as the marker would go with its call.
+
+; RUN: env PROVSAN_HOOK_MARKERS=1 %provsan_opt -passes=provsan-pre -S %s \
+; RUN:   2>/dev/null | FileCheck %s --check-prefix=PRE
+; RUN: env PROVSAN_HOOK_MARKERS=1 %provsan_opt -passes=provsan-pre %s \
+; RUN:   2>/dev/null | %provsan_opt -passes=always-inline,provsan-post -S \
+; RUN:   2>/dev/null | FileCheck %s --check-prefix=POST
+
+declare i8* @malloc(i64)
+
+define i8* @trusted_malloc(i64 %size, i64 %align) alwaysinline {
+entry:
+  %p = call i8* @malloc(i64 %size)
+  ret i8* %p
+}
+
+define i8* @f() {
+entry:
+  %p = call i8* @trusted_malloc(i64 16, i64 8)
+  ret i8* %p
+}
+
+; PRE: define i8* @trusted_malloc(i64 %size, i64 %align) #[[ATTRS:[0-9]+]]
+; PRE: call i8* @trusted_malloc(i64 16, i64 8), !provsan.hook
+; PRE: attributes #[[ATTRS]] = { noinline }
+
+; POST-LABEL: define i8* @f()
+; POST: %p = call i8* @trusted_malloc(i64 16, i64 8)
+; POST-NEXT: call void @allocHook(i8* %p, i64 16,
@@ -0,0 +1,40 @@
+; With PROVSAN_HOOK_MARKERS=1, ProvsanPre only tags the allocation calls, and
+; ProvsanPost inserts the hooks after them before numbering them.
+
+; RUN: env PROVSAN_HOOK_MARKERS=1 %provsan_opt -passes=provsan-pre -S %s \
+; RUN:   2>/dev/null | FileCheck %s --check-prefix=PRE
+; RUN: env PROVSAN_HOOK_MARKERS=1 %provsan_opt -passes=provsan-pre -S %s \
+; RUN:   2>/dev/null | %provsan_opt -passes=provsan-post -S 2>/dev/null \
+; RUN:   | FileCheck %s --check-prefix=POST
+
+declare i8* @trusted_malloc(i64, i64)
+declare i8* @trusted_realloc(i8*, i64, i64, i64)
+declare void @trusted_free(i8*, i64, i64)
+
+define void @f() {
+entry:
+  %p = call i8* @trusted_malloc(i64 16, i64 8)
+  %q = call i8* @trusted_realloc(i8* %p, i64 16, i64 8, i64 32)
+  call void @trusted_free(i8* %q, i64 32, i64 8)
+  ret void
+}
+
+; PRE-LABEL: define void @f()
+; PRE-NOT: call void @{{.*}}Hook
+; PRE: call i8* @trusted_malloc(i64 16, i64 8), !provsan.hook ![[ALLOC:[0-9]+]]
+; PRE: call i8* @trusted_realloc({{.*}}), !provsan.hook ![[REALLOC:[0-9]+]]
+; PRE: call void @trusted_free({{.*}}), !provsan.hook ![[DEALLOC:[0-9]+]]
+; PRE-NOT: call void @{{.*}}Hook
+; PRE: !{i32 7, !"provsan.hook-markers", i32 1}
+; PRE-DAG: ![[ALLOC]] = !{!"alloc"}
+; PRE-DAG: ![[REALLOC]] = !{!"realloc"}
+; PRE-DAG: ![[DEALLOC]] = !{!"dealloc"}
+
+; POST-LABEL: define void @f()
+; POST: %p = call i8* @trusted_malloc(i64 16, i64 8)
+; POST-NEXT: call void @allocHook(i8* %p, i64 16, i64 0,
+; POST: %q = call i8* @trusted_realloc(
+; POST-NEXT: call void @reallocHook(i8* %q, i64 32, i8* %p, i64 16, i64 1,
+; POST: call void @trusted_free(
+; POST-NEXT: call void @deallocHook(
+; POST-NOT: provsan.hook-markers
@@ -0,0 +1,26 @@
+; ProvsanPost numbers the hooks of a module once. A second run, as in the
+; link step of a ThinLTO build, leaves the module alone.
+
+; RUN: %provsan_opt -passes=provsan-post -S %s 2>/dev/null \
+; RUN:   | %provsan_opt -passes=provsan-post -S 2>%t.err | FileCheck %s
+; RUN: FileCheck %s --check-prefix=ERR --allow-empty < %t.err
+
+declare i8* @trusted_malloc(i64, i64)
+declare void @allocHook(i8*, i64, i64, i8*, i8*)
+
+define void @f() {
+entry:
+  %p = call i8* @trusted_malloc(i64 16, i64 8)
+  call void @allocHook(i8* %p, i64 16, i64 0, i8* null, i8* null)
+  %q = call i8* @trusted_malloc(i64 32, i64 8)
+  call void @allocHook(i8* %q, i64 32, i64 0, i8* null, i8* null)
+  ret void
+}
+
+; CHECK: @3 = private unnamed_addr constant [2 x i8] c"f\00"
+; CHECK-NOT: @4 =
+; CHECK: call void @allocHook(i8* %p, i64 16, i64 0, {{.*}}@0
+; CHECK: call void @allocHook(i8* %q, i64 32, i64 1, {{.*}}@2
+; CHECK: !{i32 7, !"provsan.post-done", i32 1}
+
+; ERR-NOT: ProvsanPost Pass Running
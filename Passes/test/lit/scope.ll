@@ -0,0 +1,51 @@
+; PROVSAN_INCLUDE and PROVSAN_EXCLUDE restrict the functions ProvsanPre hooks
+; with fun:, src: and mod: glob patterns. In marker mode, the calls of the
+; functions outside of the scope are marked "none", and the functions carry
+; an attribute for the calls whose markers get dropped.
+
+; RUN: env PROVSAN_EXCLUDE=fun:skip_* %provsan_opt -passes=provsan-pre -S %s \
+; RUN:   2>%t.err | FileCheck %s
+; RUN: FileCheck %s --check-prefix=REPORT < %t.err
+; RUN: env PROVSAN_INCLUDE=src:*/scope.ll %provsan_opt -passes=provsan-pre -S \
+; RUN:   %s 2>/dev/null | FileCheck %s --check-prefix=ALL
+; RUN: env PROVSAN_INCLUDE=src:other.c %provsan_opt -passes=provsan-pre -S %s \
+; RUN:   2>/dev/null | FileCheck %s --check-prefix=OUTSIDE
+; RUN: env PROVSAN_EXCLUDE=fun:skip_* PROVSAN_HOOK_MARKERS=1 \
+; RUN:   %provsan_opt -passes=provsan-pre -S %s 2>/dev/null \
+; RUN:   | FileCheck %s --check-prefix=MARKERS
+
+declare i8* @trusted_malloc(i64, i64)
+
+define i8* @hooked() {
+entry:
+  %p = call i8* @trusted_malloc(i64 16, i64 8)
+  ret i8* %p
+}
+
+define i8* @skip_me() {
+entry:
+  %p = call i8* @trusted_malloc(i64 32, i64 8)
+  ret i8* %p
+}
+
+; CHECK-LABEL: define i8* @hooked()
+; CHECK-NEXT: entry:
+; CHECK-NEXT: %p = call i8* @trusted_malloc(i64 16, i64 8)
+; CHECK-NEXT: call void @allocHook(
+; CHECK-LABEL: define i8* @skip_me()
+; CHECK-NEXT: entry:
+; CHECK-NEXT: %p = call i8* @trusted_malloc(i64 32, i64 8)
+; CHECK-NEXT: ret i8* %p
+
+; REPORT: ProvsanPre: {{.*}}scope.ll: instrumented 1 functions, skipped 1 (1 hooks)
+
+; ALL-COUNT-2: call void @allocHook(
+
+; OUTSIDE-NOT: call void @allocHook(
+
+; MARKERS: call i8* @trusted_malloc(i64 16, i64 8), !provsan.hook ![[ALLOC:[0-9]+]]
+; MARKERS: define i8* @skip_me() #[[UNSCOPED:[0-9]+]]
+; MARKERS: call i8* @trusted_malloc(i64 32, i64 8), !provsan.hook ![[SKIPPED:[0-9]+]]
+; MARKERS: attributes #[[UNSCOPED]] = { "provsan-unscoped" }
+; MARKERS-DAG: ![[ALLOC]] = !{!"alloc"}
+; MARKERS-DAG: ![[SKIPPED]] = !{!"none"}
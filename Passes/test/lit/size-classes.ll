@@ -0,0 +1,37 @@
+; With PROVSAN_SIZE_CLASSES=1, patched sites of constant size and alignment
+; call the untrusted allocator's entry point for their size class. Sites of
+; variable or large size keep calling untrusted_malloc.
+
+; RUN: env PROVSAN_SIZE_CLASSES=1 PROVSAN_PATH=%S/Inputs/size-classes \
+; RUN:   %provsan_opt -passes=provsan-post -S %s 2>/dev/null | FileCheck %s
+; RUN: env PROVSAN_PATH=%S/Inputs/size-classes \
+; RUN:   %provsan_opt -passes=provsan-post -S %s 2>/dev/null \
+; RUN:   | FileCheck %s --check-prefix=GENERIC
+
+declare i8* @trusted_malloc(i64, i64)
+declare i8* @untrusted_malloc(i64, i64)
+declare void @allocHook(i8*, i64, i64, i8*, i8*)
+
+define void @f(i64 %n) {
+entry:
+  %small = call i8* @trusted_malloc(i64 16, i64 8)
+  call void @allocHook(i8* %small, i64 16, i64 0, i8* null, i8* null)
+  %medium = call i8* @trusted_malloc(i64 1000, i64 8)
+  call void @allocHook(i8* %medium, i64 1000, i64 0, i8* null, i8* null)
+  %variable = call i8* @trusted_malloc(i64 %n, i64 8)
+  call void @allocHook(i8* %variable, i64 %n, i64 0, i8* null, i8* null)
+  %large = call i8* @trusted_malloc(i64 1048576, i64 8)
+  call void @allocHook(i8* %large, i64 1048576, i64 0, i8* null, i8* null)
+  ret void
+}
+
+; CHECK: %small = call i8* @untrusted_malloc_c[[SMALL:[0-9]+]](i64 16, i64 8)
+; CHECK: %medium = call i8* @untrusted_malloc_c[[MEDIUM:[0-9]+]](i64 1000, i64 8)
+; CHECK: %variable = call i8* @untrusted_malloc(i64 %n, i64 8)
+; CHECK: %large = call i8* @untrusted_malloc(i64 1048576, i64 8)
+; CHECK-DAG: declare i8* @untrusted_malloc_c[[SMALL]](i64, i64)
+; CHECK-DAG: declare i8* @untrusted_malloc_c[[MEDIUM]](i64, i64)
+
+; GENERIC: %small = call i8* @untrusted_malloc(i64 16, i64 8)
+; GENERIC: %medium = call i8* @untrusted_malloc(i64 1000, i64 8)
+; GENERIC-NOT: untrusted_malloc_c
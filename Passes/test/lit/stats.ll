@@ -0,0 +1,51 @@
+; With PROVSAN_STATS_JSON set, each pass writes the counters and phase times
+; of its run, and the hooks and time of each function with hooks.
+
+; RUN: rm -rf %t.dir
+; RUN: env PROVSAN_STATS_JSON=%t.dir %provsan_opt \
+; RUN:   -passes=provsan-pre,provsan-post -S %s -o /dev/null 2>/dev/null
+; RUN: cat %t.dir/ProvsanPre-*.json | FileCheck %s --check-prefix=PRE
+; RUN: cat %t.dir/ProvsanPost-*.json | FileCheck %s --check-prefix=POST
+
+declare i8* @trusted_malloc(i64, i64)
+declare void @trusted_free(i8*, i64, i64)
+
+define void @two() {
+entry:
+  %p = call i8* @trusted_malloc(i64 16, i64 8)
+  call void @trusted_free(i8* %p, i64 16, i64 8)
+  ret void
+}
+
+define void @none() {
+entry:
+  ret void
+}
+
+; PRE: "pass": "ProvsanPre",
+; PRE: "counters": {
+; PRE-NEXT: "NumHooks": 2,
+; PRE-NEXT: "NumAllocHooks": 1,
+; PRE: "NumDeallocHooks": 1,
+; PRE: "NumInstrumentedFunctions": 2,
+; PRE: "phases": {
+; PRE-NEXT: "hook-functions": {{[0-9.e+-]+}}
+; PRE: "functions": [
+; PRE-NEXT: {
+; PRE-NEXT: "name": "two",
+; PRE-NEXT: "hooks": 2,
+; PRE-NEXT: "seconds": {{[0-9.e+-]+}}
+; PRE-NEXT: }
+; PRE-NEXT: ]
+
+; POST: "pass": "ProvsanPost",
+; POST: "NumHooks": 2,
+; POST: "phases": {
+; POST-DAG: "load-profiles":
+; POST-DAG: "assign-ids":
+; POST-DAG: "materialize-hooks":
+; POST: "functions": [
+; POST-NEXT: {
+; POST-NEXT: "name": "two",
+; POST-NEXT: "hooks": 2,
+; POST-NOT: "name"
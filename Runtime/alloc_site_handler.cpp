@@ -1,7 +1,17 @@
 #include "alloc_site_handler.h"
+#include "provsan_control.h"
+#include "provsan_fault_stacks.h"
+#include "provsan_site_pcs.h"
+#include "provsan_site_profile.h"
+#include "provsan_stats.h"
+#include "provsan_trace.h"
+
+#include <pthread.h>
 
 extern "C" {
 bool is_safe_address(void *addr) { return false; }
+
+__thread uint64_t __provsan_alloc_context = 0;
 }
 
 namespace __provsan {
@@ -9,13 +19,42 @@ namespace __provsan {
 
 AllocSiteHandler *AllocSiteHandle = nullptr;
 
+std::atomic<const provsan_allocator_ops *> AllocatorOps(nullptr);
+
 std::once_flag AllocHandlerInitFlag;
 
 AllocSite AllocSite::error() { return AllocSite(); }
 
+static void prepareFork() {
+  AllocSiteHandle->lockForFork();
+  lockTraceForFork();
+}
+
+static void parentAfterFork() {
+  unlockTraceAfterFork();
+  AllocSiteHandle->unlockAfterFork(false);
+}
+
+static void childAfterFork() {
+  unlockTraceAfterFork();
+  AllocSiteHandle->unlockAfterFork(true);
+  reopenStatsAfterFork();
+  // The inherited fault log belongs to the parent, give the child its own.
+  reopenFaultLogAfterFork();
+  reopenTraceAfterFork();
+}
+
 void AllocSiteHandler::init() {
+  initStats();
   AllocSiteHandle = new AllocSiteHandler();
   provsan_untrusted_constructor();
+  initSiteTable();
+  initSiteProfiles();
+  initStackDepot();
+  initFaultStacks();
+  initTrace();
+  openFaultLog();
+  pthread_atfork(prepareFork, parentAfterFork, childAfterFork);
 }
 
 AllocSiteHandler *AllocSiteHandler::getOrInit() {
@@ -25,22 +64,89 @@ AllocSiteHandler *AllocSiteHandler::getOrInit() {
   return AllocSiteHandle;
 }
 
+// Lets page faults in site segregated memory be attributed without a map
+// lookup, see AllocSiteHandler::getPageSite.
+static inline void bindAllocatorSite(rust_ptr ptr, uint32_t siteIndex) {
+  if (provsan_alloc_site_of)
+    bindSiteTag(provsan_alloc_site_of(ptr, nullptr, nullptr), siteIndex);
+}
+
+// Stores the site in the metadata of the registered allocator, if any.
+// Returns false if the allocation has to be tracked in the allocation map.
+static inline bool tagAllocatorSite(rust_ptr ptr, uint32_t siteIndex) {
+  auto *ops = AllocatorOps.load(std::memory_order_acquire);
+  return ops && siteIndex != NO_SITE_INDEX && ops->set_site(ptr, siteIndex);
+}
+
 } // namespace __provsan
 
 extern "C" {
 void allocHook(rust_ptr ptr, int64_t size, int64_t localID, const char *bbName,
                const char *funcName) {
-  __provsan::AllocSite site(ptr, size, localID, bbName, funcName);
+  if (!__provsan::profilingEnabled()) {
+    // Still make sure the fault handler is installed.
+    __provsan::AllocSiteHandler::getOrInit();
+    return;
+  }
+
   auto handler = __provsan::AllocSiteHandler::getOrInit();
+  __provsan::StatsScope stats(__provsan::STAT_ALLOC_HOOK);
+  __provsan::cacheStackBounds();
+  uint32_t siteIndex = __provsan::getSiteIndex(localID, bbName, funcName, false);
+  __provsan::markSiteExecuted(siteIndex);
+  __provsan::traceEvent(__provsan::TRACE_ALLOC, (uintptr_t)ptr, size, 0,
+                        siteIndex);
+  __provsan::recordSiteSize(siteIndex, size);
+  __provsan::bindAllocatorSite(ptr, siteIndex);
+  if (__provsan::tagAllocatorSite(ptr, siteIndex)) {
+    REPORT("INFO : AllocSiteHook tagged address: %p ID: %d funcName: %s.\n",
+           ptr, localID, funcName);
+    return;
+  }
+  __provsan::AllocSite site(ptr, size, localID, bbName, funcName, DEFAULT_PKEY,
+                            false, siteIndex, __provsan::captureAllocStack(),
+                            __provsan_alloc_context);
   handler->insertAllocSite(ptr, site);
   REPORT(
       "INFO : AllocSiteHook for address: %p ID: %d bbName: %s funcName: %s.\n",
       ptr, localID, bbName, funcName);
+}
+
+void allocHookBatch(const HookBatchEntry *entries, int64_t count,
+                    int64_t localID, const char *bbName,
+                    const char *funcName) {
+  if (!__provsan::profilingEnabled()) {
+    __provsan::AllocSiteHandler::getOrInit();
+    return;
+  }
 
-#ifdef MPK_STATS
-  if (AllocSiteCount != 0)
-    allocHookCalls++;
-#endif
+  auto handler = __provsan::AllocSiteHandler::getOrInit();
+  __provsan::StatsScope stats(__provsan::STAT_ALLOC_HOOK);
+  __provsan::cacheStackBounds();
+  // The site is resolved once for the whole batch.
+  uint32_t siteIndex = __provsan::getSiteIndex(localID, bbName, funcName, false);
+  __provsan::markSiteExecuted(siteIndex);
+  std::vector<std::pair<rust_ptr, __provsan::AllocSite>> untagged;
+  for (int64_t i = 0; i < count; ++i) {
+    rust_ptr ptr = entries[i].ptr;
+    int64_t size = entries[i].size;
+    __provsan::traceEvent(__provsan::TRACE_ALLOC, (uintptr_t)ptr, size, 0,
+                          siteIndex);
+    __provsan::recordSiteSize(siteIndex, size);
+    __provsan::bindAllocatorSite(ptr, siteIndex);
+    if (__provsan::tagAllocatorSite(ptr, siteIndex))
+      continue;
+    untagged.emplace_back(
+        ptr, __provsan::AllocSite(ptr, size, localID, bbName, funcName,
+                                  DEFAULT_PKEY, false, siteIndex,
+                                  __provsan::captureAllocStack(),
+                                  __provsan_alloc_context));
+  }
+  if (!untagged.empty())
+    handler->insertAllocSites(untagged);
+  REPORT("INFO : AllocSiteHookBatch for %ld allocations ID: %d bbName: %s "
+         "funcName: %s.\n",
+         count, localID, bbName, funcName);
 }
 
 /// reallocHook will remove the previous mapping from oldPtr -> oldAllocSite,
@@ -50,13 +156,55 @@ void allocHook(rust_ptr ptr, int64_t size, int64_t localID, const char *bbName,
 void reallocHook(rust_ptr newPtr, int64_t newSize, rust_ptr oldPtr,
                  int64_t oldSize, int64_t localID, const char *bbName,
                  const char *funcName) {
+  if (!__provsan::profilingEnabled()) {
+    // The new allocation is not tracked, but a stale mapping for oldPtr must
+    // not be left behind to be matched against unrelated memory later. Until
+    // the first allocation is tracked there is nothing to remove, and the
+    // runtime is left uninitialized.
+    if (__provsan::ProfilingStarted.load(std::memory_order_relaxed)) {
+      __provsan::AllocSiteHandler::getOrInit()->removeAllocSite(oldPtr);
+      __provsan::traceEvent(__provsan::TRACE_FREE, (uintptr_t)oldPtr, oldSize,
+                            0, NO_SITE_INDEX);
+    }
+    return;
+  }
+
   // Get the AllocSiteHandler and the old AllocSite for the associated oldPtr.
   auto handler = __provsan::AllocSiteHandler::getOrInit();
-  auto oldAS = handler->getAllocSite(oldPtr);
+  __provsan::StatsScope stats(__provsan::STAT_REALLOC_HOOK);
+  __provsan::cacheStackBounds();
+  // The old allocation is looked up before the new one is tagged, as the
+  // allocator may have resized it in place.
+  auto oldAS = handler->getAllocatorSite(oldPtr);
+  bool oldTagged = oldAS.isValid();
+  if (!oldTagged)
+    oldAS = handler->getAllocSite(oldPtr);
+  uint32_t siteIndex = __provsan::getSiteIndex(localID, bbName, funcName, true);
+  __provsan::markSiteExecuted(siteIndex);
+  __provsan::traceEvent(__provsan::TRACE_REALLOC, (uintptr_t)newPtr, newSize,
+                        (uintptr_t)oldPtr, siteIndex);
+  __provsan::recordSiteSize(siteIndex, newSize);
+  __provsan::bindAllocatorSite(newPtr, siteIndex);
+  if (__provsan::tagAllocatorSite(newPtr, siteIndex)) {
+    auto newAS = __provsan::AllocSiteHandler::siteFromEntry(siteIndex, newPtr,
+                                                            newSize);
+    if (oldAS.isValid() && newAS.isValid())
+      handler->updateReallocChain(oldAS, newAS);
+    // The old allocation may predate the registration of the allocator.
+    if (!oldTagged)
+      handler->removeAllocSite(oldPtr);
+    REPORT("INFO : ReallocSiteHook tagged oldptr: %p, newptr: %p, ID: %d "
+           "funcName: %s.\n",
+           oldPtr, newPtr, localID, funcName);
+    return;
+  }
+  uint32_t stackID = __provsan::captureAllocStack();
 
   if (!oldAS.isValid()) {
     // Returned ErrorAlloc, which should not be part of the realloc chain.
-    __provsan::AllocSite site(newPtr, newSize, localID, bbName, funcName);
+    __provsan::AllocSite site(newPtr, newSize, localID, bbName, funcName,
+                              DEFAULT_PKEY, false, siteIndex, stackID,
+                              __provsan_alloc_context);
     handler->insertAllocSite(newPtr, site);
     REPORT("ERROR<AllocSite> : Realloc Site: %p : %d could not find the "
            "previous allocation: %d\n",
@@ -65,34 +213,68 @@ void reallocHook(rust_ptr newPtr, int64_t newSize, rust_ptr oldPtr,
   }
 
   __provsan::AllocSite newAS(newPtr, newSize, localID, bbName, funcName,
-                                   DEFAULT_PKEY, true);
+                             DEFAULT_PKEY, true, siteIndex, stackID,
+                             __provsan_alloc_context);
 
   // Get the previously associated set from the site being re-allocated and
   // add the previous site to the associated set.
   handler->updateReallocChain(oldAS, newAS);
 
   // Remove previous Allocation Site from the mapping.
-  handler->removeAllocSite(oldPtr);
+  if (!oldTagged)
+    handler->removeAllocSite(oldPtr);
 
   handler->insertAllocSite(newPtr, newAS);
   REPORT("INFO : ReallocSiteHook for oldptr: %p, newptr: %p, ID: %d bbName: %s "
          "funcName: %s.\n",
          oldPtr, newPtr, localID, bbName, funcName);
-
-#ifdef MPK_STATS
-  if (AllocSiteCount != 0)
-    reallocHookCalls++;
-#endif
 }
 
 void deallocHook(rust_ptr ptr, int64_t size, int64_t localID) {
+  // Until the first allocation is tracked, there is nothing to remove.
+  if (!__provsan::ProfilingStarted.load(std::memory_order_relaxed))
+    return;
+
+  // Frees are tracked even while profiling is paused, so that the map never
+  // holds mappings for memory that has since been reused.
   auto handler = __provsan::AllocSiteHandler::getOrInit();
-  handler->removeAllocSite(ptr);
+  __provsan::StatsScope stats(__provsan::STAT_DEALLOC_HOOK);
+  __provsan::cacheStackBounds();
+  __provsan::traceEvent(__provsan::TRACE_FREE, (uintptr_t)ptr, size, 0,
+                        NO_SITE_INDEX);
+  // Once any untagged allocation was tracked, the map would have to be locked
+  // for every free. Tagged allocations are found without it.
+  if (!handler->isAllocatorTagged(ptr))
+    handler->removeAllocSite(ptr);
   REPORT("INFO : DeallocSiteHook for address: %p ID: %d.\n", ptr, localID);
+}
+
+void provsan_register_allocator(const provsan_allocator_ops *ops) {
+  __provsan::AllocatorOps.store(ops, std::memory_order_release);
+  REPORT("INFO : Registered allocator site tags.\n");
+}
+
+void allocHookPC(rust_ptr ptr, int64_t size) {
+  auto *site = __provsan::lookupSitePC((uintptr_t)__builtin_return_address(0));
+  if (!site) {
+    REPORT("ERROR : No site registered for compact hook at %p.\n",
+           __builtin_return_address(0));
+    return;
+  }
+  allocHook(ptr, size, site->localID, site->bbName, site->funcName);
+}
 
-#ifdef MPK_STATS
-  if (AllocSiteCount != 0)
-    deallocHookCalls++;
-#endif
+void reallocHookPC(rust_ptr newPtr, int64_t newSize, rust_ptr oldPtr,
+                   int64_t oldSize) {
+  auto *site = __provsan::lookupSitePC((uintptr_t)__builtin_return_address(0));
+  if (!site) {
+    REPORT("ERROR : No site registered for compact hook at %p.\n",
+           __builtin_return_address(0));
+    // The old allocation must not stay tracked.
+    deallocHook(oldPtr, oldSize, 0);
+    return;
+  }
+  reallocHook(newPtr, newSize, oldPtr, oldSize, site->localID, site->bbName,
+              site->funcName);
 }
 } // end extern "C"
@@ -1,8 +1,14 @@
 #ifndef ALLOCSITEHANDLER_H
 #define ALLOCSITEHANDLER_H
 
+#include "provsan_allocator.h"
 #include "provsan_common.h"
+#include "provsan_fault_log.h"
 #include "provsan_init.h"
+#include "provsan_site_profile.h"
+#include "provsan_site_table.h"
+#include "provsan_stack_depot.h"
+#include "provsan_stats.h"
 
 #include <cassert>
 #include <functional>
@@ -14,14 +20,22 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <utility>
+#include <vector>
 
 typedef int8_t *rust_ptr;
 extern "C" {
 extern bool __attribute__((weak)) is_safe_address(void *addr);
+// Provided by libprovsan_alloc when it is linked in.
+extern uintptr_t __attribute__((weak))
+provsan_alloc_site_of(void *addr, void **base, size_t *size);
 }
 
 namespace __provsan {
 
+// Callbacks of the allocator that tags allocations with their site, if one is
+// registered (see provsan_register_allocator).
+extern std::atomic<const provsan_allocator_ops *> AllocatorOps;
+
 /**
  * @brief A class for tracking allocation metadata for a given allocation site
  * in target source code.
@@ -37,6 +51,12 @@ namespace __provsan {
  * @param isRealloc Simple marker for determining if an allocation site is
  * an alloc call or a realloc call. Mostly used for confirming results of
  * traces.
+ * @param siteIndex Index of the allocation site in the site table.
+ * @param stackID Stack depot id of the call stack that reached the allocation
+ * site, or NO_STACK_ID when allocation stacks are disabled.
+ * @param allocTime TSC reading at allocation, for lifetime profiles.
+ * @param context Id of the call to an allocation wrapper the allocation was
+ * made through (see __provsan_alloc_context), 0 if none.
  *
  *
  * @note For each call to alloc (and realloc), an AllocSite will be created to
@@ -60,14 +80,24 @@ private:
   std::string funcName;
   uint32_t pkey;
   bool isRealloc;
+  uint32_t siteIndex;
+  uint32_t stackID;
+  uint64_t allocTime;
+  uint64_t context;
   AllocSite()
-      : ptr(nullptr), size(-1), localID(-1), pkey(0), isRealloc(false) {}
+      : ptr(nullptr), size(-1), localID(-1), pkey(0), isRealloc(false),
+        siteIndex(NO_SITE_INDEX), stackID(NO_STACK_ID), allocTime(0),
+        context(0) {}
 
 public:
   AllocSite(rust_ptr ptr, int64_t size, int64_t localID, std::string bbName,
-            std::string funcName, uint32_t pkey = 0, bool isRealloc = false)
+            std::string funcName, uint32_t pkey = 0, bool isRealloc = false,
+            uint32_t siteIndex = NO_SITE_INDEX, uint32_t stackID = NO_STACK_ID,
+            uint64_t context = 0)
       : ptr{ptr}, size{size}, localID{localID}, bbName{bbName},
-        funcName{funcName}, pkey{pkey}, isRealloc{isRealloc} {
+        funcName{funcName}, pkey{pkey}, isRealloc{isRealloc},
+        siteIndex{siteIndex}, stackID{stackID}, allocTime{__rdtsc()},
+        context{context} {
     assert(ptr != nullptr);
     assert(size > 0);
     assert(localID >= 0);
@@ -88,6 +118,8 @@ public:
 
   int64_t id() const { return localID; }
 
+  int64_t getSize() const { return size; }
+
   rust_ptr getPtr() const { return ptr; }
 
   bool isValid() { return (ptr != nullptr) && (size > 0) && (localID >= 0); }
@@ -101,15 +133,24 @@ public:
   // protected behind AllocSiteHandler's mutex.
   void addPkey(uint32_t faultPkey) { pkey = faultPkey; }
 
-  uint32_t getPkey() { return pkey; }
+  uint32_t getPkey() const { return pkey; }
 
   std::string getBBName() const { return bbName; }
 
   std::string getFuncName() const { return funcName; }
 
-  bool isReAlloc() { return isRealloc; }
+  bool isReAlloc() const { return isRealloc; }
+
+  uint32_t getSiteIndex() const { return siteIndex; }
+
+  uint32_t getStackID() const { return stackID; }
+
+  uint64_t getAllocTime() const { return allocTime; }
 
-  // Required for AllocSite to be hashable.
+  uint64_t getContext() const { return context; }
+
+  // Required for AllocSite to be hashable. Compares the site only, the stack
+  // and context of an allocation are recorded per site in FaultOrigins.
   bool operator==(const AllocSite &ac) const {
     return funcName.compare(ac.getFuncName()) == 0 &&
            bbName.compare(ac.getBBName()) == 0 && localID == ac.id();
@@ -151,6 +192,32 @@ template <> struct hash<__provsan::AllocSite> {
 
 namespace __provsan {
 
+/**
+ * @brief How the faulting allocations of a site were reached.
+ *
+ * @param stackIDs Allocation stacks (PROVSAN_ALLOC_STACKS) of the faulting
+ * allocations.
+ * @param contexts Wrapper calls the faulting allocations were made through.
+ * @param contextFree Set if any faulting allocation was made outside of a
+ * wrapper call.
+ */
+struct FaultOrigins {
+  std::set<uint32_t> stackIDs;
+  std::set<uint64_t> contexts;
+  bool contextFree = false;
+
+  void add(const AllocSite &site) {
+    if (site.getStackID() != NO_STACK_ID)
+      stackIDs.insert(site.getStackID());
+    if (site.getContext())
+      contexts.insert(site.getContext());
+    else
+      contextFree = true;
+  }
+};
+
+using fault_map_t = std::unordered_map<AllocSite, FaultOrigins>;
+
 /**
  * @brief A Class that handles mapping of pointers to allocation sites,
  * collecting the set of faulted allocation sites, and tracking PendingPKeyInfo
@@ -158,7 +225,8 @@ namespace __provsan {
  *
  * @param allocation_map Maps the pointer result from an alloc or realloc call
  * to its Allocation Site metadata.
- * @param fault_set Contains the set of faulted Allocation Sites.
+ * @param fault_set Contains the set of faulted Allocation Sites, each with the
+ * stacks and contexts its faulting allocations were made through.
  * @param pkey_by_tid_map Maps a given thread-id to its PendingPKeyInfo.
  * @param FM Maps Allocation Sites to their associated set.
  *
@@ -166,7 +234,8 @@ namespace __provsan {
  * all threads access the same handler and data can be synchronized between
  * threads. To handle synchronization and allow for concurrent operations on the
  * separate data fields, each of the listed parameters above have an associated
- * mutex.
+ * mutex. All mutexes are held across fork() (see lockForFork()), so that the
+ * child never inherits a lock owned by a thread that no longer exists.
  */
 class AllocSiteHandler {
   using alloc_set_t = std::unordered_set<AllocSite>;
@@ -178,7 +247,7 @@ private:
   // allocation_map mutex
   std::mutex alloc_map_mx;
   // Set of faulting AllocationSites
-  alloc_set_t fault_set;
+  fault_map_t fault_set;
   // Fault set mutex
   std::mutex fault_set_mx;
   // Mapping of thread-id to saved pkey information
@@ -190,6 +259,32 @@ private:
   realloc_map_t FM;
   // FM mutex
   std::mutex realloc_map_mx;
+  // Set once any allocation was added to allocation_map. Until then, frees
+  // skip the map entirely. Allocations tagged by a registered allocator are
+  // never added, see isAllocatorTagged.
+  std::atomic<bool> map_used{false};
+
+  // Adds a single site to the fault_set. Requires fault_set_mx to be held.
+  void recordFault(AllocSite &site, uint32_t pkey) {
+    site.addPkey(pkey);
+    // When sharing faults across forked workers, a site that any process has
+    // already faulted on is considered recorded.
+    if (sharedFaultsEnabled() && !markSiteFaulted(site.getSiteIndex(), pkey))
+      return;
+    // Stream newly discovered sites to the crash-safe fault log.
+    auto inserted = fault_set.emplace(site, FaultOrigins());
+    if (inserted.second)
+      appendFaultLog(site.id(), pkey, site.isReAlloc(), site.getBBName(),
+                     site.getFuncName());
+    inserted.first->second.add(site);
+#ifdef MPK_STATS
+    if (AllocSiteCount != 0) {
+      // Increment the count of the allocation faulting
+      assert((uint64_t)site.id() < AllocSiteCount && site.id() >= 0);
+      AllocSiteUseCounter[site.id()]++;
+    }
+#endif
+  }
 
 public:
   AllocSiteHandler() = default;
@@ -203,20 +298,57 @@ public:
   void insertAllocSite(rust_ptr ptr, AllocSite site) {
     // First, obtain the mutex lock to ensure safe addition of item to map.
     const std::lock_guard<std::mutex> alloc_map_guard(alloc_map_mx);
+    map_used.store(true, std::memory_order_relaxed);
 
     // Insert AllocationSite for given ptr.
     allocation_map.emplace(ptr, site);
+    if (Stats)
+      Stats->liveAllocations.store(allocation_map.size(),
+                                   std::memory_order_relaxed);
+  }
+
+  /// Inserts several allocations under a single acquisition of the map lock.
+  void
+  insertAllocSites(const std::vector<std::pair<rust_ptr, AllocSite>> &sites) {
+    const std::lock_guard<std::mutex> alloc_map_guard(alloc_map_mx);
+    map_used.store(true, std::memory_order_relaxed);
+
+    for (auto &entry : sites)
+      allocation_map.emplace(entry.first, entry.second);
+    if (Stats)
+      Stats->liveAllocations.store(allocation_map.size(),
+                                   std::memory_order_relaxed);
   }
 
   void removeAllocSite(rust_ptr ptr) {
+    if (!map_used.load(std::memory_order_relaxed))
+      return;
     // Obtain mutex lock.
     const std::lock_guard<std::mutex> alloc_map_guard(alloc_map_mx);
 
-    // Remove AllocationSite for given ptr.
-    allocation_map.erase(ptr);
+    // Remove AllocationSite for given ptr, ending its lifetime.
+    auto iter = allocation_map.find(ptr);
+    if (iter == allocation_map.end())
+      return;
+    recordSiteLifetime(iter->second.getSiteIndex(),
+                       __rdtsc() - iter->second.getAllocTime());
+    allocation_map.erase(iter);
+    if (Stats)
+      Stats->liveAllocations.store(allocation_map.size(),
+                                   std::memory_order_relaxed);
+  }
+
+  /// Counts the allocations that are still tracked in the lifetime profiles
+  /// of their sites. Called once, when the profile is written.
+  void recordLiveAtExit() {
+    const std::lock_guard<std::mutex> alloc_map_guard(alloc_map_mx);
+    for (auto &entry : allocation_map)
+      recordSiteLiveAtExit(entry.second.getSiteIndex());
   }
 
   AllocSite getAllocSite(rust_ptr ptr) {
+    if (!map_used.load(std::memory_order_relaxed))
+      return AllocSite::error();
     // Obtain mutex lock.
     const std::lock_guard<std::mutex> alloc_map_guard(alloc_map_mx);
 
@@ -252,9 +384,60 @@ public:
     return AllocSite::error();
   }
 
-  // Add a faulting allocation site to the fault_set with the given pkey.
-  void addFaultAlloc(rust_ptr ptr, uint32_t pkey) {
-    auto alloc = getAllocSite(ptr);
+  /// Looks up the site owning the page of ptr when the compartment allocator
+  /// segregates sites (PROVSAN_SEGREGATE_SITES). This is O(1), and exact even
+  /// for addresses that are not inside a live allocation.
+  AllocSite getPageSite(rust_ptr ptr) {
+    if (!provsan_alloc_site_of)
+      return AllocSite::error();
+    void *base;
+    size_t size;
+    uintptr_t tag = provsan_alloc_site_of(ptr, &base, &size);
+    return siteFromEntry(lookupSiteTag(tag), base, size);
+  }
+
+  /// Looks up the site stored in the metadata of a registered allocator.
+  AllocSite getAllocatorSite(rust_ptr ptr) {
+    auto *ops = AllocatorOps.load(std::memory_order_acquire);
+    if (!ops)
+      return AllocSite::error();
+    void *base;
+    size_t size;
+    uint32_t index = ops->lookup(ptr, &base, &size);
+    return siteFromEntry(index, base, size);
+  }
+
+  /// Returns true if ptr is the start of an allocation tagged by the
+  /// registered allocator, which is then not in allocation_map. Lock free.
+  bool isAllocatorTagged(rust_ptr ptr) {
+    auto *ops = AllocatorOps.load(std::memory_order_acquire);
+    if (!ops)
+      return false;
+    void *base;
+    size_t size;
+    return ops->lookup(ptr, &base, &size) != PROVSAN_NO_SITE && base == ptr;
+  }
+
+  /// Builds an AllocSite for the allocation [base, base + size) from the site
+  /// table, or returns an error AllocSite if index is not a registered site.
+  static AllocSite siteFromEntry(uint32_t index, void *base, size_t size) {
+    SiteEntry *entry = getSiteEntry(index);
+    if (!entry ||
+        entry->ready.load(std::memory_order_acquire) != SITE_ENTRY_READY ||
+        !base || !size)
+      return AllocSite::error();
+    return AllocSite((rust_ptr)base, size, entry->localID, siteBBName(*entry),
+                     siteFuncName(*entry), 0, entry->isRealloc, index);
+  }
+
+  // Add a faulting allocation site to the fault_set with the given pkey, and
+  // return it.
+  AllocSite addFaultAlloc(rust_ptr ptr, uint32_t pkey) {
+    auto alloc = getAllocatorSite(ptr);
+    if (!alloc.isValid())
+      alloc = getPageSite(ptr);
+    if (!alloc.isValid())
+      alloc = getAllocSite(ptr);
     REPORT("INFO : Getting AllocSite : id(%ld), ptr(%p)\n", alloc.id(),
            alloc.getPtr());
 
@@ -262,43 +445,27 @@ public:
     // not returned.
     if (!alloc.isValid()) {
       REPORT("INFO : AllocSite is not valid, will not add it to Fault Set.\n");
-      return;
-    }
-
-#ifdef MPK_STATS
-    if (AllocSiteCount != 0) {
-      // Increment the count of the allocation faulting
-      assert((uint64_t)alloc.id() < AllocSiteCount && alloc.id() >= 0);
-      AllocSiteUseCounter[alloc.id()]++;
+      return alloc;
     }
-#endif
 
     // Add faulted allocation to fault_set
     const std::lock_guard<std::mutex> fault_set_insertion_guard(fault_set_mx);
-    alloc.addPkey(pkey);
-    fault_set.insert(alloc);
+    recordFault(alloc, pkey);
 
     // Note: no other code tries to take this lock and also lock the fault map
     // if that changes, the locking logic will need to be updated
     const std::lock_guard<std::mutex> guard(realloc_map_mx);
     auto it = FM.find(alloc);
     if (it == FM.end()) {
-      return;
+      return alloc;
     }
 
     // For each Allocation Site in the associated set, add them to the fault_set
     // as well. Thus if a reallocated pointer faults, all associated allocation
     // sites are also marked as being unsafe.
-    for (auto assoc : it->second) {
-      assoc.addPkey(pkey);
-      fault_set.insert(assoc);
-#ifdef MPK_STATS
-      if (AllocSiteCount != 0) {
-        assert((uint64_t)assoc.id() < AllocSiteCount && assoc.id() >= 0);
-        AllocSiteUseCounter[assoc.id()]++;
-      }
-#endif
-    }
+    for (auto assoc : it->second)
+      recordFault(assoc, pkey);
+    return alloc;
   }
 
   /// For single instruction stepping, this function will store a given PKey's
@@ -327,7 +494,7 @@ public:
     return ret_val;
   }
 
-  std::unordered_set<AllocSite> &faultingAllocs() {
+  fault_map_t &faultingAllocs() {
     const std::lock_guard<std::mutex> fault_set_guard(fault_set_mx);
     return fault_set;
   }
@@ -347,11 +514,44 @@ public:
     realloc_chain.emplace(oldAS);
     FM.emplace(newAS, realloc_chain);
   }
+
+  /// pthread_atfork handlers. All handler mutexes are taken before fork() and
+  /// released again in both the parent and the child.
+  void lockForFork() {
+    alloc_map_mx.lock();
+    fault_set_mx.lock();
+    realloc_map_mx.lock();
+    pkey_tid_map_mx.lock();
+  }
+
+  void unlockAfterFork(bool isChild) {
+    // Pending single step state belongs to threads that do not exist in the
+    // child.
+    if (isChild)
+      pkey_by_tid_map.clear();
+    pkey_tid_map_mx.unlock();
+    realloc_map_mx.unlock();
+    fault_set_mx.unlock();
+    alloc_map_mx.unlock();
+  }
 };
 
 } // namespace __provsan
 
+/// An allocation buffered by a loop instrumented with batched hooks, see
+/// DynUntrustedAllocPre.
+struct HookBatchEntry {
+  rust_ptr ptr;
+  int64_t size;
+};
+
 extern "C" {
+/// Set by code instrumented by ProvsanPost around calls to allocation
+/// wrappers, to the id of the call. Allocations record it as their context, so
+/// that only the faulting callers of a wrapper are patched.
+extern __attribute__((visibility("default"), tls_model("initial-exec")))
+__thread uint64_t __provsan_alloc_context;
+
 __attribute__((visibility("default"))) void
 allocHook(rust_ptr ptr, int64_t size, int64_t localID, const char *bbName,
           const char *funcName);
@@ -360,5 +560,20 @@ reallocHook(rust_ptr newPtr, int64_t newSize, rust_ptr oldPtr, int64_t oldSize,
             int64_t localID, const char *bbName, const char *funcName);
 __attribute__((visibility("default"))) void
 deallocHook(rust_ptr ptr, int64_t size, int64_t localID);
+
+/// Registers count allocations made at the same site, buffered by a loop that
+/// does not call out of the compartment before flushing them.
+__attribute__((visibility("default"))) void
+allocHookBatch(const HookBatchEntry *entries, int64_t count, int64_t localID,
+               const char *bbName, const char *funcName);
+
+/// Compact hooks, emitted by ProvsanPost with PROVSAN_COMPACT_HOOKS=1. The
+/// site is found from the return address of the hook call, through the site
+/// tables registered with provsan_register_site_pcs.
+__attribute__((visibility("default"))) void allocHookPC(rust_ptr ptr,
+                                                        int64_t size);
+__attribute__((visibility("default"))) void
+reallocHookPC(rust_ptr newPtr, int64_t newSize, rust_ptr oldPtr,
+              int64_t oldSize);
 }
 #endif
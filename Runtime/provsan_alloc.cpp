@@ -0,0 +1,746 @@
+#include "provsan_alloc.h"
+#include "provsan_allocator.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace __provsan {
+
+// Smallest alignment of every object.
+#define ALLOC_MIN_ALIGN 16
+#define ALLOC_PAGE_SIZE 4096
+
+/**
+ * @param base/end The address space reserved for the compartment.
+ * @param nextSpan Offset of the next span to carve.
+ * @param spanClass Size class + 1 of every carved span, 0 for unused spans.
+ * @param spanHeap Site heap index + 1 of every segregated span, 0 otherwise.
+ * @param siteTags Runtime site ID + 1 of the object starting at every
+ * ALLOC_MIN_ALIGN granule, when PROVSAN_ALLOC_SITE_TAGS is set.
+ */
+struct Region {
+  char *base;
+  char *end;
+  std::atomic<uint64_t> nextSpan;
+  uint8_t *spanClass;
+  uint32_t *spanHeap;
+  uint32_t *siteTags;
+  int pkey;
+};
+
+/// Objects shared between threads for one compartment and size class. Free
+/// objects are kept in a list, and new objects are carved lazily from
+/// [cursor, end) so that fresh spans are not touched until they are used.
+struct CentralList {
+  std::mutex lock;
+  void *head;
+  uint32_t count;
+  char *cursor;
+  char *end;
+};
+
+struct FreeList {
+  void *head;
+  uint32_t count;
+};
+
+struct ThreadCache {
+  FreeList lists[NUM_COMPARTMENTS][ALLOC_NUM_CLASSES];
+  bool registered;
+};
+
+/// The spans of a single allocation site (or of several, once all heaps are
+/// taken). site is the first site of the heap, shared is set once other sites
+/// use it as well.
+struct SiteHeap {
+  std::atomic<uintptr_t> site;
+  std::atomic<bool> shared;
+  CentralList lists[ALLOC_NUM_CLASSES];
+};
+
+/// A large allocation, mapped on its own. Kept out of band, as the untrusted
+/// compartment can write to the memory around its allocations.
+struct LargeAlloc {
+  void *mapping;
+  size_t length;
+  size_t usable;
+  Compartment compartment;
+};
+
+static Region Regions[NUM_COMPARTMENTS];
+static CentralList Central[NUM_COMPARTMENTS][ALLOC_NUM_CLASSES];
+static uint32_t ClassSize[ALLOC_NUM_CLASSES];
+static uint32_t ClassBatch[ALLOC_NUM_CLASSES];
+#define PROVSAN_COUNT_CLASS(cls) +1
+static_assert(0 PROVSAN_FOR_EACH_SIZE_CLASS(PROVSAN_COUNT_CLASS) ==
+                  ALLOC_NUM_CLASSES,
+              "PROVSAN_FOR_EACH_SIZE_CLASS must list every size class");
+#undef PROVSAN_COUNT_CLASS
+// Size class of every size, in ALLOC_MIN_ALIGN steps.
+static uint8_t ClassIndex[ALLOC_MAX_SMALL / ALLOC_MIN_ALIGN + 1];
+
+static bool SegregateSites = false;
+static SiteHeap *SiteHeaps = nullptr;
+
+// Large allocations by address.
+static std::mutex LargeLock;
+static std::map<void *, LargeAlloc> LargeAllocs;
+
+static std::atomic<bool> AllocInitialized(false);
+static std::once_flag AllocInitFlag;
+static pthread_key_t ThreadCacheKey;
+
+// The library may be loaded with dlopen, so the cache cannot use the static
+// TLS block of the initial-exec model.
+static thread_local ThreadCache Cache;
+
+static inline uint32_t rdpkru() {
+  uint32_t eax, edx;
+  asm volatile(".byte 0x0f,0x01,0xee" : "=a"(eax), "=d"(edx) : "c"(0));
+  return eax;
+}
+
+static inline void wrpkru(uint32_t pkru) {
+  asm volatile(".byte 0x0f,0x01,0xef" : : "a"(pkru), "c"(0), "d"(0)
+               : "memory");
+}
+
+/// Grants the current thread access to a compartment's pkey for the lifetime
+/// of the scope. The default pkey 0 is always accessible.
+class AccessScope {
+  uint32_t saved;
+  bool restore;
+
+public:
+  AccessScope(int pkey) : saved(0), restore(false) {
+    if (pkey <= 0)
+      return;
+    saved = rdpkru();
+    uint32_t mask = 3U << (2 * pkey);
+    if (saved & mask) {
+      wrpkru(saved & ~mask);
+      restore = true;
+    }
+  }
+
+  ~AccessScope() {
+    if (restore)
+      wrpkru(saved);
+  }
+};
+
+static void flushThreadCache(void *arg);
+
+static void initSizeClasses() {
+  // 16 byte steps up to 128 bytes, then four classes per power of two.
+  // ProvsanPost computes the same classes for constant-size sites, see
+  // getSizeClass in DynUntrustedAllocPost.cpp.
+  unsigned cls = 0;
+  for (uint32_t size = ALLOC_MIN_ALIGN; size <= 128; size += ALLOC_MIN_ALIGN)
+    ClassSize[cls++] = size;
+  for (uint32_t base = 128; base < ALLOC_MAX_SMALL; base *= 2)
+    for (uint32_t step = 1; step <= 4; ++step)
+      ClassSize[cls++] = base + step * (base / 4);
+
+  unsigned index = 0;
+  for (cls = 0; cls < ALLOC_NUM_CLASSES; ++cls) {
+    for (; index * ALLOC_MIN_ALIGN <= ClassSize[cls]; ++index)
+      ClassIndex[index] = cls;
+    // Move roughly 16 KiB per exchange with the central list.
+    ClassBatch[cls] = std::clamp<uint32_t>((16 << 10) / ClassSize[cls], 4, 64);
+  }
+}
+
+static int readPkey(const char *env, int fallback) {
+  if (const char *value = getenv(env))
+    return atoi(value);
+  return fallback;
+}
+
+static void initAllocator() {
+  initSizeClasses();
+
+  uint64_t regionSize = ALLOC_DEFAULT_REGION_SIZE;
+  if (const char *size = getenv("PROVSAN_ALLOC_REGION_SIZE"))
+    regionSize = strtoull(size, nullptr, 0);
+  regionSize = std::max<uint64_t>(
+      (regionSize + ALLOC_SPAN_SIZE - 1) & ~(uint64_t)(ALLOC_SPAN_SIZE - 1),
+      ALLOC_SPAN_SIZE);
+
+  int trustedPkey = readPkey("PROVSAN_TRUSTED_PKEY", -1);
+  if (trustedPkey < 0)
+    trustedPkey = pkey_alloc(0, 0);
+  if (trustedPkey < 0) {
+    REPORT("ERROR : Unable to allocate a pkey for the trusted compartment, "
+           "falling back to the default pkey.\n");
+    trustedPkey = 0;
+  }
+  Regions[TRUSTED].pkey = trustedPkey;
+  Regions[UNTRUSTED].pkey = readPkey("PROVSAN_UNTRUSTED_PKEY", 0);
+
+  for (auto &region : Regions) {
+    // Reserve an extra span so the region can be aligned to the span size.
+    // Spans are only made accessible once they are carved.
+    void *mapping =
+        mmap(nullptr, regionSize + ALLOC_SPAN_SIZE, PROT_NONE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    uint64_t spans = regionSize / ALLOC_SPAN_SIZE;
+    void *classes = mmap(nullptr, spans * (sizeof(uint8_t) + sizeof(uint32_t)),
+                         PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mapping == MAP_FAILED || classes == MAP_FAILED) {
+      REPORT("ERROR : Unable to reserve allocator region.\n");
+      continue;
+    }
+    uintptr_t base = ((uintptr_t)mapping + ALLOC_SPAN_SIZE - 1) &
+                     ~(uintptr_t)(ALLOC_SPAN_SIZE - 1);
+    region.base = (char *)base;
+    region.end = region.base + regionSize;
+    region.spanClass = static_cast<uint8_t *>(classes);
+    region.spanHeap =
+        reinterpret_cast<uint32_t *>(region.spanClass + spans);
+  }
+
+  const char *tags = getenv("PROVSAN_ALLOC_SITE_TAGS");
+  if (tags && atoi(tags) != 0 && Regions[TRUSTED].base) {
+    // Only the pages holding tags of live objects are ever backed.
+    void *mapping = mmap(nullptr, regionSize / ALLOC_MIN_ALIGN * sizeof(uint32_t),
+                         PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mapping == MAP_FAILED)
+      REPORT("ERROR : Unable to map site tags.\n");
+    else
+      Regions[TRUSTED].siteTags = static_cast<uint32_t *>(mapping);
+  }
+
+  const char *segregate = getenv("PROVSAN_SEGREGATE_SITES");
+  if (segregate && atoi(segregate) != 0) {
+    // SiteHeaps hold mutexes, which are valid when zero filled.
+    void *heaps = mmap(nullptr, ALLOC_SITE_HEAPS * sizeof(SiteHeap),
+                       PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (heaps == MAP_FAILED) {
+      REPORT("ERROR : Unable to map site heaps.\n");
+    } else {
+      SiteHeaps = static_cast<SiteHeap *>(heaps);
+      SegregateSites = true;
+    }
+  }
+
+  pthread_key_create(&ThreadCacheKey, flushThreadCache);
+  AllocInitialized.store(true, std::memory_order_release);
+  REPORT("INFO : Allocator regions use pkeys %d (trusted) and %d "
+         "(untrusted).\n",
+         Regions[TRUSTED].pkey, Regions[UNTRUSTED].pkey);
+}
+
+static inline void ensureInitialized() {
+  if (__builtin_expect(!AllocInitialized.load(std::memory_order_acquire), 0))
+    std::call_once(AllocInitFlag, initAllocator);
+}
+
+// Returns the compartment whose region contains ptr, or NUM_COMPARTMENTS for
+// large (or foreign) allocations.
+static inline unsigned regionOf(void *ptr) {
+  for (unsigned c = 0; c < NUM_COMPARTMENTS; ++c)
+    if (ptr >= Regions[c].base && ptr < Regions[c].end)
+      return c;
+  return NUM_COMPARTMENTS;
+}
+
+static inline unsigned spanClassOf(unsigned compartment, void *ptr) {
+  Region &region = Regions[compartment];
+  return region.spanClass[((char *)ptr - region.base) / ALLOC_SPAN_SIZE] - 1;
+}
+
+// Carves a new span for the central list, owned by the given site heap (+ 1)
+// if any. Requires central.lock.
+static bool carveSpan(unsigned compartment, unsigned cls, CentralList &central,
+                      uint32_t heap = 0) {
+  Region &region = Regions[compartment];
+  if (!region.base)
+    return false;
+  uint64_t offset =
+      region.nextSpan.fetch_add(ALLOC_SPAN_SIZE, std::memory_order_relaxed);
+  if (region.base + offset + ALLOC_SPAN_SIZE > region.end) {
+    REPORT("ERROR : Allocator region exhausted.\n");
+    return false;
+  }
+
+  char *span = region.base + offset;
+  // The whole span is tagged with a single system call. A pkey of -1 leaves
+  // the span on the default key, even without MPK support.
+  if (pkey_mprotect(span, ALLOC_SPAN_SIZE, PROT_READ | PROT_WRITE,
+                    region.pkey > 0 ? region.pkey : -1) == -1) {
+    REPORT("ERROR : Unable to protect span %p.\n", span);
+    return false;
+  }
+  region.spanClass[offset / ALLOC_SPAN_SIZE] = cls + 1;
+  region.spanHeap[offset / ALLOC_SPAN_SIZE] = heap;
+  central.cursor = span;
+  central.end = span + (ALLOC_SPAN_SIZE / ClassSize[cls]) * ClassSize[cls];
+  return true;
+}
+
+// Free list links are stored in the free objects themselves, where the
+// untrusted compartment can overwrite them. A link is only followed if it
+// points to an object of the same size class, in a carved span of the same
+// heap (+ 1, or 0 for the shared lists).
+static inline bool validLink(unsigned compartment, unsigned cls, uint32_t heap,
+                             void *next) {
+  if (!next)
+    return true;
+  Region &region = Regions[compartment];
+  if (next < region.base ||
+      next >= region.base + region.nextSpan.load(std::memory_order_relaxed))
+    return false;
+  uint64_t offset = (char *)next - region.base;
+  uint64_t span = offset / ALLOC_SPAN_SIZE;
+  uint64_t inSpan = offset % ALLOC_SPAN_SIZE;
+  return region.spanClass[span] == cls + 1 && region.spanHeap[span] == heap &&
+         inSpan % ClassSize[cls] == 0 &&
+         inSpan < (ALLOC_SPAN_SIZE / ClassSize[cls]) * ClassSize[cls];
+}
+
+// Pops the first object of a free list. A corrupt link drops the rest of the
+// list, leaking its objects instead of handing out arbitrary memory.
+static inline void *popFree(unsigned compartment, unsigned cls, void *&head,
+                            uint32_t &count, uint32_t heap = 0) {
+  void *obj = head;
+  if (!obj)
+    return nullptr;
+  void *next = *(void **)obj;
+  if (!validLink(compartment, cls, heap, next)) {
+    REPORT("ERROR : Corrupt free list link %p in %p, dropping %u objects.\n",
+           next, obj, count - 1);
+    next = nullptr;
+    count = 1;
+  }
+  head = next;
+  --count;
+  return obj;
+}
+
+static inline void pushFree(void *obj, void *&head, uint32_t &count) {
+  *(void **)obj = head;
+  head = obj;
+  ++count;
+}
+
+// Moves a batch of objects from the central list into the thread cache.
+// Requires access to the compartment's pkey.
+static void refill(unsigned compartment, unsigned cls, FreeList &list) {
+  CentralList &central = Central[compartment][cls];
+  const std::lock_guard<std::mutex> guard(central.lock);
+
+  uint32_t wanted = ClassBatch[cls];
+  while (wanted && central.head) {
+    pushFree(popFree(compartment, cls, central.head, central.count), list.head,
+             list.count);
+    --wanted;
+  }
+
+  while (wanted) {
+    if (central.cursor == central.end &&
+        !carveSpan(compartment, cls, central))
+      return;
+    void *obj = central.cursor;
+    central.cursor += ClassSize[cls];
+    pushFree(obj, list.head, list.count);
+    --wanted;
+  }
+}
+
+// Returns up to count objects from the thread cache to the central list.
+// Requires access to the compartment's pkey.
+static void release(unsigned compartment, unsigned cls, FreeList &list,
+                    uint32_t count) {
+  CentralList &central = Central[compartment][cls];
+  const std::lock_guard<std::mutex> guard(central.lock);
+  while (count-- && list.head)
+    pushFree(popFree(compartment, cls, list.head, list.count), central.head,
+             central.count);
+}
+
+static void flushThreadCache(void *arg) {
+  auto *cache = static_cast<ThreadCache *>(arg);
+  for (unsigned c = 0; c < NUM_COMPARTMENTS; ++c) {
+    AccessScope scope(Regions[c].pkey);
+    for (unsigned cls = 0; cls < ALLOC_NUM_CLASSES; ++cls)
+      release(c, cls, cache->lists[c][cls], UINT32_MAX);
+  }
+}
+
+static inline ThreadCache &threadCache() {
+  if (__builtin_expect(!Cache.registered, 0)) {
+    // Hand the cache back to the central lists when the thread exits.
+    Cache.registered = true;
+    pthread_setspecific(ThreadCacheKey, &Cache);
+  }
+  return Cache;
+}
+
+// Returns the index of the heap for the given site, claiming a free heap for
+// new sites.
+static uint32_t siteHeapIndex(uintptr_t site) {
+  uint64_t hash = site * 0x9E3779B97F4A7C15ULL;
+  for (uint32_t probe = 0; probe < ALLOC_SITE_HEAPS; ++probe) {
+    uint32_t index = (hash + probe) % ALLOC_SITE_HEAPS;
+    std::atomic<uintptr_t> &owner = SiteHeaps[index].site;
+    uintptr_t current = owner.load(std::memory_order_acquire);
+    if (current == 0 &&
+        owner.compare_exchange_strong(current, site, std::memory_order_acq_rel))
+      return index;
+    if (current == site)
+      return index;
+  }
+  // All heaps are taken, share one. Its pages no longer identify a site.
+  REPORT("INFO : Out of site heaps, site %lx shares a heap.\n", site);
+  uint32_t index = hash % ALLOC_SITE_HEAPS;
+  SiteHeaps[index].shared.store(true, std::memory_order_relaxed);
+  return index;
+}
+
+// Allocates from the site's own spans. Requires access to the trusted pkey.
+static void *segregatedAlloc(uintptr_t site, unsigned cls) {
+  uint32_t heap = siteHeapIndex(site);
+  CentralList &central = SiteHeaps[heap].lists[cls];
+  const std::lock_guard<std::mutex> guard(central.lock);
+  if (void *obj =
+          popFree(TRUSTED, cls, central.head, central.count, heap + 1))
+    return obj;
+  if (central.cursor == central.end &&
+      !carveSpan(TRUSTED, cls, central, heap + 1))
+    return nullptr;
+  void *obj = central.cursor;
+  central.cursor += ClassSize[cls];
+  return obj;
+}
+
+// Returns an object to its site's heap. Requires access to the trusted pkey.
+static void segregatedFree(uint32_t heap, unsigned cls, void *ptr) {
+  CentralList &central = SiteHeaps[heap - 1].lists[cls];
+  const std::lock_guard<std::mutex> guard(central.lock);
+  pushFree(ptr, central.head, central.count);
+}
+
+// Returns the slot holding the site tag of the object containing ptr, or
+// nullptr if ptr is not in a tagged span. Sets base and size to the bounds of
+// the object.
+static inline uint32_t *siteTagOf(void *ptr, char *&base, size_t &size) {
+  Region &region = Regions[TRUSTED];
+  if (!region.siteTags || ptr < region.base || ptr >= region.end)
+    return nullptr;
+  uint64_t offset = (char *)ptr - region.base;
+  uint8_t cls = region.spanClass[offset / ALLOC_SPAN_SIZE];
+  if (!cls)
+    return nullptr;
+  size = ClassSize[cls - 1];
+  base = (char *)ptr - (offset % ALLOC_SPAN_SIZE) % size;
+  return &region.siteTags[(base - region.base) / ALLOC_MIN_ALIGN];
+}
+
+// A new object must not inherit the site of a previous object at the same
+// address, in case its allocation is not tagged by the runtime.
+static inline void clearSiteTag(void *obj) {
+  char *base;
+  size_t size;
+  if (uint32_t *tag = siteTagOf(obj, base, size))
+    __atomic_store_n(tag, 0, __ATOMIC_RELAXED);
+}
+
+static int setSiteTag(void *ptr, uint32_t site) {
+  char *base;
+  size_t size;
+  uint32_t *tag = siteTagOf(ptr, base, size);
+  if (!tag || base != ptr)
+    return 0;
+  __atomic_store_n(tag, site + 1, __ATOMIC_RELAXED);
+  return 1;
+}
+
+// Runs in the runtime's fault handler, only reads the span and tag tables.
+static uint32_t lookupSiteTag(void *addr, void **base, size_t *size) {
+  char *object;
+  size_t objectSize;
+  uint32_t *tag = siteTagOf(addr, object, objectSize);
+  uint32_t site = tag ? __atomic_load_n(tag, __ATOMIC_RELAXED) : 0;
+  if (!site)
+    return PROVSAN_NO_SITE;
+  if (base)
+    *base = object;
+  if (size)
+    *size = objectSize;
+  return site - 1;
+}
+
+static const provsan_allocator_ops SiteTagOps = {setSiteTag, lookupSiteTag};
+
+static void *largeAlloc(Compartment compartment, size_t size, size_t align) {
+  align = std::max<size_t>(align, ALLOC_PAGE_SIZE);
+  size_t usable = (size + ALLOC_PAGE_SIZE - 1) & ~(size_t)(ALLOC_PAGE_SIZE - 1);
+  size_t length = usable + (align > ALLOC_PAGE_SIZE ? align : 0);
+  void *mapping = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED)
+    return nullptr;
+  int pkey = Regions[compartment].pkey;
+  if (pkey > 0 &&
+      pkey_mprotect(mapping, length, PROT_READ | PROT_WRITE, pkey) == -1) {
+    // Handing out the memory on the default key would silently move it out
+    // of its compartment.
+    REPORT("ERROR : Unable to protect large allocation %p.\n", mapping);
+    munmap(mapping, length);
+    return nullptr;
+  }
+
+  uintptr_t user = ((uintptr_t)mapping + align - 1) & ~(uintptr_t)(align - 1);
+  const std::lock_guard<std::mutex> guard(LargeLock);
+  LargeAllocs[(void *)user] = {mapping, length, usable, compartment};
+  return (void *)user;
+}
+
+// Finds the large allocation starting at ptr, which may belong to either
+// compartment.
+static bool findLargeAlloc(void *ptr, LargeAlloc &large, bool remove = false) {
+  const std::lock_guard<std::mutex> guard(LargeLock);
+  auto iter = LargeAllocs.find(ptr);
+  if (iter == LargeAllocs.end())
+    return false;
+  large = iter->second;
+  if (remove)
+    LargeAllocs.erase(iter);
+  return true;
+}
+
+int allocPkey(Compartment compartment) {
+  ensureInitialized();
+  return Regions[compartment].pkey;
+}
+
+void *compartmentAlloc(Compartment compartment, size_t size, size_t align,
+                       bool zero, uintptr_t site) {
+  ensureInitialized();
+  if (size == 0)
+    size = 1;
+
+  if (align > ALLOC_MIN_ALIGN) {
+    // Power of two classes hold objects aligned to their size.
+    size_t rounded = 1;
+    while (rounded < std::max(size, align))
+      rounded <<= 1;
+    if (align > ALLOC_PAGE_SIZE || rounded > ALLOC_MAX_SMALL)
+      return largeAlloc(compartment, size, align);
+    size = rounded;
+  }
+  if (size > ALLOC_MAX_SMALL)
+    return largeAlloc(compartment, size, align);
+
+  unsigned cls = ClassIndex[(size + ALLOC_MIN_ALIGN - 1) / ALLOC_MIN_ALIGN];
+  return classAlloc(compartment, cls, size, zero, site);
+}
+
+void *classAlloc(Compartment compartment, unsigned cls, size_t size, bool zero,
+                 uintptr_t site) {
+  AccessScope scope(Regions[compartment].pkey);
+  if (SegregateSites && compartment == TRUSTED && site) {
+    void *obj = segregatedAlloc(site, cls);
+    if (obj && zero)
+      memset(obj, 0, size);
+    if (obj)
+      clearSiteTag(obj);
+    return obj;
+  }
+
+  FreeList &list = threadCache().lists[compartment][cls];
+  if (!list.head)
+    refill(compartment, cls, list);
+  void *obj = popFree(compartment, cls, list.head, list.count);
+  if (!obj)
+    return nullptr;
+  if (zero)
+    memset(obj, 0, size);
+  if (compartment == TRUSTED)
+    clearSiteTag(obj);
+  return obj;
+}
+
+void compartmentFree(void *ptr) {
+  if (!ptr)
+    return;
+  ensureInitialized();
+
+  unsigned compartment = regionOf(ptr);
+  if (compartment == NUM_COMPARTMENTS) {
+    LargeAlloc large;
+    if (!findLargeAlloc(ptr, large, /*remove=*/true)) {
+      REPORT("ERROR : Freeing unknown pointer %p.\n", ptr);
+      return;
+    }
+    munmap(large.mapping, large.length);
+    return;
+  }
+
+  unsigned cls = spanClassOf(compartment, ptr);
+  AccessScope scope(Regions[compartment].pkey);
+  Region &region = Regions[compartment];
+  if (uint32_t heap =
+          region.spanHeap[((char *)ptr - region.base) / ALLOC_SPAN_SIZE]) {
+    segregatedFree(heap, cls, ptr);
+    return;
+  }
+
+  FreeList &list = threadCache().lists[compartment][cls];
+  pushFree(ptr, list.head, list.count);
+  if (list.count > ALLOC_MAX_CACHED)
+    release(compartment, cls, list, ClassBatch[cls]);
+}
+
+size_t allocUsableSize(void *ptr) {
+  if (!ptr)
+    return 0;
+  ensureInitialized();
+  unsigned compartment = regionOf(ptr);
+  if (compartment != NUM_COMPARTMENTS)
+    return ClassSize[spanClassOf(compartment, ptr)];
+  LargeAlloc large;
+  return findLargeAlloc(ptr, large) ? large.usable : 0;
+}
+
+void *compartmentRealloc(Compartment compartment, void *ptr, size_t newSize,
+                         size_t align, uintptr_t site) {
+  if (!ptr)
+    return compartmentAlloc(compartment, newSize, align, false, site);
+
+  // Reallocated memory stays in the compartment it was allocated from.
+  ensureInitialized();
+  unsigned owner = regionOf(ptr);
+  LargeAlloc large;
+  if (owner == NUM_COMPARTMENTS && findLargeAlloc(ptr, large))
+    owner = large.compartment;
+  if (owner != NUM_COMPARTMENTS)
+    compartment = (Compartment)owner;
+
+  // Keep the object if it still fits and is not mostly empty.
+  size_t usable = allocUsableSize(ptr);
+  if (newSize <= usable && newSize > usable / 2)
+    return ptr;
+
+  void *moved = compartmentAlloc(compartment, newSize, align, false, site);
+  if (!moved)
+    return nullptr;
+  {
+    AccessScope scope(Regions[compartment].pkey);
+    memcpy(moved, ptr, std::min(usable, newSize));
+  }
+  compartmentFree(ptr);
+  return moved;
+}
+
+} // namespace __provsan
+
+using namespace __provsan;
+
+extern "C" {
+uint8_t *trusted_malloc(size_t size, size_t align) {
+  return provsan_trusted_malloc_at(size, align,
+                                   (uintptr_t)__builtin_return_address(0));
+}
+
+uint8_t *trusted_realloc(uint8_t *ptr, size_t oldSize, size_t align,
+                         size_t newSize) {
+  return provsan_trusted_realloc_at(ptr, oldSize, align, newSize,
+                                    (uintptr_t)__builtin_return_address(0));
+}
+
+uint8_t *provsan_trusted_malloc_at(size_t size, size_t align, uintptr_t site) {
+  return (uint8_t *)compartmentAlloc(TRUSTED, size, align, false, site);
+}
+
+uint8_t *provsan_trusted_realloc_at(uint8_t *ptr, size_t oldSize, size_t align,
+                                    size_t newSize, uintptr_t site) {
+  (void)oldSize;
+  return (uint8_t *)compartmentRealloc(TRUSTED, ptr, newSize, align, site);
+}
+
+void trusted_free(uint8_t *ptr, size_t size, size_t align) {
+  (void)size;
+  (void)align;
+  compartmentFree(ptr);
+}
+
+uint8_t *untrusted_malloc(size_t size, size_t align) {
+  return (uint8_t *)compartmentAlloc(UNTRUSTED, size, align);
+}
+
+uint8_t *untrusted_realloc(uint8_t *ptr, size_t oldSize, size_t align,
+                           size_t newSize) {
+  (void)oldSize;
+  return (uint8_t *)compartmentRealloc(UNTRUSTED, ptr, newSize, align);
+}
+
+void untrusted_free(uint8_t *ptr, size_t size, size_t align) {
+  (void)size;
+  (void)align;
+  compartmentFree(ptr);
+}
+
+// ProvsanPost redirects a site with a constant size and alignment to the entry
+// point of its size class, leaving both arguments in place. Objects of a class
+// are aligned to at least 16 bytes, and Post puts over-aligned sizes in the
+// power of two class of max(size, align), whose objects are aligned to their
+// size, so the alignment is implied by cls and can be ignored here.
+#define PROVSAN_UNTRUSTED_CLASS_ALLOC(cls)                                     \
+  uint8_t *untrusted_malloc_c##cls(size_t size, size_t align) {                \
+    (void)align;                                                               \
+    ensureInitialized();                                                       \
+    return (uint8_t *)classAlloc(UNTRUSTED, cls, size);                        \
+  }
+PROVSAN_FOR_EACH_SIZE_CLASS(PROVSAN_UNTRUSTED_CLASS_ALLOC)
+#undef PROVSAN_UNTRUSTED_CLASS_ALLOC
+
+uint8_t *__rust_untrusted_alloc(size_t size, size_t align) {
+  return (uint8_t *)compartmentAlloc(UNTRUSTED, size, align);
+}
+
+uint8_t *__rust_untrusted_alloc_zeroed(size_t size, size_t align) {
+  return (uint8_t *)compartmentAlloc(UNTRUSTED, size, align, true);
+}
+
+int provsan_trusted_pkey() { return allocPkey(TRUSTED); }
+
+uintptr_t provsan_alloc_site_of(void *addr, void **base, size_t *size) {
+  if (!SegregateSites)
+    return 0;
+  Region &region = Regions[TRUSTED];
+  if (addr < region.base || addr >= region.end)
+    return 0;
+  uint64_t offset = (char *)addr - region.base;
+  uint32_t heap = region.spanHeap[offset / ALLOC_SPAN_SIZE];
+  if (!heap || SiteHeaps[heap - 1].shared.load(std::memory_order_relaxed))
+    return 0;
+  uint32_t objectSize = ClassSize[region.spanClass[offset / ALLOC_SPAN_SIZE] - 1];
+  if (base)
+    *base = (char *)addr - (offset % ALLOC_SPAN_SIZE) % objectSize;
+  if (size)
+    *size = objectSize;
+  return SiteHeaps[heap - 1].site.load(std::memory_order_relaxed);
+}
+
+// Lets the runtime store site IDs in the allocator's tag table instead of its
+// own allocation map.
+static void __attribute__((constructor)) provsan_alloc_register_site_tags() {
+  const char *tags = getenv("PROVSAN_ALLOC_SITE_TAGS");
+  if (!tags || atoi(tags) == 0 || !provsan_register_allocator)
+    return;
+  ensureInitialized();
+  if (Regions[TRUSTED].siteTags)
+    provsan_register_allocator(&SiteTagOps);
+}
+}
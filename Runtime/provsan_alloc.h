@@ -0,0 +1,153 @@
+#ifndef PROVSAN_ALLOC_H
+#define PROVSAN_ALLOC_H
+
+#include "provsan_common.h"
+
+#include <cstddef>
+#include <cstdint>
+
+namespace __provsan {
+
+enum Compartment { TRUSTED, UNTRUSTED, NUM_COMPARTMENTS };
+
+// Objects of up to ALLOC_MAX_SMALL bytes are served from size classes, larger
+// ones are mapped individually.
+#define ALLOC_MAX_SMALL 32768
+#define ALLOC_NUM_CLASSES 40
+// Expands X(cls) for every size class.
+#define PROVSAN_FOR_EACH_SIZE_CLASS(X)                                         \
+  X(0) X(1) X(2) X(3) X(4) X(5) X(6) X(7) X(8) X(9) X(10) X(11) X(12) X(13)    \
+  X(14) X(15) X(16) X(17) X(18) X(19) X(20) X(21) X(22) X(23) X(24) X(25)     \
+  X(26) X(27) X(28) X(29) X(30) X(31) X(32) X(33) X(34) X(35) X(36) X(37)     \
+  X(38) X(39)
+// Spans are carved from a compartment's region, and hold objects of a single
+// size class. Each span is pkey_mprotect-ed once, when it is carved.
+#define ALLOC_SPAN_SIZE (256 << 10)
+// Default amount of address space reserved for each compartment. Can be
+// overridden with the PROVSAN_ALLOC_REGION_SIZE environment variable.
+#define ALLOC_DEFAULT_REGION_SIZE (64ULL << 30)
+// Upper bound on the number of objects a thread caches per size class.
+#define ALLOC_MAX_CACHED 256
+// Number of site heaps used by PROVSAN_SEGREGATE_SITES. Sites beyond this
+// share heaps.
+#define ALLOC_SITE_HEAPS 4096
+
+/**
+ * @brief A size-class allocator that keeps the trusted and untrusted
+ * compartments in separate, pkey tagged regions.
+ *
+ * @note Each compartment reserves one contiguous region of address space up
+ * front, so the compartment and size class of any pointer can be found from
+ * its address alone. realloc and free therefore accept memory from either
+ * compartment: sites patched to untrusted_malloc (or __rust_untrusted_alloc)
+ * keep using the trusted realloc and free symbols.
+ *
+ * @note Allocation and free are served from per-thread free lists without
+ * locks or system calls. Threads exchange batches of objects with a per size
+ * class central list when their cache runs empty or overflows. Only carving a
+ * new span takes a system call.
+ *
+ * @note The allocator temporarily grants itself access to the compartment's
+ * pkey (through PKRU) while it touches free list links, so it can be called
+ * with the key disabled without raising MPK faults.
+ *
+ * @note Free list links live in the free objects, where untrusted code can
+ * overwrite them, so every link is checked to point to an object of the same
+ * size class before it is followed. The bookkeeping of large allocations is
+ * kept out of band.
+ *
+ * @note With PROVSAN_SEGREGATE_SITES=1, trusted allocations are served from
+ * separate spans for every allocation site, identified by the return address
+ * of the trusted_malloc call. Every page then holds objects of a single site,
+ * so a page mode unprotect never hides faults on other sites, and the span
+ * table maps any address back to its site in O(1). Segregated heaps bypass
+ * the thread caches, as they are meant for profiling runs.
+ *
+ * @note With PROVSAN_ALLOC_SITE_TAGS=1, the allocator registers itself with
+ * the runtime (see provsan_allocator.h) and keeps the site ID of every small
+ * trusted object in a table indexed by address. The runtime then finds the
+ * site of a faulting address without its global allocation map.
+ */
+
+/// Returns the pkey tagging the given compartment. The trusted compartment
+/// uses PROVSAN_TRUSTED_PKEY if set, or a freshly allocated pkey otherwise.
+/// The untrusted compartment uses PROVSAN_UNTRUSTED_PKEY, or the default
+/// pkey 0.
+int allocPkey(Compartment compartment);
+
+/// Site is the return address of the allocation call, used to segregate
+/// sites when enabled.
+void *compartmentAlloc(Compartment compartment, size_t size, size_t align,
+                       bool zero = false, uintptr_t site = 0);
+void *compartmentRealloc(Compartment compartment, void *ptr, size_t newSize,
+                         size_t align, uintptr_t site = 0);
+void compartmentFree(void *ptr);
+
+/// Allocates an object of size class cls, holding size bytes, skipping the
+/// size class lookup of compartmentAlloc. The allocator must be initialized.
+void *classAlloc(Compartment compartment, unsigned cls, size_t size,
+                 bool zero = false, uintptr_t site = 0);
+
+/// Returns the number of bytes usable at ptr.
+size_t allocUsableSize(void *ptr);
+
+} // namespace __provsan
+
+// The entry points follow the Rust allocator ABI, which the Pre pass expects
+// for the symbols named by PROVSAN_ALLOC, PROVSAN_REALLOC and PROVSAN_FREE.
+extern "C" {
+__attribute__((visibility("default"))) uint8_t *trusted_malloc(size_t size,
+                                                               size_t align);
+__attribute__((visibility("default"))) uint8_t *
+trusted_realloc(uint8_t *ptr, size_t oldSize, size_t align, size_t newSize);
+__attribute__((visibility("default"))) void
+trusted_free(uint8_t *ptr, size_t size, size_t align);
+
+/// trusted_malloc and trusted_realloc, allocating for the given site (return
+/// address of the allocation call) rather than their own caller. Used by
+/// wrappers such as libprovsan_interpose, which would otherwise be taken as
+/// the site of every allocation.
+__attribute__((visibility("default"))) uint8_t *
+provsan_trusted_malloc_at(size_t size, size_t align, uintptr_t site);
+__attribute__((visibility("default"))) uint8_t *
+provsan_trusted_realloc_at(uint8_t *ptr, size_t oldSize, size_t align,
+                           size_t newSize, uintptr_t site);
+
+__attribute__((visibility("default"))) uint8_t *untrusted_malloc(size_t size,
+                                                                 size_t align);
+__attribute__((visibility("default"))) uint8_t *
+untrusted_realloc(uint8_t *ptr, size_t oldSize, size_t align, size_t newSize);
+__attribute__((visibility("default"))) void
+untrusted_free(uint8_t *ptr, size_t size, size_t align);
+
+/// untrusted_malloc_c<N> allocates from size class N of the untrusted
+/// compartment. ProvsanPost calls them in place of untrusted_malloc and
+/// __rust_untrusted_alloc at patched sites of constant size and alignment,
+/// when built with PROVSAN_SIZE_CLASSES=1. size and align are ignored.
+#define PROVSAN_DECLARE_CLASS_ALLOC(cls)                                       \
+  __attribute__((visibility("default"))) uint8_t *untrusted_malloc_c##cls(     \
+      size_t size, size_t align);
+PROVSAN_FOR_EACH_SIZE_CLASS(PROVSAN_DECLARE_CLASS_ALLOC)
+#undef PROVSAN_DECLARE_CLASS_ALLOC
+
+__attribute__((visibility("default"))) uint8_t *
+__rust_untrusted_alloc(size_t size, size_t align);
+__attribute__((visibility("default"))) uint8_t *
+__rust_untrusted_alloc_zeroed(size_t size, size_t align);
+
+/// Returns the pkey of the trusted compartment, for use in call gates.
+__attribute__((visibility("default"))) int provsan_trusted_pkey();
+
+/// Returns the allocation site (return address of the allocation call) owning
+/// the page of addr, and the bounds of the object containing addr. Returns 0
+/// unless addr is in a site segregated span, or if the span's heap is shared
+/// by several sites.
+__attribute__((visibility("default"))) uintptr_t
+provsan_alloc_site_of(void *addr, void **base, size_t *size);
+}
+
+// Provided by libprovsan_rt when it is linked in.
+extern "C" __attribute__((weak)) void
+provsan_register_allocator(const struct provsan_allocator_ops *ops);
+
+#endif // PROVSAN_ALLOC_H
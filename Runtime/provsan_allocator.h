@@ -0,0 +1,46 @@
+#ifndef PROVSAN_ALLOCATOR_H
+#define PROVSAN_ALLOCATOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Returned by lookup for addresses the allocator does not tag.
+#define PROVSAN_NO_SITE UINT32_MAX
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Callbacks through which an allocator stores the runtime's site ID of
+ * each allocation in its own metadata (chunk headers, slab tables, ...).
+ *
+ * @param set_site Stores site for the allocation starting at ptr, which was
+ * just returned by the allocator. Returns 0 if ptr is not tagged by the
+ * allocator (e.g. large allocations), the runtime then tracks it itself.
+ * @param lookup Returns the site of the allocation containing addr, and its
+ * bounds through base and size, or PROVSAN_NO_SITE. Called from the fault
+ * handler, so it must be async-signal-safe and must not take locks. Tags of
+ * freed allocations must stay readable until the memory is reused, as
+ * reallocHook looks up the old allocation after it was released.
+ *
+ * @note While an allocator is registered, allocations it tags are not added to
+ * the runtime's allocation map, and their frees do not touch the runtime at
+ * all. Allocation stacks and lifetimes are not recorded for them.
+ */
+struct provsan_allocator_ops {
+  int (*set_site)(void *ptr, uint32_t site);
+  uint32_t (*lookup)(void *addr, void **base, size_t *size);
+};
+
+/// Registers the allocator's callbacks. ops must stay valid for the lifetime
+/// of the process. Only one allocator can be registered, later calls replace
+/// earlier ones.
+__attribute__((visibility("default"))) void
+provsan_register_allocator(const struct provsan_allocator_ops *ops);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PROVSAN_ALLOCATOR_H
@@ -12,9 +12,6 @@
 
 // Pointer to the global array tracking number of faults per allocation site
 extern std::atomic<uint64_t> *AllocSiteUseCounter;
-extern std::atomic<uint64_t> allocHookCalls;
-extern std::atomic<uint64_t> reallocHookCalls;
-extern std::atomic<uint64_t> deallocHookCalls;
 extern std::atomic<uint64_t> AllocSiteCount;
 #endif
 
@@ -0,0 +1,92 @@
+#include "provsan_control.h"
+#include "provsan_utils.h"
+
+#include <csignal>
+#include <cstdlib>
+
+namespace __provsan {
+
+std::atomic<bool> ProfilingEnabled(true);
+std::atomic<bool> ProfilingStarted(true);
+std::atomic<bool> ProfilingInterrupted(false);
+std::atomic<uint64_t> UntrackedFaults(0);
+
+// Deadline (CLOCK_MONOTONIC_COARSE, in ns) after which profiling starts, or 0
+// if there is no pending warmup.
+static std::atomic<uint64_t> WarmupDeadline(0);
+
+bool checkWarmup() {
+  uint64_t deadline = WarmupDeadline.load(std::memory_order_relaxed);
+  if (!deadline || monotonicNs(CLOCK_MONOTONIC_COARSE) < deadline)
+    return false;
+
+  // Only the first thread past the deadline turns profiling on, so a later
+  // provsan_disable() is not undone by the warmup.
+  if (WarmupDeadline.compare_exchange_strong(deadline, 0)) {
+    REPORT("INFO : Warmup finished, enabling profiling.\n");
+    provsan_enable();
+  }
+  return ProfilingEnabled.load(std::memory_order_relaxed);
+}
+
+static void toggleHandler(int) {
+  // Only touches lock free atomics, so it is async signal safe.
+  WarmupDeadline.store(0, std::memory_order_relaxed);
+  if (ProfilingEnabled.load(std::memory_order_relaxed))
+    provsan_disable();
+  else
+    provsan_enable();
+}
+
+void initProfilingControl() {
+  const char *enable = getenv("PROVSAN_ENABLE");
+  if (enable && atoi(enable) == 0) {
+    ProfilingEnabled = false;
+    ProfilingStarted = false;
+    ProfilingInterrupted = true;
+  }
+
+  const char *warmup = getenv("PROVSAN_WARMUP");
+  if (warmup && atof(warmup) > 0) {
+    ProfilingEnabled = false;
+    ProfilingStarted = false;
+    ProfilingInterrupted = true;
+    WarmupDeadline = monotonicNs(CLOCK_MONOTONIC_COARSE) +
+                     (uint64_t)(atof(warmup) * 1e9);
+    REPORT("INFO : Delaying profiling for %s seconds.\n", warmup);
+  }
+
+  const char *toggle = getenv("PROVSAN_TOGGLE_SIGNAL");
+  if (toggle && atoi(toggle) > 0) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(struct sigaction));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sa.sa_handler = toggleHandler;
+    if (sigaction(atoi(toggle), &sa, nullptr) == -1)
+      REPORT("ERROR : Unable to install toggle handler for signal %s.\n",
+             toggle);
+  }
+}
+
+} // namespace __provsan
+
+extern "C" {
+void provsan_enable() {
+  __provsan::ProfilingStarted.store(true, std::memory_order_relaxed);
+  __provsan::ProfilingEnabled.store(true, std::memory_order_relaxed);
+}
+
+void provsan_disable() {
+  __provsan::ProfilingInterrupted.store(true, std::memory_order_relaxed);
+  __provsan::ProfilingEnabled.store(false, std::memory_order_relaxed);
+}
+
+bool provsan_is_enabled() {
+  return __provsan::ProfilingEnabled.load(std::memory_order_relaxed);
+}
+
+static void __attribute__((constructor)) init_profiling_control() {
+  __provsan::initProfilingControl();
+}
+}
@@ -0,0 +1,49 @@
+#ifndef PROVSAN_CONTROL_H
+#define PROVSAN_CONTROL_H
+
+#include "provsan_common.h"
+
+#include <atomic>
+#include <cstdint>
+
+namespace __provsan {
+
+// Whether the hooks currently track allocations.
+extern std::atomic<bool> ProfilingEnabled;
+// Whether the hooks have tracked any allocation so far. Until then, the map is
+// empty and every hook can return immediately.
+extern std::atomic<bool> ProfilingStarted;
+// Whether profiling has been paused (or delayed) at any point. Faults on
+// untracked memory are expected once this is set.
+extern std::atomic<bool> ProfilingInterrupted;
+// Number of faults on memory that was allocated while profiling was disabled.
+extern std::atomic<uint64_t> UntrackedFaults;
+
+/// Slow path of profilingEnabled(), enables profiling once the warmup period
+/// configured by PROVSAN_WARMUP has passed.
+bool checkWarmup();
+
+/// Checked first in every hook.
+inline bool profilingEnabled() {
+  if (ProfilingEnabled.load(std::memory_order_relaxed))
+    return true;
+  return checkWarmup();
+}
+
+/// Reads the PROVSAN_ENABLE, PROVSAN_WARMUP and PROVSAN_TOGGLE_SIGNAL
+/// environment variables.
+void initProfilingControl();
+
+} // namespace __provsan
+
+extern "C" {
+/// Starts (or resumes) tracking allocations.
+__attribute__((visibility("default"))) void provsan_enable();
+/// Pauses tracking allocations. Allocations that are already tracked are still
+/// removed when they are freed or reallocated, and faults on them are still
+/// recorded.
+__attribute__((visibility("default"))) void provsan_disable();
+__attribute__((visibility("default"))) bool provsan_is_enabled();
+}
+
+#endif // PROVSAN_CONTROL_H
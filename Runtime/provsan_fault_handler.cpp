@@ -1,18 +1,38 @@
 #include "provsan_fault_handler.h"
 #include "alloc_site_handler.h"
+#include "provsan_control.h"
+#include "provsan_fault_stacks.h"
+#include "provsan_site_profile.h"
+#include "provsan_stats.h"
+#include "provsan_trace.h"
 #include "provsan_utils.h"
 
+#include <atomic>
+#include <cstdlib>
+#include <fcntl.h>
 #include <sys/mman.h>
 
 namespace __provsan {
 
-// Set to whatever the default page size will be for page based MPK.
+// Smallest page size, used when the mapping of an address cannot be found.
 #define PAGE_SIZE 4096
+// Number of mappings whose bounds are remembered.
+#define MAPPING_CACHE_SIZE 64
 
 // Trap Flag
 #define TF 0x100
 
-void disable_mpk(siginfo_t *si, void *arg);
+void disable_mpk(siginfo_t *si, void *arg, AllocSite &site);
+
+// Whether page mode unprotects the whole faulting allocation, or only the
+// page of the faulting address. Set by PROVSAN_UNPROTECT.
+static bool UnprotectAllocation = true;
+
+void initPageMPK() {
+  const char *mode = getenv("PROVSAN_UNPROTECT");
+  if (mode && strcmp(mode, "page") == 0)
+    UnprotectAllocation = false;
+}
 
 // General MPK segfault handler. Regardless of MPK access approach, all faults
 // will first pass through this handler. The timing of adding this fault handler
@@ -45,6 +65,7 @@ void pku_segv_handler(int sig, siginfo_t *si, void *arg) {
     return;
   }
   REPORT("INFO : Handling SEGV_PKUERR.\n");
+  StatsScope stats(STAT_FAULT, /*inSignalHandler=*/true);
 
   // Obtains pointer causing fault
   void *ptr = si->si_addr;
@@ -54,24 +75,216 @@ void pku_segv_handler(int sig, siginfo_t *si, void *arg) {
 
   // Get Alloc Site information from the handler.
   auto handler = AllocSiteHandler::getOrInit();
-  handler->addFaultAlloc((rust_ptr)ptr, pkey);
-  auto fault_site = handler->getAllocSite((rust_ptr)ptr);
-  if (!fault_site.isValid()) {
-    fprintf(stderr, "ERROR : Error AllocSite on address: %p; is_safe_addr: %s\n",
-                  ptr, is_safe_address(ptr) ? "true" : "false");
+  auto fault_site = handler->addFaultAlloc((rust_ptr)ptr, pkey);
+  // Bit 1 of the page fault error code is set for writes.
+  ucontext_t *uctxt = (ucontext_t *)arg;
+  bool isWrite = uctxt->uc_mcontext.gregs[REG_ERR] & 0x2;
+  traceEvent(TRACE_FAULT, (uintptr_t)ptr, 0, isWrite ? TRACE_FAULT_WRITE : 0,
+             fault_site.getSiteIndex(), pkey);
+  if (fault_site.isValid()) {
+    // Attribute the fault to the code path that performed the access.
+    recordFaultStack(fault_site.getSiteIndex(), arg);
+    recordSiteAccess(fault_site.getSiteIndex(),
+                     (rust_ptr)ptr - fault_site.getPtr(),
+                     isWrite ? ACCESS_WRITE : ACCESS_READ);
+  } else {
+    ++UntrackedFaults;
+    // Memory allocated while profiling was paused is expected to be missing
+    // from the map, it is still unprotected below like any other fault.
+    if (!ProfilingInterrupted)
+      fprintf(stderr,
+              "ERROR : Error AllocSite on address: %p; is_safe_addr: %s\n",
+              ptr, is_safe_address(ptr) ? "true" : "false");
   }
   REPORT("INFO : Got Allocation Site (%d) for address: %p with pkey: %d.\n",
-         handler->getAllocSite((rust_ptr)ptr).id(), ptr, pkey);
-  disable_mpk(si, arg);
+         fault_site.id(), ptr, pkey);
+  disable_mpk(si, arg, fault_site);
+}
+
+/**
+ * @brief A mapping of the process, and the granularity at which its
+ * protection can be changed.
+ *
+ * @param pageSize The kernel page size, larger than PAGE_SIZE for hugetlbfs
+ * mappings only. Transparent huge pages are split by the kernel when part of
+ * them changes protection, so they use PAGE_SIZE.
+ */
+struct MappingInfo {
+  uintptr_t start;
+  uintptr_t end;
+  uintptr_t pageSize;
+};
+
+/**
+ * @brief A cached mapping and its page size, shared by concurrent fault
+ * handlers.
+ *
+ * @param seq Odd while the entry is being written (a seqlock).
+ * @param epoch The MappingCacheEpoch the entry was read in. Entries of older
+ * epochs are ignored.
+ *
+ * @note hugetlbfs mappings are cached too, so their faults do not read smaps
+ * again. Rounding is clamped to the cached bounds, and bounds or a page size
+ * that no longer match the process's mappings make pkey_mprotect fail, which
+ * starts a new epoch.
+ */
+struct CachedMapping {
+  std::atomic<uint32_t> seq;
+  std::atomic<uint32_t> epoch;
+  std::atomic<uintptr_t> start;
+  std::atomic<uintptr_t> end;
+  std::atomic<uintptr_t> pageSize;
+};
+
+static CachedMapping MappingCache[MAPPING_CACHE_SIZE];
+static std::atomic<uint32_t> MappingCacheNext(0);
+static std::atomic<uint32_t> MappingCacheEpoch(1);
+
+static bool findCachedMapping(uintptr_t addr, MappingInfo &info) {
+  uint32_t epoch = MappingCacheEpoch.load(std::memory_order_acquire);
+  for (auto &entry : MappingCache) {
+    uint32_t seq = entry.seq.load(std::memory_order_acquire);
+    if (seq & 1 || entry.epoch.load(std::memory_order_relaxed) != epoch)
+      continue;
+    uintptr_t start = entry.start.load(std::memory_order_relaxed);
+    uintptr_t end = entry.end.load(std::memory_order_relaxed);
+    uintptr_t pageSize = entry.pageSize.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (entry.seq.load(std::memory_order_relaxed) != seq)
+      continue;
+    if (start <= addr && addr < end) {
+      info = {start, end, pageSize};
+      return true;
+    }
+  }
+  return false;
+}
+
+static void cacheMapping(const MappingInfo &info) {
+  // The cache is small, once it is full the oldest entries are replaced. A
+  // slot another handler is writing to is skipped.
+  CachedMapping &entry = MappingCache[MappingCacheNext++ % MAPPING_CACHE_SIZE];
+  uint32_t seq = entry.seq.load(std::memory_order_relaxed);
+  if (seq & 1 || !entry.seq.compare_exchange_strong(seq, seq + 1,
+                                                    std::memory_order_acquire))
+    return;
+  entry.epoch.store(MappingCacheEpoch.load(std::memory_order_relaxed),
+                    std::memory_order_relaxed);
+  entry.start.store(info.start, std::memory_order_relaxed);
+  entry.end.store(info.end, std::memory_order_relaxed);
+  entry.pageSize.store(info.pageSize, std::memory_order_relaxed);
+  entry.seq.store(seq + 2, std::memory_order_release);
+}
+
+// Reads /proc/self/smaps with a fixed buffer, as this runs in the signal
+// handler and must not allocate.
+class SmapsReader {
+  int fd;
+  char buffer[4096];
+  size_t pos = 0;
+  size_t len = 0;
+
+public:
+  SmapsReader() : fd(open("/proc/self/smaps", O_RDONLY | O_CLOEXEC)) {}
+  ~SmapsReader() {
+    if (fd != -1)
+      close(fd);
+  }
+
+  /// Reads the next line, truncated to the size of line.
+  bool getLine(char *line, size_t size) {
+    size_t used = 0;
+    while (true) {
+      if (pos == len) {
+        ssize_t bytes = fd == -1 ? -1 : read(fd, buffer, sizeof(buffer));
+        if (bytes <= 0)
+          return used != 0;
+        pos = 0;
+        len = bytes;
+      }
+      char c = buffer[pos++];
+      if (c == '\n')
+        break;
+      if (used + 1 < size)
+        line[used++] = c;
+    }
+    line[used] = '\0';
+    return true;
+  }
+};
+
+// Looks up the mapping containing addr, and how large its pages are.
+static bool findMapping(uintptr_t addr, MappingInfo &info) {
+  if (findCachedMapping(addr, info))
+    return true;
+
+  SmapsReader reader;
+  char line[256];
+  bool found = false;
+  info.pageSize = PAGE_SIZE;
+  while (reader.getLine(line, sizeof(line))) {
+    char *end;
+    uintptr_t start = strtoul(line, &end, 16);
+    if (*end == '-') {
+      // A new mapping starts, stop if the previous one was ours.
+      if (found)
+        break;
+      uintptr_t stop = strtoul(end + 1, nullptr, 16);
+      if (start <= addr && addr < stop) {
+        found = true;
+        info.start = start;
+        info.end = stop;
+      }
+      continue;
+    }
+    if (!found)
+      continue;
+    if (strncmp(line, "KernelPageSize:", 15) == 0)
+      info.pageSize = std::max<uintptr_t>(info.pageSize,
+                                          strtoul(line + 15, nullptr, 10) << 10);
+  }
+  if (!found)
+    return false;
+
+  cacheMapping(info);
+  return true;
 }
 
-// Disables MPK protection for the given page for the remainder of the runtime.
-void disablePageMPK(siginfo_t *si, void *arg) {
-  void *page_addr = (void *)((uintptr_t)si->si_addr & ~(PAGE_SIZE - 1));
+// Disables MPK protection for the remainder of the runtime. Unprotects the
+// whole faulting allocation (unless PROVSAN_UNPROTECT=page), rounded out to
+// the page size of its mapping, so accesses streaming over a large buffer, or
+// over a hugetlbfs page, fault only once.
+void disablePageMPK(siginfo_t *si, AllocSite &site) {
+  uintptr_t addr = (uintptr_t)si->si_addr;
+  uintptr_t start = addr;
+  uintptr_t end = addr + 1;
+  if (UnprotectAllocation && site.isValid()) {
+    start = std::min(start, (uintptr_t)site.getPtr());
+    end = std::max(end, (uintptr_t)site.getPtr() + site.getSize());
+  }
 
-  REPORT("INFO : Disabling MPK protection for page(%p).\n", page_addr);
+  MappingInfo mapping;
+  for (unsigned attempt = 0; attempt < 2; ++attempt) {
+    mapping = {0, UINTPTR_MAX, PAGE_SIZE};
+    findMapping(addr, mapping);
+    uintptr_t first = std::max(start & ~(mapping.pageSize - 1), mapping.start);
+    uintptr_t last =
+        std::min((end + mapping.pageSize - 1) & ~(mapping.pageSize - 1),
+                 mapping.end);
+
+    REPORT("INFO : Disabling MPK protection for [%p, %p).\n", (void *)first,
+           (void *)last);
+    if (pkey_mprotect((void *)first, last - first, PROT_READ | PROT_WRITE,
+                      0) == 0)
+      return;
+    // The cached bounds may be stale after a munmap or mremap, read the
+    // mappings again.
+    MappingCacheEpoch.fetch_add(1, std::memory_order_release);
+  }
 
-  pkey_mprotect(page_addr, PAGE_SIZE, PROT_READ | PROT_WRITE, 0);
+  // Fall back to the faulting page, so the access can make progress.
+  pkey_mprotect((void *)(addr & ~(mapping.pageSize - 1)), mapping.pageSize,
+                PROT_READ | PROT_WRITE, 0);
 }
 
 // Temporarily disables the given pkey for the current thread.
@@ -96,16 +309,19 @@ void enableThreadMPK(void *arg, PendingPKeyInfo pkey_info) {
          pkey_info.access_rights);
 }
 
-void disable_mpk(siginfo_t *si, void *arg) {
+void disable_mpk(siginfo_t *si, void *arg, AllocSite &site) {
 #ifndef PAGE_MPK
-  // If PAGE_MPK not defined, default to Single Step
+  // If PAGE_MPK not defined, default to Single Step, which does not need the
+  // allocation.
+  (void)site;
   disableThreadMPK(arg, si->si_pkey);
 
   // Set trap flag on next instruction
   ucontext_t *uctxt = (ucontext_t *)arg;
   uctxt->uc_mcontext.gregs[REG_EFL] |= TF;
 #else
-  disablePageMPK(si, arg);
+  (void)arg;
+  disablePageMPK(si, site);
 #endif
 }
 
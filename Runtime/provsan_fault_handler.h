@@ -19,8 +19,18 @@
 
 namespace __provsan {
 
+class AllocSite;
+
 extern void pku_segv_handler(int sig, siginfo_t *si, void *arg);
 extern void pku_trap_handler(int sig, siginfo_t *si, void *arg);
 
+/// Reads PROVSAN_UNPROTECT, which selects how much memory page mode
+/// unprotects on a fault.
+void initPageMPK();
+
+/// Page mode: removes the protection from the faulting allocation of site (or
+/// only the faulting page), rounded out to the page size of its mapping.
+void disablePageMPK(siginfo_t *si, AllocSite &site);
+
 } // namespace __provsan
 #endif
@@ -0,0 +1,217 @@
+#include "provsan_fault_log.h"
+#include "provsan_formatter.h"
+
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace __provsan {
+
+static FaultLogHeader *LogHeader = nullptr;
+static size_t LogMappingSize = 0;
+static pid_t LogOwner = 0;
+// Kept open with a shared lock for the lifetime of the log, so that
+// compactOrphanFaultLogs never takes it from a running process.
+static int LogFD = -1;
+// Plain storage, as static destructors may run before flush_allocs.
+static char LogPath[PATH_MAX];
+
+static inline uint64_t alignRecord(uint64_t len) { return (len + 7) & ~7ULL; }
+
+static inline char *recordArea(FaultLogHeader *header) {
+  return reinterpret_cast<char *>(header + 1);
+}
+
+void openFaultLog() {
+  if (LogHeader)
+    return;
+
+  const char *enabled = getenv("PROVSAN_FAULT_LOG");
+  if (enabled && atoi(enabled) == 0)
+    return;
+
+  uint64_t capacity = FAULT_LOG_DEFAULT_SIZE;
+  if (const char *size = getenv("PROVSAN_FAULT_LOG_SIZE")) {
+    uint64_t requested = strtoull(size, nullptr, 0);
+    if (requested > sizeof(FaultLogRecord))
+      capacity = alignRecord(requested);
+  }
+
+  std::string TestDirectory = "TestResults";
+  if (!makeTestDirectory(TestDirectory))
+    return;
+
+  snprintf(LogPath, sizeof(LogPath), "%s/fault-log-%d.plog",
+           TestDirectory.c_str(), getpid());
+  int fd = open(LogPath, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (fd == -1) {
+    REPORT("ERROR : Unable to create fault log %s.\n", LogPath);
+    return;
+  }
+  flock(fd, LOCK_SH);
+
+  size_t mapping_size = sizeof(FaultLogHeader) + capacity;
+  if (ftruncate(fd, mapping_size) == -1) {
+    REPORT("ERROR : Unable to size fault log %s.\n", LogPath);
+    close(fd);
+    unlink(LogPath);
+    return;
+  }
+
+  void *mapping =
+      mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED) {
+    REPORT("ERROR : Unable to map fault log %s.\n", LogPath);
+    close(fd);
+    unlink(LogPath);
+    return;
+  }
+
+  // The file was truncated, so the header and all records start zeroed.
+  auto *header = static_cast<FaultLogHeader *>(mapping);
+  header->version = FAULT_LOG_VERSION;
+  header->pid = getpid();
+  header->capacity = capacity;
+  // Publish the magic last so readers never see a half initialized header.
+  __atomic_store_n(&header->magic, FAULT_LOG_MAGIC, __ATOMIC_RELEASE);
+
+  LogMappingSize = mapping_size;
+  LogOwner = getpid();
+  LogFD = fd;
+  LogHeader = header;
+  REPORT("INFO : Streaming faults to %s.\n", LogPath);
+}
+
+void appendFaultLog(int64_t localID, uint32_t pkey, bool isRealloc,
+                    const std::string &bbName, const std::string &funcName) {
+  FaultLogHeader *header = LogHeader;
+  if (!header)
+    return;
+
+  uint64_t length = alignRecord(sizeof(FaultLogRecord) + bbName.size() + 1 +
+                                funcName.size() + 1);
+  uint64_t offset = header->tail.fetch_add(length, std::memory_order_relaxed);
+  if (offset + length > header->capacity) {
+    header->dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  auto *record =
+      reinterpret_cast<FaultLogRecord *>(recordArea(header) + offset);
+  record->length = length;
+  record->localID = localID;
+  record->pkey = pkey;
+  record->bbNameLen = bbName.size();
+  record->funcNameLen = funcName.size();
+  record->isRealloc = isRealloc;
+  char *names = reinterpret_cast<char *>(record + 1);
+  memcpy(names, bbName.c_str(), bbName.size() + 1);
+  memcpy(names + bbName.size() + 1, funcName.c_str(), funcName.size() + 1);
+
+  record->committed.store(1, std::memory_order_release);
+  header->commits.fetch_add(1, std::memory_order_release);
+}
+
+void retireFaultLog() {
+  if (!LogHeader || LogOwner != getpid())
+    return;
+
+  if (uint64_t dropped = LogHeader->dropped.load(std::memory_order_relaxed))
+    REPORT("INFO : Fault log dropped %lu records, consider raising "
+           "PROVSAN_FAULT_LOG_SIZE.\n",
+           dropped);
+
+  munmap(LogHeader, LogMappingSize);
+  LogHeader = nullptr;
+  unlink(LogPath);
+  close(LogFD);
+  LogFD = -1;
+}
+
+void reopenFaultLogAfterFork() {
+  if (!LogHeader || LogOwner == getpid())
+    return;
+
+  // Closing the inherited descriptor leaves the parent's lock in place.
+  munmap(LogHeader, LogMappingSize);
+  LogHeader = nullptr;
+  close(LogFD);
+  LogFD = -1;
+  openFaultLog();
+}
+
+bool readFaultLog(const std::string &path, pid_t &owner,
+                  std::vector<FaultLogEntry> &entries) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return false;
+
+  bool valid = readFaultLog(fd, owner, entries);
+  close(fd);
+  return valid;
+}
+
+bool readFaultLog(int fd, pid_t &owner, std::vector<FaultLogEntry> &entries) {
+  struct stat info;
+  if (fstat(fd, &info) == -1 ||
+      (size_t)info.st_size < sizeof(FaultLogHeader))
+    return false;
+
+  size_t mapping_size = info.st_size;
+  void *mapping = mmap(nullptr, mapping_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED)
+    return false;
+
+  auto *header = static_cast<FaultLogHeader *>(mapping);
+  if (header->magic != FAULT_LOG_MAGIC ||
+      header->version != FAULT_LOG_VERSION ||
+      sizeof(FaultLogHeader) + header->capacity > mapping_size) {
+    munmap(mapping, mapping_size);
+    return false;
+  }
+
+  owner = header->pid;
+  uint64_t end = header->tail.load(std::memory_order_acquire);
+  if (end > header->capacity)
+    end = header->capacity;
+
+  uint64_t offset = 0;
+  while (offset + sizeof(FaultLogRecord) <= end) {
+    auto *record =
+        reinterpret_cast<FaultLogRecord *>(recordArea(header) + offset);
+    // A zero length means the writer died before filling in this record, and
+    // nothing after it can be trusted either.
+    if (record->length == 0 || offset + record->length > end)
+      break;
+    // Names overrunning their record mean the log was corrupted, and the
+    // lengths that follow cannot be trusted either.
+    if (record->length < sizeof(FaultLogRecord) ||
+        (uint64_t)record->bbNameLen + record->funcNameLen + 2 >
+            record->length - sizeof(FaultLogRecord))
+      break;
+
+    if (record->committed.load(std::memory_order_acquire)) {
+      const char *names = reinterpret_cast<const char *>(record + 1);
+      FaultLogEntry entry;
+      entry.localID = record->localID;
+      entry.pkey = record->pkey;
+      entry.isRealloc = record->isRealloc;
+      entry.bbName.assign(names, record->bbNameLen);
+      entry.funcName.assign(names + record->bbNameLen + 1,
+                            record->funcNameLen);
+      entries.push_back(entry);
+    }
+    offset += record->length;
+  }
+
+  munmap(mapping, mapping_size);
+  return true;
+}
+
+} // namespace __provsan
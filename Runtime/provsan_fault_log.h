@@ -0,0 +1,96 @@
+#ifndef PROVSAN_FAULT_LOG_H
+#define PROVSAN_FAULT_LOG_H
+
+#include "provsan_common.h"
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+namespace __provsan {
+
+// "PVSANLOG" in little endian.
+#define FAULT_LOG_MAGIC 0x474f4c4e41535650ULL
+#define FAULT_LOG_VERSION 1
+// Default size of the record area of the fault log. Can be overridden with the
+// PROVSAN_FAULT_LOG_SIZE environment variable.
+#define FAULT_LOG_DEFAULT_SIZE (1 << 20)
+
+/**
+ * @brief Header of the memory mapped fault log.
+ *
+ * @param tail Number of bytes reserved in the record area.
+ * @param commits Number of records that have been completely written.
+ * @param dropped Number of records that did not fit into the log.
+ *
+ * @note The log lives in a MAP_SHARED file mapping, so everything written to
+ * it is owned by the page cache and survives the death of the process without
+ * any syscall on the fault path. Writers reserve space with an atomic bump of
+ * `tail`, fill in the record, and then publish it by setting the record's
+ * `committed` flag and bumping `commits`. Readers ignore records that were
+ * reserved but never committed.
+ */
+struct FaultLogHeader {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t pid;
+  uint64_t capacity;
+  std::atomic<uint64_t> tail;
+  std::atomic<uint64_t> commits;
+  std::atomic<uint64_t> dropped;
+};
+
+/**
+ * @brief A single variable length record in the fault log. The bbName and
+ * funcName strings (each NUL terminated) directly follow the record.
+ */
+struct FaultLogRecord {
+  uint32_t length;
+  std::atomic<uint32_t> committed;
+  int64_t localID;
+  uint32_t pkey;
+  uint32_t bbNameLen;
+  uint32_t funcNameLen;
+  uint32_t isRealloc;
+};
+
+/// A decoded fault log record, used when compacting logs into profiles.
+struct FaultLogEntry {
+  int64_t localID;
+  uint32_t pkey;
+  bool isRealloc;
+  std::string bbName;
+  std::string funcName;
+};
+
+/// Creates and maps the fault log for the current process in the TestResults
+/// folder. Setting PROVSAN_FAULT_LOG=0 disables the log. The process holds a
+/// shared flock() on the log until it is retired.
+void openFaultLog();
+
+/// Appends a faulting allocation site to the log. Only touches mapped memory.
+void appendFaultLog(int64_t localID, uint32_t pkey, bool isRealloc,
+                    const std::string &bbName, const std::string &funcName);
+
+/// Removes the fault log of the current process once its contents have been
+/// serialized into a profile. Does nothing in forked children, as the log is
+/// owned by the process that created it.
+void retireFaultLog();
+
+/// Called in forked children. Detaches from the parent's log and creates one
+/// for the child.
+void reopenFaultLogAfterFork();
+
+/// Decodes all committed records of the fault log at path. Returns false if
+/// the file is not a valid fault log.
+bool readFaultLog(const std::string &path, pid_t &owner,
+                  std::vector<FaultLogEntry> &entries);
+
+/// Same as above, for an already opened fault log.
+bool readFaultLog(int fd, pid_t &owner, std::vector<FaultLogEntry> &entries);
+
+} // namespace __provsan
+
+#endif // PROVSAN_FAULT_LOG_H
@@ -0,0 +1,110 @@
+#include "provsan_fault_stacks.h"
+#include "provsan_site_table.h"
+#include "provsan_stack_depot.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <sstream>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <vector>
+
+namespace __provsan {
+
+/**
+ * @param key (siteIndex + 1) << 32 | stackID, 0 while the bucket is free.
+ * @param count Number of faults seen with this key.
+ */
+struct FaultStackEntry {
+  std::atomic<uint64_t> key;
+  std::atomic<uint64_t> count;
+};
+
+static FaultStackEntry *FaultStacks = nullptr;
+static uint64_t FaultStacksMask = 0;
+static uint32_t FaultStackDepth = FAULT_STACKS_DEFAULT_DEPTH;
+
+void initFaultStacks() {
+  if (FaultStacks)
+    return;
+
+  if (const char *depth = getenv("PROVSAN_FAULT_STACKS"))
+    FaultStackDepth = std::min<uint32_t>(atoi(depth), STACK_DEPOT_MAX_FRAMES);
+  if (!FaultStackDepth)
+    return;
+
+  uint64_t size = FAULT_STACKS_DEFAULT_SIZE;
+  if (const char *requested = getenv("PROVSAN_FAULT_STACKS_SIZE"))
+    size = strtoull(requested, nullptr, 0);
+  // Round up to a power of two for masking.
+  uint64_t buckets = 1;
+  while (buckets < size)
+    buckets <<= 1;
+
+  void *mapping = mmap(nullptr, buckets * sizeof(FaultStackEntry),
+                       PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (mapping == MAP_FAILED) {
+    REPORT("ERROR : Unable to map the fault stack table.\n");
+    return;
+  }
+  FaultStacksMask = buckets - 1;
+  FaultStacks = static_cast<FaultStackEntry *>(mapping);
+}
+
+void recordFaultStack(uint32_t siteIndex, void *context) {
+  if (!FaultStacks || siteIndex == NO_SITE_INDEX)
+    return;
+
+  ucontext_t *uctxt = (ucontext_t *)context;
+  uintptr_t frames[STACK_DEPOT_MAX_FRAMES];
+  uint32_t size = unwindFramePointers(uctxt->uc_mcontext.gregs[REG_RIP],
+                                      uctxt->uc_mcontext.gregs[REG_RBP],
+                                      frames, FaultStackDepth,
+                                      uctxt->uc_mcontext.gregs[REG_RSP]);
+  uint64_t key = ((uint64_t)siteIndex + 1) << 32 | depotPut(frames, size);
+
+  uint64_t hash = key * 0x9e3779b97f4a7c15ULL;
+  for (uint64_t probe = 0; probe <= FaultStacksMask; ++probe) {
+    FaultStackEntry &entry = FaultStacks[(hash + probe) & FaultStacksMask];
+    uint64_t current = entry.key.load(std::memory_order_acquire);
+    if (current == 0 &&
+        entry.key.compare_exchange_strong(current, key,
+                                          std::memory_order_acq_rel))
+      current = key;
+    if (current == key) {
+      entry.count.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+  }
+}
+
+std::string formatFaultStacks(uint32_t siteIndex) {
+  if (!FaultStacks || siteIndex == NO_SITE_INDEX)
+    return "";
+
+  std::vector<std::pair<uint64_t, uint32_t>> stacks;
+  for (uint64_t i = 0; i <= FaultStacksMask; ++i) {
+    uint64_t key = FaultStacks[i].key.load(std::memory_order_acquire);
+    if (key >> 32 == (uint64_t)siteIndex + 1)
+      stacks.emplace_back(FaultStacks[i].count.load(std::memory_order_relaxed),
+                          (uint32_t)key);
+  }
+  if (stacks.empty())
+    return "";
+
+  std::sort(stacks.rbegin(), stacks.rend());
+  if (stacks.size() > FAULT_STACKS_TOP)
+    stacks.resize(FAULT_STACKS_TOP);
+
+  std::ostringstream OS;
+  OS << ", \"faultStacks\": [";
+  for (size_t i = 0; i < stacks.size(); ++i)
+    OS << (i ? ", " : "") << "{ \"count\": " << stacks[i].first
+       << ", \"stack\": " << formatStack(stacks[i].second) << " }";
+  OS << "]";
+  return OS.str();
+}
+
+} // namespace __provsan
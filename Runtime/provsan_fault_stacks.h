@@ -0,0 +1,43 @@
+#ifndef PROVSAN_FAULT_STACKS_H
+#define PROVSAN_FAULT_STACKS_H
+
+#include "provsan_common.h"
+
+#include <cstdint>
+#include <string>
+
+namespace __provsan {
+
+// Default number of (site, stack) buckets. Can be overridden with the
+// PROVSAN_FAULT_STACKS_SIZE environment variable.
+#define FAULT_STACKS_DEFAULT_SIZE (1 << 14)
+// Default number of frames captured per fault, PROVSAN_FAULT_STACKS.
+#define FAULT_STACKS_DEFAULT_DEPTH 16
+// Number of stacks reported per site in the profile.
+#define FAULT_STACKS_TOP 5
+
+/**
+ * @brief Counts faults per (allocation site, faulting call stack).
+ *
+ * @note The faulting stack is unwound from the interrupted context passed to
+ * the signal handler, so it shows the (untrusted) code path that touched the
+ * allocation rather than the handler itself. The table is allocated up front
+ * and updated with atomics only, so recording a fault is async signal safe.
+ * Once the table is full, further stacks are dropped.
+ */
+
+/// Reserves the table and reads PROVSAN_FAULT_STACKS and
+/// PROVSAN_FAULT_STACKS_SIZE.
+void initFaultStacks();
+
+/// Unwinds the faulting context (a ucontext_t) and counts the fault against
+/// the given site index.
+void recordFaultStack(uint32_t siteIndex, void *context);
+
+/// Formats the most frequent faulting stacks of a site as a JSON field,
+/// starting with a comma. Returns an empty string if there are none.
+std::string formatFaultStacks(uint32_t siteIndex);
+
+} // namespace __provsan
+
+#endif // PROVSAN_FAULT_STACKS_H
@@ -1,15 +1,28 @@
 #include "provsan_formatter.h"
+#include "provsan_control.h"
+#include "provsan_fault_log.h"
+#include "provsan_fault_stacks.h"
+#include "provsan_profile_reader.h"
+#include "provsan_site_profile.h"
+#include "provsan_trace.h"
 
 #include "llvm/ADT/Optional.h"
 #include <fstream>
 #include <iomanip>
 #include <random>
 #include <sstream>
+#include <cerrno>
+#include <csignal>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <tuple>
 #include <stdlib.h>
 #include <string>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <unordered_map>
 
 namespace __provsan {
 
@@ -69,37 +82,167 @@ bool is_directory(std::string directory) {
     return false;
 }
 
+bool makeTestDirectory(const std::string &directory) {
+  if (is_directory(directory))
+    return true;
+  // Another process may have created the directory in the meantime.
+  if (mkdir(directory.c_str(), S_IRWXU | S_IRWXG | S_IRWXO) == -1 &&
+      errno != EEXIST) {
+    REPORT("Failed to create %s directory.\n", directory.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Writes a single faulting allocation site as a JSON object. Extra fields, if
+// any, are appended verbatim and must start with a comma.
+void writeJSONEntry(std::ofstream &OS, int64_t id, uint32_t pkey,
+                    const std::string &bbName, const std::string &funcName,
+                    bool isRealloc, bool last, const std::string &extra = "") {
+  OS << "{ \"id\": " << id << ", \"pkey\": " << pkey << ", \"bbName\": \""
+     << bbName << "\", \"funcName\": \"" << funcName << "\""
+     << ", \"isRealloc\": " << (isRealloc ? "true" : "false") << extra << " }"
+     << (last ? "" : ",") << "\n";
+}
+
+// Formats the fields written after a site's names: the stacks and wrapper
+// contexts of its faulting allocations, if origins is given, then the site's
+// fault stacks and profile.
+static std::string formatSiteFields(const FaultOrigins *origins,
+                                    uint32_t siteIndex) {
+  std::string extra;
+  if (origins && !origins->stackIDs.empty()) {
+    extra = ", \"stacks\": [";
+    for (uint32_t stackID : origins->stackIDs) {
+      if (stackID != *origins->stackIDs.begin())
+        extra += ", ";
+      extra += "{ \"stackID\": " + std::to_string(stackID) +
+               ", \"stack\": " + formatStack(stackID) + " }";
+    }
+    extra += "]";
+  }
+  if (origins && !origins->contexts.empty()) {
+    extra += ", \"contexts\": [";
+    for (uint64_t context : origins->contexts) {
+      if (context != *origins->contexts.begin())
+        extra += ", ";
+      extra += std::to_string(context);
+    }
+    extra += "], \"contextFree\": ";
+    extra += origins->contextFree ? "true" : "false";
+  }
+  extra += formatFaultStacks(siteIndex);
+  extra += formatSiteProfile(siteIndex);
+  return extra;
+}
+
 // Function for handwriting the JSON output we want (to remove dependency on
 // llvm/Support).
-void writeJSON(std::ofstream &OS, std::unordered_set<AllocSite> &faultSet) {
+// Each site is written once, with the stacks and wrapper contexts of all its
+// faulting allocations.
+void writeJSON(std::ofstream &OS, fault_map_t &faultSet) {
   if (faultSet.size() <= 0)
     return;
 
   OS << "[\n";
   int64_t items_remaining = faultSet.size();
-  for (auto fault : faultSet) {
+  for (auto &entry : faultSet) {
     --items_remaining;
-    OS << "{ \"id\": " << fault.id() << ", \"pkey\": " << fault.getPkey()
-       << ", \"bbName\": \"" << fault.getBBName() << "\", \"funcName\": \""
-       << fault.getFuncName() << "\""
-       << ", \"isRealloc\": " << (fault.isReAlloc() ? "true" : "false") << " }"
-       << (items_remaining ? "," : "") << "\n";
+    const AllocSite &fault = entry.first;
+    writeJSONEntry(OS, fault.id(), fault.getPkey(), fault.getBBName(),
+                   fault.getFuncName(), fault.isReAlloc(), !items_remaining,
+                   formatSiteFields(&entry.second, fault.getSiteIndex()));
   }
   OS << "]\n";
 }
 
+// Writes the records recovered from a fault log in the same format as
+// writeJSON. extras, if not empty, holds the extra fields of each record.
+void writeJSON(std::ofstream &OS, std::vector<FaultLogEntry> &entries,
+               const std::vector<std::string> &extras = {}) {
+  if (entries.empty())
+    return;
+
+  OS << "[\n";
+  for (size_t i = 0; i < entries.size(); ++i) {
+    auto &entry = entries[i];
+    writeJSONEntry(OS, entry.localID, entry.pkey, entry.bbName, entry.funcName,
+                   entry.isRealloc, i + 1 == entries.size(),
+                   extras.empty() ? "" : extras[i]);
+  }
+  OS << "]\n";
+}
+
+// Converts fault logs left behind by processes that died without reaching
+// flush_allocs (crashes, SIGKILL, _exit) into regular profiles.
+void compactOrphanFaultLogs(const std::string &TestDirectory) {
+  DIR *dir = opendir(TestDirectory.c_str());
+  if (!dir)
+    return;
+
+  std::vector<std::string> orphans;
+  while (struct dirent *entry = readdir(dir)) {
+    int pid;
+    char suffix[8];
+    if (sscanf(entry->d_name, "fault-log-%d.%7s", &pid, suffix) != 2 ||
+        strcmp(suffix, "plog") != 0)
+      continue;
+    // Skip our own log, and logs of processes that are still running.
+    if (pid == getpid() || kill(pid, 0) == 0 || errno != ESRCH)
+      continue;
+    orphans.push_back(TestDirectory + "/" + entry->d_name);
+  }
+  closedir(dir);
+
+  for (auto &path : orphans) {
+    // The owner holds a shared lock until it retires its log, and concurrent
+    // compactors an exclusive one, so only one process compacts each log.
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+      continue;
+    struct stat info;
+    if (flock(fd, LOCK_EX | LOCK_NB) == -1 || fstat(fd, &info) == -1 ||
+        info.st_nlink == 0) {
+      // Locked, or already compacted and unlinked by another process.
+      close(fd);
+      continue;
+    }
+
+    pid_t owner;
+    std::vector<FaultLogEntry> entries;
+    if (!readFaultLog(fd, owner, entries)) {
+      REPORT("ERROR : Skipping invalid fault log %s.\n", path.c_str());
+      close(fd);
+      continue;
+    }
+
+    if (!entries.empty()) {
+      auto uniqueOS =
+          makeUniqueStream(TestDirectory, "faulting-allocs", "json");
+      if (!uniqueOS) {
+        close(fd);
+        continue;
+      }
+      writeJSON(uniqueOS.getValue(), entries);
+      uniqueOS.getValue().flush();
+      REPORT("INFO : Recovered %zu faults from %s (pid %d).\n", entries.size(),
+             path.c_str(), owner);
+    }
+    // Unlink while still holding the lock, so a compactor that opened the
+    // log in the meantime sees it unlinked once it gets the lock.
+    unlink(path.c_str());
+    close(fd);
+  }
+}
+
 // Writes output of the faultSet to a uniquely generated output file to ensure
 // we do not overwrite previously discovered faulting values.
-bool writeUniqueFile(std::unordered_set<AllocSite> &faultSet) {
+bool writeUniqueFile(fault_map_t &faultSet) {
   // Currently all results are stored by default in the folder TestResults.
   // Ensure this folder exists, or create one if it does not.
   std::string TestDirectory = "TestResults";
-  if (!is_directory(TestDirectory)) {
-    if (mkdir(TestDirectory.c_str(), S_IRWXU | S_IRWXG | S_IRWXO) == -1) {
-      REPORT("Failed to create TestResults directory.\n");
-      return false;
-    }
-  }
+  if (!makeTestDirectory(TestDirectory))
+    return false;
 
   auto uniqueOS = makeUniqueStream(TestDirectory, "faulting-allocs", "json");
   if (!uniqueOS)
@@ -114,9 +257,12 @@ bool writeUniqueFile(std::unordered_set<AllocSite> &faultSet) {
     if (!uniqueSOS)
       return false;
     std::ofstream &SOS = uniqueSOS.getValue();
-    SOS << "Number of Times allocHook Called: " << allocHookCalls << "\n"
-        << "Number of Times reallocHook Called: " << reallocHookCalls << "\n"
-        << "Number of Times deallocHook Called: " << deallocHookCalls << "\n";
+    SOS << "Number of Times allocHook Called: "
+        << totalStat(STAT_ALLOC_HOOK) << "\n"
+        << "Number of Times reallocHook Called: "
+        << totalStat(STAT_REALLOC_HOOK) << "\n"
+        << "Number of Times deallocHook Called: "
+        << totalStat(STAT_DEALLOC_HOOK) << "\n";
     uint64_t AllocSitesFound = 0;
     for (uint64_t i = 0; i < AllocSiteCount; i++) {
       if (AllocSiteUseCounter[i] > 0) {
@@ -134,11 +280,175 @@ bool writeUniqueFile(std::unordered_set<AllocSite> &faultSet) {
 
 // Flush Allocs is to be called on program exit to flush all faulting
 // allocations to disk/file.
+// A covered allocation site, ordered so the merged coverage file is stable.
+using CoveredSite = std::tuple<std::string, std::string, int64_t, bool>;
+
+// Parses the merged coverage file. It is only ever written by writeCoverage,
+// which emits one site per line.
+static void parseCoverage(const std::string &contents,
+                          std::set<CoveredSite> &sites) {
+  std::istringstream IS(contents);
+  std::string line;
+  while (std::getline(IS, line)) {
+    int64_t id;
+    std::string bbName, funcName;
+    if (!parseSiteLine(line, id, bbName, funcName))
+      continue;
+    bool isRealloc = line.find("\"isRealloc\": true") != std::string::npos;
+    sites.emplace(funcName, bbName, id, isRealloc);
+  }
+}
+
+static void writeCoverageJSON(std::ostream &OS,
+                              const std::set<CoveredSite> &sites) {
+  OS << "[\n";
+  size_t items_remaining = sites.size();
+  for (auto &site : sites) {
+    --items_remaining;
+    OS << "{ \"id\": " << std::get<2>(site) << ", \"bbName\": \""
+       << std::get<1>(site) << "\", \"funcName\": \"" << std::get<0>(site)
+       << "\", \"isRealloc\": " << (std::get<3>(site) ? "true" : "false")
+       << " }" << (items_remaining ? "," : "") << "\n";
+  }
+  OS << "]\n";
+}
+
+// Writes the allocation sites executed by this run next to the fault profile,
+// and merges them into TestResults/site-coverage.cov. Every run appends a line
+// "<pid> <sites this run> <new sites> <total sites>" to
+// TestResults/site-coverage.history, so campaign runners can stop once new
+// runs stop adding sites.
+void writeCoverage(const std::string &TestDirectory) {
+  std::set<CoveredSite> run_sites;
+  forEachExecutedSite([&run_sites](const SiteEntry &site) {
+    run_sites.emplace(siteFuncName(site), siteBBName(site), site.localID,
+                      site.isRealloc != 0);
+  });
+  if (run_sites.empty())
+    return;
+
+  if (!makeTestDirectory(TestDirectory))
+    return;
+
+  auto uniqueOS = makeUniqueStream(TestDirectory, "site-coverage", "cov");
+  if (uniqueOS) {
+    writeCoverageJSON(uniqueOS.getValue(), run_sites);
+    uniqueOS.getValue().flush();
+  }
+
+  // Merge under an exclusive lock, concurrent runs share the merged file.
+  std::string merged_path = TestDirectory + "/site-coverage.cov";
+  int fd = open(merged_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC,
+                S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (fd == -1 || flock(fd, LOCK_EX) == -1) {
+    REPORT("ERROR : Unable to lock %s.\n", merged_path.c_str());
+    if (fd != -1)
+      close(fd);
+    return;
+  }
+
+  std::string contents;
+  char buffer[4096];
+  ssize_t bytes;
+  while ((bytes = read(fd, buffer, sizeof(buffer))) > 0)
+    contents.append(buffer, bytes);
+
+  std::set<CoveredSite> merged;
+  parseCoverage(contents, merged);
+  size_t previous = merged.size();
+  merged.insert(run_sites.begin(), run_sites.end());
+
+  std::ostringstream OS;
+  writeCoverageJSON(OS, merged);
+  std::string output = OS.str();
+  if (ftruncate(fd, 0) == -1 ||
+      pwrite(fd, output.c_str(), output.size(), 0) != (ssize_t)output.size())
+    REPORT("ERROR : Unable to update %s.\n", merged_path.c_str());
+
+  std::ofstream history(TestDirectory + "/site-coverage.history",
+                        std::ios::app);
+  history << getpid() << " " << run_sites.size() << " "
+          << merged.size() - previous << " " << merged.size() << "\n";
+  REPORT("INFO : Covered %zu allocation sites, %zu new, %zu total.\n",
+         run_sites.size(), merged.size() - previous, merged.size());
+
+  flock(fd, LOCK_UN);
+  close(fd);
+}
+
+// With PROVSAN_SHARED_FAULTS, the process that created the shared site table
+// writes a single profile for itself and all of its forked workers.
+void flush_shared_allocs() {
+  if (getpid() != sharedFaultsOwner()) {
+    REPORT("INFO : Faults are shared with pid %d, skipping profile. The "
+           "stacks and site profiles of this process are dropped.\n",
+           sharedFaultsOwner());
+    retireFaultLog();
+    return;
+  }
+  writeCoverage("TestResults");
+
+  // The stacks, contexts and site profiles are private to each process, so
+  // only this process's share of them is known.
+  auto fault_set = AllocSiteHandler::getOrInit()->faultingAllocs();
+  std::unordered_map<uint32_t, const FaultOrigins *> origins;
+  for (auto &fault : fault_set)
+    origins[fault.first.getSiteIndex()] = &fault.second;
+
+  std::vector<FaultLogEntry> entries;
+  std::vector<std::string> extras;
+  forEachFaultedSite([&](const SiteEntry &site) {
+    uint32_t index = getSiteEntryIndex(site);
+    auto found = origins.find(index);
+    entries.push_back({site.localID, site.pkey, site.isRealloc != 0,
+                       siteBBName(site), siteFuncName(site)});
+    extras.push_back(formatSiteFields(
+        found == origins.end() ? nullptr : found->second, index));
+  });
+
+  if (entries.empty()) {
+    REPORT("INFO : No faulting instructions to export, returning.\n");
+    retireFaultLog();
+    return;
+  }
+
+  REPORT("INFO : Serializing %zu shared faulting allocations to disk.\n",
+         entries.size());
+  std::string TestDirectory = "TestResults";
+  if (!makeTestDirectory(TestDirectory))
+    return;
+  auto uniqueOS = makeUniqueStream(TestDirectory, "faulting-allocs", "json");
+  if (!uniqueOS) {
+    REPORT("ERROR : Unable to write merged profile.\n");
+    return;
+  }
+  writeJSON(uniqueOS.getValue(), entries, extras);
+  uniqueOS.getValue().flush();
+  retireFaultLog();
+}
+
 void flush_allocs() {
   auto handler = AllocSiteHandler::getOrInit();
+  retireStats();
+  finishTrace();
+  if (uint64_t untracked = UntrackedFaults)
+    REPORT("INFO : %lu faults on memory that was not tracked by the "
+           "runtime.\n",
+           untracked);
+  compactOrphanFaultLogs("TestResults");
+  handler->recordLiveAtExit();
+
+  if (sharedFaultsEnabled()) {
+    flush_shared_allocs();
+    return;
+  }
+
+  writeCoverage("TestResults");
   auto fault_set = handler->faultingAllocs();
+
   if (fault_set.empty()) {
     REPORT("INFO : No faulting instructions to export, returning.\n");
+    retireFaultLog();
     return;
   }
 
@@ -146,10 +456,15 @@ void flush_allocs() {
 
   // Simple method that requires either handling multiple files or a script for
   // combining them later.
-  if (!writeUniqueFile(fault_set))
+  if (!writeUniqueFile(fault_set)) {
+    // Keep the fault log around so the faults can be recovered later.
     REPORT("ERROR : Unable to successfully write unique files for "
            "given program run.\n");
+    return;
+  }
 
+  // Everything in the fault log is now part of the profile.
+  retireFaultLog();
   REPORT("INFO : Serialization complete.\n");
 }
 
@@ -8,6 +8,13 @@ namespace __provsan {
 
 void flush_allocs();
 
+// Ensures the given results directory exists, creating it if necessary.
+bool makeTestDirectory(const std::string &directory);
+
+// Converts the fault logs of dead processes in the given results directory
+// into profiles. Logs still locked by their owner are left alone.
+void compactOrphanFaultLogs(const std::string &TestDirectory);
+
 } // namespace __provsan
 
 extern "C" {
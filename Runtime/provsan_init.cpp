@@ -9,9 +9,6 @@ struct sigaction *SIGTAction = nullptr;
 
 #ifdef MPK_STATS
 std::atomic<uint64_t> *AllocSiteUseCounter(nullptr);
-std::atomic<uint64_t> allocHookCalls(0);
-std::atomic<uint64_t> reallocHookCalls(0);
-std::atomic<uint64_t> deallocHookCalls(0);
 std::atomic<uint64_t> AllocSiteCount(0);
 #endif
 
@@ -54,6 +51,7 @@ void provsan_untrusted_constructor() {
 #endif
 
   REPORT("INFO : Initializing and replacing segFaultHandler.\n");
+  __provsan::initPageMPK();
 
   // Set up our fault handler
   static struct sigaction sa;
@@ -0,0 +1,152 @@
+#include "provsan_interpose.h"
+#include "alloc_site_handler.h"
+
+#include <atomic>
+#include <climits>
+#include <dlfcn.h>
+#include <link.h>
+#include <mutex>
+#include <unistd.h>
+
+namespace __provsan {
+
+typedef uint8_t *(*MallocFn)(size_t, size_t);
+typedef uint8_t *(*ReallocFn)(uint8_t *, size_t, size_t, size_t);
+typedef void (*FreeFn)(uint8_t *, size_t, size_t);
+typedef uint8_t *(*MallocAtFn)(size_t, size_t, uintptr_t);
+typedef uint8_t *(*ReallocAtFn)(uint8_t *, size_t, size_t, size_t, uintptr_t);
+
+static MallocFn RealMalloc = nullptr;
+static ReallocFn RealRealloc = nullptr;
+static FreeFn RealFree = nullptr;
+// Entry points of libprovsan_alloc taking the site explicitly, so that its
+// site segregation sees the caller of the wrapper rather than the wrapper.
+// Null for other allocators.
+static MallocAtFn RealMallocAt = nullptr;
+static ReallocAtFn RealReallocAt = nullptr;
+
+/**
+ * @brief A return address, resolved to the module containing it.
+ *
+ * @param seq Odd while the entry is being written (a seqlock). Writers that
+ * find the entry odd, or lose the race to make it odd, leave it alone.
+ */
+struct InterposedSite {
+  std::atomic<uint32_t> seq;
+  std::atomic<uintptr_t> pc;
+  std::atomic<const char *> module;
+  std::atomic<int64_t> address;
+};
+
+static InterposedSite SiteCache[INTERPOSE_CACHE_SIZE];
+
+// The loader reports the executable by the name it was started with, which is
+// not usable once the working directory changes.
+static const char *mainModule() {
+  static char path[PATH_MAX];
+  static std::once_flag once;
+  std::call_once(once, [] {
+    ssize_t length = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    path[length > 0 ? length : 0] = '\0';
+  });
+  return path[0] ? path : "<main>";
+}
+
+template <typename T> static T nextSymbol(T &cached, const char *name) {
+  if (!cached) {
+    cached = reinterpret_cast<T>(dlsym(RTLD_NEXT, name));
+    if (!cached) {
+      fprintf(stderr, "ProvSan: no definition of %s to interpose.\n", name);
+      abort();
+    }
+  }
+  return cached;
+}
+
+static void findSiteEntryPoints() {
+  static std::once_flag once;
+  std::call_once(once, [] {
+    RealMallocAt = reinterpret_cast<MallocAtFn>(
+        dlsym(RTLD_NEXT, "provsan_trusted_malloc_at"));
+    RealReallocAt = reinterpret_cast<ReallocAtFn>(
+        dlsym(RTLD_NEXT, "provsan_trusted_realloc_at"));
+  });
+}
+
+// Resolves a return address to <module path, link time address>. The link
+// time address is what the module's DWARF line tables are keyed by, for both
+// position independent and fixed address modules. Results are cached, as
+// dladdr takes the loader lock.
+static bool resolveSite(uintptr_t pc, const char *&module, int64_t &address) {
+  InterposedSite &slot =
+      SiteCache[(pc * 0x9E3779B97F4A7C15ULL >> 52) % INTERPOSE_CACHE_SIZE];
+  uint32_t seq = slot.seq.load(std::memory_order_acquire);
+  if (!(seq & 1) && slot.pc.load(std::memory_order_relaxed) == pc) {
+    module = slot.module.load(std::memory_order_relaxed);
+    address = slot.address.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    // Only trust the fields if no writer touched the slot meanwhile.
+    if (slot.seq.load(std::memory_order_relaxed) == seq)
+      return true;
+  }
+
+  Dl_info info;
+  struct link_map *map = nullptr;
+  if (!dladdr1((void *)pc, &info, (void **)&map, RTLD_DL_LINKMAP) || !map)
+    return false;
+  module = map->l_name && map->l_name[0] ? map->l_name : mainModule();
+  address = pc - map->l_addr;
+
+  seq = slot.seq.load(std::memory_order_relaxed);
+  if (seq & 1 || !slot.seq.compare_exchange_strong(seq, seq + 1,
+                                                   std::memory_order_acquire))
+    return true;
+  // Readers that see any of the new fields also see the odd seq.
+  std::atomic_thread_fence(std::memory_order_release);
+  slot.pc.store(pc, std::memory_order_relaxed);
+  slot.module.store(module, std::memory_order_relaxed);
+  slot.address.store(address, std::memory_order_relaxed);
+  slot.seq.store(seq + 2, std::memory_order_release);
+  return true;
+}
+
+} // namespace __provsan
+
+using namespace __provsan;
+
+extern "C" {
+
+uint8_t *trusted_malloc(size_t size, size_t align) {
+  uintptr_t pc = (uintptr_t)__builtin_return_address(0);
+  findSiteEntryPoints();
+  uint8_t *ptr = RealMallocAt
+                     ? RealMallocAt(size, align, pc)
+                     : nextSymbol(RealMalloc, "trusted_malloc")(size, align);
+  const char *module;
+  int64_t address;
+  if (ptr && resolveSite(pc, module, address))
+    allocHook((rust_ptr)ptr, size, address, INTERPOSED_BB_NAME, module);
+  return ptr;
+}
+
+uint8_t *trusted_realloc(uint8_t *ptr, size_t oldSize, size_t align,
+                         size_t newSize) {
+  uintptr_t pc = (uintptr_t)__builtin_return_address(0);
+  findSiteEntryPoints();
+  uint8_t *newPtr =
+      RealReallocAt ? RealReallocAt(ptr, oldSize, align, newSize, pc)
+                    : nextSymbol(RealRealloc, "trusted_realloc")(
+                          ptr, oldSize, align, newSize);
+  const char *module;
+  int64_t address;
+  if (newPtr && resolveSite(pc, module, address))
+    reallocHook((rust_ptr)newPtr, newSize, (rust_ptr)ptr, oldSize, address,
+                INTERPOSED_BB_NAME, module);
+  return newPtr;
+}
+
+void trusted_free(uint8_t *ptr, size_t size, size_t align) {
+  deallocHook((rust_ptr)ptr, size, 0);
+  nextSymbol(RealFree, "trusted_free")(ptr, size, align);
+}
+}
@@ -0,0 +1,46 @@
+#ifndef PROVSAN_INTERPOSE_H
+#define PROVSAN_INTERPOSE_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace __provsan {
+
+// bbName reported for sites found by interposition. Their funcName is the path
+// of the calling module, and their id the link time address of the return
+// address of the allocation call within that module.
+#define INTERPOSED_BB_NAME "interposed"
+// Number of return addresses whose module is remembered.
+#define INTERPOSE_CACHE_SIZE 4096
+
+/**
+ * @brief Profiling without the compiler passes.
+ *
+ * @note libprovsan_interpose is preloaded (LD_PRELOAD) into an unmodified
+ * program, and defines the default trusted allocation entry points
+ * (trusted_malloc, trusted_realloc, trusted_free). Each wrapper forwards to the
+ * next definition of the symbol (RTLD_NEXT), and reports the allocation to the
+ * usual hooks, identifying the site by the return address of the call. The
+ * allocator must therefore live in a shared library (e.g. libprovsan_alloc),
+ * calls bound within the executable itself cannot be interposed. When the next
+ * definition is libprovsan_alloc, the wrapper calls its
+ * provsan_trusted_malloc_at and provsan_trusted_realloc_at entry points with
+ * the return address of the call, so site segregation sees the caller rather
+ * than the wrapper.
+ *
+ * @note provsan-symbolize rewrites the resulting profiles, adding the source
+ * location of every interposed site from the DWARF line tables of the -g build.
+ */
+
+} // namespace __provsan
+
+extern "C" {
+__attribute__((visibility("default"))) uint8_t *trusted_malloc(size_t size,
+                                                               size_t align);
+__attribute__((visibility("default"))) uint8_t *
+trusted_realloc(uint8_t *ptr, size_t oldSize, size_t align, size_t newSize);
+__attribute__((visibility("default"))) void
+trusted_free(uint8_t *ptr, size_t size, size_t align);
+}
+
+#endif // PROVSAN_INTERPOSE_H
@@ -0,0 +1,46 @@
+// Reading of the site lists written by the runtime (faulting-allocs-*.json
+// profiles and the merged coverage file), shared by the runtime and the
+// offline tools.
+
+#ifndef PROVSAN_PROFILE_READER_H
+#define PROVSAN_PROFILE_READER_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+namespace __provsan {
+
+/// Extracts the value of the string field starting with field (e.g.
+/// "\"bbName\": \"") from one line of a site list. The writers emit one site
+/// per line, see writeJSONEntry and writeCoverageJSON.
+inline bool extractString(const std::string &line, const char *field,
+                          std::string &value) {
+  size_t start = line.find(field);
+  if (start == std::string::npos)
+    return false;
+  start += strlen(field);
+  size_t end = line.find('"', start);
+  if (end == std::string::npos)
+    return false;
+  value = line.substr(start, end - start);
+  return true;
+}
+
+/// Parses the identity of the site on one line of a site list. Returns false
+/// for lines not holding a site.
+inline bool parseSiteLine(const std::string &line, int64_t &id,
+                          std::string &bbName, std::string &funcName) {
+  size_t field = line.find("\"id\": ");
+  if (field == std::string::npos ||
+      !extractString(line, "\"bbName\": \"", bbName) ||
+      !extractString(line, "\"funcName\": \"", funcName))
+    return false;
+  id = strtoll(line.c_str() + field + 6, nullptr, 10);
+  return true;
+}
+
+} // namespace __provsan
+
+#endif // PROVSAN_PROFILE_READER_H
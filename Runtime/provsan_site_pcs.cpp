@@ -0,0 +1,74 @@
+#include "provsan_site_pcs.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+
+namespace __provsan {
+
+struct SitePCTable {
+  const SitePCEntry *section;
+  SitePC *begin;
+  SitePC *end;
+};
+
+static SitePCTable SitePCTables[SITE_PC_MAX_MODULES];
+// Tables below this count are sorted and immutable.
+static std::atomic<uint32_t> SitePCTableCount(0);
+static std::mutex SitePCTableMutex;
+
+const SiteDescriptor *lookupSitePC(uintptr_t pc) {
+  uint32_t count = SitePCTableCount.load(std::memory_order_acquire);
+  for (uint32_t i = 0; i < count; ++i) {
+    const SitePCTable &table = SitePCTables[i];
+    if (pc < table.begin->pc || pc > (table.end - 1)->pc)
+      continue;
+    const SitePC *found = std::lower_bound(
+        table.begin, table.end, pc,
+        [](const SitePC &entry, uintptr_t pc) { return entry.pc < pc; });
+    if (found != table.end && found->pc == pc)
+      return found->site;
+  }
+  return nullptr;
+}
+
+} // namespace __provsan
+
+using namespace __provsan;
+
+extern "C" {
+void provsan_register_site_pcs(const SitePCEntry *begin,
+                               const SitePCEntry *end) {
+  if (begin >= end)
+    return;
+
+  std::lock_guard<std::mutex> lock(SitePCTableMutex);
+  uint32_t count = SitePCTableCount.load(std::memory_order_relaxed);
+  // Every translation unit of a module registers the same section.
+  for (uint32_t i = 0; i < count; ++i)
+    if (SitePCTables[i].section == begin)
+      return;
+  if (count == SITE_PC_MAX_MODULES) {
+    REPORT("ERROR : Too many modules with site tables, sites in %p are not "
+           "resolved.\n",
+           (void *)begin);
+    return;
+  }
+
+  // Tables live until exit, as hooks may run in destructors.
+  size_t size = end - begin;
+  SitePC *table = new SitePC[size];
+  for (size_t i = 0; i < size; ++i) {
+    const SitePCEntry &entry = begin[i];
+    table[i].pc = (uintptr_t)&entry.pc + entry.pc;
+    table[i].site =
+        (const SiteDescriptor *)((uintptr_t)&entry.site + entry.site);
+  }
+  std::sort(table, table + size, [](const SitePC &lhs, const SitePC &rhs) {
+    return lhs.pc < rhs.pc;
+  });
+  SitePCTables[count] = {begin, table, table + size};
+  SitePCTableCount.store(count + 1, std::memory_order_release);
+  REPORT("INFO : Registered %zu compact hook sites.\n", (size_t)(end - begin));
+}
+}
@@ -0,0 +1,57 @@
+#ifndef PROVSAN_SITE_PCS_H
+#define PROVSAN_SITE_PCS_H
+
+#include "provsan_common.h"
+
+#include <cstdint>
+
+namespace __provsan {
+
+// Maximum number of modules (executable and shared libraries) that can
+// register site tables.
+#define SITE_PC_MAX_MODULES 256
+
+/**
+ * @brief Description of an allocation site, emitted by ProvsanPost when it
+ * builds compact hooks (PROVSAN_COMPACT_HOOKS=1). Matches the arguments the
+ * full hooks take.
+ */
+struct SiteDescriptor {
+  int64_t localID;
+  const char *bbName;
+  const char *funcName;
+  int64_t isRealloc;
+};
+
+/**
+ * @brief One entry of a module's provsan_site_pcs section: the return address
+ * of a compact hook call, and the site it was emitted for, both as offsets
+ * from the field holding them. The section therefore needs no relocations.
+ */
+struct SitePCEntry {
+  int32_t pc;
+  int32_t site;
+};
+
+/// A decoded SitePCEntry.
+struct SitePC {
+  uintptr_t pc;
+  const SiteDescriptor *site;
+};
+
+/// Returns the site whose compact hook call returns to pc, or nullptr. Lock
+/// free, a binary search within the module containing pc.
+const SiteDescriptor *lookupSitePC(uintptr_t pc);
+
+} // namespace __provsan
+
+extern "C" {
+/// Called by a constructor that ProvsanPost adds to every instrumented module,
+/// with the bounds of the linked provsan_site_pcs section. The entries are
+/// decoded into a sorted table. Registering the same section again is a no-op.
+__attribute__((visibility("default"))) void
+provsan_register_site_pcs(const __provsan::SitePCEntry *begin,
+                          const __provsan::SitePCEntry *end);
+}
+
+#endif // PROVSAN_SITE_PCS_H
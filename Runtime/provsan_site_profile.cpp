@@ -0,0 +1,153 @@
+#include "provsan_site_profile.h"
+#include "provsan_site_table.h"
+#include "provsan_utils.h"
+
+#include <sstream>
+#include <sys/mman.h>
+#include <x86intrin.h>
+
+namespace __provsan {
+
+static SiteProfile *SiteProfiles = nullptr;
+static uint64_t SiteProfileCount = 0;
+// Reference points for converting lifetimes from TSC cycles to nanoseconds.
+static uint64_t ProfileTscBase = 0;
+static uint64_t ProfileNsBase = 0;
+
+void initSiteProfiles() {
+  if (SiteProfiles || !siteTableSize())
+    return;
+
+  // Only the pages of sites that record anything are ever backed.
+  uint64_t count = siteTableSize();
+  void *mapping = mmap(nullptr, count * sizeof(SiteProfile),
+                       PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (mapping == MAP_FAILED) {
+    REPORT("ERROR : Unable to map site profiles.\n");
+    return;
+  }
+  SiteProfileCount = count;
+  ProfileTscBase = __rdtsc();
+  ProfileNsBase = monotonicNs();
+  SiteProfiles = static_cast<SiteProfile *>(mapping);
+}
+
+static SiteProfile *getSiteProfile(uint32_t siteIndex) {
+  if (!SiteProfiles || siteIndex >= SiteProfileCount)
+    return nullptr;
+  return &SiteProfiles[siteIndex];
+}
+
+void recordSiteAccess(uint32_t siteIndex, uint64_t offset, AccessKind kind) {
+  if (SiteProfile *profile = getSiteProfile(siteIndex))
+    profile->accesses[kind][offsetBucket(offset)].fetch_add(
+        1, std::memory_order_relaxed);
+}
+
+void recordSiteSize(uint32_t siteIndex, uint64_t size) {
+  if (SiteProfile *profile = getSiteProfile(siteIndex))
+    profile->sizes[sizeBucket(size)].fetch_add(1, std::memory_order_relaxed);
+}
+
+void recordSiteLifetime(uint32_t siteIndex, uint64_t cycles) {
+  if (SiteProfile *profile = getSiteProfile(siteIndex))
+    profile->lifetimes[lifetimeBucket(cycles)].fetch_add(
+        1, std::memory_order_relaxed);
+}
+
+void recordSiteLiveAtExit(uint32_t siteIndex) {
+  if (SiteProfile *profile = getSiteProfile(siteIndex))
+    profile->liveAtExit.fetch_add(1, std::memory_order_relaxed);
+}
+
+// First offset that falls into the given bucket.
+static uint64_t offsetBucketStart(unsigned bucket) {
+  unsigned linear = OFFSET_LINEAR_LIMIT / OFFSET_GRANULE;
+  if (bucket < linear)
+    return (uint64_t)bucket * OFFSET_GRANULE;
+  return (uint64_t)OFFSET_LINEAR_LIMIT << (bucket - linear);
+}
+
+static void formatAccesses(std::ostream &OS, SiteProfile &profile) {
+  uint64_t totals[NUM_ACCESS_KINDS] = {0, 0};
+  for (unsigned kind = 0; kind < NUM_ACCESS_KINDS; ++kind)
+    for (auto &count : profile.accesses[kind])
+      totals[kind] += count.load(std::memory_order_relaxed);
+  if (!totals[ACCESS_READ] && !totals[ACCESS_WRITE])
+    return;
+
+  OS << ", \"accesses\": { \"reads\": " << totals[ACCESS_READ]
+     << ", \"writes\": " << totals[ACCESS_WRITE] << ", \"offsets\": [";
+  bool first = true;
+  for (unsigned bucket = 0; bucket < OFFSET_BUCKETS; ++bucket) {
+    uint32_t reads = profile.accesses[ACCESS_READ][bucket];
+    uint32_t writes = profile.accesses[ACCESS_WRITE][bucket];
+    if (!reads && !writes)
+      continue;
+    OS << (first ? "" : ", ") << "{ \"start\": " << offsetBucketStart(bucket);
+    // The last bucket is open ended.
+    if (bucket + 1 < OFFSET_BUCKETS)
+      OS << ", \"end\": " << offsetBucketStart(bucket + 1);
+    OS << ", \"reads\": " << reads << ", \"writes\": " << writes << " }";
+    first = false;
+  }
+  OS << "] }";
+}
+
+static void formatSizes(std::ostream &OS, SiteProfile &profile) {
+  bool first = true;
+  for (unsigned bucket = 0; bucket < SIZE_BUCKETS; ++bucket) {
+    uint64_t count = profile.sizes[bucket].load(std::memory_order_relaxed);
+    if (!count)
+      continue;
+    OS << (first ? ", \"sizes\": [" : ", ") << "{ \"maxSize\": "
+       << (1ULL << bucket) << ", \"count\": " << count << " }";
+    first = false;
+  }
+  if (!first)
+    OS << "]";
+}
+
+static void formatLifetimes(std::ostream &OS, SiteProfile &profile) {
+  // Bucket bounds are reported in ns.
+  double nsPerCycle = 0;
+  uint64_t cycles = __rdtsc() - ProfileTscBase;
+  if (cycles)
+    nsPerCycle = (double)(monotonicNs() - ProfileNsBase) / cycles;
+
+  bool first = true;
+  for (unsigned bucket = 0; bucket < LIFETIME_BUCKETS; ++bucket) {
+    uint64_t count = profile.lifetimes[bucket].load(std::memory_order_relaxed);
+    if (!count)
+      continue;
+    OS << (first ? ", \"lifetimes\": [" : ", ") << "{ ";
+    // The last bucket is open ended.
+    if (bucket + 1 < LIFETIME_BUCKETS)
+      OS << "\"maxNs\": " << (uint64_t)((1ULL << bucket) * nsPerCycle) << ", ";
+    OS << "\"count\": " << count << " }";
+    first = false;
+  }
+  // Allocations that were never freed get a bucket of their own.
+  if (uint64_t live = profile.liveAtExit.load(std::memory_order_relaxed)) {
+    OS << (first ? ", \"lifetimes\": [" : ", ")
+       << "{ \"liveAtExit\": true, \"count\": " << live << " }";
+    first = false;
+  }
+  if (!first)
+    OS << "]";
+}
+
+std::string formatSiteProfile(uint32_t siteIndex) {
+  SiteProfile *profile = getSiteProfile(siteIndex);
+  if (!profile)
+    return "";
+
+  std::ostringstream OS;
+  formatAccesses(OS, *profile);
+  formatSizes(OS, *profile);
+  formatLifetimes(OS, *profile);
+  return OS.str();
+}
+
+} // namespace __provsan
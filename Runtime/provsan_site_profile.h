@@ -0,0 +1,92 @@
+#ifndef PROVSAN_SITE_PROFILE_H
+#define PROVSAN_SITE_PROFILE_H
+
+#include "provsan_common.h"
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+namespace __provsan {
+
+// Offsets below OFFSET_LINEAR_LIMIT are bucketed in OFFSET_GRANULE byte
+// steps, larger offsets by log2.
+#define OFFSET_GRANULE 8
+#define OFFSET_LINEAR_LIMIT 256
+#define OFFSET_BUCKETS 64
+// Sizes are bucketed by the next power of two, lifetimes by log2 of the
+// elapsed TSC cycles.
+#define SIZE_BUCKETS 48
+#define LIFETIME_BUCKETS 48
+
+enum AccessKind { ACCESS_READ, ACCESS_WRITE, NUM_ACCESS_KINDS };
+
+/**
+ * @brief Histograms collected for a single allocation site, indexed by its
+ * site table index.
+ *
+ * @param accesses Faulting accesses by kind and offset into the allocation.
+ * The offsets show which byte ranges of a shared object are touched from the
+ * other compartment, e.g. to split hot fields into a separate allocation.
+ * @param sizes Allocation sizes, bucketed by size class.
+ * @param lifetimes Time from allocation to free (or reallocation).
+ * @param liveAtExit Allocations still tracked when the profile was written,
+ * which have no lifetime.
+ *
+ * @note Sizes and lifetimes describe how much memory a site would draw from an
+ * untrusted arena once it is patched, and how long it would hold on to it.
+ */
+struct SiteProfile {
+  std::atomic<uint32_t> accesses[NUM_ACCESS_KINDS][OFFSET_BUCKETS];
+  std::atomic<uint64_t> sizes[SIZE_BUCKETS];
+  std::atomic<uint64_t> lifetimes[LIFETIME_BUCKETS];
+  std::atomic<uint64_t> liveAtExit;
+};
+
+/// Maps one SiteProfile per site table slot. Must run after initSiteTable.
+void initSiteProfiles();
+
+/// Returns the bucket for an offset into an allocation.
+inline unsigned offsetBucket(uint64_t offset) {
+  if (offset < OFFSET_LINEAR_LIMIT)
+    return offset / OFFSET_GRANULE;
+  unsigned bucket = OFFSET_LINEAR_LIMIT / OFFSET_GRANULE +
+                    (63 - __builtin_clzll(offset)) -
+                    __builtin_ctz(OFFSET_LINEAR_LIMIT);
+  return bucket < OFFSET_BUCKETS ? bucket : OFFSET_BUCKETS - 1;
+}
+
+/// Returns the bucket of an allocation size, bucket n holds sizes in
+/// (2^(n-1), 2^n].
+inline unsigned sizeBucket(uint64_t size) {
+  unsigned bucket = size > 1 ? 64 - __builtin_clzll(size - 1) : 0;
+  return bucket < SIZE_BUCKETS ? bucket : SIZE_BUCKETS - 1;
+}
+
+/// Returns the bucket of a lifetime, bucket n holds lifetimes in
+/// [2^(n-1), 2^n) cycles.
+inline unsigned lifetimeBucket(uint64_t cycles) {
+  unsigned bucket = cycles ? 64 - __builtin_clzll(cycles) : 0;
+  return bucket < LIFETIME_BUCKETS ? bucket : LIFETIME_BUCKETS - 1;
+}
+
+/// Records the size of an allocation made at the site.
+void recordSiteSize(uint32_t siteIndex, uint64_t size);
+
+/// Records the lifetime, in TSC cycles, of an allocation made at the site.
+void recordSiteLifetime(uint32_t siteIndex, uint64_t cycles);
+
+/// Records an allocation of the site that was never freed.
+void recordSiteLiveAtExit(uint32_t siteIndex);
+
+/// Records a faulting access at the given offset into an allocation of the
+/// site. Async signal safe.
+void recordSiteAccess(uint32_t siteIndex, uint64_t offset, AccessKind kind);
+
+/// Formats the profile of a site as JSON fields, starting with a comma.
+/// Returns an empty string if nothing was recorded for the site.
+std::string formatSiteProfile(uint32_t siteIndex);
+
+} // namespace __provsan
+
+#endif // PROVSAN_SITE_PROFILE_H
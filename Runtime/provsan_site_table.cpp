@@ -0,0 +1,295 @@
+#include "provsan_site_table.h"
+#include "provsan_stats.h"
+
+#include <cstdlib>
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace __provsan {
+
+std::atomic<uint64_t> *SiteCoverage = nullptr;
+
+static SiteEntry *SiteTable = nullptr;
+static uint64_t SiteTableMask = 0;
+static bool SiteTableShared = false;
+static pid_t SiteTableOwner = 0;
+
+/// Maps allocator site tags to site indices, with the same number of slots as
+/// the site table. Tags are addresses, so this table is always private.
+struct SiteTag {
+  std::atomic<uintptr_t> tag;
+  // Site index + 1, 0 until the slot is filled in.
+  std::atomic<uint32_t> index;
+};
+static SiteTag *SiteTags = nullptr;
+
+/// Copies of the site names, in the same mapping as the table so that every
+/// process sharing the table can read them. Offset 0 is the empty string.
+struct SiteNames {
+  std::atomic<uint64_t> tail;
+  uint64_t capacity;
+  char data[];
+};
+static SiteNames *SiteNameArea = nullptr;
+
+// Number of pause and yield iterations to wait for a claimed slot to be
+// filled in, see waitForEntry.
+#define SITE_READY_SPINS 1024
+#define SITE_READY_YIELDS 16384
+
+// Copies a name into the string area, and returns its offset.
+static uint32_t copySiteName(const char *name) {
+  if (!SiteNameArea || !name)
+    return 0;
+  uint64_t length = strlen(name) + 1;
+  uint64_t offset =
+      SiteNameArea->tail.fetch_add(length, std::memory_order_relaxed);
+  if (offset + length > SiteNameArea->capacity) {
+    REPORT("ERROR : Site table names are full, site %s is not named.\n", name);
+    return 0;
+  }
+  memcpy(SiteNameArea->data + offset, name, length);
+  return offset;
+}
+
+const char *siteBBName(const SiteEntry &entry) {
+  return SiteNameArea ? SiteNameArea->data + entry.bbNameOffset : "";
+}
+
+const char *siteFuncName(const SiteEntry &entry) {
+  return SiteNameArea ? SiteNameArea->data + entry.funcNameOffset : "";
+}
+
+// Waits for the slot's claimer to fill it in. Slots are filled in right after
+// they are claimed, so this only gives up if the claimer died in between,
+// which is possible when the table is shared by several processes. The first
+// reader to give up marks the slot abandoned, so later probes skip it without
+// waiting.
+static bool waitForEntry(SiteEntry &entry) {
+  for (uint32_t spins = 0;; ++spins) {
+    uint32_t state = entry.ready.load(std::memory_order_acquire);
+    if (state != SITE_ENTRY_CLAIMED)
+      return state == SITE_ENTRY_READY;
+    if (spins == SITE_READY_SPINS + SITE_READY_YIELDS) {
+      // Fails if the claimer filled the slot in after all.
+      entry.ready.compare_exchange_strong(state, SITE_ENTRY_ABANDONED,
+                                          std::memory_order_acq_rel);
+      return state == SITE_ENTRY_READY;
+    }
+    if (spins < SITE_READY_SPINS)
+      __builtin_ia32_pause();
+    else
+      sched_yield();
+  }
+}
+
+static inline uint64_t siteKey(int64_t localID, const char *funcName) {
+  uint64_t key = (uintptr_t)funcName * 0x9E3779B97F4A7C15ULL;
+  key ^= (uint64_t)localID * 0xC2B2AE3D27D4EB4FULL;
+  key ^= key >> 29;
+  // 0 marks a free slot.
+  return key | 1;
+}
+
+void initSiteTable() {
+  if (SiteTable)
+    return;
+
+  uint64_t slots = SITE_TABLE_DEFAULT_SIZE;
+  if (const char *size = getenv("PROVSAN_SITE_TABLE_SIZE")) {
+    uint64_t requested = strtoull(size, nullptr, 0);
+    // Round up to the next power of two.
+    if (requested > 0) {
+      slots = 1;
+      while (slots < requested)
+        slots <<= 1;
+    }
+  }
+
+  const char *shared = getenv("PROVSAN_SHARED_FAULTS");
+  SiteTableShared = shared && atoi(shared) != 0;
+
+  // Anonymous mappings are zero filled, so every slot starts out free. Pages
+  // are only backed once a site hashes into them. The coverage bitmap and the
+  // site names follow the entries in the same mapping.
+  size_t table_size = slots * sizeof(SiteEntry);
+  size_t coverage_size = ((slots + 63) / 64) * sizeof(uint64_t);
+  size_t names_size = sizeof(SiteNames) + slots * SITE_NAME_BYTES_PER_SLOT;
+  int flags = MAP_ANONYMOUS | MAP_NORESERVE |
+              (SiteTableShared ? MAP_SHARED : MAP_PRIVATE);
+  void *mapping = mmap(nullptr, table_size + coverage_size + names_size,
+                       PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (mapping == MAP_FAILED) {
+    REPORT("ERROR : Unable to map site table.\n");
+    SiteTableShared = false;
+    return;
+  }
+
+  SiteTableMask = slots - 1;
+  SiteTableOwner = getpid();
+  SiteTable = static_cast<SiteEntry *>(mapping);
+  SiteCoverage = reinterpret_cast<std::atomic<uint64_t> *>(
+      static_cast<char *>(mapping) + table_size);
+  SiteNameArea = reinterpret_cast<SiteNames *>(
+      static_cast<char *>(mapping) + table_size + coverage_size);
+  SiteNameArea->capacity = slots * SITE_NAME_BYTES_PER_SLOT;
+  // The first byte stays zero, for unnamed sites.
+  SiteNameArea->tail.store(1, std::memory_order_relaxed);
+  void *tags = mmap(nullptr, slots * sizeof(SiteTag), PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (tags != MAP_FAILED)
+    SiteTags = static_cast<SiteTag *>(tags);
+  REPORT("INFO : Mapped %s site table with %lu slots.\n",
+         SiteTableShared ? "shared" : "private", slots);
+}
+
+// Pre-forking servers may fork their workers before any hook runs, which
+// would leave each worker with a private table.
+static void __attribute__((constructor)) init_shared_site_table() {
+  const char *shared = getenv("PROVSAN_SHARED_FAULTS");
+  if (shared && atoi(shared) != 0)
+    initSiteTable();
+}
+
+uint64_t siteTableSize() { return SiteTable ? SiteTableMask + 1 : 0; }
+
+uint32_t getSiteIndex(int64_t localID, const char *bbName,
+                      const char *funcName, bool isRealloc) {
+  if (!SiteTable)
+    return NO_SITE_INDEX;
+
+  uint64_t key = siteKey(localID, funcName);
+  for (uint64_t probe = 0; probe <= SiteTableMask; ++probe) {
+    uint64_t index = (key + probe) & SiteTableMask;
+    SiteEntry &entry = SiteTable[index];
+
+    uint64_t found = entry.key.load(std::memory_order_acquire);
+    if (found == 0) {
+      if (entry.key.compare_exchange_strong(found, key,
+                                            std::memory_order_acq_rel)) {
+        entry.localID = localID;
+        entry.funcNameKey = (uintptr_t)funcName;
+        entry.bbNameOffset = copySiteName(bbName);
+        entry.funcNameOffset = copySiteName(funcName);
+        entry.isRealloc = isRealloc;
+        // A reader that waited too long may have abandoned the slot, in which
+        // case the site goes to the next free one.
+        uint32_t state = SITE_ENTRY_CLAIMED;
+        if (!entry.ready.compare_exchange_strong(state, SITE_ENTRY_READY,
+                                                 std::memory_order_acq_rel))
+          continue;
+        if (Stats)
+          Stats->trackedSites.fetch_add(1, std::memory_order_relaxed);
+        return index;
+      }
+      // Lost the race, `found` now holds the winning key.
+    }
+
+    if (found != key)
+      continue;
+
+    // Another thread claimed the slot for a site with the same key, wait
+    // until it has filled in the entry before comparing.
+    if (!waitForEntry(entry))
+      continue;
+
+    if (entry.funcNameKey == (uintptr_t)funcName && entry.localID == localID)
+      return index;
+  }
+
+  REPORT("ERROR : Site table is full, consider raising "
+         "PROVSAN_SITE_TABLE_SIZE.\n");
+  return NO_SITE_INDEX;
+}
+
+SiteEntry *getSiteEntry(uint32_t index) {
+  if (!SiteTable || index == NO_SITE_INDEX)
+    return nullptr;
+  return &SiteTable[index];
+}
+
+uint32_t getSiteEntryIndex(const SiteEntry &entry) {
+  return &entry - SiteTable;
+}
+
+void bindSiteTag(uintptr_t tag, uint32_t index) {
+  if (!SiteTags || !tag || index == NO_SITE_INDEX)
+    return;
+
+  uint64_t hash = tag * 0x9E3779B97F4A7C15ULL;
+  for (uint64_t probe = 0; probe <= SiteTableMask; ++probe) {
+    SiteTag &slot = SiteTags[(hash + probe) & SiteTableMask];
+    uintptr_t found = slot.tag.load(std::memory_order_acquire);
+    if (found == 0 &&
+        slot.tag.compare_exchange_strong(found, tag, std::memory_order_acq_rel)) {
+      slot.index.store(index + 1, std::memory_order_release);
+      return;
+    }
+    if (found == tag)
+      return;
+  }
+}
+
+uint32_t lookupSiteTag(uintptr_t tag) {
+  if (!SiteTags || !tag)
+    return NO_SITE_INDEX;
+
+  uint64_t hash = tag * 0x9E3779B97F4A7C15ULL;
+  for (uint64_t probe = 0; probe <= SiteTableMask; ++probe) {
+    SiteTag &slot = SiteTags[(hash + probe) & SiteTableMask];
+    uintptr_t found = slot.tag.load(std::memory_order_acquire);
+    if (found == 0)
+      return NO_SITE_INDEX;
+    if (found == tag) {
+      uint32_t index = slot.index.load(std::memory_order_acquire);
+      return index ? index - 1 : NO_SITE_INDEX;
+    }
+  }
+  return NO_SITE_INDEX;
+}
+
+bool markSiteFaulted(uint32_t index, uint32_t pkey) {
+  SiteEntry *entry = getSiteEntry(index);
+  if (!entry)
+    return true;
+
+  if (entry->faulted.load(std::memory_order_relaxed))
+    return false;
+  if (entry->faulted.exchange(1, std::memory_order_acq_rel))
+    return false;
+  entry->pkey = pkey;
+  return true;
+}
+
+bool sharedFaultsEnabled() { return SiteTableShared; }
+
+pid_t sharedFaultsOwner() { return SiteTableOwner; }
+
+void forEachFaultedSite(const std::function<void(const SiteEntry &)> &F) {
+  if (!SiteTable)
+    return;
+
+  for (uint64_t index = 0; index <= SiteTableMask; ++index) {
+    SiteEntry &entry = SiteTable[index];
+    if (entry.ready.load(std::memory_order_acquire) == SITE_ENTRY_READY &&
+        entry.faulted.load(std::memory_order_acquire))
+      F(entry);
+  }
+}
+
+void forEachExecutedSite(const std::function<void(const SiteEntry &)> &F) {
+  if (!SiteTable)
+    return;
+
+  for (uint64_t index = 0; index <= SiteTableMask; ++index) {
+    uint64_t word = SiteCoverage[index / 64].load(std::memory_order_relaxed);
+    if (!(word & (1ULL << (index % 64))))
+      continue;
+    SiteEntry &entry = SiteTable[index];
+    if (entry.ready.load(std::memory_order_acquire) == SITE_ENTRY_READY)
+      F(entry);
+  }
+}
+
+} // namespace __provsan
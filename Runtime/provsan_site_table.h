@@ -0,0 +1,120 @@
+#ifndef PROVSAN_SITE_TABLE_H
+#define PROVSAN_SITE_TABLE_H
+
+#include "provsan_common.h"
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <sys/types.h>
+
+namespace __provsan {
+
+#define NO_SITE_INDEX UINT32_MAX
+// Default number of slots in the site table, must be a power of two. Can be
+// overridden with the PROVSAN_SITE_TABLE_SIZE environment variable.
+#define SITE_TABLE_DEFAULT_SIZE (1 << 16)
+// Bytes of site names the table can hold per slot, on average.
+#define SITE_NAME_BYTES_PER_SLOT 128
+// States of SiteEntry::ready.
+#define SITE_ENTRY_CLAIMED 0
+#define SITE_ENTRY_READY 1
+#define SITE_ENTRY_ABANDONED 2
+
+/**
+ * @brief A slot in the site table, describing one instrumented allocation
+ * site.
+ *
+ * @param key Hash of <funcName, localID>, 0 while the slot is free.
+ * @param ready SITE_ENTRY_READY once the remaining fields of a claimed slot are
+ * valid, SITE_ENTRY_ABANDONED if its claimer gave no sign of life for too
+ * long. Abandoned slots stay claimed and are skipped by every probe.
+ * @param faulted Set once any process sharing the table faulted on the site.
+ * @param funcNameKey Address of the funcName constant passed to the hooks. It
+ * identifies the site and is never dereferenced, as the process that
+ * registered the site may have mapped it from a library the reader never
+ * loaded.
+ * @param bbNameOffset/funcNameOffset Copies of the names in the string area of
+ * the table, read through siteBBName and siteFuncName.
+ */
+struct SiteEntry {
+  std::atomic<uint64_t> key;
+  std::atomic<uint32_t> ready;
+  std::atomic<uint32_t> faulted;
+  int64_t localID;
+  uintptr_t funcNameKey;
+  uint32_t bbNameOffset;
+  uint32_t funcNameOffset;
+  uint32_t pkey;
+  uint32_t isRealloc;
+};
+
+/// The names of a ready site table entry. Empty if the string area of the
+/// table was full when the site was registered.
+const char *siteBBName(const SiteEntry &entry);
+const char *siteFuncName(const SiteEntry &entry);
+
+// One bit per site table slot, set the first time the site allocates.
+extern std::atomic<uint64_t> *SiteCoverage;
+
+/// Maps the site table. When PROVSAN_SHARED_FAULTS=1 the table is placed in
+/// shared memory that is inherited across fork(), so that pre-forked workers
+/// share a single view of which sites have faulted. A shared table is mapped
+/// as soon as the runtime is loaded, so that it is shared with workers forked
+/// before the first hook runs.
+void initSiteTable();
+
+/// Returns the dense index of the given allocation site, registering it on
+/// first use. Lock free. Returns NO_SITE_INDEX if the table is full. A slot
+/// whose registration never completes (the registering process died in
+/// between) is skipped after a bounded wait.
+uint32_t getSiteIndex(int64_t localID, const char *bbName,
+                      const char *funcName, bool isRealloc);
+
+/// Records that the site has executed. Only the first call per site writes to
+/// the (shared) cache line, later calls are a relaxed load.
+inline void markSiteExecuted(uint32_t index) {
+  if (!SiteCoverage || index == NO_SITE_INDEX)
+    return;
+  std::atomic<uint64_t> &word = SiteCoverage[index / 64];
+  uint64_t bit = 1ULL << (index % 64);
+  if (!(word.load(std::memory_order_relaxed) & bit))
+    word.fetch_or(bit, std::memory_order_relaxed);
+}
+
+/// Number of slots in the site table, site indices are below this value.
+uint64_t siteTableSize();
+
+/// Returns the entry for a site index previously returned by getSiteIndex.
+SiteEntry *getSiteEntry(uint32_t index);
+
+/// Returns the site index of an entry of the table.
+uint32_t getSiteEntryIndex(const SiteEntry &entry);
+
+/// Associates an allocator site tag (the return address of the allocation
+/// call, see provsan_alloc_site_of) with a site index.
+void bindSiteTag(uintptr_t tag, uint32_t index);
+
+/// Returns the site index bound to an allocator site tag, or NO_SITE_INDEX.
+uint32_t lookupSiteTag(uintptr_t tag);
+
+/// Marks the site as faulted. Returns true if this call was the first to do
+/// so across all processes sharing the table.
+bool markSiteFaulted(uint32_t index, uint32_t pkey);
+
+/// True if the site table is shared across fork().
+bool sharedFaultsEnabled();
+
+/// The process that created a shared site table, and which is responsible for
+/// writing the merged profile.
+pid_t sharedFaultsOwner();
+
+/// Calls F for every registered site that has faulted.
+void forEachFaultedSite(const std::function<void(const SiteEntry &)> &F);
+
+/// Calls F for every registered site that has executed.
+void forEachExecutedSite(const std::function<void(const SiteEntry &)> &F);
+
+} // namespace __provsan
+
+#endif // PROVSAN_SITE_TABLE_H
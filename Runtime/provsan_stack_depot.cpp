@@ -0,0 +1,201 @@
+#include "provsan_stack_depot.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sstream>
+#include <sys/mman.h>
+
+namespace __provsan {
+
+uint32_t AllocStackDepth = 0;
+
+// Stacks are stored back to back in the arena as [hash, size, frames...].
+// A stack id is the word offset of its entry, offset 0 is never used.
+static uintptr_t *DepotArena = nullptr;
+static uint64_t DepotArenaWords = 0;
+static std::atomic<uint64_t> DepotArenaUsed(1);
+// Open addressing table of stack ids, 0 marks a free bucket.
+static std::atomic<uint32_t> *DepotBuckets = nullptr;
+static uint64_t DepotBucketMask = 0;
+
+thread_local uintptr_t StackLow = 0;
+thread_local uintptr_t StackHigh = 0;
+
+void queryStackBounds() {
+  pthread_attr_t attr;
+  void *addr;
+  size_t size;
+  if (pthread_getattr_np(pthread_self(), &attr) != 0)
+    return;
+  if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+    StackLow = (uintptr_t)addr;
+    StackHigh = StackLow + size;
+  }
+  pthread_attr_destroy(&attr);
+}
+
+void initStackDepot() {
+  if (DepotArena)
+    return;
+  cacheStackBounds();
+
+  if (const char *depth = getenv("PROVSAN_ALLOC_STACKS")) {
+    AllocStackDepth = atoi(depth);
+    if (AllocStackDepth > STACK_DEPOT_MAX_FRAMES)
+      AllocStackDepth = STACK_DEPOT_MAX_FRAMES;
+  }
+
+  uint64_t size = STACK_DEPOT_DEFAULT_SIZE;
+  if (const char *requested = getenv("PROVSAN_STACK_DEPOT_SIZE"))
+    size = strtoull(requested, nullptr, 0);
+  if (size < 4096)
+    size = 4096;
+
+  // Budget roughly one bucket per 8 frames of storage.
+  uint64_t buckets = 1;
+  while (buckets * 8 * sizeof(uintptr_t) < size)
+    buckets <<= 1;
+
+  void *arena = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  void *table = mmap(nullptr, buckets * sizeof(uint32_t),
+                     PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (arena == MAP_FAILED || table == MAP_FAILED) {
+    REPORT("ERROR : Unable to reserve the stack depot.\n");
+    AllocStackDepth = 0;
+    return;
+  }
+
+  DepotArenaWords = size / sizeof(uintptr_t);
+  DepotBuckets = static_cast<std::atomic<uint32_t> *>(table);
+  DepotBucketMask = buckets - 1;
+  DepotArena = static_cast<uintptr_t *>(arena);
+}
+
+static uint64_t hashStack(const uintptr_t *frames, uint32_t size) {
+  // FNV-1a over the frame addresses.
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (uint32_t i = 0; i < size; ++i) {
+    hash ^= frames[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash ^ size;
+}
+
+static bool sameStack(uint32_t id, uint64_t hash, const uintptr_t *frames,
+                      uint32_t size) {
+  const uintptr_t *entry = &DepotArena[id];
+  if (entry[0] != hash || entry[1] != size)
+    return false;
+  return memcmp(&entry[2], frames, size * sizeof(uintptr_t)) == 0;
+}
+
+uint32_t depotPut(const uintptr_t *frames, uint32_t size) {
+  if (!DepotArena || size == 0)
+    return NO_STACK_ID;
+
+  uint64_t hash = hashStack(frames, size);
+  uint32_t reserved = NO_STACK_ID;
+  for (uint64_t probe = 0; probe <= DepotBucketMask; ++probe) {
+    std::atomic<uint32_t> &bucket = DepotBuckets[(hash + probe) & DepotBucketMask];
+    uint32_t id = bucket.load(std::memory_order_acquire);
+
+    if (id == NO_STACK_ID) {
+      // Write the stack into the arena before publishing it in the table. If
+      // another thread wins the bucket, the reserved entry is reused for the
+      // next free bucket (or wasted, which is bounded by the arena size).
+      if (reserved == NO_STACK_ID) {
+        uint64_t offset =
+            DepotArenaUsed.fetch_add(size + 2, std::memory_order_relaxed);
+        if (offset + size + 2 > DepotArenaWords || offset > UINT32_MAX)
+          return NO_STACK_ID;
+        DepotArena[offset] = hash;
+        DepotArena[offset + 1] = size;
+        memcpy(&DepotArena[offset + 2], frames, size * sizeof(uintptr_t));
+        reserved = offset;
+      }
+      if (bucket.compare_exchange_strong(id, reserved,
+                                         std::memory_order_acq_rel))
+        return reserved;
+      // Lost the race, `id` now holds the winner.
+    }
+
+    if (sameStack(id, hash, frames, size))
+      return id;
+  }
+  return NO_STACK_ID;
+}
+
+bool depotGet(uint32_t id, const uintptr_t *&frames, uint32_t &size) {
+  if (!DepotArena || id == NO_STACK_ID || id >= DepotArenaWords)
+    return false;
+  size = DepotArena[id + 1];
+  frames = &DepotArena[id + 2];
+  return true;
+}
+
+uint32_t unwindFramePointers(uintptr_t pc, uintptr_t fp, uintptr_t *frames,
+                             uint32_t max, uintptr_t sp) {
+  if (max == 0)
+    return 0;
+
+  if (!sp)
+    cacheStackBounds();
+
+  uintptr_t low = StackLow;
+  uintptr_t high = StackHigh;
+  uint32_t size = 0;
+  frames[size++] = pc;
+  if (sp) {
+    // Without the bounds of the stack, or on a stack other than the thread's
+    // own, a corrupt frame pointer could not be told apart from a valid one.
+    if (sp < low || sp >= high)
+      return size;
+    // Frames live between the interrupted stack pointer and the stack base.
+    low = sp;
+  }
+  while (size < max) {
+    // Frame records are [previous fp, return address], and must be aligned,
+    // on this thread's stack, and move towards the stack base.
+    if (fp & (sizeof(uintptr_t) - 1) || fp < low ||
+        fp + 2 * sizeof(uintptr_t) > high)
+      break;
+    uintptr_t *record = (uintptr_t *)fp;
+    uintptr_t ret = record[1];
+    if (!ret)
+      break;
+    frames[size++] = ret;
+    if (record[0] <= fp)
+      break;
+    fp = record[0];
+  }
+  return size;
+}
+
+std::string formatStack(uint32_t id) {
+  const uintptr_t *frames;
+  uint32_t size;
+  if (!depotGet(id, frames, size))
+    return "[]";
+
+  // Addresses are printed relative to their module, so they can be
+  // symbolized offline regardless of ASLR.
+  std::ostringstream OS;
+  OS << "[";
+  for (uint32_t i = 0; i < size; ++i) {
+    Dl_info info;
+    if (dladdr((void *)frames[i], &info) && info.dli_fname)
+      OS << "\"" << info.dli_fname << "+0x" << std::hex
+         << frames[i] - (uintptr_t)info.dli_fbase << std::dec << "\"";
+    else
+      OS << "\"0x" << std::hex << frames[i] << std::dec << "\"";
+    OS << (i + 1 == size ? "" : ", ");
+  }
+  OS << "]";
+  return OS.str();
+}
+
+} // namespace __provsan
@@ -0,0 +1,85 @@
+#ifndef PROVSAN_STACK_DEPOT_H
+#define PROVSAN_STACK_DEPOT_H
+
+#include "provsan_common.h"
+
+#include <cstdint>
+#include <string>
+
+namespace __provsan {
+
+// Stack id used for "no stack".
+#define NO_STACK_ID 0
+// Maximum number of frames stored for a single stack.
+#define STACK_DEPOT_MAX_FRAMES 32
+// Default amount of memory reserved for stack frames. Can be overridden with
+// the PROVSAN_STACK_DEPOT_SIZE environment variable.
+#define STACK_DEPOT_DEFAULT_SIZE (16 << 20)
+
+/**
+ * @brief A lock free, deduplicating store for call stacks.
+ *
+ * @note Stacks are hash-consed: identical stacks share a single compact id, so
+ * recording a stack for every allocation costs one hash table probe in the
+ * common case. All memory is reserved up front and bounded, and no function
+ * allocates or takes a lock, so the depot can be used from signal handlers.
+ * Once the depot is full, new stacks map to NO_STACK_ID.
+ */
+
+/// Reserves the depot memory.
+void initStackDepot();
+
+/// Returns the id of the given stack, inserting it if it is not yet known.
+uint32_t depotPut(const uintptr_t *frames, uint32_t size);
+
+/// Looks up a stack previously returned by depotPut.
+bool depotGet(uint32_t id, const uintptr_t *&frames, uint32_t &size);
+
+/// Bounds of the calling thread's stack, zero until cacheStackBounds ran on
+/// the thread.
+extern thread_local uintptr_t StackLow;
+extern thread_local uintptr_t StackHigh;
+
+/// Queries the bounds of the calling thread's stack (not async signal safe).
+void queryStackBounds();
+
+/// Caches the bounds of the calling thread's stack, for the unwinds done
+/// later in the fault handler. Called from the hooks.
+inline void cacheStackBounds() {
+  if (!StackHigh)
+    queryStackBounds();
+}
+
+/// Unwinds the frame pointer chain starting at fp, storing pc as the first
+/// frame. Frame pointers outside the current thread's stack end the walk.
+/// Signal handlers pass the stack pointer of the interrupted context as sp.
+/// The bounds are not queried then (which is not async signal safe), and only
+/// pc is returned on threads whose bounds were not cached yet, or that run
+/// on another stack.
+uint32_t unwindFramePointers(uintptr_t pc, uintptr_t fp, uintptr_t *frames,
+                             uint32_t max, uintptr_t sp = 0);
+
+/// Number of frames captured for each allocation, set from
+/// PROVSAN_ALLOC_STACKS. Zero disables allocation stacks.
+extern uint32_t AllocStackDepth;
+
+/// Captures the call stack of the instrumented allocation site that called
+/// the current hook. Always inlined into the hook, so that the first frame is
+/// the hook's return address. Requires the instrumented code to keep frame
+/// pointers (-fno-omit-frame-pointer).
+__attribute__((always_inline)) inline uint32_t captureAllocStack() {
+  if (!AllocStackDepth)
+    return NO_STACK_ID;
+  uintptr_t frames[STACK_DEPOT_MAX_FRAMES];
+  uintptr_t pc = (uintptr_t)__builtin_return_address(0);
+  uintptr_t fp = *(uintptr_t *)__builtin_frame_address(0);
+  uint32_t size = unwindFramePointers(pc, fp, frames, AllocStackDepth);
+  return depotPut(frames, size);
+}
+
+/// Formats a stack as a JSON array of "module+0xoffset" strings.
+std::string formatStack(uint32_t id);
+
+} // namespace __provsan
+
+#endif // PROVSAN_STACK_DEPOT_H
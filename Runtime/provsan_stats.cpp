@@ -0,0 +1,146 @@
+#include "provsan_stats.h"
+#include "provsan_fault_handler.h"
+#include "provsan_utils.h"
+
+#include <cstdlib>
+#include <ctime>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace __provsan {
+
+StatsSegment *Stats = nullptr;
+
+static thread_local ThreadStats *CurrentThreadStats = nullptr;
+static pthread_key_t ThreadStatsKey;
+static bool StatsShared = false;
+// Plain storage, as static destructors may run before flush_allocs.
+static char StatsName[64];
+
+// Folds the counters of an exiting thread into the overflow slot, and frees its
+// slot for reuse. Events of the thread after this point (e.g. hooks run by
+// later TLS destructors) go to the overflow slot.
+static void releaseThreadStats(void *arg) {
+  auto *slot = static_cast<ThreadStats *>(arg);
+  ThreadStats &overflow = Stats->threads[0];
+  for (unsigned event = 0; event < NUM_STAT_EVENTS; ++event) {
+    overflow.events[event].fetch_add(
+        slot->events[event].exchange(0, std::memory_order_relaxed),
+        std::memory_order_relaxed);
+    for (unsigned bucket = 0; bucket < STATS_LATENCY_BUCKETS; ++bucket)
+      overflow.latency[event][bucket].fetch_add(
+          slot->latency[event][bucket].exchange(0, std::memory_order_relaxed),
+          std::memory_order_relaxed);
+  }
+  CurrentThreadStats = &overflow;
+  slot->tid.store(0, std::memory_order_release);
+}
+
+ThreadStats *threadStats(bool inSignalHandler) {
+  if (CurrentThreadStats)
+    return CurrentThreadStats;
+  // Claiming a slot registers its release with pthread_setspecific, which is
+  // not async signal safe. Until the thread runs a hook, its faults are
+  // counted in the overflow slot.
+  if (inSignalHandler)
+    return &Stats->threads[0];
+
+  uint32_t tid = gettid();
+  ThreadStats *slot = &Stats->threads[0];
+  for (unsigned index = 1; index < STATS_MAX_THREADS; ++index) {
+    uint32_t expected = 0;
+    if (Stats->threads[index].tid.compare_exchange_strong(
+            expected, tid, std::memory_order_acq_rel)) {
+      slot = &Stats->threads[index];
+      pthread_setspecific(ThreadStatsKey, slot);
+      break;
+    }
+  }
+  CurrentThreadStats = slot;
+  return slot;
+}
+
+void initStats() {
+  if (Stats)
+    return;
+
+  const char *enabled = getenv("PROVSAN_STATS");
+  if (enabled && atoi(enabled) == 0)
+    return;
+
+  // The segment outlives processes that crash, so it is only exported on
+  // request.
+  const char *shm = getenv("PROVSAN_STATS_SHM");
+  StatsShared = shm && atoi(shm) != 0;
+
+  void *mapping = MAP_FAILED;
+  if (StatsShared) {
+    snprintf(StatsName, sizeof(StatsName), "%s%d", STATS_SHM_PREFIX, getpid());
+    int fd = shm_open(StatsName, O_RDWR | O_CREAT | O_TRUNC,
+                      S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd != -1 && ftruncate(fd, sizeof(StatsSegment)) != -1)
+      mapping = mmap(nullptr, sizeof(StatsSegment), PROT_READ | PROT_WRITE,
+                     MAP_SHARED, fd, 0);
+    if (fd != -1)
+      close(fd);
+    if (mapping == MAP_FAILED) {
+      REPORT("ERROR : Unable to create stats segment %s.\n",
+             StatsName);
+      shm_unlink(StatsName);
+      StatsShared = false;
+    }
+  }
+
+  if (mapping == MAP_FAILED)
+    mapping = mmap(nullptr, sizeof(StatsSegment), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED) {
+    REPORT("ERROR : Unable to map stats segment.\n");
+    return;
+  }
+
+  auto *segment = static_cast<StatsSegment *>(mapping);
+  segment->tscBase = __rdtsc();
+  segment->nsBase = monotonicNs();
+  segment->version = STATS_VERSION;
+  segment->pid = getpid();
+  segment->maxThreads = STATS_MAX_THREADS;
+  segment->latencyBuckets = STATS_LATENCY_BUCKETS;
+  // Publish the magic last so readers never see a half initialized header.
+  __atomic_store_n(&segment->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+
+  pthread_key_create(&ThreadStatsKey, releaseThreadStats);
+  Stats = segment;
+  if (StatsShared)
+    REPORT("INFO : Exporting runtime statistics to %s.\n", StatsName);
+}
+
+void reopenStatsAfterFork() {
+  if (!Stats || !StatsShared)
+    return;
+
+  munmap(Stats, sizeof(StatsSegment));
+  Stats = nullptr;
+  CurrentThreadStats = nullptr;
+  pthread_key_delete(ThreadStatsKey);
+  initStats();
+}
+
+void retireStats() {
+  if (StatsShared && Stats && Stats->pid == (uint32_t)getpid())
+    shm_unlink(StatsName);
+}
+
+uint64_t totalStat(StatEvent event) {
+  if (!Stats)
+    return 0;
+
+  uint64_t total = 0;
+  for (auto &slot : Stats->threads)
+    total += slot.events[event].load(std::memory_order_relaxed);
+  return total;
+}
+
+} // namespace __provsan
@@ -0,0 +1,123 @@
+#ifndef PROVSAN_STATS_H
+#define PROVSAN_STATS_H
+
+#include "provsan_common.h"
+
+#include <atomic>
+#include <cstdint>
+#include <x86intrin.h>
+
+namespace __provsan {
+
+// "PVSANSTA" in little endian.
+#define STATS_MAGIC 0x4154534e41535650ULL
+#define STATS_VERSION 1
+// Number of per-thread slots. Threads beyond this share the overflow slot 0.
+#define STATS_MAX_THREADS 256
+// Latencies are bucketed by log2 of the elapsed TSC cycles.
+#define STATS_LATENCY_BUCKETS 40
+// Name of the shared memory segment is STATS_SHM_PREFIX followed by the pid.
+#define STATS_SHM_PREFIX "/provsan-stats-"
+
+enum StatEvent {
+  STAT_ALLOC_HOOK,
+  STAT_REALLOC_HOOK,
+  STAT_DEALLOC_HOOK,
+  STAT_FAULT,
+  NUM_STAT_EVENTS
+};
+
+/**
+ * @brief Counters and latency histograms for a single thread.
+ *
+ * @note Each slot is owned by exactly one thread, which updates it with plain
+ * relaxed loads and stores rather than read-modify-write operations. Slots are
+ * cache line aligned so that threads never share a line. Readers (the exit
+ * report and provsan-top) may observe slightly stale values.
+ */
+struct alignas(64) ThreadStats {
+  std::atomic<uint32_t> tid;
+  std::atomic<uint64_t> events[NUM_STAT_EVENTS];
+  std::atomic<uint64_t> latency[NUM_STAT_EVENTS][STATS_LATENCY_BUCKETS];
+};
+
+/**
+ * @brief Layout of the stats segment shared with provsan-top.
+ *
+ * @param tscBase/nsBase A TSC reading and the CLOCK_MONOTONIC time at which it
+ * was taken, so readers can convert cycles to time.
+ * @param liveAllocations Current size of the allocation map.
+ * @param trackedSites Number of sites registered in the site table.
+ */
+struct StatsSegment {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t pid;
+  uint32_t maxThreads;
+  uint32_t latencyBuckets;
+  uint64_t tscBase;
+  uint64_t nsBase;
+  std::atomic<uint64_t> liveAllocations;
+  std::atomic<uint64_t> trackedSites;
+  ThreadStats threads[STATS_MAX_THREADS];
+};
+
+extern StatsSegment *Stats;
+
+/// Returns the stats slot of the calling thread, claiming one on first use.
+/// Signal handlers get the overflow slot if the thread has none yet.
+ThreadStats *threadStats(bool inSignalHandler = false);
+
+/// Maps the stats segment. PROVSAN_STATS=0 disables statistics and
+/// PROVSAN_STATS_SHM=1 exports them to provsan-top.
+void initStats();
+
+/// Called in forked children, which export their own segment rather than
+/// writing into the parent's.
+void reopenStatsAfterFork();
+
+/// Removes the shared memory segment at exit.
+void retireStats();
+
+/// Sums an event counter over all threads.
+uint64_t totalStat(StatEvent event);
+
+inline unsigned latencyBucket(uint64_t cycles) {
+  unsigned bucket = cycles ? 64 - __builtin_clzll(cycles) : 0;
+  return bucket < STATS_LATENCY_BUCKETS ? bucket : STATS_LATENCY_BUCKETS - 1;
+}
+
+/// Counts an event and records its latency for the lifetime of the scope.
+class StatsScope {
+  ThreadStats *slot;
+  StatEvent event;
+  uint64_t start;
+
+public:
+  StatsScope(StatEvent event, bool inSignalHandler = false)
+      : slot(Stats ? threadStats(inSignalHandler) : nullptr), event(event),
+        start(slot ? __rdtsc() : 0) {}
+
+  ~StatsScope() {
+    if (!slot)
+      return;
+    uint64_t elapsed = __rdtsc() - start;
+    // Slot 0 is shared by threads that did not get their own slot.
+    if (slot == &Stats->threads[0]) {
+      slot->events[event].fetch_add(1, std::memory_order_relaxed);
+      slot->latency[event][latencyBucket(elapsed)].fetch_add(
+          1, std::memory_order_relaxed);
+      return;
+    }
+    auto &count = slot->events[event];
+    count.store(count.load(std::memory_order_relaxed) + 1,
+                std::memory_order_relaxed);
+    auto &bucket = slot->latency[event][latencyBucket(elapsed)];
+    bucket.store(bucket.load(std::memory_order_relaxed) + 1,
+                 std::memory_order_relaxed);
+  }
+};
+
+} // namespace __provsan
+
+#endif // PROVSAN_STATS_H
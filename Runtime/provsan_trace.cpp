@@ -0,0 +1,254 @@
+#include "provsan_trace.h"
+#include "provsan_formatter.h"
+#include "provsan_site_table.h"
+
+#include <atomic>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <mutex>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <x86intrin.h>
+
+namespace __provsan {
+
+bool TraceEnabled = false;
+
+// Values of TraceBuffer::lock.
+enum TraceLock : uint32_t { TRACE_UNLOCKED, TRACE_OWNER, TRACE_FLUSHER };
+
+struct TraceBuffer {
+  // Held by the owning thread while it appends, and by other threads while
+  // they flush the buffer.
+  std::atomic<uint32_t> lock;
+  int fd;
+  pid_t pid;
+  pid_t tid;
+  uint32_t count;
+  TraceEvent events[TRACE_BUFFER_EVENTS];
+};
+
+// Buffers are mapped on the first event of a thread, as a static TLS buffer
+// of this size would not fit when the runtime is loaded with dlopen.
+static thread_local TraceBuffer *ThreadTrace
+    __attribute__((tls_model("initial-exec"))) = nullptr;
+static std::atomic<TraceBuffer *> TraceBuffers[TRACE_MAX_THREADS];
+// Serializes flushes of other threads' buffers with the release of buffers by
+// exiting threads.
+static std::mutex TraceBuffersMutex;
+static pthread_key_t TraceKey;
+// trace-<pid>.sites, appended to the first time an event names a site.
+static int SitesFd = -1;
+// One bit per site table slot, set once the site was written to SitesFd.
+static std::atomic<uint64_t> *TracedSites = nullptr;
+
+static void writeAll(int fd, const void *data, size_t length) {
+  const char *bytes = static_cast<const char *>(data);
+  while (length) {
+    ssize_t written = write(fd, bytes, length);
+    if (written <= 0)
+      return;
+    bytes += written;
+    length -= written;
+  }
+}
+
+static void flushTraceBuffer(TraceBuffer *buffer) {
+  if (!buffer->count)
+    return;
+  if (buffer->fd == -1) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "TestResults/trace-%d-%d.ptrace", buffer->pid,
+             buffer->tid);
+    buffer->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                      S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (buffer->fd == -1) {
+      buffer->count = 0;
+      return;
+    }
+    TraceHeader header = {TRACE_MAGIC, TRACE_VERSION, (uint32_t)buffer->pid,
+                          (uint32_t)buffer->tid, sizeof(TraceEvent)};
+    writeAll(buffer->fd, &header, sizeof(header));
+  }
+  writeAll(buffer->fd, buffer->events, buffer->count * sizeof(TraceEvent));
+  buffer->count = 0;
+}
+
+static void releaseTraceBuffer(void *arg) {
+  auto *buffer = static_cast<TraceBuffer *>(arg);
+  {
+    // Once the slot is cleared, no other thread can reach the buffer.
+    std::lock_guard<std::mutex> guard(TraceBuffersMutex);
+    for (auto &slot : TraceBuffers) {
+      TraceBuffer *expected = buffer;
+      if (slot.compare_exchange_strong(expected, nullptr))
+        break;
+    }
+  }
+  flushTraceBuffer(buffer);
+  if (buffer->fd != -1)
+    close(buffer->fd);
+  if (ThreadTrace == buffer)
+    ThreadTrace = nullptr;
+  munmap(buffer, sizeof(TraceBuffer));
+}
+
+static TraceBuffer *threadTrace() {
+  if (__builtin_expect(ThreadTrace != nullptr, 1))
+    return ThreadTrace;
+
+  void *mapping = mmap(nullptr, sizeof(TraceBuffer), PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED)
+    return nullptr;
+  auto *buffer = static_cast<TraceBuffer *>(mapping);
+  buffer->fd = -1;
+  buffer->pid = getpid();
+  buffer->tid = syscall(SYS_gettid);
+  for (auto &slot : TraceBuffers) {
+    TraceBuffer *expected = nullptr;
+    if (slot.compare_exchange_strong(expected, buffer))
+      break;
+  }
+  // Flushes the buffer when the thread exits.
+  pthread_setspecific(TraceKey, buffer);
+  ThreadTrace = buffer;
+  return buffer;
+}
+
+static void openSitesFile() {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "TestResults/trace-%d.sites", getpid());
+  SitesFd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+                 S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (SitesFd == -1)
+    REPORT("ERROR : Unable to write %s.\n", path);
+}
+
+// Names the site in the sites file the first time an event refers to it, so
+// the names survive a crash. Not async-signal-safe.
+static void traceSiteName(uint32_t index) {
+  if (index == NO_SITE_INDEX || SitesFd == -1)
+    return;
+  std::atomic<uint64_t> &word = TracedSites[index / 64];
+  uint64_t bit = 1ULL << (index % 64);
+  if ((word.load(std::memory_order_relaxed) & bit) ||
+      (word.fetch_or(bit, std::memory_order_relaxed) & bit))
+    return;
+  const SiteEntry &site = *getSiteEntry(index);
+  // Appended with a single write, lines of concurrent writers do not mix.
+  char line[8192];
+  int length = snprintf(line, sizeof(line), "%u\t%ld\t%u\t%s\t%s\n", index,
+                        (long)site.localID, site.isRealloc, siteBBName(site),
+                        siteFuncName(site));
+  if (length <= 0)
+    return;
+  if ((size_t)length >= sizeof(line)) {
+    length = sizeof(line) - 1;
+    line[length - 1] = '\n';
+  }
+  writeAll(SitesFd, line, length);
+}
+
+void initTrace() {
+  const char *trace = getenv("PROVSAN_TRACE");
+  if (!trace || atoi(trace) == 0 || !makeTestDirectory("TestResults"))
+    return;
+  void *bitmap = mmap(nullptr, (siteTableSize() + 63) / 64 * sizeof(uint64_t),
+                      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+                      0);
+  if (bitmap == MAP_FAILED)
+    return;
+  TracedSites = static_cast<std::atomic<uint64_t> *>(bitmap);
+  openSitesFile();
+  pthread_key_create(&TraceKey, releaseTraceBuffer);
+  TraceEnabled = true;
+  REPORT("INFO : Recording event traces to TestResults/trace-%d-*.ptrace.\n",
+         getpid());
+}
+
+void recordTraceEvent(TraceEventKind kind, uint64_t ptr, uint64_t size,
+                      uint64_t aux, uint32_t site, uint16_t pkey) {
+  if (kind != TRACE_FAULT)
+    traceSiteName(site);
+  TraceBuffer *buffer = threadTrace();
+  if (!buffer)
+    return;
+  // A flush by another thread is short, wait for it. The buffer is only
+  // already held by this thread if a signal handler interrupted an append,
+  // the event is then dropped.
+  uint32_t expected = TRACE_UNLOCKED;
+  while (!buffer->lock.compare_exchange_weak(expected, TRACE_OWNER,
+                                             std::memory_order_acquire)) {
+    if (expected == TRACE_OWNER)
+      return;
+    expected = TRACE_UNLOCKED;
+    _mm_pause();
+  }
+  TraceEvent &event = buffer->events[buffer->count];
+  event.time = __rdtsc();
+  event.ptr = ptr;
+  event.size = size;
+  event.aux = aux;
+  event.site = site;
+  event.kind = kind;
+  event.pkey = pkey;
+  if (++buffer->count == TRACE_BUFFER_EVENTS)
+    flushTraceBuffer(buffer);
+  buffer->lock.store(TRACE_UNLOCKED, std::memory_order_release);
+}
+
+void finishTrace() {
+  if (!TraceEnabled)
+    return;
+  // Other threads may still be recording.
+  std::lock_guard<std::mutex> guard(TraceBuffersMutex);
+  for (auto &slot : TraceBuffers) {
+    TraceBuffer *buffer = slot.load();
+    if (!buffer)
+      continue;
+    uint32_t expected = TRACE_UNLOCKED;
+    while (!buffer->lock.compare_exchange_weak(expected, TRACE_FLUSHER,
+                                               std::memory_order_acquire)) {
+      expected = TRACE_UNLOCKED;
+      _mm_pause();
+    }
+    flushTraceBuffer(buffer);
+    buffer->lock.store(TRACE_UNLOCKED, std::memory_order_release);
+  }
+}
+
+void lockTraceForFork() { TraceBuffersMutex.lock(); }
+
+void unlockTraceAfterFork() { TraceBuffersMutex.unlock(); }
+
+void reopenTraceAfterFork() {
+  if (!TraceEnabled)
+    return;
+  // Only the forking thread exists in the child. Its unflushed events are
+  // written by the parent.
+  for (auto &slot : TraceBuffers)
+    if (slot.load() != ThreadTrace)
+      slot.store(nullptr);
+  if (TraceBuffer *buffer = ThreadTrace) {
+    if (buffer->fd != -1)
+      close(buffer->fd);
+    buffer->fd = -1;
+    buffer->count = 0;
+    buffer->pid = getpid();
+    buffer->tid = syscall(SYS_gettid);
+  }
+  // The child names its sites in its own file.
+  if (SitesFd != -1)
+    close(SitesFd);
+  memset((void *)TracedSites, 0,
+         (siteTableSize() + 63) / 64 * sizeof(uint64_t));
+  openSitesFile();
+}
+
+} // namespace __provsan
@@ -0,0 +1,98 @@
+#ifndef PROVSAN_TRACE_H
+#define PROVSAN_TRACE_H
+
+#include "provsan_common.h"
+
+#include <cstdint>
+
+namespace __provsan {
+
+// "PVSANTRC" in little endian.
+#define TRACE_MAGIC 0x4352544e41535650ULL
+#define TRACE_VERSION 1
+// Number of events a thread buffers before writing them out.
+#define TRACE_BUFFER_EVENTS 4096
+// Maximum number of threads with a live trace buffer.
+#define TRACE_MAX_THREADS 4096
+
+enum TraceEventKind : uint16_t {
+  TRACE_ALLOC = 1,
+  TRACE_REALLOC,
+  TRACE_FREE,
+  TRACE_FAULT,
+};
+
+// Set in aux of TRACE_FAULT events for write accesses.
+#define TRACE_FAULT_WRITE 0x1
+
+/**
+ * @brief Header of a per-thread trace file
+ * (TestResults/trace-<pid>-<tid>.ptrace), followed by TraceEvents.
+ */
+struct TraceHeader {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t pid;
+  uint32_t tid;
+  uint32_t eventSize;
+};
+
+/**
+ * @brief A single recorded event.
+ *
+ * @param time TSC reading, comparable across the threads of a process.
+ * @param ptr The allocation (new allocation for reallocs), or the faulting
+ * address.
+ * @param size Size of the (new) allocation.
+ * @param aux The old allocation for reallocs, TRACE_FAULT_* flags for faults.
+ * @param site Site table index, NO_SITE_INDEX if unknown. For faults, the
+ * site the runtime attributed the fault to.
+ * @param pkey The faulting pkey.
+ *
+ * @note Site indices are resolved to sites through
+ * TestResults/trace-<pid>.sites, which holds one
+ * "<index>\t<localID>\t<isRealloc>\t<bbName>\t<funcName>" line per site. A
+ * line is appended the first time an allocation or realloc event names the
+ * site, so the file is complete even if the process crashes.
+ */
+struct TraceEvent {
+  uint64_t time;
+  uint64_t ptr;
+  uint64_t size;
+  uint64_t aux;
+  uint32_t site;
+  uint16_t kind;
+  uint16_t pkey;
+};
+
+extern bool TraceEnabled;
+
+/// Reads PROVSAN_TRACE, and prepares tracing if it is set to 1.
+void initTrace();
+
+/// Appends an event to the calling thread's trace buffer. Async-signal-safe.
+void recordTraceEvent(TraceEventKind kind, uint64_t ptr, uint64_t size,
+                      uint64_t aux, uint32_t site, uint16_t pkey = 0);
+
+inline void traceEvent(TraceEventKind kind, uint64_t ptr, uint64_t size,
+                       uint64_t aux, uint32_t site, uint16_t pkey = 0) {
+  if (TraceEnabled)
+    recordTraceEvent(kind, ptr, size, aux, site, pkey);
+}
+
+/// Writes out the buffers of all threads. Threads still recording wait for
+/// the flush of their buffer.
+void finishTrace();
+
+/// Hold the lock serializing cross-thread flushes across fork(), so the child
+/// never inherits it locked.
+void lockTraceForFork();
+void unlockTraceAfterFork();
+
+/// Called in forked children. Drops events inherited from the parent and
+/// starts new trace files for the child.
+void reopenTraceAfterFork();
+
+} // namespace __provsan
+
+#endif // PROVSAN_TRACE_H
@@ -29,6 +29,7 @@
 #include "provsan_common.h"
 #include <cstddef>
 #include <cstdint>
+#include <ctime>
 
 namespace __provsan {
 #define HAS_MPK 1
@@ -70,6 +71,18 @@ int pkey_set(uint32_t *pkru, int key, unsigned int rights);
 #define XSTATE_PKRU 0x200
 
 int pkru_xstate_offset(void);
+
+/**
+ * Reads a clock in nanoseconds.
+ *
+ * @param clock The clock to read, CLOCK_MONOTONIC by default
+ * @return the time in ns
+ */
+inline uint64_t monotonicNs(clockid_t clock = CLOCK_MONOTONIC) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 } // namespace __provsan
 
 #endif // PROVSAN_UTILS_H
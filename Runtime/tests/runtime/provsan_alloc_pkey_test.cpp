@@ -0,0 +1,18 @@
+#include "provsan_alloc.h"
+
+#include "gtest/gtest.h"
+
+namespace __provsan {
+
+// Run with PROVSAN_TRUSTED_PKEY set to a pkey that was never allocated, so
+// that tagging memory with it fails.
+TEST(AllocPkey, UntaggedMemoryIsNotHandedOut) {
+  EXPECT_EQ(trusted_malloc(64, 8), nullptr);
+  EXPECT_EQ(trusted_malloc(1 << 20, 8), nullptr);
+  // The untrusted compartment uses the default pkey.
+  uint8_t *ptr = untrusted_malloc(1 << 20, 8);
+  EXPECT_NE(ptr, nullptr);
+  untrusted_free(ptr, 1 << 20, 8);
+}
+
+} // namespace __provsan
@@ -0,0 +1,56 @@
+#include "provsan_alloc.h"
+
+#include "gtest/gtest.h"
+#include <map>
+#include <vector>
+
+namespace __provsan {
+
+// Run with PROVSAN_SEGREGATE_SITES=1.
+TEST(AllocSites, SitesOwnTheirPages) {
+  void *a = compartmentAlloc(TRUSTED, 32, 8, false, 0x1000);
+  void *b = compartmentAlloc(TRUSTED, 32, 8, false, 0x2000);
+  void *base;
+  size_t size;
+  EXPECT_EQ(provsan_alloc_site_of((char *)a + 5, &base, &size), 0x1000u);
+  EXPECT_EQ(base, a);
+  EXPECT_EQ(size, 32u);
+  EXPECT_EQ(provsan_alloc_site_of(b, nullptr, nullptr), 0x2000u);
+  compartmentFree(a);
+  compartmentFree(b);
+}
+
+TEST(AllocSites, SharedHeapsHaveNoSite) {
+  // Take every heap, then add one more site, which has to share one. The
+  // first two sites are those of SitesOwnTheirPages, so every heap belongs to
+  // a site of this test.
+  std::vector<void *> objects;
+  for (uintptr_t site = 1; site <= ALLOC_SITE_HEAPS + 1; ++site)
+    objects.push_back(compartmentAlloc(TRUSTED, 16, 8, false, site * 0x1000));
+
+  // Objects of sites sharing a heap are carved from the heap's spans, while
+  // every other site has a span of its own.
+  std::map<uintptr_t, unsigned> objectsPerSpan;
+  for (void *obj : objects)
+    ++objectsPerSpan[(uintptr_t)obj / ALLOC_SPAN_SIZE];
+
+  unsigned sharedObjects = 0;
+  for (size_t i = 0; i < objects.size(); ++i) {
+    uintptr_t site = provsan_alloc_site_of(objects[i], nullptr, nullptr);
+    if (objectsPerSpan[(uintptr_t)objects[i] / ALLOC_SPAN_SIZE] > 1) {
+      // A shared heap must not blame its first site for the others' objects,
+      // and is left to the runtime's allocation map instead.
+      EXPECT_EQ(site, 0u) << "object " << i;
+      ++sharedObjects;
+    } else {
+      EXPECT_EQ(site, (i + 1) * 0x1000) << "object " << i;
+    }
+  }
+  // The last site and the first site of the heap it shares.
+  EXPECT_EQ(sharedObjects, 2u);
+  EXPECT_EQ(provsan_alloc_site_of(objects.back(), nullptr, nullptr), 0u);
+  for (void *obj : objects)
+    compartmentFree(obj);
+}
+
+} // namespace __provsan
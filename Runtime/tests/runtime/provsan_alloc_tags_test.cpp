@@ -0,0 +1,42 @@
+#include "alloc_site_handler.h"
+#include "provsan_alloc.h"
+
+#include "gtest/gtest.h"
+
+namespace __provsan {
+
+// Run with PROVSAN_ALLOC_SITE_TAGS=1.
+TEST(AllocTags, TaggedAllocationsStayOutOfTheMap) {
+  auto *handler = AllocSiteHandler::getOrInit();
+  // Large allocations are not tagged, and put the map to use.
+  size_t largeSize = 1 << 20;
+  uint8_t *large = trusted_malloc(largeSize, 8);
+  allocHook((rust_ptr)large, largeSize, 1, "entry", "large");
+  uint8_t *small = trusted_malloc(32, 8);
+  allocHook((rust_ptr)small, 32, 2, "entry", "small");
+
+  EXPECT_FALSE(handler->isAllocatorTagged((rust_ptr)large));
+  EXPECT_TRUE(handler->isAllocatorTagged((rust_ptr)small));
+  EXPECT_FALSE(handler->isAllocatorTagged((rust_ptr)small + 8));
+  EXPECT_TRUE(handler->getAllocSite((rust_ptr)large).isValid());
+  EXPECT_FALSE(handler->getAllocSite((rust_ptr)small).isValid());
+  EXPECT_EQ(handler->getAllocatorSite((rust_ptr)small + 8).getFuncName(),
+            std::string("small"));
+
+  // Reallocating a tagged allocation into an untagged one tracks it.
+  uint8_t *moved = trusted_realloc(small, 32, 8, largeSize);
+  reallocHook((rust_ptr)moved, largeSize, (rust_ptr)small, 32, 3, "entry",
+              "moved");
+  AllocSite site = handler->getAllocSite((rust_ptr)moved);
+  ASSERT_TRUE(site.isValid());
+  EXPECT_TRUE(site.isReAlloc());
+
+  deallocHook((rust_ptr)moved, largeSize, 3);
+  trusted_free(moved, largeSize, 8);
+  deallocHook((rust_ptr)large, largeSize, 1);
+  trusted_free(large, largeSize, 8);
+  EXPECT_FALSE(handler->getAllocSite((rust_ptr)large).isValid());
+  EXPECT_FALSE(handler->getAllocSite((rust_ptr)moved).isValid());
+}
+
+} // namespace __provsan
@@ -0,0 +1,136 @@
+#include "provsan_alloc.h"
+
+#include "gtest/gtest.h"
+#include <cstring>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <vector>
+
+namespace __provsan {
+
+TEST(Alloc, SmallRoundTrip) {
+  for (size_t size = 1; size <= ALLOC_MAX_SMALL; size = size * 3 / 2 + 1) {
+    uint8_t *ptr = trusted_malloc(size, 8);
+    ASSERT_NE(ptr, nullptr) << size;
+    EXPECT_EQ((uintptr_t)ptr % 16, 0u) << size;
+    EXPECT_GE(allocUsableSize(ptr), size);
+    memset(ptr, 0xAB, size);
+    trusted_free(ptr, size, 8);
+  }
+}
+
+TEST(Alloc, Alignment) {
+  for (size_t align : {32, 256, 4096, 16384}) {
+    uint8_t *ptr = untrusted_malloc(100, align);
+    ASSERT_NE(ptr, nullptr) << align;
+    EXPECT_EQ((uintptr_t)ptr % align, 0u) << align;
+    untrusted_free(ptr, 100, align);
+  }
+}
+
+TEST(Alloc, ReallocKeepsContents) {
+  uint8_t *ptr = untrusted_malloc(64, 8);
+  for (int i = 0; i < 64; ++i)
+    ptr[i] = i;
+  ptr = trusted_realloc(ptr, 64, 8, 100000);
+  ASSERT_NE(ptr, nullptr);
+  for (int i = 0; i < 64; ++i)
+    EXPECT_EQ(ptr[i], i);
+  ptr = trusted_realloc(ptr, 100000, 8, 32);
+  ASSERT_NE(ptr, nullptr);
+  for (int i = 0; i < 32; ++i)
+    EXPECT_EQ(ptr[i], i);
+  trusted_free(ptr, 32, 8);
+}
+
+TEST(Alloc, LargeAllocation) {
+  size_t size = (1 << 20) + 1;
+  uint8_t *ptr = trusted_malloc(size, 8);
+  ASSERT_NE(ptr, nullptr);
+  EXPECT_GE(allocUsableSize(ptr), size);
+  ptr[0] = ptr[size - 1] = 1;
+  trusted_free(ptr, size, 8);
+  // The allocation is forgotten once it is freed.
+  EXPECT_EQ(allocUsableSize(ptr), 0u);
+}
+
+TEST(Alloc, UnknownPointerIsNotRead) {
+  // A page aligned pointer, preceded by an inaccessible page. Reading a
+  // header in front of it would fault.
+  char *mapping = (char *)mmap(nullptr, 2 * 4096, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  ASSERT_NE(mapping, MAP_FAILED);
+  mprotect(mapping, 4096, PROT_NONE);
+  EXPECT_EQ(allocUsableSize(mapping + 4096), 0u);
+  trusted_free((uint8_t *)mapping + 4096, 0, 0);
+  munmap(mapping, 2 * 4096);
+}
+
+TEST(Alloc, CorruptFreeListLinkIsNotFollowed) {
+  uint8_t *a = untrusted_malloc(48, 8);
+  uint8_t *b = untrusted_malloc(48, 8);
+  // An object of another size class, which must not be handed out as a
+  // 48 byte object either.
+  uint8_t *other = untrusted_malloc(16, 8);
+  untrusted_free(a, 48, 8);
+  untrusted_free(b, 48, 8);
+
+  for (void *link : {(void *)0x4141414141414140ULL, (void *)other}) {
+    // b is on top of the free list, and links to a.
+    *(void **)b = link;
+    uint8_t *first = untrusted_malloc(48, 8);
+    uint8_t *second = untrusted_malloc(48, 8);
+    EXPECT_EQ(first, b);
+    EXPECT_NE(second, link);
+    EXPECT_EQ(allocUsableSize(second), 48u);
+    untrusted_free(second, 48, 8);
+    untrusted_free(first, 48, 8);
+  }
+  untrusted_free(other, 16, 8);
+}
+
+TEST(Alloc, SizeClassEntryPoints) {
+  // The size and alignment are implied by the class.
+  uint8_t *smallest = untrusted_malloc_c0(16, 8);
+  ASSERT_NE(smallest, nullptr);
+  EXPECT_EQ(allocUsableSize(smallest), 16u);
+  uint8_t *sized = untrusted_malloc_c19(1000, 8);
+  ASSERT_NE(sized, nullptr);
+  EXPECT_GE(allocUsableSize(sized), 1000u);
+  uint8_t *generic = untrusted_malloc(1000, 8);
+  EXPECT_EQ(allocUsableSize(sized), allocUsableSize(generic));
+  memset(sized, 0xAB, 1000);
+  untrusted_free(generic, 1000, 8);
+  untrusted_free(sized, 1000, 8);
+  untrusted_free(smallest, 16, 8);
+}
+
+static void *churn(void *) {
+  std::vector<uint8_t *> ptrs;
+  for (int round = 0; round < 4; ++round) {
+    for (size_t i = 0; i < 1000; ++i) {
+      size_t size = 16 + (i * 37) % 2048;
+      uint8_t *ptr = round % 2 ? untrusted_malloc(size, 8)
+                               : trusted_malloc(size, 8);
+      memset(ptr, (int)i, size);
+      ptrs.push_back(ptr);
+    }
+    for (uint8_t *ptr : ptrs)
+      trusted_free(ptr, 0, 8);
+    ptrs.clear();
+  }
+  return nullptr;
+}
+
+TEST(Alloc, ThreadsExchangeObjects) {
+  // Exiting threads hand their caches back to the central lists.
+  for (int batch = 0; batch < 4; ++batch) {
+    pthread_t threads[8];
+    for (auto &thread : threads)
+      ASSERT_EQ(pthread_create(&thread, nullptr, churn, nullptr), 0);
+    for (auto &thread : threads)
+      pthread_join(thread, nullptr);
+  }
+}
+
+} // namespace __provsan
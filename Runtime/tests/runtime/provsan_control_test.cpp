@@ -0,0 +1,50 @@
+#include "alloc_site_handler.h"
+#include "provsan_control.h"
+#include "provsan_stats.h"
+
+#include "gtest/gtest.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace __provsan {
+
+// Run with PROVSAN_ENABLE=0.
+
+// Runs first, before anything initialized the runtime.
+TEST(Control, PausedReallocLeavesTheRuntimeUninitialized) {
+  EXPECT_FALSE(provsan_is_enabled());
+  static int8_t old[16], moved[32];
+  reallocHook(moved, sizeof(moved), old, sizeof(old), 1, "entry",
+              "paused_realloc");
+  deallocHook(moved, sizeof(moved), 1);
+  EXPECT_EQ(Stats, nullptr);
+}
+
+TEST(Control, OnlyAllocationsWhileEnabledAreTracked) {
+  auto *handler = AllocSiteHandler::getOrInit();
+  static int8_t before[16], during[16], after[16];
+  allocHook(before, sizeof(before), 2, "entry", "paused_site");
+  provsan_enable();
+  EXPECT_TRUE(provsan_is_enabled());
+  allocHook(during, sizeof(during), 3, "entry", "enabled_site");
+  provsan_disable();
+  EXPECT_FALSE(provsan_is_enabled());
+  allocHook(after, sizeof(after), 4, "entry", "paused_site");
+
+  EXPECT_FALSE(handler->getAllocSite(before).isValid());
+  EXPECT_TRUE(handler->getAllocSite(during).isValid());
+  EXPECT_FALSE(handler->getAllocSite(after).isValid());
+  // Tracked allocations are still forgotten while paused.
+  deallocHook(during, sizeof(during), 3);
+  EXPECT_FALSE(handler->getAllocSite(during).isValid());
+}
+
+TEST(Control, StatsAreOnlyExportedOnRequest) {
+  AllocSiteHandler::getOrInit();
+  EXPECT_NE(Stats, nullptr);
+  std::string name = STATS_SHM_PREFIX + std::to_string(getpid());
+  EXPECT_EQ(shm_open(name.c_str(), O_RDONLY, 0), -1);
+}
+
+} // namespace __provsan
@@ -0,0 +1,35 @@
+#include "provsan_alloc.h"
+
+#include "gtest/gtest.h"
+#include <cstring>
+#include <dlfcn.h>
+
+namespace __provsan {
+
+static const char *moduleOf(uintptr_t pc) {
+  Dl_info info;
+  return dladdr((void *)pc, &info) ? info.dli_fname : nullptr;
+}
+
+// Run with libprovsan_interpose preloaded and PROVSAN_SEGREGATE_SITES=1. The
+// allocator must segregate by the caller of the wrapper, not the wrapper.
+TEST(Interpose, SitesAreTheCallers) {
+  ASSERT_NE(dlsym(RTLD_DEFAULT, "provsan_trusted_malloc_at"), nullptr);
+  const char *self = moduleOf((uintptr_t)&moduleOf);
+  ASSERT_NE(self, nullptr);
+
+  uint8_t *ptr = trusted_malloc(48, 8);
+  ASSERT_NE(ptr, nullptr);
+  uintptr_t site = provsan_alloc_site_of(ptr, nullptr, nullptr);
+  ASSERT_NE(site, 0u);
+  EXPECT_STREQ(moduleOf(site), self);
+
+  ptr = trusted_realloc(ptr, 48, 8, 4000);
+  ASSERT_NE(ptr, nullptr);
+  site = provsan_alloc_site_of(ptr, nullptr, nullptr);
+  ASSERT_NE(site, 0u);
+  EXPECT_STREQ(moduleOf(site), self);
+  trusted_free(ptr, 4000, 8);
+}
+
+} // namespace __provsan
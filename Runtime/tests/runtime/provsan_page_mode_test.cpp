@@ -0,0 +1,129 @@
+#include "alloc_site_handler.h"
+#include "provsan_fault_handler.h"
+
+#include "gtest/gtest.h"
+#include <cstdio>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace __provsan {
+
+#define TEST_PAGE 4096
+#define TEST_HUGE_PAGE (2 << 20)
+
+// Returns the pkey of the mapping containing addr, or -1.
+static int pkeyOf(void *addr) {
+  FILE *smaps = fopen("/proc/self/smaps", "r");
+  if (!smaps)
+    return -1;
+  char line[256];
+  bool found = false;
+  int pkey = -1;
+  while (fgets(line, sizeof(line), smaps)) {
+    uintptr_t start, end;
+    if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+      if (found)
+        break;
+      found = start <= (uintptr_t)addr && (uintptr_t)addr < end;
+    } else if (found && sscanf(line, "ProtectionKey: %d", &pkey) == 1) {
+      break;
+    }
+  }
+  fclose(smaps);
+  return pkey;
+}
+
+// Simulates a page mode fault at addr, in the given allocation.
+static void unprotect(char *addr, char *base, int64_t size) {
+  siginfo_t si;
+  memset(&si, 0, sizeof(si));
+  si.si_addr = addr;
+  AllocSite site((rust_ptr)base, size, 1, "entry", "page_mode_site");
+  disablePageMPK(&si, site);
+}
+
+class PageMode : public ::testing::Test {
+protected:
+  int pkey = -1;
+
+  void SetUp() override {
+    pkey = pkey_alloc(0, 0);
+    if (pkey == -1)
+      GTEST_SKIP() << "pkeys are not supported";
+  }
+
+  void TearDown() override {
+    if (pkey != -1)
+      pkey_free(pkey);
+  }
+};
+
+TEST_F(PageMode, WholeAllocationIsUnprotected) {
+  char *region = (char *)mmap(nullptr, 4 * TEST_PAGE, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  ASSERT_NE(region, MAP_FAILED);
+  ASSERT_EQ(pkey_mprotect(region, 4 * TEST_PAGE, PROT_READ | PROT_WRITE, pkey),
+            0);
+  // The allocation spans pages 0 to 2, and faults on page 1.
+  unprotect(region + TEST_PAGE + 8, region + 100, 2 * TEST_PAGE);
+  EXPECT_EQ(pkeyOf(region), 0);
+  EXPECT_EQ(pkeyOf(region + 2 * TEST_PAGE), 0);
+  EXPECT_EQ(pkeyOf(region + 3 * TEST_PAGE), pkey);
+  munmap(region, 4 * TEST_PAGE);
+}
+
+TEST_F(PageMode, TransparentHugePagesAreNotRounded) {
+  char *mapping =
+      (char *)mmap(nullptr, 2 * TEST_HUGE_PAGE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  ASSERT_NE(mapping, MAP_FAILED);
+  char *region = (char *)(((uintptr_t)mapping + TEST_HUGE_PAGE - 1) &
+                          ~(uintptr_t)(TEST_HUGE_PAGE - 1));
+  madvise(region, TEST_HUGE_PAGE, MADV_HUGEPAGE);
+  memset(region, 1, TEST_HUGE_PAGE);
+  ASSERT_EQ(
+      pkey_mprotect(region, TEST_HUGE_PAGE, PROT_READ | PROT_WRITE, pkey), 0);
+  // The kernel splits the huge page, so only the allocation's page is
+  // unprotected.
+  unprotect(region + 8, region, 64);
+  EXPECT_EQ(pkeyOf(region), 0);
+  EXPECT_EQ(pkeyOf(region + TEST_PAGE), pkey);
+  munmap(mapping, 2 * TEST_HUGE_PAGE);
+}
+
+TEST_F(PageMode, HugetlbPagesAreUnprotectedWhole) {
+  char *region = (char *)mmap(nullptr, 2 * TEST_HUGE_PAGE,
+                              PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (region == MAP_FAILED)
+    GTEST_SKIP() << "no hugetlb pages are reserved";
+  ASSERT_EQ(pkey_mprotect(region, 2 * TEST_HUGE_PAGE, PROT_READ | PROT_WRITE,
+                          pkey),
+            0);
+  // A 64 byte allocation unprotects its whole huge page. The first fault
+  // reads the mapping from smaps, the second one finds it in the cache.
+  unprotect(region + 8, region + 8, 64);
+  EXPECT_EQ(pkeyOf(region), 0);
+  EXPECT_EQ(pkeyOf(region + TEST_HUGE_PAGE), pkey);
+  unprotect(region + TEST_HUGE_PAGE + 8, region + TEST_HUGE_PAGE + 8, 64);
+  EXPECT_EQ(pkeyOf(region + TEST_HUGE_PAGE), 0);
+  munmap(region, 2 * TEST_HUGE_PAGE);
+}
+
+// Changes the unprotect mode, so it runs last.
+TEST_F(PageMode, PageModeOnlyUnprotectsTheFaultingPage) {
+  setenv("PROVSAN_UNPROTECT", "page", 1);
+  initPageMPK();
+  char *region = (char *)mmap(nullptr, 3 * TEST_PAGE, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  ASSERT_NE(region, MAP_FAILED);
+  ASSERT_EQ(pkey_mprotect(region, 3 * TEST_PAGE, PROT_READ | PROT_WRITE, pkey),
+            0);
+  unprotect(region + TEST_PAGE + 8, region, 3 * TEST_PAGE);
+  EXPECT_EQ(pkeyOf(region), pkey);
+  EXPECT_EQ(pkeyOf(region + TEST_PAGE), 0);
+  EXPECT_EQ(pkeyOf(region + 2 * TEST_PAGE), pkey);
+  munmap(region, 3 * TEST_PAGE);
+}
+
+} // namespace __provsan
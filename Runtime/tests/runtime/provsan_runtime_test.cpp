@@ -0,0 +1,371 @@
+#include "alloc_site_handler.h"
+#include "provsan_fault_log.h"
+#include "provsan_fault_stacks.h"
+#include "provsan_formatter.h"
+#include "provsan_site_pcs.h"
+#include "provsan_site_profile.h"
+#include "provsan_site_table.h"
+#include "provsan_stack_depot.h"
+#include "provsan_stats.h"
+
+#include "gtest/gtest.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+namespace __provsan {
+
+// Run with PROVSAN_ALLOC_STACKS=8 and PROVSAN_STATS_SHM=1.
+
+static std::string readFile(const std::string &path) {
+  std::ifstream file(path);
+  std::stringstream contents;
+  contents << file.rdbuf();
+  return contents.str();
+}
+
+// Number of profiles in TestResults mentioning the given site.
+static unsigned countProfiles(const std::string &funcName) {
+  unsigned count = 0;
+  DIR *dir = opendir("TestResults");
+  if (!dir)
+    return 0;
+  while (struct dirent *entry = readdir(dir))
+    if (!strncmp(entry->d_name, "faulting-allocs-", 16) &&
+        readFile(std::string("TestResults/") + entry->d_name)
+                .find("\"" + funcName + "\"") != std::string::npos)
+      ++count;
+  closedir(dir);
+  return count;
+}
+
+TEST(FaultLog, NewSitesAreStreamedOnce) {
+  auto *handler = AllocSiteHandler::getOrInit();
+  static int8_t buffer[64];
+  allocHook(buffer, sizeof(buffer), 1, "entry", "logged_site");
+  handler->addFaultAlloc(buffer + 8, 3);
+  handler->addFaultAlloc(buffer + 16, 3);
+
+  pid_t owner;
+  std::vector<FaultLogEntry> entries;
+  ASSERT_TRUE(readFaultLog("TestResults/fault-log-" +
+                               std::to_string(getpid()) + ".plog",
+                           owner, entries));
+  EXPECT_EQ(owner, getpid());
+  unsigned logged = 0;
+  for (auto &entry : entries)
+    if (entry.funcName == "logged_site") {
+      ++logged;
+      EXPECT_EQ(entry.localID, 1);
+      EXPECT_EQ(entry.pkey, 3u);
+      EXPECT_EQ(entry.bbName, "entry");
+    }
+  EXPECT_EQ(logged, 1u);
+  deallocHook(buffer, sizeof(buffer), 1);
+}
+
+TEST(FaultLog, OrphansAreCompactedOnceUnlocked) {
+  AllocSiteHandler::getOrInit();
+  pid_t child = fork();
+  ASSERT_NE(child, -1);
+  if (child == 0) {
+    // The child streams to a log of its own, and dies without a profile.
+    appendFaultLog(5, 1, false, "entry", "orphan_site");
+    _exit(0);
+  }
+  int status;
+  ASSERT_EQ(waitpid(child, &status, 0), child);
+  std::string log = "TestResults/fault-log-" + std::to_string(child) + ".plog";
+  unsigned profiles = countProfiles("orphan_site");
+
+  // A log locked by its owner is not compacted, even if the owner is gone.
+  int fd = open(log.c_str(), O_RDONLY);
+  ASSERT_NE(fd, -1);
+  ASSERT_EQ(flock(fd, LOCK_SH), 0);
+  compactOrphanFaultLogs("TestResults");
+  EXPECT_EQ(access(log.c_str(), F_OK), 0);
+  EXPECT_EQ(countProfiles("orphan_site"), profiles);
+  close(fd);
+
+  compactOrphanFaultLogs("TestResults");
+  EXPECT_NE(access(log.c_str(), F_OK), 0);
+  EXPECT_EQ(countProfiles("orphan_site"), profiles + 1);
+}
+
+// Writes a log of two committed "entry"/"ok" records, and returns the records
+// read back. The names of the first record claim bbNameLen bytes.
+static std::vector<FaultLogEntry> readTwoRecordLog(uint32_t bbNameLen) {
+  const size_t recordSize = sizeof(FaultLogRecord) + 16;
+  std::vector<char> log(sizeof(FaultLogHeader) + 2 * recordSize);
+  auto *header = reinterpret_cast<FaultLogHeader *>(log.data());
+  header->magic = FAULT_LOG_MAGIC;
+  header->version = FAULT_LOG_VERSION;
+  header->capacity = 2 * recordSize;
+  header->tail = 2 * recordSize;
+  for (size_t i = 0; i < 2; ++i) {
+    auto *record = reinterpret_cast<FaultLogRecord *>(
+        log.data() + sizeof(FaultLogHeader) + i * recordSize);
+    record->length = recordSize;
+    record->committed = 1;
+    record->bbNameLen = i == 0 ? bbNameLen : 5;
+    record->funcNameLen = 2;
+    memcpy(record + 1, "entry\0ok", 9);
+  }
+  std::ofstream("two-records.plog", std::ios::binary)
+      .write(log.data(), log.size());
+
+  pid_t owner;
+  std::vector<FaultLogEntry> entries;
+  EXPECT_TRUE(readFaultLog("two-records.plog", owner, entries));
+  return entries;
+}
+
+TEST(FaultLog, OverrunningNamesEndTheScan) {
+  EXPECT_EQ(readTwoRecordLog(5).size(), 2u);
+  EXPECT_TRUE(readTwoRecordLog(64).empty());
+}
+
+TEST(Coverage, OnlyExecutedSitesAreCovered) {
+  AllocSiteHandler::getOrInit();
+  static int8_t buffer[16];
+  allocHook(buffer, sizeof(buffer), 2, "entry", "covered_site");
+  getSiteIndex(3, "entry", "registered_site", false);
+
+  std::set<std::string> covered;
+  forEachExecutedSite([&covered](const SiteEntry &site) {
+    covered.insert(siteFuncName(site));
+  });
+  EXPECT_TRUE(covered.count("covered_site"));
+  EXPECT_FALSE(covered.count("registered_site"));
+  deallocHook(buffer, sizeof(buffer), 2);
+}
+
+TEST(Stats, HooksAreCountedAndExported) {
+  AllocSiteHandler::getOrInit();
+  ASSERT_NE(Stats, nullptr);
+  uint64_t allocs = totalStat(STAT_ALLOC_HOOK);
+  uint64_t deallocs = totalStat(STAT_DEALLOC_HOOK);
+  static int8_t buffer[16];
+  allocHook(buffer, sizeof(buffer), 4, "entry", "counted_site");
+  deallocHook(buffer, sizeof(buffer), 4);
+  EXPECT_EQ(totalStat(STAT_ALLOC_HOOK), allocs + 1);
+  EXPECT_EQ(totalStat(STAT_DEALLOC_HOOK), deallocs + 1);
+
+  std::string name = STATS_SHM_PREFIX + std::to_string(getpid());
+  int fd = shm_open(name.c_str(), O_RDONLY, 0);
+  ASSERT_NE(fd, -1) << name;
+  void *mapping =
+      mmap(nullptr, sizeof(StatsSegment), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  ASSERT_NE(mapping, MAP_FAILED);
+  auto *segment = static_cast<StatsSegment *>(mapping);
+  EXPECT_EQ(segment->magic, STATS_MAGIC);
+  EXPECT_EQ(segment->pid, (uint32_t)getpid());
+  munmap(mapping, sizeof(StatsSegment));
+}
+
+TEST(StackDepot, StacksAreDeduplicated) {
+  AllocSiteHandler::getOrInit();
+  uintptr_t stack[] = {0x1000, 0x2000, 0x3000};
+  uintptr_t other[] = {0x1000, 0x2000, 0x3001};
+  uint32_t id = depotPut(stack, 3);
+  EXPECT_NE(id, (uint32_t)NO_STACK_ID);
+  EXPECT_EQ(depotPut(stack, 3), id);
+  EXPECT_NE(depotPut(other, 3), id);
+  EXPECT_EQ(depotPut(stack, 0), (uint32_t)NO_STACK_ID);
+
+  const uintptr_t *frames;
+  uint32_t size;
+  ASSERT_TRUE(depotGet(id, frames, size));
+  ASSERT_EQ(size, 3u);
+  EXPECT_EQ(frames[2], 0x3000u);
+  EXPECT_EQ(formatStack(id), "[\"0x1000\", \"0x2000\", \"0x3000\"]");
+}
+
+__attribute__((noinline)) static void allocFromFirstCaller(rust_ptr ptr) {
+  allocHook(ptr, 16, 6, "entry", "stacked_site");
+}
+
+__attribute__((noinline)) static void allocFromSecondCaller(rust_ptr ptr) {
+  allocHook(ptr, 16, 6, "entry", "stacked_site");
+}
+
+TEST(StackDepot, FaultingSitesAreReportedOnceWithTheirStacks) {
+  auto *handler = AllocSiteHandler::getOrInit();
+  static int8_t first[16], second[16];
+  allocFromFirstCaller(first);
+  allocFromSecondCaller(second);
+  EXPECT_NE(handler->getAllocSite(first).getStackID(),
+            handler->getAllocSite(second).getStackID());
+  handler->addFaultAlloc(first, 1);
+  handler->addFaultAlloc(second, 1);
+
+  unsigned sites = 0;
+  for (auto &entry : handler->faultingAllocs())
+    if (entry.first.getFuncName() == "stacked_site") {
+      ++sites;
+      EXPECT_EQ(entry.second.stackIDs.size(), 2u);
+    }
+  EXPECT_EQ(sites, 1u);
+  deallocHook(first, 16, 6);
+  deallocHook(second, 16, 6);
+}
+
+TEST(FaultStacks, OnlyTheCachedStackIsUnwound) {
+  AllocSiteHandler::getOrInit();
+  cacheStackBounds();
+  uint32_t index = getSiteIndex(7, "entry", "fault_stack_site", false);
+  // A frame record on this thread's stack, returning to 0x2222.
+  uintptr_t record[2] = {0, 0x2222};
+  ucontext_t context;
+  memset(&context, 0, sizeof(context));
+  context.uc_mcontext.gregs[REG_RIP] = 0x1111;
+  context.uc_mcontext.gregs[REG_RBP] = (uintptr_t)record;
+  context.uc_mcontext.gregs[REG_RSP] = (uintptr_t)record;
+  recordFaultStack(index, &context);
+  recordFaultStack(index, &context);
+  // On another stack, such as a signal stack, only the faulting pc is kept.
+  static uintptr_t altStack[64];
+  context.uc_mcontext.gregs[REG_RSP] = (uintptr_t)altStack;
+  recordFaultStack(index, &context);
+
+  std::string stacks = formatFaultStacks(index);
+  EXPECT_NE(stacks.find("{ \"count\": 2, \"stack\": [\"0x1111\", \"0x2222\"] }"),
+            std::string::npos)
+      << stacks;
+  EXPECT_NE(stacks.find("{ \"count\": 1, \"stack\": [\"0x1111\"] }"),
+            std::string::npos)
+      << stacks;
+}
+
+TEST(SiteProfile, Buckets) {
+  EXPECT_EQ(offsetBucket(0), 0u);
+  EXPECT_EQ(offsetBucket(OFFSET_LINEAR_LIMIT - 1), 31u);
+  EXPECT_EQ(offsetBucket(OFFSET_LINEAR_LIMIT), 32u);
+  EXPECT_EQ(offsetBucket(2 * OFFSET_LINEAR_LIMIT), 33u);
+  EXPECT_EQ(offsetBucket(UINT64_MAX), OFFSET_BUCKETS - 1u);
+  EXPECT_EQ(sizeBucket(1), 0u);
+  EXPECT_EQ(sizeBucket(16), 4u);
+  EXPECT_EQ(sizeBucket(17), 5u);
+  EXPECT_EQ(lifetimeBucket(0), 0u);
+  EXPECT_EQ(lifetimeBucket(1), 1u);
+  EXPECT_EQ(lifetimeBucket(UINT64_MAX), LIFETIME_BUCKETS - 1u);
+}
+
+TEST(SiteProfile, SizesAccessesAndLifetimesAreFormatted) {
+  AllocSiteHandler::getOrInit();
+  uint32_t index = getSiteIndex(8, "entry", "profiled_site", false);
+  EXPECT_EQ(formatSiteProfile(index), "");
+  recordSiteSize(index, 16);
+  recordSiteSize(index, 12);
+  recordSiteAccess(index, 8, ACCESS_READ);
+  recordSiteAccess(index, 300, ACCESS_WRITE);
+  recordSiteLifetime(index, 1000);
+  recordSiteLiveAtExit(index);
+
+  std::string profile = formatSiteProfile(index);
+  EXPECT_NE(profile.find("\"accesses\": { \"reads\": 1, \"writes\": 1"),
+            std::string::npos)
+      << profile;
+  EXPECT_NE(profile.find("{ \"start\": 8, \"end\": 16, \"reads\": 1, "
+                         "\"writes\": 0 }"),
+            std::string::npos)
+      << profile;
+  EXPECT_NE(profile.find("{ \"start\": 256, \"end\": 512, \"reads\": 0, "
+                         "\"writes\": 1 }"),
+            std::string::npos)
+      << profile;
+  EXPECT_NE(profile.find("\"sizes\": [{ \"maxSize\": 16, \"count\": 2 }]"),
+            std::string::npos)
+      << profile;
+  EXPECT_NE(profile.find("{ \"liveAtExit\": true, \"count\": 1 }"),
+            std::string::npos)
+      << profile;
+}
+
+TEST(SiteProfile, LiveAllocationsAreCountedAtExit) {
+  auto *handler = AllocSiteHandler::getOrInit();
+  static int8_t live[32], freed[32];
+  allocHook(live, sizeof(live), 9, "entry", "live_site");
+  allocHook(freed, sizeof(freed), 9, "entry", "live_site");
+  deallocHook(freed, sizeof(freed), 9);
+  handler->recordLiveAtExit();
+
+  std::string profile =
+      formatSiteProfile(getSiteIndex(9, "entry", "live_site", false));
+  EXPECT_NE(profile.find("\"sizes\": [{ \"maxSize\": 32, \"count\": 2 }]"),
+            std::string::npos)
+      << profile;
+  EXPECT_NE(profile.find("{ \"liveAtExit\": true, \"count\": 1 }"),
+            std::string::npos)
+      << profile;
+  deallocHook(live, sizeof(live), 9);
+}
+
+TEST(Hooks, BatchesAreTrackedUnderOneHook) {
+  auto *handler = AllocSiteHandler::getOrInit();
+  static int8_t buffer[3][16];
+  HookBatchEntry entries[3];
+  for (int i = 0; i < 3; ++i)
+    entries[i] = {buffer[i], 16};
+  uint64_t allocs = totalStat(STAT_ALLOC_HOOK);
+  allocHookBatch(entries, 3, 10, "loop", "batched_site");
+  EXPECT_EQ(totalStat(STAT_ALLOC_HOOK), allocs + 1);
+  for (auto &object : buffer) {
+    AllocSite site = handler->getAllocSite(object);
+    ASSERT_TRUE(site.isValid());
+    EXPECT_EQ(site.getFuncName(), "batched_site");
+    EXPECT_EQ(site.getPtr(), object);
+    deallocHook(object, 16, 10);
+  }
+}
+
+TEST(Hooks, AllocationsRecordTheirWrapperContext) {
+  auto *handler = AllocSiteHandler::getOrInit();
+  static int8_t wrapped[16], direct[16];
+  __provsan_alloc_context = 42;
+  allocHook(wrapped, sizeof(wrapped), 11, "entry", "wrapper_site");
+  __provsan_alloc_context = 0;
+  allocHook(direct, sizeof(direct), 11, "entry", "wrapper_site");
+  EXPECT_EQ(handler->getAllocSite(wrapped).getContext(), 42u);
+
+  handler->addFaultAlloc(wrapped, 1);
+  auto &faults = handler->faultingAllocs();
+  auto fault = faults.find(handler->getAllocSite(wrapped));
+  ASSERT_NE(fault, faults.end());
+  EXPECT_EQ(fault->second.contexts, std::set<uint64_t>{42});
+  EXPECT_FALSE(fault->second.contextFree);
+  handler->addFaultAlloc(direct, 1);
+  EXPECT_TRUE(fault->second.contextFree);
+  deallocHook(wrapped, sizeof(wrapped), 11);
+  deallocHook(direct, sizeof(direct), 11);
+}
+
+static SiteDescriptor PCSite = {12, "entry", "pc_site", 0};
+static SitePCEntry PCEntries[2];
+
+TEST(SitePCs, RelativeEntriesAreDecoded) {
+  // Made up return addresses inside readFile, listed out of order.
+  uintptr_t base = (uintptr_t)&readFile;
+  uintptr_t pcs[2] = {base + 32, base + 16};
+  for (int i = 0; i < 2; ++i) {
+    PCEntries[i].pc = (int32_t)(pcs[i] - (uintptr_t)&PCEntries[i].pc);
+    PCEntries[i].site = (int32_t)((uintptr_t)&PCSite -
+                                  (uintptr_t)&PCEntries[i].site);
+  }
+  provsan_register_site_pcs(PCEntries, PCEntries + 2);
+  // Every translation unit registers the section, only the first counts.
+  provsan_register_site_pcs(PCEntries, PCEntries + 2);
+  EXPECT_EQ(lookupSitePC(base + 16), &PCSite);
+  EXPECT_EQ(lookupSitePC(base + 32), &PCSite);
+  EXPECT_EQ(lookupSitePC(base + 24), nullptr);
+}
+
+} // namespace __provsan
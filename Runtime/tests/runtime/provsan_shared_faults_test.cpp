@@ -0,0 +1,100 @@
+#include "alloc_site_handler.h"
+#include "provsan_formatter.h"
+#include "provsan_site_table.h"
+
+#include "gtest/gtest.h"
+#include <dirent.h>
+#include <fstream>
+#include <sstream>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace __provsan {
+
+// Run with PROVSAN_SHARED_FAULTS=1 and PROVSAN_ALLOC_STACKS=8.
+
+TEST(SharedFaults, WorkersShareFaultedSites) {
+  // The table is mapped when the runtime is loaded, so workers forked before
+  // the first hook still share it.
+  ASSERT_TRUE(sharedFaultsEnabled());
+  EXPECT_EQ(sharedFaultsOwner(), getpid());
+
+  pid_t child = fork();
+  ASSERT_NE(child, -1);
+  if (child == 0) {
+    // A site first seen by the worker, after the fork.
+    uint32_t index = getSiteIndex(21, "entry", "worker_site", false);
+    _exit(index != NO_SITE_INDEX && markSiteFaulted(index, 2) ? 0 : 1);
+  }
+  int status;
+  ASSERT_EQ(waitpid(child, &status, 0), child);
+  ASSERT_TRUE(WIFEXITED(status));
+  EXPECT_EQ(WEXITSTATUS(status), 0);
+
+  uint32_t index = getSiteIndex(21, "entry", "worker_site", false);
+  ASSERT_NE(index, (uint32_t)NO_SITE_INDEX);
+  // The worker already recorded the fault.
+  EXPECT_FALSE(markSiteFaulted(index, 2));
+
+  unsigned faulted = 0;
+  forEachFaultedSite([&faulted](const SiteEntry &site) {
+    if (strcmp(siteFuncName(site), "worker_site"))
+      return;
+    ++faulted;
+    EXPECT_STREQ(siteBBName(site), "entry");
+    EXPECT_EQ(site.localID, 21);
+    EXPECT_EQ(site.pkey, 2u);
+  });
+  EXPECT_EQ(faulted, 1u);
+}
+
+TEST(SharedFaults, SlotsOfDeadClaimersAreAbandoned) {
+  uint32_t index = getSiteIndex(22, "entry", "dead_claimer_site", false);
+  ASSERT_NE(index, (uint32_t)NO_SITE_INDEX);
+  // As if the claimer died between claiming the slot and filling it in.
+  SiteEntry *entry = getSiteEntry(index);
+  entry->ready.store(SITE_ENTRY_CLAIMED);
+
+  uint32_t moved = getSiteIndex(22, "entry", "dead_claimer_site", false);
+  ASSERT_NE(moved, (uint32_t)NO_SITE_INDEX);
+  EXPECT_NE(moved, index);
+  EXPECT_EQ(entry->ready.load(), (uint32_t)SITE_ENTRY_ABANDONED);
+  // Later probes skip the abandoned slot.
+  EXPECT_EQ(getSiteIndex(22, "entry", "dead_claimer_site", false), moved);
+}
+
+// Returns the profile this process wrote to TestResults.
+static std::string findProfile() {
+  std::string prefix = "faulting-allocs-" + std::to_string(getpid()) + "-";
+  std::string profile;
+  DIR *dir = opendir("TestResults");
+  if (!dir)
+    return profile;
+  while (struct dirent *entry = readdir(dir)) {
+    if (strncmp(entry->d_name, prefix.c_str(), prefix.size()))
+      continue;
+    std::ifstream file(std::string("TestResults/") + entry->d_name);
+    std::stringstream contents;
+    contents << file.rdbuf();
+    profile = contents.str();
+  }
+  closedir(dir);
+  return profile;
+}
+
+// Writes the merged profile, so it runs last.
+TEST(SharedFaults, MergedProfileHasTheSiteFieldsOfItsWriter) {
+  auto *handler = AllocSiteHandler::getOrInit();
+  static int8_t buffer[48];
+  allocHook(buffer, sizeof(buffer), 23, "entry", "owner_site");
+  handler->addFaultAlloc(buffer, 2);
+  flush_allocs();
+
+  std::string profile = findProfile();
+  ASSERT_NE(profile.find("\"owner_site\""), std::string::npos) << profile;
+  EXPECT_NE(profile.find("\"stacks\": ["), std::string::npos) << profile;
+  EXPECT_NE(profile.find("\"sizes\": ["), std::string::npos) << profile;
+  deallocHook(buffer, sizeof(buffer), 23);
+}
+
+} // namespace __provsan
@@ -0,0 +1,153 @@
+#include "alloc_site_handler.h"
+#include "provsan_formatter.h"
+#include "provsan_site_table.h"
+#include "provsan_trace.h"
+#include "tools/provsan_trace_reader.h"
+
+#include "gtest/gtest.h"
+#include <fstream>
+#include <pthread.h>
+#include <sstream>
+#include <unistd.h>
+
+namespace __provsan {
+
+// Run with PROVSAN_TRACE=1, and PROVSAN_REPLAY and PROVSAN_WHATIF naming
+// provsan-replay and provsan-whatif.
+
+static std::string readFile(const std::string &path) {
+  std::ifstream file(path);
+  std::stringstream contents;
+  contents << file.rdbuf();
+  return contents.str();
+}
+
+TEST(Trace, SitesAreNamedWhenFirstTraced) {
+  AllocSiteHandler::getOrInit();
+  ASSERT_TRUE(TraceEnabled);
+  allocHook((rust_ptr)0x1000, 16, 7, "entry", "named_site");
+  uint32_t index = getSiteIndex(7, "entry", "named_site", false);
+  // Written before the trace is finished, so a crash keeps the names.
+  std::string sites =
+      readFile("TestResults/trace-" + std::to_string(getpid()) + ".sites");
+  EXPECT_NE(sites.find(std::to_string(index) + "\t7\t0\tentry\tnamed_site\n"),
+            std::string::npos)
+      << sites;
+  deallocHook((rust_ptr)0x1000, 16, 7);
+}
+
+#define TRACE_TEST_THREADS 4
+#define TRACE_TEST_EVENTS (3 * TRACE_BUFFER_EVENTS + 17)
+#define TRACE_TEST_MARKER 0x7e57
+
+static void *record(void *arg) {
+  uint64_t thread = (uintptr_t)arg;
+  for (uint64_t i = 0; i < TRACE_TEST_EVENTS; ++i)
+    recordTraceEvent(TRACE_FREE, thread << 32 | i, TRACE_TEST_MARKER, 0,
+                     NO_SITE_INDEX);
+  return nullptr;
+}
+
+TEST(Trace, FlushesRaceWithRecordingThreads) {
+  AllocSiteHandler::getOrInit();
+  ASSERT_TRUE(TraceEnabled);
+  pthread_t threads[TRACE_TEST_THREADS];
+  for (uintptr_t i = 0; i < TRACE_TEST_THREADS; ++i)
+    ASSERT_EQ(pthread_create(&threads[i], nullptr, record, (void *)i), 0);
+  for (int i = 0; i < 200; ++i)
+    finishTrace();
+  for (auto &thread : threads)
+    pthread_join(thread, nullptr);
+  finishTrace();
+
+  std::vector<TracedEvent> events;
+  std::map<TracedSiteKey, TracedSite> sites;
+  readTraces("provsan_trace_test", {"TestResults"}, events, sites);
+  // Every event is written exactly once.
+  std::set<uint64_t> seen;
+  for (auto &entry : events) {
+    if (entry.pid == (uint32_t)getpid() &&
+        entry.event.size == TRACE_TEST_MARKER) {
+      EXPECT_TRUE(seen.insert(entry.event.ptr).second) << entry.event.ptr;
+    }
+  }
+  EXPECT_EQ(seen.size(), (size_t)TRACE_TEST_THREADS * TRACE_TEST_EVENTS);
+}
+
+// Writes a trace of a made up process to directory.
+static void writeTrace(const std::string &directory,
+                       const std::vector<TraceEvent> &events) {
+  uint32_t pid = 1;
+  std::ofstream trace(directory + "/trace-1-1.ptrace", std::ios::binary);
+  TraceHeader header = {TRACE_MAGIC, TRACE_VERSION, pid, 1,
+                        sizeof(TraceEvent)};
+  trace.write((const char *)&header, sizeof(header));
+  for (auto &event : events)
+    trace.write((const char *)&event, sizeof(event));
+  std::ofstream names(directory + "/trace-1.sites");
+  names << "0\t0\t0\tentry\tbig\n1\t1\t0\tentry\tneighbour\n";
+}
+
+static std::string replay(const std::string &directory,
+                          const std::string &options) {
+  const char *tool = getenv("PROVSAN_REPLAY");
+  std::string output = directory + "/profile.json";
+  std::string command = std::string(tool) + " " + options + " -o " + output +
+                        " " + directory + " 2>/dev/null";
+  EXPECT_EQ(system(command.c_str()), 0) << command;
+  return readFile(output);
+}
+
+TEST(Trace, ReplayUnprotectsWholeAllocations) {
+  ASSERT_NE(getenv("PROVSAN_REPLAY"), nullptr);
+  std::string directory = "replay";
+  ASSERT_TRUE(makeTestDirectory(directory));
+  // big spans pages 0x10 to 0x13, and shares page 0x13 with neighbour.
+  writeTrace(directory, {{1, 0x10000, 0x3080, 0, 0, TRACE_ALLOC, 0},
+                         {2, 0x13100, 64, 0, 1, TRACE_ALLOC, 0},
+                         {3, 0x10008, 0, 0, 0, TRACE_FAULT, 1},
+                         {4, 0x13108, 0, 0, 1, TRACE_FAULT, 1}});
+
+  // Unprotecting big also unprotected the page of neighbour.
+  std::string profile = replay(directory, "--attribution=page");
+  EXPECT_NE(profile.find("\"big\""), std::string::npos) << profile;
+  EXPECT_EQ(profile.find("\"neighbour\""), std::string::npos) << profile;
+  EXPECT_EQ(replay(directory, "--attribution=page --unprotect=allocation"),
+            profile);
+
+  profile = replay(directory, "--attribution=page --unprotect=page");
+  EXPECT_NE(profile.find("\"big\""), std::string::npos) << profile;
+  EXPECT_NE(profile.find("\"neighbour\""), std::string::npos) << profile;
+}
+
+TEST(Trace, WhatIfReportsTheFaultsLeftByACandidate) {
+  const char *tool = getenv("PROVSAN_WHATIF");
+  ASSERT_NE(tool, nullptr);
+  std::string directory = "whatif";
+  ASSERT_TRUE(makeTestDirectory(directory));
+  writeTrace(directory, {{1, 0x10000, 0x3080, 0, 0, TRACE_ALLOC, 0},
+                         {2, 0x13100, 64, 0, 1, TRACE_ALLOC, 0},
+                         {3, 0x10008, 0, 0, 0, TRACE_FAULT, 1},
+                         {4, 0x13108, 0, 0, 1, TRACE_FAULT, 1}});
+  std::string candidate = directory + "/candidate.json";
+  std::ofstream(candidate) << "[\n{ \"id\": 0, \"pkey\": 1, \"bbName\": "
+                              "\"entry\", \"funcName\": \"big\", "
+                              "\"isRealloc\": false }\n]\n";
+
+  std::string output = directory + "/report.txt";
+  std::string command = std::string(tool) + " -v -p " + candidate + " " +
+                        directory + " > " + output + " 2>/dev/null";
+  ASSERT_EQ(system(command.c_str()), 0) << command;
+  std::string report = readFile(output);
+  EXPECT_NE(report.find("2 allocations, 2 faults"), std::string::npos)
+      << report;
+  // Patching big moves it, and leaves only the fault on neighbour.
+  size_t remaining = report.find("Remaining faulting sites with " + candidate);
+  ASSERT_NE(remaining, std::string::npos) << report;
+  EXPECT_NE(report.find("neighbour entry 1", remaining), std::string::npos)
+      << report;
+  EXPECT_EQ(report.find("big entry 0", remaining), std::string::npos)
+      << report;
+}
+
+} // namespace __provsan
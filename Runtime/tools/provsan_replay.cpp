@@ -0,0 +1,384 @@
+// provsan-replay: rebuilds the fault profile of a run from its event traces.
+//
+// Usage: provsan-replay [options] <trace file | directory>...
+//
+// Options:
+//   -j <n>                 Number of shards replayed in parallel (default: all
+//                          cores).
+//   --chains=on|off        Attribute faults on reallocated memory to the
+//                          earlier sites of the realloc chain (default on).
+//   --attribution=<mode>   single-step (default) sees every fault. page drops
+//                          faults on pages that an earlier fault unprotected,
+//                          as the runtime does when built with PAGE_MPK.
+//   --unprotect=<mode>     What a fault unprotects in page attribution, as
+//                          PROVSAN_UNPROTECT: allocation (default) the pages
+//                          of the whole faulting allocation, page only the
+//                          4 KiB page of the faulting address.
+//   --sample=<n>           Only track one in n allocations.
+//   -o <file>              Write the profile to file instead of stdout.
+//
+// Traces are recorded with PROVSAN_TRACE=1. The profile has the format of the
+// runtime's faulting-allocs-*.json files, so it can be passed to ProvsanPost.
+
+#include "provsan_trace_reader.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <iterator>
+#include <map>
+#include <set>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+using namespace __provsan;
+
+namespace {
+
+#define REPLAY_PAGE_SIZE 4096
+// Allocations are sharded by the 1 MiB chunk holding their start, so that
+// neighbouring objects land on the same shard.
+#define REPLAY_SHARD_SHIFT 20
+
+enum Attribution { SINGLE_STEP, PAGE };
+enum Unprotect { UNPROTECT_ALLOCATION, UNPROTECT_PAGE };
+
+struct Options {
+  unsigned shards = std::max(1u, std::thread::hardware_concurrency());
+  bool chains = true;
+  Attribution attribution = SINGLE_STEP;
+  Unprotect unprotect = UNPROTECT_ALLOCATION;
+  uint64_t sample = 1;
+  const char *output = nullptr;
+};
+
+using Event = TracedEvent;
+using SiteName = TracedSite;
+using SiteKey = TracedSiteKey;
+
+struct LiveAlloc {
+  uint64_t size;
+  uint32_t site;
+};
+
+/// An event delivered to a shard. track is set if the shard owns the (new)
+/// allocation of the event.
+struct ShardEvent {
+  const Event *entry;
+  bool track;
+};
+
+/// Replay state of one shard. Each shard owns the allocations starting in its
+/// chunks, and sees every fault.
+struct Shard {
+  std::map<std::pair<uint32_t, uint64_t>, LiveAlloc> live;
+  std::map<SiteKey, uint32_t> faulted;
+  // Realloc chain edges, from the new site to the site it reallocated.
+  std::set<std::pair<SiteKey, SiteKey>> chains;
+  uint64_t attributed = 0;
+  std::vector<ShardEvent> events;
+
+  const LiveAlloc *find(uint32_t pid, uint64_t addr) const {
+    auto iter = live.upper_bound({pid, addr});
+    if (iter == live.begin())
+      return nullptr;
+    --iter;
+    if (iter->first.first != pid || addr - iter->first.second >= iter->second.size)
+      return nullptr;
+    return &iter->second;
+  }
+
+  void replay(const Options &options) {
+    for (const ShardEvent &delivered : events) {
+      const TraceEvent &event = delivered.entry->event;
+      uint32_t pid = delivered.entry->pid;
+      switch (event.kind) {
+      case TRACE_ALLOC:
+        live[{pid, event.ptr}] = {event.size, event.site};
+        break;
+      case TRACE_REALLOC: {
+        // A realloc is delivered to the shards of both its old and its new
+        // allocation.
+        auto old = live.find({pid, event.aux});
+        if (old != live.end()) {
+          if (options.chains)
+            chains.insert({{pid, event.site}, {pid, old->second.site}});
+          live.erase(old);
+        }
+        if (delivered.track)
+          live[{pid, event.ptr}] = {event.size, event.site};
+        break;
+      }
+      case TRACE_FREE:
+        live.erase({pid, event.ptr});
+        break;
+      case TRACE_FAULT:
+        if (const LiveAlloc *alloc = find(pid, event.ptr)) {
+          faulted.emplace(SiteKey(pid, alloc->site), event.pkey);
+          ++attributed;
+        }
+        break;
+      }
+    }
+  }
+
+  static unsigned shardOf(uint64_t ptr, const Options &options) {
+    return (ptr >> REPLAY_SHARD_SHIFT) % options.shards;
+  }
+};
+
+/// The pages unprotected by page mode faults, as disjoint [first, last) page
+/// ranges keyed by <pid, first>. Pages stay unprotected when their memory is
+/// freed, as in the runtime.
+struct UnprotectedPages {
+  std::map<std::pair<uint32_t, uint64_t>, uint64_t> ranges;
+
+  bool contains(uint32_t pid, uint64_t page) const {
+    auto iter = ranges.upper_bound({pid, page});
+    if (iter == ranges.begin())
+      return false;
+    --iter;
+    return iter->first.first == pid && page < iter->second;
+  }
+
+  void add(uint32_t pid, uint64_t first, uint64_t last) {
+    auto iter = ranges.upper_bound({pid, first});
+    if (iter != ranges.begin() && std::prev(iter)->first.first == pid &&
+        std::prev(iter)->second >= first)
+      --iter;
+    // Merges every range overlapping or adjacent to [first, last).
+    while (iter != ranges.end() && iter->first.first == pid &&
+           iter->first.second <= last) {
+      first = std::min(first, iter->first.second);
+      last = std::max(last, iter->second);
+      iter = ranges.erase(iter);
+    }
+    ranges[{pid, first}] = last;
+  }
+};
+
+/// Allocation bounds of every process, for page attribution in allocation
+/// mode. Unlike the shards, it tracks every allocation regardless of
+/// sampling, as the runtime does.
+struct AllocationBounds {
+  std::map<std::pair<uint32_t, uint64_t>, uint64_t> sizes;
+
+  void replay(uint32_t pid, const TraceEvent &event) {
+    switch (event.kind) {
+    case TRACE_ALLOC:
+      sizes[{pid, event.ptr}] = event.size;
+      break;
+    case TRACE_REALLOC:
+      sizes.erase({pid, event.aux});
+      sizes[{pid, event.ptr}] = event.size;
+      break;
+    case TRACE_FREE:
+      sizes.erase({pid, event.ptr});
+      break;
+    }
+  }
+
+  /// Sets [start, end) to the allocation containing addr, or to addr's byte
+  /// if there is none.
+  void find(uint32_t pid, uint64_t addr, uint64_t &start,
+            uint64_t &end) const {
+    start = addr;
+    end = addr + 1;
+    auto iter = sizes.upper_bound({pid, addr});
+    if (iter == sizes.begin())
+      return;
+    --iter;
+    if (iter->first.first == pid && addr - iter->first.second < iter->second) {
+      start = iter->first.second;
+      end = start + iter->second;
+    }
+  }
+};
+
+// Whether an allocation is tracked when sampling one in options.sample.
+bool sampled(uint32_t pid, const TraceEvent &event, const Options &options) {
+  if (options.sample <= 1)
+    return true;
+  uint64_t hash = (event.ptr ^ event.time ^ pid) * 0x9E3779B97F4A7C15ULL;
+  return (hash >> 32) % options.sample == 0;
+}
+
+bool parseOptions(int argc, char **argv, Options &options,
+                  std::vector<std::string> &inputs) {
+  for (int arg = 1; arg < argc; ++arg) {
+    std::string value = argv[arg];
+    if (value == "-j" && arg + 1 < argc)
+      options.shards = std::max(1, atoi(argv[++arg]));
+    else if (value == "-o" && arg + 1 < argc)
+      options.output = argv[++arg];
+    else if (value == "--chains=on" || value == "--chains=off")
+      options.chains = value == "--chains=on";
+    else if (value == "--attribution=single-step")
+      options.attribution = SINGLE_STEP;
+    else if (value == "--attribution=page")
+      options.attribution = PAGE;
+    else if (value == "--unprotect=allocation")
+      options.unprotect = UNPROTECT_ALLOCATION;
+    else if (value == "--unprotect=page")
+      options.unprotect = UNPROTECT_PAGE;
+    else if (value.rfind("--sample=", 0) == 0)
+      options.sample = std::max(1ULL, strtoull(value.c_str() + 9, nullptr, 10));
+    else if (value[0] == '-')
+      return false;
+    else
+      inputs.push_back(value);
+  }
+  return !inputs.empty();
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  Options options;
+  std::vector<std::string> inputs;
+  if (!parseOptions(argc, argv, options, inputs)) {
+    fprintf(stderr,
+            "Usage: %s [-j n] [--chains=on|off] "
+            "[--attribution=single-step|page] [--unprotect=allocation|page] "
+            "[--sample=n] [-o file] "
+            "<trace | directory>...\n",
+            argv[0]);
+    return 1;
+  }
+
+  std::vector<Event> events;
+  std::map<SiteKey, SiteName> sites;
+  readTraces("provsan-replay", inputs, events, sites);
+
+  std::vector<Shard> shards(options.shards);
+  UnprotectedPages unprotected;
+  AllocationBounds bounds;
+  bool trackBounds =
+      options.attribution == PAGE && options.unprotect == UNPROTECT_ALLOCATION;
+  uint64_t faults = 0, dropped = 0;
+  for (const Event &entry : events) {
+    const TraceEvent &event = entry.event;
+    if (trackBounds)
+      bounds.replay(entry.pid, event);
+    switch (event.kind) {
+    case TRACE_ALLOC:
+      if (sampled(entry.pid, event, options))
+        shards[Shard::shardOf(event.ptr, options)].events.push_back(
+            {&entry, true});
+      break;
+    case TRACE_REALLOC: {
+      // The shard of the old allocation drops it (and records the chain), the
+      // shard of the new allocation tracks it.
+      bool track = sampled(entry.pid, event, options);
+      unsigned oldShard = Shard::shardOf(event.aux, options);
+      unsigned newShard = Shard::shardOf(event.ptr, options);
+      shards[oldShard].events.push_back({&entry, track && newShard == oldShard});
+      if (track && newShard != oldShard)
+        shards[newShard].events.push_back({&entry, true});
+      break;
+    }
+    case TRACE_FREE:
+      shards[Shard::shardOf(event.ptr, options)].events.push_back(
+          {&entry, false});
+      break;
+    case TRACE_FAULT:
+      ++faults;
+      // In page mode, the first fault on a page unprotects it for the rest of
+      // the run, whether or not it was attributed. In allocation mode, the
+      // pages of the whole faulting allocation are unprotected with it.
+      if (options.attribution == PAGE) {
+        uint64_t page = event.ptr / REPLAY_PAGE_SIZE;
+        if (unprotected.contains(entry.pid, page)) {
+          ++dropped;
+          break;
+        }
+        uint64_t start = event.ptr, end = event.ptr + 1;
+        if (trackBounds)
+          bounds.find(entry.pid, event.ptr, start, end);
+        unprotected.add(entry.pid, start / REPLAY_PAGE_SIZE,
+                        (end + REPLAY_PAGE_SIZE - 1) / REPLAY_PAGE_SIZE);
+      }
+      for (auto &shard : shards)
+        shard.events.push_back({&entry, false});
+      break;
+    }
+  }
+
+  std::vector<std::thread> workers;
+  for (auto &shard : shards)
+    workers.emplace_back([&shard, &options] { shard.replay(options); });
+  for (auto &worker : workers)
+    worker.join();
+
+  std::map<SiteKey, uint32_t> faulted;
+  std::multimap<SiteKey, SiteKey> chains;
+  uint64_t attributed = 0;
+  for (auto &shard : shards) {
+    attributed += shard.attributed;
+    faulted.insert(shard.faulted.begin(), shard.faulted.end());
+    for (auto &edge : shard.chains)
+      chains.insert(edge);
+  }
+
+  // Every site a faulting allocation was reallocated from faults as well.
+  std::vector<SiteKey> worklist;
+  for (auto &site : faulted)
+    worklist.push_back(site.first);
+  while (!worklist.empty()) {
+    SiteKey site = worklist.back();
+    worklist.pop_back();
+    uint32_t pkey = faulted[site];
+    auto range = chains.equal_range(site);
+    for (auto edge = range.first; edge != range.second; ++edge)
+      if (faulted.emplace(edge->second, pkey).second)
+        worklist.push_back(edge->second);
+  }
+
+  // Sites of different processes with the same name are reported once.
+  std::map<std::tuple<std::string, std::string, int64_t>,
+           std::pair<const SiteName *, uint32_t>>
+      profile;
+  uint64_t unnamed = 0;
+  for (auto &site : faulted) {
+    auto name = sites.find(site.first);
+    if (name == sites.end()) {
+      ++unnamed;
+      continue;
+    }
+    const SiteName &site_name = name->second;
+    profile.emplace(std::make_tuple(site_name.funcName, site_name.bbName,
+                                    site_name.localID),
+                    std::make_pair(&site_name, site.second));
+  }
+
+  FILE *output = options.output ? fopen(options.output, "w") : stdout;
+  if (!output) {
+    perror(options.output);
+    return 1;
+  }
+  fprintf(output, "[\n");
+  size_t remaining = profile.size();
+  for (auto &entry : profile) {
+    const SiteName &site = *entry.second.first;
+    fprintf(output,
+            "{ \"id\": %ld, \"pkey\": %u, \"bbName\": \"%s\", \"funcName\": "
+            "\"%s\", \"isRealloc\": %s }%s\n",
+            (long)site.localID, entry.second.second, site.bbName.c_str(),
+            site.funcName.c_str(), site.isRealloc ? "true" : "false",
+            --remaining ? "," : "");
+  }
+  fprintf(output, "]\n");
+  if (output != stdout)
+    fclose(output);
+
+  fprintf(stderr,
+          "provsan-replay: %zu events, %lu faults (%lu dropped by page "
+          "attribution, %lu attributed), %zu faulting sites",
+          events.size(), faults, dropped, attributed, profile.size());
+  if (unnamed)
+    fprintf(stderr, ", %lu without names", unnamed);
+  fprintf(stderr, ".\n");
+  return 0;
+}
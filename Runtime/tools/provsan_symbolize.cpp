@@ -0,0 +1,204 @@
+// provsan-symbolize: adds source locations to profiles of interposed sites.
+//
+// Usage: provsan-symbolize <profile.json | directory>...
+//
+// Sites recorded through libprovsan_interpose are identified by the module
+// and link time address of the allocation call. Their entries are rewritten
+// in place with "file", "line", "column" and "function" fields, looked up in
+// the DWARF line tables of the module by llvm-symbolizer (or the symbolizer
+// named by PROVSAN_SYMBOLIZER, which must accept the same arguments and
+// output format).
+
+#include "provsan_interpose.h"
+#include "provsan_profile_reader.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+using namespace __provsan;
+
+namespace {
+
+struct Location {
+  std::string function;
+  std::string file;
+  unsigned line = 0;
+  unsigned column = 0;
+};
+
+bool isInterposed(const std::string &line, std::string &module,
+                  uint64_t &address) {
+  int64_t id;
+  std::string bbName;
+  if (line.find("\"file\": ") != std::string::npos ||
+      !parseSiteLine(line, id, bbName, module) || bbName != INTERPOSED_BB_NAME)
+    return false;
+  address = id;
+  return true;
+}
+
+std::string escapeJSON(const std::string &value) {
+  std::string escaped;
+  for (char c : value) {
+    if (c == '"' || c == '\\')
+      escaped += '\\';
+    escaped += c;
+  }
+  return escaped;
+}
+
+// Symbolizes all addresses of one module with a single symbolizer process.
+// Addresses are return addresses, so the call itself is at address - 1. Only
+// the innermost frame of inlined calls is kept, which matches the debug
+// location of the allocation call in the IR.
+void symbolizeModule(const std::string &module,
+                     const std::vector<uint64_t> &addresses,
+                     std::map<uint64_t, Location> &locations) {
+  if (module.find('\'') != std::string::npos) {
+    fprintf(stderr, "provsan-symbolize: skipping module %s.\n",
+            module.c_str());
+    return;
+  }
+  const char *symbolizer = getenv("PROVSAN_SYMBOLIZER");
+  std::ostringstream command;
+  command << (symbolizer ? symbolizer : "llvm-symbolizer") << " --obj='"
+          << module << "'";
+  for (uint64_t address : addresses)
+    command << " 0x" << std::hex << address - 1;
+
+  FILE *pipe = popen(command.str().c_str(), "r");
+  if (!pipe) {
+    perror("provsan-symbolize: popen");
+    return;
+  }
+
+  // Output is one block per address: pairs of "function" and
+  // "file:line:column" lines, terminated by an empty line.
+  char buffer[4096];
+  size_t index = 0;
+  std::vector<std::string> block;
+  while (index < addresses.size()) {
+    bool eof = !fgets(buffer, sizeof(buffer), pipe);
+    std::string line = eof ? "" : buffer;
+    if (!line.empty() && line.back() == '\n')
+      line.pop_back();
+    if (!line.empty()) {
+      block.push_back(line);
+      continue;
+    }
+    if (block.size() >= 2) {
+      Location location;
+      location.function = block[0];
+      // The file name may contain ':', the line and column are the last two
+      // fields.
+      std::string &position = block[1];
+      size_t column = position.rfind(':');
+      size_t line_sep = column == std::string::npos
+                            ? std::string::npos
+                            : position.rfind(':', column - 1);
+      if (line_sep != std::string::npos) {
+        location.file = position.substr(0, line_sep);
+        location.line = strtoul(position.c_str() + line_sep + 1, nullptr, 10);
+        location.column = strtoul(position.c_str() + column + 1, nullptr, 10);
+        if (location.line != 0)
+          locations[addresses[index]] = location;
+      }
+    }
+    block.clear();
+    ++index;
+    if (eof)
+      break;
+  }
+  pclose(pipe);
+}
+
+bool symbolizeProfile(const std::string &path) {
+  std::ifstream IS(path);
+  if (!IS) {
+    fprintf(stderr, "provsan-symbolize: unable to read %s.\n", path.c_str());
+    return false;
+  }
+  std::vector<std::string> lines;
+  std::map<std::string, std::vector<uint64_t>> modules;
+  std::string line;
+  while (std::getline(IS, line)) {
+    std::string module;
+    uint64_t address;
+    if (isInterposed(line, module, address))
+      modules[module].push_back(address);
+    lines.push_back(line);
+  }
+  IS.close();
+  if (modules.empty())
+    return true;
+
+  std::map<std::string, std::map<uint64_t, Location>> locations;
+  for (auto &module : modules)
+    symbolizeModule(module.first, module.second, locations[module.first]);
+
+  size_t symbolized = 0;
+  for (auto &line : lines) {
+    std::string module;
+    uint64_t address;
+    if (!isInterposed(line, module, address))
+      continue;
+    auto found = locations[module].find(address);
+    size_t end = line.rfind(" }");
+    if (found == locations[module].end() || end == std::string::npos)
+      continue;
+    const Location &location = found->second;
+    std::ostringstream fields;
+    fields << ", \"file\": \"" << escapeJSON(location.file)
+           << "\", \"line\": " << location.line
+           << ", \"column\": " << location.column << ", \"function\": \""
+           << escapeJSON(location.function) << "\"";
+    line.insert(end, fields.str());
+    ++symbolized;
+  }
+
+  std::ofstream OS(path, std::ios::trunc);
+  for (auto &line : lines)
+    OS << line << "\n";
+  printf("%s: symbolized %zu sites.\n", path.c_str(), symbolized);
+  return bool(OS);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <profile.json | directory>...\n", argv[0]);
+    return 1;
+  }
+
+  bool ok = true;
+  for (int arg = 1; arg < argc; ++arg) {
+    std::string path = argv[arg];
+    struct stat info;
+    if (stat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode)) {
+      DIR *dir = opendir(path.c_str());
+      if (!dir) {
+        perror(path.c_str());
+        ok = false;
+        continue;
+      }
+      while (struct dirent *entry = readdir(dir)) {
+        size_t length = strlen(entry->d_name);
+        if (length > 5 && strcmp(entry->d_name + length - 5, ".json") == 0)
+          ok &= symbolizeProfile(path + "/" + entry->d_name);
+      }
+      closedir(dir);
+    } else {
+      ok &= symbolizeProfile(path);
+    }
+  }
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,163 @@
+// provsan-top: samples the runtime statistics of a live ProvSan process.
+//
+// Usage: provsan-top [pid] [interval in seconds]
+//
+// Without a pid, lists the processes currently exporting statistics, and
+// removes the segments left behind by processes that died.
+
+#include "provsan_stats.h"
+#include "provsan_utils.h"
+
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <dirent.h>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace __provsan;
+
+namespace {
+
+struct Sample {
+  uint64_t events[NUM_STAT_EVENTS];
+  uint64_t latency[NUM_STAT_EVENTS][STATS_LATENCY_BUCKETS];
+};
+
+const char *EventNames[NUM_STAT_EVENTS] = {"alloc", "realloc", "dealloc",
+                                           "fault"};
+
+void takeSample(const StatsSegment *segment, Sample &sample) {
+  for (unsigned event = 0; event < NUM_STAT_EVENTS; ++event) {
+    sample.events[event] = 0;
+    for (unsigned bucket = 0; bucket < STATS_LATENCY_BUCKETS; ++bucket)
+      sample.latency[event][bucket] = 0;
+    for (auto &slot : segment->threads) {
+      sample.events[event] += slot.events[event].load(std::memory_order_relaxed);
+      for (unsigned bucket = 0; bucket < STATS_LATENCY_BUCKETS; ++bucket)
+        sample.latency[event][bucket] +=
+            slot.latency[event][bucket].load(std::memory_order_relaxed);
+    }
+  }
+}
+
+// Returns the upper bound (in cycles) of the bucket holding the given
+// percentile of the events recorded between two samples.
+uint64_t percentile(const Sample &prev, const Sample &cur, unsigned event,
+                    double pct) {
+  uint64_t total = cur.events[event] - prev.events[event];
+  if (!total)
+    return 0;
+  uint64_t seen = 0;
+  for (unsigned bucket = 0; bucket < STATS_LATENCY_BUCKETS; ++bucket) {
+    seen += cur.latency[event][bucket] - prev.latency[event][bucket];
+    if (seen >= total * pct)
+      return 1ULL << bucket;
+  }
+  return 1ULL << (STATS_LATENCY_BUCKETS - 1);
+}
+
+int listSegments() {
+  DIR *dir = opendir("/dev/shm");
+  if (!dir) {
+    perror("provsan-top: /dev/shm");
+    return 1;
+  }
+  printf("PID\n");
+  while (struct dirent *entry = readdir(dir)) {
+    int pid;
+    if (sscanf(entry->d_name, "provsan-stats-%d", &pid) != 1)
+      continue;
+    if (kill(pid, 0) == -1 && errno == ESRCH) {
+      shm_unlink((STATS_SHM_PREFIX + std::to_string(pid)).c_str());
+      printf("%d (exited, removed)\n", pid);
+    } else {
+      printf("%d\n", pid);
+    }
+  }
+  closedir(dir);
+  return 0;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  if (argc < 2)
+    return listSegments();
+
+  int pid = atoi(argv[1]);
+  double interval = argc > 2 ? atof(argv[2]) : 1.0;
+  if (pid <= 0 || interval <= 0) {
+    fprintf(stderr, "usage: %s [pid] [interval in seconds]\n", argv[0]);
+    return 1;
+  }
+
+  std::string name = STATS_SHM_PREFIX + std::to_string(pid);
+  int fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if (fd == -1) {
+    fprintf(stderr, "provsan-top: no statistics exported by pid %d\n", pid);
+    return 1;
+  }
+  void *mapping =
+      mmap(nullptr, sizeof(StatsSegment), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    perror("provsan-top: mmap");
+    return 1;
+  }
+
+  auto *segment = static_cast<const StatsSegment *>(mapping);
+  if (segment->magic != STATS_MAGIC || segment->version != STATS_VERSION) {
+    fprintf(stderr, "provsan-top: incompatible statistics segment\n");
+    return 1;
+  }
+
+  Sample prev, cur;
+  takeSample(segment, prev);
+  uint64_t prev_ns = monotonicNs();
+
+  printf("%10s %10s %10s %10s %12s %8s %17s %17s\n", "alloc/s", "realloc/s",
+         "dealloc/s", "faults/s", "live-allocs", "sites", "alloc p50/p99 ns",
+         "fault p50/p99 ns");
+  while (kill(pid, 0) == 0 || errno != ESRCH) {
+    usleep(interval * 1e6);
+    takeSample(segment, cur);
+    uint64_t now_ns = monotonicNs();
+    double seconds = (now_ns - prev_ns) / 1e9;
+    // TSC cycles per nanosecond, measured against the base recorded by the
+    // runtime.
+    double cycles_per_ns =
+        (double)(__rdtsc() - segment->tscBase) / (now_ns - segment->nsBase);
+
+    double rate[NUM_STAT_EVENTS];
+    for (unsigned event = 0; event < NUM_STAT_EVENTS; ++event)
+      rate[event] = (cur.events[event] - prev.events[event]) / seconds;
+
+    printf("%10.0f %10.0f %10.0f %10.0f %12lu %8lu %8.0f/%-8.0f "
+           "%8.0f/%-8.0f\n",
+           rate[STAT_ALLOC_HOOK], rate[STAT_REALLOC_HOOK],
+           rate[STAT_DEALLOC_HOOK], rate[STAT_FAULT],
+           segment->liveAllocations.load(std::memory_order_relaxed),
+           segment->trackedSites.load(std::memory_order_relaxed),
+           percentile(prev, cur, STAT_ALLOC_HOOK, 0.5) / cycles_per_ns,
+           percentile(prev, cur, STAT_ALLOC_HOOK, 0.99) / cycles_per_ns,
+           percentile(prev, cur, STAT_FAULT, 0.5) / cycles_per_ns,
+           percentile(prev, cur, STAT_FAULT, 0.99) / cycles_per_ns);
+    fflush(stdout);
+
+    prev = cur;
+    prev_ns = now_ns;
+  }
+
+  // Left behind if the process crashed.
+  shm_unlink(name.c_str());
+  printf("Process %d exited. Totals:", pid);
+  for (unsigned event = 0; event < NUM_STAT_EVENTS; ++event)
+    printf(" %s=%lu", EventNames[event], cur.events[event]);
+  printf("\n");
+  return 0;
+}
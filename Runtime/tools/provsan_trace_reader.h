@@ -0,0 +1,136 @@
+// Reading of the event traces recorded with PROVSAN_TRACE=1, shared by the
+// offline tools.
+
+#ifndef PROVSAN_TRACE_READER_H
+#define PROVSAN_TRACE_READER_H
+
+#include "provsan_trace.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <map>
+#include <set>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+namespace __provsan {
+
+struct TracedEvent {
+  uint32_t pid;
+  TraceEvent event;
+};
+
+struct TracedSite {
+  int64_t localID;
+  bool isRealloc;
+  std::string bbName;
+  std::string funcName;
+};
+
+// Sites are identified by <pid, site index>.
+using TracedSiteKey = std::pair<uint32_t, uint32_t>;
+
+inline bool readTraceFile(const char *tool, const std::string &path,
+                          std::vector<TracedEvent> &events,
+                          std::set<uint32_t> &pids) {
+  FILE *file = fopen(path.c_str(), "rb");
+  if (!file)
+    return false;
+  TraceHeader header;
+  bool valid = fread(&header, sizeof(header), 1, file) == 1 &&
+               header.magic == TRACE_MAGIC &&
+               header.version == TRACE_VERSION &&
+               header.eventSize == sizeof(TraceEvent);
+  if (valid) {
+    TraceEvent event;
+    while (fread(&event, sizeof(event), 1, file) == 1)
+      events.push_back({header.pid, event});
+    pids.insert(header.pid);
+  } else {
+    fprintf(stderr, "%s: %s is not a trace.\n", tool, path.c_str());
+  }
+  fclose(file);
+  return valid;
+}
+
+inline void readTraceSites(const char *tool, const std::string &directory,
+                           uint32_t pid,
+                           std::map<TracedSiteKey, TracedSite> &sites) {
+  std::string path = directory + "/trace-" + std::to_string(pid) + ".sites";
+  FILE *file = fopen(path.c_str(), "r");
+  if (!file) {
+    fprintf(stderr, "%s: missing %s, sites of pid %u are not named.\n", tool,
+            path.c_str(), pid);
+    return;
+  }
+  char line[8192];
+  while (fgets(line, sizeof(line), file)) {
+    char *fields[5];
+    char *cursor = line;
+    unsigned count = 0;
+    for (; count < 5 && cursor; ++count) {
+      fields[count] = cursor;
+      cursor = strpbrk(cursor, count == 4 ? "\n" : "\t\n");
+      if (cursor)
+        *cursor++ = '\0';
+    }
+    if (count < 5)
+      continue;
+    sites[{pid, (uint32_t)strtoul(fields[0], nullptr, 10)}] = {
+        strtoll(fields[1], nullptr, 10), atoi(fields[2]) != 0, fields[3],
+        fields[4]};
+  }
+  fclose(file);
+}
+
+/// Reads the given trace files, and every trace in the given directories,
+/// along with the names of their sites. Events are returned in time order.
+inline void readTraces(const char *tool, const std::vector<std::string> &inputs,
+                       std::vector<TracedEvent> &events,
+                       std::map<TracedSiteKey, TracedSite> &sites) {
+  // The directories holding the site names of each process.
+  std::map<uint32_t, std::string> siteDirectories;
+  for (auto &input : inputs) {
+    std::vector<std::string> files;
+    std::string directory = input;
+    struct stat info;
+    if (stat(input.c_str(), &info) == 0 && S_ISDIR(info.st_mode)) {
+      DIR *dir = opendir(input.c_str());
+      while (struct dirent *entry = dir ? readdir(dir) : nullptr) {
+        size_t length = strlen(entry->d_name);
+        if (length > 7 && strcmp(entry->d_name + length - 7, ".ptrace") == 0)
+          files.push_back(input + "/" + entry->d_name);
+      }
+      if (dir)
+        closedir(dir);
+    } else {
+      files.push_back(input);
+      size_t slash = input.rfind('/');
+      directory = slash == std::string::npos ? "." : input.substr(0, slash);
+    }
+    for (auto &file : files) {
+      std::set<uint32_t> pids;
+      readTraceFile(tool, file, events, pids);
+      for (uint32_t pid : pids)
+        siteDirectories.emplace(pid, directory);
+    }
+  }
+
+  for (auto &pid : siteDirectories)
+    readTraceSites(tool, pid.second, pid.first, sites);
+
+  // Threads of a process share a synchronized TSC, so a stable sort keeps the
+  // order of events within each thread.
+  std::stable_sort(events.begin(), events.end(),
+                   [](const TracedEvent &lhs, const TracedEvent &rhs) {
+                     return lhs.event.time < rhs.event.time;
+                   });
+}
+
+} // namespace __provsan
+
+#endif // PROVSAN_TRACE_READER_H
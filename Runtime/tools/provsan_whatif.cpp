@@ -0,0 +1,242 @@
+// provsan-whatif: estimates the effect of candidate patch sets on a recorded
+// run.
+//
+// Usage: provsan-whatif [-v] -p <profile.json> [-p <profile.json>]...
+//                       <trace file | directory>...
+//
+// Each -p names a candidate patch set, in the format of the runtime's
+// faulting-allocs-*.json profiles: the sites ProvsanPost would move to
+// untrusted_malloc if given that profile. The event traces (recorded with
+// PROVSAN_TRACE=1) are replayed once for all candidates, and for each one the
+// simulator reports
+//   - the peak of live bytes in the untrusted (and remaining trusted) heap of
+//     any one process,
+//   - how many allocations move to the untrusted allocator, and their rate in
+//     allocations per million TSC cycles of the run,
+//   - the faults, and faulting sites, that remain.
+// With -v the remaining faulting sites of each candidate are listed.
+//
+// Allocations are placed by the site that (re)allocated them, as patched
+// reallocs call untrusted_realloc.
+
+#include "provsan_profile_reader.h"
+#include "provsan_site_table.h"
+#include "provsan_trace_reader.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <set>
+#include <string>
+#include <tuple>
+#include <vector>
+
+using namespace __provsan;
+
+namespace {
+
+// Sites are matched to profiles by name, as ProvsanPost does.
+using SiteName = std::tuple<std::string, std::string, int64_t>;
+
+struct Candidate {
+  std::string path;
+  std::set<SiteName> sites;
+  // Site keys of the trace that the candidate patches.
+  std::set<TracedSiteKey> patched;
+
+  uint64_t movedAllocs = 0;
+  uint64_t movedBytes = 0;
+  uint64_t untrustedPeak = 0;
+  uint64_t trustedPeak = 0;
+  uint64_t remainingFaults = 0;
+  std::map<TracedSiteKey, uint64_t> remainingSites;
+  // Live bytes per process.
+  std::map<uint32_t, uint64_t> untrustedLive;
+  std::map<uint32_t, uint64_t> trustedLive;
+};
+
+struct LiveAlloc {
+  uint64_t size;
+  uint32_t site;
+};
+
+bool readCandidate(Candidate &candidate) {
+  FILE *file = fopen(candidate.path.c_str(), "r");
+  if (!file) {
+    perror(candidate.path.c_str());
+    return false;
+  }
+  char buffer[65536];
+  while (fgets(buffer, sizeof(buffer), file)) {
+    std::string line = buffer;
+    int64_t id;
+    std::string bbName, funcName;
+    if (parseSiteLine(line, id, bbName, funcName))
+      candidate.sites.emplace(funcName, bbName, id);
+  }
+  fclose(file);
+  return true;
+}
+
+void allocate(Candidate &candidate, uint32_t pid, const LiveAlloc &alloc) {
+  bool untrusted = candidate.patched.count({pid, alloc.site});
+  uint64_t &live = untrusted ? candidate.untrustedLive[pid]
+                             : candidate.trustedLive[pid];
+  live += alloc.size;
+  uint64_t &peak = untrusted ? candidate.untrustedPeak : candidate.trustedPeak;
+  peak = std::max(peak, live);
+  if (untrusted) {
+    ++candidate.movedAllocs;
+    candidate.movedBytes += alloc.size;
+  }
+}
+
+void release(Candidate &candidate, uint32_t pid, const LiveAlloc &alloc) {
+  bool untrusted = candidate.patched.count({pid, alloc.site});
+  (untrusted ? candidate.untrustedLive[pid] : candidate.trustedLive[pid]) -=
+      alloc.size;
+}
+
+const TracedSite *siteName(const std::map<TracedSiteKey, TracedSite> &sites,
+                           const TracedSiteKey &key) {
+  auto name = sites.find(key);
+  return name == sites.end() ? nullptr : &name->second;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  bool verbose = false;
+  std::vector<Candidate> candidates(1);
+  candidates[0].path = "(none)";
+  std::vector<std::string> inputs;
+  bool valid = true;
+  for (int arg = 1; arg < argc; ++arg) {
+    if (!strcmp(argv[arg], "-v"))
+      verbose = true;
+    else if (!strcmp(argv[arg], "-p") && arg + 1 < argc)
+      candidates.emplace_back().path = argv[++arg];
+    else if (argv[arg][0] == '-')
+      valid = false;
+    else
+      inputs.push_back(argv[arg]);
+  }
+  if (!valid || inputs.empty() || candidates.size() < 2) {
+    fprintf(stderr,
+            "Usage: %s [-v] -p <profile.json> [-p <profile.json>]... "
+            "<trace | directory>...\n",
+            argv[0]);
+    return 1;
+  }
+  for (size_t i = 1; i < candidates.size(); ++i)
+    if (!readCandidate(candidates[i]))
+      return 1;
+
+  std::vector<TracedEvent> events;
+  std::map<TracedSiteKey, TracedSite> sites;
+  readTraces("provsan-whatif", inputs, events, sites);
+
+  for (auto &site : sites) {
+    SiteName name(site.second.funcName, site.second.bbName,
+                  site.second.localID);
+    for (auto &candidate : candidates)
+      if (candidate.sites.count(name))
+        candidate.patched.insert(site.first);
+  }
+
+  // Replay the run once, tracking every allocation with the site that placed
+  // it, and account it to each candidate's compartments.
+  std::map<std::pair<uint32_t, uint64_t>, LiveAlloc> live;
+  std::map<uint32_t, std::pair<uint64_t, uint64_t>> runTimes;
+  uint64_t allocs = 0, faults = 0;
+  auto drop = [&](uint32_t pid, uint64_t ptr) {
+    auto alloc = live.find({pid, ptr});
+    if (alloc == live.end())
+      return;
+    for (auto &candidate : candidates)
+      release(candidate, pid, alloc->second);
+    live.erase(alloc);
+  };
+  for (const TracedEvent &entry : events) {
+    const TraceEvent &event = entry.event;
+    uint32_t pid = entry.pid;
+    auto times = runTimes.emplace(pid, std::make_pair(event.time, event.time));
+    times.first->second.second = event.time;
+    switch (event.kind) {
+    case TRACE_ALLOC:
+    case TRACE_REALLOC: {
+      if (event.kind == TRACE_REALLOC)
+        drop(pid, event.aux);
+      // Drop allocations whose free was not recorded (e.g. while paused).
+      drop(pid, event.ptr);
+      LiveAlloc alloc = {event.size, event.site};
+      live[{pid, event.ptr}] = alloc;
+      for (auto &candidate : candidates)
+        allocate(candidate, pid, alloc);
+      ++allocs;
+      break;
+    }
+    case TRACE_FREE:
+      drop(pid, event.ptr);
+      break;
+    case TRACE_FAULT: {
+      ++faults;
+      uint32_t site = event.site;
+      auto alloc = live.upper_bound({pid, event.ptr});
+      if (alloc != live.begin()) {
+        --alloc;
+        if (alloc->first.first == pid &&
+            event.ptr - alloc->first.second < alloc->second.size)
+          site = alloc->second.site;
+      }
+      for (auto &candidate : candidates) {
+        if (site != NO_SITE_INDEX && candidate.patched.count({pid, site}))
+          continue;
+        ++candidate.remainingFaults;
+        ++candidate.remainingSites[{pid, site}];
+      }
+      break;
+    }
+    }
+  }
+
+  uint64_t cycles = 0;
+  for (auto &times : runTimes)
+    cycles += times.second.second - times.second.first;
+  double megacycles = std::max(1.0, cycles / 1e6);
+
+  printf("%lu allocations, %lu faults, %.1f Mcycles across %zu processes.\n\n",
+         allocs, faults, cycles / 1e6, runTimes.size());
+  printf("%-32s %8s %14s %14s %10s %8s %14s %12s %10s %8s\n", "candidate",
+         "sites", "untrusted peak", "trusted peak", "moved", "moved %",
+         "moved bytes", "moved/Mcyc", "faults", "fsites");
+  for (auto &candidate : candidates) {
+    std::string label = candidate.path;
+    if (label.size() > 32)
+      label = "..." + label.substr(label.size() - 29);
+    printf("%-32s %8zu %14lu %14lu %10lu %7.1f%% %14lu %12.2f %10lu %8zu\n",
+           label.c_str(), candidate.patched.size(), candidate.untrustedPeak,
+           candidate.trustedPeak, candidate.movedAllocs,
+           allocs ? 100.0 * candidate.movedAllocs / allocs : 0.0,
+           candidate.movedBytes, candidate.movedAllocs / megacycles, candidate.remainingFaults,
+           candidate.remainingSites.size());
+  }
+
+  if (!verbose)
+    return 0;
+  for (auto &candidate : candidates) {
+    printf("\nRemaining faulting sites with %s:\n", candidate.path.c_str());
+    for (auto &site : candidate.remainingSites) {
+      const TracedSite *name = siteName(sites, site.first);
+      if (name)
+        printf("  %10lu  %s %s %ld (pid %u)\n", site.second,
+               name->funcName.c_str(), name->bbName.c_str(),
+               (long)name->localID, site.first.first);
+      else
+        printf("  %10lu  unattributed (pid %u)\n", site.second,
+               site.first.first);
+    }
+  }
+  return 0;
+}